@@ -0,0 +1,178 @@
+/* Standard BSD license disclaimer.
+
+Copyright(c) 2016-2021, Lance D. Stringham
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "targetver.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "CopySparse.h"
+
+/* Checksums are CRC32C in the raw form of SparseFileLib, so the copy engines
+ * hash views and buffers in whatever order they finish and holes are simply
+ * left out: a run of zeros adds nothing but a shift. */
+
+/* Bytes read at once when hashing a range on its own. */
+#define CHECKSUM_READ_SIZE  (1024 * 1024)
+
+
+_Use_decl_annotations_
+DWORD
+ChecksumFileRange(
+	HANDLE          File,
+	UINT64          Offset,
+	UINT64          Length,
+	UINT64          End,
+	UINT32          *RawCrc
+	)
+{
+	PBYTE   buffer;
+	UINT64  pos;
+	UINT32  crc;
+	DWORD   request, bytesRead, errRet;
+
+	/* Page aligned, which satisfies any sector size for unbuffered I/O. */
+	buffer = VirtualAlloc(NULL, CHECKSUM_READ_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (NULL == buffer) {
+		errRet = GetLastError();
+		LogError(L"Failed VirtualAlloc with lastErr %lu (0x%08lx)\n", errRet, errRet);
+		return errRet;
+	}
+
+	crc = 0;
+	errRet = ERROR_SUCCESS;
+	for (pos = Offset; pos < Offset + Length; pos += bytesRead) {
+		request = (DWORD)MIN(CHECKSUM_READ_SIZE, Offset + Length - pos);
+		QosThrottle(QosClassRead, request);
+
+		/* Unbuffered reads are whole sectors; whatever comes back past the
+		 * range is ignored. */
+		errRet = ReadFileSync(File, pos, buffer,
+		                      (DWORD)ALIGN_UP_BY(request, COPY_VIEW_ALIGNMENT), &bytesRead);
+		if (ERROR_SUCCESS == errRet && 0 == bytesRead)
+			errRet = ERROR_HANDLE_EOF;
+		if (ERROR_SUCCESS != errRet) {
+			LogError(L"Failed to read for the checksum at offset %llu with lastErr %lu (0x%08lx)\n",
+			         pos, errRet, errRet);
+			goto func_return;
+		}
+		bytesRead = MIN(bytesRead, request);
+		crc = Crc32cUpdate(crc, buffer, bytesRead);
+	}
+
+	*RawCrc ^= Crc32cShift(crc, End - (Offset + Length));
+
+func_return:
+	(void)VirtualFree(buffer, 0, MEM_RELEASE);
+	return errRet;
+}
+
+
+_Use_decl_annotations_
+DWORD
+VerifyFileChecksum(
+	LPCWSTR         FileName,
+	UINT64          FileSize,
+	UINT32          Expected
+	)
+{
+	HANDLE              file;
+	PALLOCATED_RANGE    ranges;
+	ALLOCATED_RANGE     wholeFile;
+	SIZE_T              numRanges, i;
+	UINT64              bytesHashed, startQPC;
+	UINT32              rawCrc, digest;
+	DWORD               errRet;
+
+	ranges = NULL;
+	startQPC = GetQPCVal();
+
+	/* Reading around the cache is the point: the data has to come off the
+	 * disk to prove it got there. */
+	file = CreateFileW(FileName,
+	                   GENERIC_READ,
+	                   FILE_SHARE_READ,
+	                   NULL,
+	                   OPEN_EXISTING,
+	                   FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN,
+	                   NULL);
+	if (INVALID_HANDLE_VALUE == file) {
+		errRet = GetLastError();
+		LogError(L"Failed to open file %s for verification with lastErr %lu (0x%08lx)\n",
+		         FileName, errRet, errRet);
+		return errRet;
+	}
+
+	/* Only the allocated parts can hold anything but zeros. */
+	errRet = QueryAllocatedRanges(file, 0, FileSize, &ranges, &numRanges);
+	if (ERROR_SUCCESS != errRet) {
+		LogInfo(L"Allocated ranges of %s are unknown (lastErr %lu); reading all of it.\n",
+		        FileName, errRet);
+		wholeFile.Offset = 0;
+		wholeFile.Length = FileSize;
+		numRanges = 1;
+	}
+
+	rawCrc = 0;
+	bytesHashed = 0;
+	for (i = 0; i < numRanges; ++i) {
+		errRet = ChecksumFileRange(file,
+		                           ranges ? ranges[i].Offset : wholeFile.Offset,
+		                           ranges ? ranges[i].Length : wholeFile.Length,
+		                           FileSize,
+		                           &rawCrc);
+		if (ERROR_SUCCESS != errRet)
+			goto func_return;
+		bytesHashed += ranges ? ranges[i].Length : wholeFile.Length;
+	}
+
+	digest = Crc32cFinal(rawCrc, FileSize);
+	if (digest != Expected) {
+		errRet = ERROR_CRC;
+		LogError(L"Verification of %s failed: CRC32C is %08lx but the source had %08lx.\n",
+		         FileName, (unsigned long)digest, (unsigned long)Expected);
+		goto func_return;
+	}
+
+	LogInfo(L"Verified %s: read back %8.2f MiB of allocated data in %llu ms, CRC32C %08lx.\n",
+	        FileName, (double)bytesHashed / 1048576.0,
+	        ElapsedQPCInMillisec(startQPC, GetQPCVal()), (unsigned long)digest);
+
+func_return:
+	free(ranges);
+	(void)CloseHandle(file);
+	return errRet;
+}
@@ -0,0 +1,123 @@
+/* Standard BSD license disclaimer.
+
+Copyright(c) 2016-2021, Lance D. Stringham
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "targetver.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "CopySparse.h"
+
+/* Largest range handed to the file system in one clone request. */
+#define CLONE_CHUNK_SIZE    (1024ull * 1024 * 1024)
+
+
+_Use_decl_annotations_
+DWORD
+CloneAllocatedRanges(
+	HANDLE              Source,
+	HANDLE              Target,
+	UINT64              FileSize,
+	SIZE_T              ClusterSize,
+	PALLOCATED_RANGE    Ranges,
+	SIZE_T              *NumRanges,
+	UINT64              *BytesCloned,
+	UINT32              *SourceCrc
+	)
+{
+	BY_HANDLE_FILE_INFORMATION  sourceInfo, targetInfo;
+	UINT64                      start, end, pos, len;
+	SIZE_T                      numLeft, i;
+	DWORD                       errRet;
+
+	*BytesCloned = 0;
+
+	/* Cloning never works across volumes; don't bother asking. */
+	if (!GetFileInformationByHandle(Source, &sourceInfo)
+	    || !GetFileInformationByHandle(Target, &targetInfo)
+	    || sourceInfo.dwVolumeSerialNumber != targetInfo.dwVolumeSerialNumber)
+		return ERROR_SUCCESS;
+
+	numLeft = 0;
+	errRet = ERROR_SUCCESS;
+	for (i = 0; i < *NumRanges; ++i) {
+		/* Once the volume said no, everything left is copied. */
+		if (ERROR_SUCCESS != errRet) {
+			Ranges[numLeft++] = Ranges[i];
+			continue;
+		}
+
+		/* Clones work on whole clusters; the last one may end at EOF. */
+		start = Ranges[i].Offset - Ranges[i].Offset % ClusterSize;
+		end = Ranges[i].Offset + Ranges[i].Length + ClusterSize - 1;
+		end = MIN(end - end % ClusterSize, FileSize);
+
+		for (pos = start; pos < end; pos += len) {
+			len = MIN(CLONE_CHUNK_SIZE, end - pos);
+			errRet = CloneFileRange(Target, pos, Source, pos, len);
+			if (ERROR_SUCCESS != errRet)
+				break;
+			*BytesCloned += len;
+
+			/* The copy engines never see this data, so it is hashed here. */
+			if (SourceCrc) {
+				errRet = ChecksumFileRange(Source, pos, len, FileSize, SourceCrc);
+				if (ERROR_SUCCESS != errRet)
+					return errRet;
+			}
+		}
+		if (pos >= end)
+			continue;
+
+		/* Whatever was not cloned is copied the usual way. */
+		Ranges[numLeft].Offset = MAX(pos, Ranges[i].Offset);
+		Ranges[numLeft].Length = Ranges[i].Offset + Ranges[i].Length - Ranges[numLeft].Offset;
+		++numLeft;
+
+		if (ERROR_INVALID_FUNCTION == errRet || ERROR_NOT_SUPPORTED == errRet
+		    || ERROR_NOT_SAME_DEVICE == errRet) {
+			if (0 == *BytesCloned)
+				LogInfo(L"The volume cannot clone blocks; copying the data instead.\n");
+		} else {
+			LogInfo(L"Failed to clone %llu bytes at offset %llu with lastErr %lu; "
+			        L"copying them instead.\n", end - pos, pos, errRet);
+			errRet = ERROR_SUCCESS;
+		}
+	}
+
+	*NumRanges = numLeft;
+	return ERROR_SUCCESS;
+}
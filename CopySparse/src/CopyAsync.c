@@ -0,0 +1,366 @@
+/* Standard BSD license disclaimer.
+
+Copyright(c) 2016-2021, Lance D. Stringham
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "targetver.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "CopySparse.h"
+
+/* The async engine.
+ *
+ * Mapped views leave the writes to the cache manager, which on SAN and
+ * network volumes ends up writing the target in small random pieces as
+ * pages are dirtied. This engine keeps a fixed set of buffers, each either
+ * being filled by a read of the next chunk of an extent or being written
+ * out. Once a chunk is in, it is cut into runs of clusters that are not all
+ * zeros and each run goes out as one write, so holes are never written and
+ * writes are as large as the data allows. Everything completes through one
+ * I/O completion port on a single thread. */
+
+#define COPY_ASYNC_BUFFER_SIZE  (1024 * 1024)
+
+typedef struct COPY_SLOT {
+	OVERLAPPED  Overlapped;
+	PBYTE       Buffer;
+	UINT64      Offset;
+	/* Bytes asked for and bytes the read returned. */
+	DWORD       Length;
+	DWORD       Valid;
+	/* Where the search for the next data run continues. */
+	DWORD       Next;
+	/* Bytes of the source the write in flight covers. */
+	DWORD       WriteLength;
+	BOOL        Writing;
+} COPY_SLOT, *PCOPY_SLOT;
+
+typedef struct COPY_ASYNC {
+	HANDLE              Source;
+	HANDLE              Target;
+	HANDLE              Port;
+	UINT64              FileSize;
+	/* Zeros are looked for in units of this many bytes, which every chunk
+	 * starts on. Unbuffered writes are rounded up to it. */
+	DWORD               ZeroUnit;
+	BOOL                Unbuffered;
+	/* Hash every chunk read; CRCs are shifted to the end of the range. */
+	BOOL                Checksum;
+	UINT64              End;
+	PALLOCATED_RANGE    Extents;
+	SIZE_T              NumExtents;
+	SIZE_T              NextExtent;
+	UINT64              NextOffset;
+	DWORD               Outstanding;
+	DWORD               FirstError;
+	COPY_STATS          Stats;
+} COPY_ASYNC, *PCOPY_ASYNC;
+
+
+/* Read the next chunk into Slot. The slot stays idle once there is none. */
+static DWORD
+StartRead(
+	_Inout_     PCOPY_ASYNC     Copy,
+	_Inout_     PCOPY_SLOT      Slot
+	)
+{
+	PALLOCATED_RANGE    extent;
+	DWORD               readLength, errRet;
+
+	if (ERROR_SUCCESS != Copy->FirstError || Copy->NextExtent >= Copy->NumExtents)
+		return ERROR_SUCCESS;
+
+	extent = &Copy->Extents[Copy->NextExtent];
+	Slot->Offset = Copy->NextOffset;
+	Slot->Length = (DWORD)MIN(COPY_ASYNC_BUFFER_SIZE,
+	                          extent->Offset + extent->Length - Slot->Offset);
+	Slot->Valid = 0;
+	Slot->Next = 0;
+	Slot->Writing = FALSE;
+	Copy->NextOffset += Slot->Length;
+	if (Copy->NextOffset == extent->Offset + extent->Length
+	    && ++Copy->NextExtent < Copy->NumExtents)
+		Copy->NextOffset = Copy->Extents[Copy->NextExtent].Offset;
+
+	/* Unbuffered reads are whole sectors; the one at the end of the file
+	 * simply comes back short. */
+	readLength = Slot->Length;
+	if (Copy->Unbuffered)
+		readLength = (DWORD)ALIGN_UP_BY(readLength, Copy->ZeroUnit);
+
+	QosThrottle(QosClassRead, Slot->Length);
+
+	memset(&Slot->Overlapped, 0, sizeof(Slot->Overlapped));
+	Slot->Overlapped.Offset = (DWORD)Slot->Offset;
+	Slot->Overlapped.OffsetHigh = (DWORD)(Slot->Offset >> 32);
+	if (!ReadFile(Copy->Source, Slot->Buffer, readLength, NULL, &Slot->Overlapped)) {
+		errRet = GetLastError();
+		if (ERROR_IO_PENDING != errRet) {
+			LogError(L"Failed ReadFile at offset %llu with lastErr %lu (0x%08lx)\n",
+			         Slot->Offset, errRet, errRet);
+			return errRet;
+		}
+	}
+	Copy->Outstanding++;
+	return ERROR_SUCCESS;
+}
+
+
+/* Write the next run of data clusters in Slot, or move on to the next chunk
+ * once there are none left. */
+static DWORD
+ContinueSlot(
+	_Inout_     PCOPY_ASYNC     Copy,
+	_Inout_     PCOPY_SLOT      Slot
+	)
+{
+	UINT64  offset;
+	DWORD   start, end, unit, writeLength, errRet;
+
+	unit = Copy->ZeroUnit;
+
+	for (start = Slot->Next; start < Slot->Valid; start += unit) {
+		if (!IsZeroBuf(Slot->Buffer + start, MIN(unit, Slot->Valid - start)))
+			break;
+	}
+	for (end = start; end < Slot->Valid; end += unit) {
+		if (IsZeroBuf(Slot->Buffer + end, MIN(unit, Slot->Valid - end)))
+			break;
+	}
+	end = MIN(end, Slot->Valid);
+
+	if (start >= Slot->Valid || ERROR_SUCCESS != Copy->FirstError)
+		return StartRead(Copy, Slot);
+
+	Slot->Next = end;
+	Slot->WriteLength = end - start;
+	Slot->Writing = TRUE;
+
+	/* The zeros the read left past the end of the file keep an unbuffered
+	 * write whole sectors; the file is cut back to size afterwards. */
+	writeLength = Slot->WriteLength;
+	if (Copy->Unbuffered)
+		writeLength = (DWORD)ALIGN_UP_BY(writeLength, unit);
+
+	QosThrottle(QosClassWrite, Slot->WriteLength);
+
+	offset = Slot->Offset + start;
+	memset(&Slot->Overlapped, 0, sizeof(Slot->Overlapped));
+	Slot->Overlapped.Offset = (DWORD)offset;
+	Slot->Overlapped.OffsetHigh = (DWORD)(offset >> 32);
+	if (!WriteFile(Copy->Target, Slot->Buffer + start, writeLength, NULL, &Slot->Overlapped)) {
+		errRet = GetLastError();
+		if (ERROR_IO_PENDING != errRet) {
+			LogError(L"Failed WriteFile at offset %llu with lastErr %lu (0x%08lx)\n",
+			         offset, errRet, errRet);
+			return errRet;
+		}
+	}
+	Copy->Outstanding++;
+	return ERROR_SUCCESS;
+}
+
+
+_Use_decl_annotations_
+DWORD
+CopyFileAsync(
+	HANDLE                  Source,
+	HANDLE                  Target,
+	UINT64                  FileSize,
+	SIZE_T                  ClusterSize,
+	UINT64                  Offset,
+	UINT64                  Length,
+	const ALLOCATED_RANGE   *Ranges,
+	SIZE_T                  NumRanges,
+	DWORD                   QueueDepth,
+	BOOL                    Unbuffered,
+	BOOL                    Checksum,
+	PCOPY_STATS             Stats
+	)
+{
+	COPY_ASYNC      copy;
+	PCOPY_SLOT      slots, slot;
+	LPOVERLAPPED    overlapped;
+	LARGE_INTEGER   fileSize;
+	ULONG_PTR       key;
+	UINT64          extentBytes, lastStatsQPCVal;
+	SIZE_T          j;
+	DWORD           bytes, i, errRet;
+	BOOL            ok;
+
+	assert(0 < QueueDepth && QueueDepth <= MAX_COPY_QUEUE_DEPTH);
+
+	memset(Stats, 0, sizeof(*Stats));
+	memset(&copy, 0, sizeof(copy));
+	copy.Source     = Source;
+	copy.Target     = Target;
+	copy.FileSize   = FileSize;
+	copy.ZeroUnit   = (DWORD)MIN(ClusterSize, COPY_VIEW_ALIGNMENT);
+	copy.Unbuffered = Unbuffered;
+	copy.Checksum   = Checksum;
+	copy.End        = Offset + Length;
+	slots = NULL;
+
+	errRet = CopyBuildExtents(Offset, Offset + Length, Ranges, NumRanges,
+	                          &copy.Extents, &copy.NumExtents);
+	if (ERROR_SUCCESS != errRet) {
+		LogError(L"Failed to allocate copy extents\n");
+		goto func_return;
+	}
+	extentBytes = 0;
+	for (j = 0; j < copy.NumExtents; ++j)
+		extentBytes += copy.Extents[j].Length;
+	copy.Stats.BytesSkipped = Length - extentBytes;
+	if (copy.NumExtents)
+		copy.NextOffset = copy.Extents[0].Offset;
+	if (Ranges) {
+		LogInfo(L"Copying %8.2f MiB in %llu allocated extents; %8.2f MiB need no copying.\n",
+		        (double)extentBytes / 1048576.0, (UINT64)copy.NumExtents,
+		        (double)copy.Stats.BytesSkipped / 1048576.0);
+	}
+
+	copy.Port = CreateIoCompletionPort(Source, NULL, 0, 1);
+	if (NULL == copy.Port || NULL == CreateIoCompletionPort(Target, copy.Port, 0, 1)) {
+		errRet = GetLastError();
+		LogError(L"Failed CreateIoCompletionPort with lastErr %lu (0x%08lx)\n", errRet, errRet);
+		goto func_return;
+	}
+
+	slots = calloc(QueueDepth, sizeof(*slots));
+	if (NULL == slots) {
+		errRet = ERROR_NOT_ENOUGH_MEMORY;
+		LogError(L"Failed to allocate copy buffers\n");
+		goto func_return;
+	}
+	/* Page aligned, which satisfies any sector size for unbuffered I/O. */
+	for (i = 0; i < QueueDepth; ++i) {
+		slots[i].Buffer = VirtualAlloc(NULL, COPY_ASYNC_BUFFER_SIZE,
+		                               MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (NULL == slots[i].Buffer) {
+			errRet = GetLastError();
+			LogError(L"Failed VirtualAlloc with lastErr %lu (0x%08lx)\n", errRet, errRet);
+			goto func_return;
+		}
+	}
+
+	for (i = 0; i < QueueDepth && ERROR_SUCCESS == copy.FirstError; ++i)
+		copy.FirstError = StartRead(&copy, &slots[i]);
+
+	lastStatsQPCVal = GetQPCVal();
+	while (copy.Outstanding) {
+		ok = GetQueuedCompletionStatus(copy.Port, &bytes, &key, &overlapped,
+		                               COPY_STATS_INTERVAL_MS);
+		if (NULL == overlapped) {
+			errRet = GetLastError();
+			if (WAIT_TIMEOUT != errRet) {
+				/* Nothing can be waited for anymore; the I/O in flight is
+				 * left to the handles being closed. */
+				LogError(L"Failed GetQueuedCompletionStatus with lastErr %lu (0x%08lx)\n",
+				         errRet, errRet);
+				goto func_return;
+			}
+		} else {
+			slot = CONTAINING_RECORD(overlapped, COPY_SLOT, Overlapped);
+			copy.Outstanding--;
+
+			if (!ok) {
+				errRet = GetLastError();
+				LogError(L"Failed to %s files at offset %llu with lastErr %lu (0x%08lx)\n",
+				         slot->Writing ? L"write" : L"read",
+				         slot->Offset + (slot->Writing ? slot->Next - slot->WriteLength : 0),
+				         errRet, errRet);
+				if (ERROR_SUCCESS == copy.FirstError)
+					copy.FirstError = errRet;
+				continue;
+			}
+
+			if (slot->Writing) {
+				copy.Stats.BytesWritten += slot->WriteLength;
+			} else {
+				slot->Valid = MIN(bytes, slot->Length);
+				copy.Stats.BytesRead += slot->Valid;
+				if (Checksum) {
+					copy.Stats.SourceCrc ^= Crc32cShift(Crc32cUpdate(0, slot->Buffer, slot->Valid),
+					                                    copy.End - (slot->Offset + slot->Valid));
+				}
+				/* A short read means the end of the file. Unbuffered writes
+				 * round up into this part of the buffer. */
+				if (Unbuffered)
+					memset(slot->Buffer + slot->Valid, 0,
+					       ALIGN_UP_BY(slot->Valid, copy.ZeroUnit) - slot->Valid);
+				copy.Stats.ViewsCopied++;
+			}
+
+			errRet = ContinueSlot(&copy, slot);
+			if (ERROR_SUCCESS != errRet && ERROR_SUCCESS == copy.FirstError)
+				copy.FirstError = errRet;
+		}
+
+		if (ElapsedQPCInMillisec(lastStatsQPCVal, GetQPCVal()) >= COPY_STATS_INTERVAL_MS) {
+			LogInfo(L"Copied: %8.2f MiB of %8.2f MiB\n",
+			        (double)copy.Stats.BytesRead / 1048576.0, (double)extentBytes / 1048576.0);
+			lastStatsQPCVal = GetQPCVal();
+		}
+	}
+
+	errRet = copy.FirstError;
+
+	/* Undo what the last unbuffered write added past the end of the file. */
+	if (ERROR_SUCCESS == errRet && Unbuffered
+	    && GetFileSizeEx(Target, &fileSize) && (UINT64)fileSize.QuadPart > FileSize) {
+		fileSize.QuadPart = (LONGLONG)FileSize;
+		errRet = SetFileSize(Target, fileSize);
+		if (ERROR_SUCCESS != errRet)
+			LogError(L"Failed SetFileSize with lastErr %lu (0x%08lx)\n", errRet, errRet);
+	}
+
+func_return:
+	*Stats = copy.Stats;
+	/* Buffers of I/O still in flight after a port failure are leaked rather
+	 * than freed under the file system. */
+	if (slots && 0 == copy.Outstanding) {
+		for (i = 0; i < QueueDepth; ++i) {
+			if (slots[i].Buffer)
+				(void)VirtualFree(slots[i].Buffer, 0, MEM_RELEASE);
+		}
+		free(slots);
+	}
+	if (copy.Port)
+		(void)CloseHandle(copy.Port);
+	free(copy.Extents);
+	return errRet;
+}
@@ -40,21 +40,13 @@ THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <stdint.h>
 #include <inttypes.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <SparseFileLib.h>
 
-#define DEFAULT_EXE_NAME    L"CopySparse.exe"
+#include "CopySparse.h"
 
-/* I came up with 512 MiB so the contiguous VA space required for file mappings
- * would fit in both 32 and 64 bit processes. Since VA space is limited in
- * 32-bit processes we need to be careful not to pick a value that is too large
- * since Windows loads various libraries into the process memory and randomizes
- * the address layout throughout the address space. There may be much better
- * values that could be picked for 32-bit processes. I didn't spend any real
- * time trying to find a good one and just picked it based on the factors noted
- * above.
-*/
-#define MAX_FILE_VIEW_SIZE (512 * 1024 * 1024)
+#define DEFAULT_EXE_NAME    L"CopySparse.exe"
 
 
 static void __stdcall
@@ -62,7 +54,44 @@ PrintUsageInfo(
 	LPWSTR exeName
 	)
 {
-	LogInfo(L"Usage: %s [-h] [-m] INPUTFILE OUTPUTFILE\n\t-h Print this help message.\n", exeName);
+	LogInfo(L"Usage: %s [-h] [-m] [--background] [--max-read SIZE] [--max-write SIZE]\n"
+	        L"\t[--qos-file QosLimits.txt] [--presize | --range OFFSET:LENGTH]\n"
+	        L"\t[--shard-result Shard.txt] [--threads N] [--no-clone]\n"
+	        L"\t[--engine async [--queue-depth N] [--unbuffered]] [--checksum | --verify]\n"
+	        L"\t[--update] [--write-behind SIZE] INPUTFILE OUTPUTFILE [OUTPUTFILE ...]\n"
+	        L"\t-h Print this help message.\n"
+	        L"\t--threads copies N views of the file at once (1 - %d, default 1).\n"
+	        L"\t--no-clone copies the data even when both files are on a volume\n"
+	        L"\t  that can share it through block cloning.\n"
+	        L"\t--engine async reads into buffers with overlapped I/O and writes\n"
+	        L"\t  only the data clusters, in large writes, instead of copying\n"
+	        L"\t  through mapped views (--engine mmap, the default). Suits SAN and\n"
+	        L"\t  network volumes. --queue-depth sets the reads and writes kept\n"
+	        L"\t  in flight (1 - %d, default %d) and --unbuffered bypasses the\n"
+	        L"\t  file cache. Not available with --threads.\n"
+	        L"\t--checksum prints the CRC32C of INPUTFILE, computed while copying.\n"
+	        L"\t--verify also reads the data of OUTPUTFILE back from disk afterwards\n"
+	        L"\t  and fails unless its CRC32C matches. Neither works with --range.\n"
+	        L"\t--update refreshes an existing OUTPUTFILE: both files are compared\n"
+	        L"\t  cluster by cluster and only the clusters that differ are written,\n"
+	        L"\t  or deallocated where INPUTFILE is zero. Not available with\n"
+	        L"\t  --presize, --range, --threads or --engine.\n"
+	        L"\t--write-behind flushes every view of OUTPUTFILE in the background\n"
+	        L"\t  once it is copied and holds the copy back while more than SIZE\n"
+	        L"\t  bytes of it are not on disk yet. Not available with --engine\n"
+	        L"\t  async or --update.\n"
+	        L"\tSeveral OUTPUTFILEs (up to %d) are written from one read of INPUTFILE;\n"
+	        L"\t  a target that fails is dropped and the others are finished. Only\n"
+	        L"\t  plain copies with the default engine take more than one.\n"
+	        L"\t--presize only creates OUTPUTFILE, sparse and as large as INPUTFILE.\n"
+	        L"\t--range copies LENGTH bytes (0 for the rest of the file) starting at\n"
+	        L"\t  OFFSET into an OUTPUTFILE created with --presize, so several\n"
+	        L"\t  processes or machines can copy one file. Both must be multiples\n"
+	        L"\t  of 64K and of the cluster size. Timestamps are not copied.\n"
+	        L"\t--shard-result writes what was done to a file that MakeSparse\n"
+	        L"\t  --merge-shards combines into one report.\n"
+	        QOS_USAGE_TEXT, exeName, MAX_COPY_THREADS, MAX_COPY_QUEUE_DEPTH,
+	        DEFAULT_COPY_QUEUE_DEPTH, MAX_COPY_TARGETS);
 }
 
 
@@ -70,136 +99,436 @@ _Must_inspect_result_
 _Success_(return != 0)
 static BOOL __stdcall
 ParseArgs(
-	_In_    int         argc,
-	_In_    wchar_t     **argv,
-	_Out_   LPWSTR      *SourceFileName,
-	_Out_   LPWSTR      *TargetFileName
+	_In_    int                 argc,
+	_In_    wchar_t             **argv,
+	_Out_   PCOPYSPARSE_OPTIONS Options
 	)
 {
+	UINT64  tmp;
 	BOOL    retVal;
-	BOOLEAN pcm;
 	int     i;
 
 	retVal = FALSE;
-	pcm = FALSE;
+	memset(Options, 0, sizeof(*Options));
 
-	if ((argc < 3) || (argc > 4)) {
+	if (argc < 3) {
 		PrintUsageInfo((argc < 1) ? DEFAULT_EXE_NAME : argv[0]);
 		goto func_return;
 	}
 
-	for (i = 1; i < (argc - 2); ++i) {
-		if (!wcscmp(L"-h", argv[i])) {
-			PrintUsageInfo(argv[0]);
-			goto func_return;
+	/* Options end at the first argument that is not one; the source and at
+	 * least one target follow. */
+	for (i = 1; i < (argc - 2) && L'-' == argv[i][0]; ++i) {
+		if (!wcscmp(L"--range", argv[i])) {
+			if (++i >= argc - 2
+			    || !ParseRangeArg(argv[i], &Options->RangeOffset, &Options->RangeLength))
+				goto usage_return;
+			Options->Ranged = TRUE;
+		} else if (!wcscmp(L"--presize", argv[i])) {
+			Options->Presize = TRUE;
+		} else if (!wcscmp(L"--shard-result", argv[i])) {
+			if (++i >= argc - 2)
+				goto usage_return;
+			Options->ShardResult = argv[i];
+		} else if (!wcscmp(L"--no-clone", argv[i])) {
+			Options->NoClone = TRUE;
+		} else if (!wcscmp(L"--engine", argv[i])) {
+			if (++i >= argc - 2)
+				goto usage_return;
+			if (!wcscmp(L"mmap", argv[i]))
+				Options->Engine = CopyEngineMapped;
+			else if (!wcscmp(L"async", argv[i]))
+				Options->Engine = CopyEngineAsync;
+			else
+				goto usage_return;
+		} else if (!wcscmp(L"--queue-depth", argv[i])) {
+			if (++i >= argc - 2 || !ParseSizeArg(argv[i], &tmp)
+			    || !tmp || MAX_COPY_QUEUE_DEPTH < tmp)
+				goto usage_return;
+			Options->QueueDepth = (DWORD)tmp;
+		} else if (!wcscmp(L"--unbuffered", argv[i])) {
+			Options->Unbuffered = TRUE;
+		} else if (!wcscmp(L"--update", argv[i])) {
+			Options->Update = TRUE;
+		} else if (!wcscmp(L"--checksum", argv[i])) {
+			Options->Checksum = TRUE;
+		} else if (!wcscmp(L"--verify", argv[i])) {
+			Options->Checksum = TRUE;
+			Options->Verify = TRUE;
+		} else if (!wcscmp(L"--write-behind", argv[i])) {
+			if (++i >= argc - 2 || !ParseSizeArg(argv[i], &tmp) || !tmp)
+				goto usage_return;
+			Options->WriteBehind = tmp;
+		} else if (!wcscmp(L"--threads", argv[i])) {
+			if (++i >= argc - 2 || !ParseSizeArg(argv[i], &tmp)
+			    || !tmp || MAX_COPY_THREADS < tmp)
+				goto usage_return;
+			Options->Threads = (DWORD)tmp;
+		} else if (!wcscmp(L"-h", argv[i])
+		           || QosArgConsumed != QosParseArg(argc - 2, argv, &i, &Options->Qos)) {
+			goto usage_return;
 		}
 	}
 
-	*SourceFileName = argv[i];
-	*TargetFileName = argv[i + 1];
+	Options->SourceFileName = argv[i];
+	Options->TargetFileName = argv[i + 1];
+	Options->TargetFileNames = &argv[i + 1];
+	Options->NumTargets = (DWORD)(argc - i - 1);
+
+	if (MAX_COPY_TARGETS < Options->NumTargets)
+		goto usage_return;
+	/* Fanning out is only done by the view engine, on whole new files. */
+	if (1 < Options->NumTargets
+	    && (Options->Presize || Options->Ranged || Options->ShardResult || Options->Update
+	        || CopyEngineMapped != Options->Engine))
+		goto usage_return;
+	if (Options->Presize && (Options->Ranged || Options->ShardResult || Options->Threads))
+		goto usage_return;
+	/* Updates compare the files on a single thread of their own. */
+	if (Options->Update && (Options->Presize || Options->Ranged || Options->Threads
+	                        || CopyEngineMapped != Options->Engine))
+		goto usage_return;
+	/* A shard only sees part of the file, so it has no digest of its own. */
+	if (Options->Checksum && (Options->Presize || Options->Ranged))
+		goto usage_return;
+	/* The async engine runs on one thread; its queue depth does the job. */
+	if (CopyEngineAsync == Options->Engine && Options->Threads)
+		goto usage_return;
+	if (CopyEngineAsync != Options->Engine && (Options->QueueDepth || Options->Unbuffered))
+		goto usage_return;
+	/* Only the view engine leaves its writes to the cache manager. */
+	if (Options->WriteBehind && (CopyEngineMapped != Options->Engine || Options->Update))
+		goto usage_return;
+	if (0 == Options->Threads)
+		Options->Threads = 1;
+	if (0 == Options->QueueDepth)
+		Options->QueueDepth = DEFAULT_COPY_QUEUE_DEPTH;
+
 	retVal = TRUE;
+	goto func_return;
+
+usage_return:
+	PrintUsageInfo(argv[0]);
 
 func_return:
 	return retVal;
 }
 
 
+_Success_(return == TRUE)
+static BOOL
+SaveShardResult(
+	_In_    const COPYSPARSE_OPTIONS    *Options,
+	_In_    UINT64                      FileSize,
+	_In_    SIZE_T                      ClusterSize,
+	_In_    UINT64                      RangeLength,
+	_In_    UINT64                      BytesRead,
+	_In_    UINT64                      BytesWritten,
+	_In_    DWORD                       Error
+	)
+{
+	SHARD_RESULT    result;
+	DWORD           lastErr;
+
+	memset(&result, 0, sizeof(result));
+	wcscpy_s(result.Tool, ARRAYSIZE(result.Tool), L"CopySparse");
+	result.FileSize     = FileSize;
+	result.ClusterSize  = ClusterSize;
+	result.RangeOffset  = Options->RangeOffset;
+	result.RangeLength  = RangeLength;
+	result.Error        = Error;
+	result.BytesRead    = BytesRead;
+	result.BytesWritten = BytesWritten;
+
+	lastErr = ShardResultSave(Options->ShardResult, &result, NULL);
+	if (ERROR_SUCCESS != lastErr) {
+		LogError(L"Failed to write shard result %s with lastErr %lu (0x%08lx)\n",
+		         Options->ShardResult, lastErr, lastErr);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+
+/* Create Target, or open it for --update, make it sparse and give it the
+ * size of the source. Target->File is left for the caller to close. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+static DWORD
+OpenTargetFile(
+	_In_    const COPYSPARSE_OPTIONS    *Options,
+	_Inout_ PCOPY_TARGET                Target,
+	_In_    HANDLE                      SourceFile,
+	_In_    LARGE_INTEGER               SourceFileSize,
+	_In_    DWORD                       IoFlags
+	)
+{
+	FILE_SET_SPARSE_BUFFER  sparseBuf;
+	DWORD                   lastErr;
+
+	/* An update takes the target as it is; it is made sparse and cut or
+	 * grown to the size of the source like a new one. */
+	Target->File = CreateFileW(Target->FileName,
+	                           Options->Update ? GENERIC_READ | GENERIC_WRITE : GENERIC_ALL,
+	                           0,
+	                           NULL,
+	                           Options->Update ? OPEN_EXISTING : CREATE_NEW,
+	                           FILE_ATTRIBUTE_NORMAL | IoFlags,
+	                           Options->Update ? NULL : SourceFile);
+	if (INVALID_HANDLE_VALUE == Target->File) {
+		Target->File = NULL;
+		lastErr = GetLastError();
+		LogError(L"Failed CreateFileW for filename %s with lastErr %lu (0x%08lx)", Target->FileName, lastErr, lastErr);
+		return lastErr;
+	}
+
+	/* Set the sparse attribute on the target file */
+	sparseBuf.SetSparse = TRUE;
+	lastErr = DeviceIoControlSync(Target->File,
+	                              FSCTL_SET_SPARSE,
+	                              &sparseBuf,
+	                              sizeof(sparseBuf),
+	                              NULL,
+	                              0,
+	                              NULL);
+	if (ERROR_SUCCESS != lastErr) {
+		LogError(L"Failed DeviceIoControl for FSCTL_SET_SPARSE with lastErr %lu (0x%08lx)", lastErr, lastErr);
+		return lastErr;
+	}
+
+	/* Set the target file size to match the source. */
+	lastErr = SetFileSize(Target->File, SourceFileSize);
+	if (ERROR_SUCCESS != lastErr) {
+		LogError(L"Failed SetFileSize with lastErr %lu (0x%08lx)", lastErr, lastErr);
+		return lastErr;
+	}
+	return ERROR_SUCCESS;
+}
+
+
 int
 wmain(
 	int         argc,
 	wchar_t     **argv
 	)
 {
+	COPYSPARSE_OPTIONS      opts;
 	LPWSTR                  sourceFileName, targetFileName;
 	HANDLE                  sourceFile, targetFile;
-	HANDLE                  sourceFileMap, targetFileMap;
-	char                    *sourceViewBase, *targetViewBase;
-	SIZE_T                  currentMapSize, currentMapAlignedDownSize, i;
-	UINT64                  bytesProcessed, startQPC;
+	HANDLE                  sourceFileMap;
+	COPY_TARGET             targets[MAX_COPY_TARGETS];
+	COPY_STATS              copyStats;
+	PALLOCATED_RANGE        allocatedRanges, extents;
+	SIZE_T                  numAllocatedRanges, numExtents;
+	UINT64                  bytesCloned;
+	UINT32                  cloneCrc, digest;
+	SIZE_T                  clusterSize;
+	UINT64                  startQPC;
+	UINT64                  copyStart, copyLength;
 	FILETIME                ftCreate, ftAccess, ftWrite;
-	FILE_SET_SPARSE_BUFFER  sparseBuf;
-	LARGE_INTEGER           sourceFileSize, statsFreq;
+	LARGE_INTEGER           sourceFileSize, targetFileSize;
 	UINT64                  hours, minutes, seconds;
-	HANDLE                  statsTimer;
-	DWORD                   lastErr;
-	double                  sourceFileSizeMiB;
+	DWORD                   lastErr, ioFlags, t, numLive;
 	int                     retVal;
-	ULONG_PTR               tmpULP;
-	char                    tmpChar;
 
 	SparseFileLibInit();
 
 	sourceFile      = NULL;
 	targetFile      = NULL;
 	sourceFileMap   = NULL;
-	targetFileMap   = NULL;
-	sourceViewBase  = NULL;
-	targetViewBase  = NULL;
-	statsTimer      = NULL;
+	memset(targets, 0, sizeof(targets));
+	opts.NumTargets = 0;
+
+	allocatedRanges = NULL;
+	numAllocatedRanges = 0;
+	bytesCloned = 0;
+	cloneCrc = 0;
 
-	bytesProcessed  = 0;
+	memset(&copyStats, 0, sizeof(copyStats));
+	copyStart       = 0;
+	copyLength      = 0;
+	clusterSize     = 0;
+	lastErr         = ERROR_SUCCESS;
+	sourceFileSize.QuadPart = 0;
 
 	startQPC = GetQPCVal();
 
-	if (!ParseArgs(argc, argv, &sourceFileName, &targetFileName)) {
+	if (!ParseArgs(argc, argv, &opts)) {
 		goto error_return;
 	}
+	sourceFileName = opts.SourceFileName;
+	targetFileName = opts.TargetFileName;
+	for (t = 0; t < opts.NumTargets; ++t)
+		targets[t].FileName = opts.TargetFileNames[t];
 
-	sourceFile = OpenFileExclusive(sourceFileName,
-	                               FILE_FLAG_SEQUENTIAL_SCAN,
-	                               &sourceFileSize,
-	                               NULL,
-	                               &ftCreate,
-	                               &ftAccess,
-	                               &ftWrite);
+	if (ERROR_SUCCESS != QosStart(&opts.Qos))
+		goto error_return;
+
+	/* The async engine and updates need both files opened for overlapped
+	 * I/O. */
+	ioFlags = 0;
+	if (CopyEngineAsync == opts.Engine || opts.Update)
+		ioFlags = FILE_FLAG_OVERLAPPED | (opts.Unbuffered ? FILE_FLAG_NO_BUFFERING : 0);
+
+	/* Shards read the source alongside each other. */
+	if (opts.Ranged) {
+		sourceFile = CreateFileW(sourceFileName,
+		                         GENERIC_READ,
+		                         FILE_SHARE_READ,
+		                         NULL,
+		                         OPEN_EXISTING,
+		                         FILE_FLAG_SEQUENTIAL_SCAN | ioFlags,
+		                         NULL);
+		if (INVALID_HANDLE_VALUE == sourceFile) {
+			sourceFile = NULL;
+		} else if (!GetFileSizeEx(sourceFile, &sourceFileSize)) {
+			lastErr = GetLastError();
+			(void)CloseHandle(sourceFile);
+			sourceFile = NULL;
+			SetLastError(lastErr);
+		}
+	} else {
+		sourceFile = OpenFileExclusive(sourceFileName,
+		                               FILE_FLAG_SEQUENTIAL_SCAN | ioFlags,
+		                               &sourceFileSize,
+		                               NULL,
+		                               &ftCreate,
+		                               &ftAccess,
+		                               &ftWrite);
+	}
 	if (!sourceFile) {
 		lastErr = GetLastError();
 		LogError(L"Failed to open file %s with lastErr %lu (0x%08lx)", sourceFileName, lastErr, lastErr);
 		goto error_return;
 	}
 
-	sourceFileSizeMiB = (double)sourceFileSize.QuadPart / 1048576.0;
+	if (opts.Ranged)
+		goto open_shard_target;
+
+	/* A target that cannot be set up is dropped; the copy goes on as long as
+	 * one is left. targetFile is the first of those, and the only target
+	 * of everything but plain copies. */
+	for (t = 0; t < opts.NumTargets; ++t) {
+		targets[t].Error = OpenTargetFile(&opts, &targets[t], sourceFile, sourceFileSize, ioFlags);
+		if (ERROR_SUCCESS != targets[t].Error)
+			lastErr = targets[t].Error;
+		else if (NULL == targetFile)
+			targetFile = targets[t].File;
+	}
+	if (NULL == targetFile)
+		goto error_return;
+	lastErr = ERROR_SUCCESS;
+
+	if (opts.Presize) {
+		LogInfo(L"Created %s with a size of %llu bytes.\n",
+		        targetFileName, (UINT64)sourceFileSize.QuadPart);
+		retVal = EXIT_SUCCESS;
+		goto func_return;
+	}
+	goto start_copy;
 
-	targetFile = CreateFileW(targetFileName,
-	                         GENERIC_ALL,
-	                         0,
+open_shard_target:
+	/* The target was created by --presize; shards only fill in their part. */
+	targets[0].File = CreateFileW(targetFileName,
+	                         GENERIC_READ | GENERIC_WRITE,
+	                         FILE_SHARE_READ | FILE_SHARE_WRITE,
 	                         NULL,
-	                         CREATE_NEW,
-	                         FILE_ATTRIBUTE_NORMAL,
-	                         sourceFile);
-	if (INVALID_HANDLE_VALUE == targetFile) {
-		targetFile = NULL;
+	                         OPEN_EXISTING,
+	                         FILE_ATTRIBUTE_NORMAL | ioFlags,
+	                         NULL);
+	if (INVALID_HANDLE_VALUE == targets[0].File) {
+		targets[0].File = NULL;
 		lastErr = GetLastError();
 		LogError(L"Failed CreateFileW for filename %s with lastErr %lu (0x%08lx)", targetFileName, lastErr, lastErr);
 		goto error_return;
 	}
-
-	/* Set the sparse attribute on the target file */
-	sparseBuf.SetSparse = TRUE;
-	if (!DeviceIoControl(targetFile,
-	                     FSCTL_SET_SPARSE,
-	                     &sparseBuf,
-	                     sizeof(sparseBuf),
-	                     NULL,
-	                     0,
-	                     NULL,
-	                     NULL)) {
+	targetFile = targets[0].File;
+	if (!GetFileSizeEx(targetFile, &targetFileSize)) {
 		lastErr = GetLastError();
-		LogError(L"Failed DeviceIoControl for FSCTL_SET_SPARSE with lastErr %lu (0x%08lx)", lastErr, lastErr);
+		LogError(L"Failed GetFileSizeEx with lastErr %lu (0x%08lx)", lastErr, lastErr);
 		goto error_return;
 	}
-
-	/* Set the target file size to match the source. */
-	lastErr = SetFileSize(targetFile, sourceFileSize);
-	if (ERROR_SUCCESS != lastErr) {
-		LogError(L"Failed SetFileSize with lastErr %lu (0x%08lx)", lastErr, lastErr);
+	if (targetFileSize.QuadPart != sourceFileSize.QuadPart) {
+		lastErr = ERROR_INVALID_PARAMETER;
+		LogError(L"Target file %s is not the size of the source. Create it with --presize first.\n",
+		         targetFileName);
+		goto error_return;
+	}
+	copyStart = opts.RangeOffset;
+	copyLength = opts.RangeLength;
+
+start_copy:
+	/* Without --range the whole file is the one shard. */
+	clusterSize = GetVolumeClusterSizeFromFileHandle(targetFile);
+	if (0 == clusterSize || (SIZE_T)-1 == clusterSize)
+		clusterSize = SPARSE_MAP_RANGE_ALIGNMENT;
+	if (!ShardRangeResolve((UINT64)sourceFileSize.QuadPart, clusterSize, copyStart, &copyLength)) {
+		lastErr = ERROR_INVALID_PARAMETER;
+		LogError(L"Range %llu:%llu does not fit the file or is not a multiple of %llu bytes.\n",
+		         opts.RangeOffset, opts.RangeLength,
+		         (UINT64)MAX(clusterSize, SPARSE_MAP_RANGE_ALIGNMENT));
 		goto error_return;
 	}
+
 	/* Check if the source file is zero bytes. If it is we're done. Requesting
 	 * zero-byte mappings from CreateFileMap is an error. */
 	if (!sourceFileSize.QuadPart)
 		goto out_stats;
 
+	/* Only the allocated parts of the source can hold anything but zeros.
+	 * File systems that cannot say get every byte read. */
+	lastErr = QueryAllocatedRanges(sourceFile, copyStart, copyLength,
+	                               &allocatedRanges, &numAllocatedRanges);
+	if (ERROR_SUCCESS != lastErr) {
+		LogInfo(L"Allocated ranges of %s are unknown (lastErr %lu); reading all of it.\n",
+		        sourceFileName, lastErr);
+		allocatedRanges = NULL;
+		numAllocatedRanges = 0;
+		lastErr = ERROR_SUCCESS;
+	}
+
+	if (opts.Update) {
+		lastErr = UpdateFileDelta(sourceFile, targetFile, (UINT64)sourceFileSize.QuadPart,
+		                          clusterSize, allocatedRanges, numAllocatedRanges,
+		                          opts.Checksum, &copyStats);
+		goto copy_done;
+	}
+
+	/* Cloned blocks are shared, not copied, and holes stay holes. This has
+	 * to happen before the target is mapped. Targets fanned out to are all
+	 * written from the one read of the source instead. */
+	if (allocatedRanges && !opts.NoClone && 1 == opts.NumTargets) {
+		/* Clone the very extents the engines would copy, so no part is both
+		 * cloned and copied, which would hash it twice. */
+		lastErr = CopyBuildExtents(copyStart, copyStart + copyLength, allocatedRanges,
+		                           numAllocatedRanges, &extents, &numExtents);
+		if (ERROR_SUCCESS != lastErr) {
+			LogError(L"Failed to allocate copy extents\n");
+			goto error_return;
+		}
+		free(allocatedRanges);
+		allocatedRanges = extents;
+		numAllocatedRanges = numExtents;
+
+		lastErr = CloneAllocatedRanges(sourceFile, targetFile, (UINT64)sourceFileSize.QuadPart,
+		                               clusterSize, allocatedRanges, &numAllocatedRanges,
+		                               &bytesCloned, opts.Checksum ? &cloneCrc : NULL);
+		if (ERROR_SUCCESS != lastErr)
+			goto error_return;
+		if (bytesCloned) {
+			LogInfo(L"Cloned %8.2f MiB without copying it.\n",
+			        (double)bytesCloned / 1048576.0);
+		}
+	}
+
+	if (CopyEngineAsync == opts.Engine) {
+		lastErr = CopyFileAsync(sourceFile, targetFile, (UINT64)sourceFileSize.QuadPart,
+		                        clusterSize, copyStart, copyLength, allocatedRanges,
+		                        numAllocatedRanges, opts.QueueDepth, opts.Unbuffered,
+		                        opts.Checksum, &copyStats);
+		goto copy_done;
+	}
+
 	sourceFileMap = CreateFileMappingW(sourceFile,
 	                                   NULL,
 	                                   PAGE_READONLY,
@@ -212,147 +541,111 @@ wmain(
 		goto error_return;
 	}
 
-	targetFileMap = CreateFileMappingW(targetFile,
-	                                   NULL,
-	                                   PAGE_READWRITE,
-	                                   0,
-	                                   0,
-	                                   NULL);
-	if (!targetFileMap) {
-		lastErr = GetLastError();
-		LogError(L"Failed CreateFileMappingW with lastErr %lu (0x%08lx)", lastErr, lastErr);
-		goto error_return;
+	numLive = 0;
+	for (t = 0; t < opts.NumTargets; ++t) {
+		if (ERROR_SUCCESS != targets[t].Error)
+			continue;
+		targets[t].Map = CreateFileMappingW(targets[t].File,
+		                                    NULL,
+		                                    PAGE_READWRITE,
+		                                    0,
+		                                    0,
+		                                    NULL);
+		if (!targets[t].Map) {
+			lastErr = targets[t].Error = GetLastError();
+			LogError(L"Failed CreateFileMappingW for %s with lastErr %lu (0x%08lx)",
+			         targets[t].FileName, lastErr, lastErr);
+			continue;
+		}
+		++numLive;
 	}
-
-	/* create and set waitable timer for stats output */
-	statsFreq.QuadPart = -100000000ll; /* 10 seconds */
-	statsTimer = CreateWaitableTimerW(NULL, TRUE, NULL);
-	if (!statsTimer) {
-		lastErr = GetLastError();
-		LogError(L"Failed CreateWaitableTimerW with lastErr %lu (0x%08lx)", lastErr, lastErr);
+	if (0 == numLive)
+		goto error_return;
+	lastErr = ERROR_SUCCESS;
+
+	/* Read the source and write to the target using sliding windows over the
+	 * files, one pair per copy thread. This allows the OS to only allocate
+	 * blocks for mapped segments we actually wrote data to. It's fast for
+	 * reading because there are zero memory copies involved and Windows can
+	 * simply DMA the data directly to a physical page and map it to our
+	 * address space. It's super fast for writing because only pages we
+	 * actually write to in the target VA window get backed with a physical
+	 * page and blocks allocated in the file system. The kernel never needs to
+	 * copy memory, or even map a system address, and can simply DMA the
+	 * physical page to disk whenever it decides to flush it's dirty page
+	 * cache. Of course if we're operating on a file over the network or there
+	 * are filter drivers scanning all IO (i.e. virus scanner) then things
+	 * aren't quite as efficient on the backend, but it's still way better than
+	 * using ReadFiles/WriteFile. */
+	lastErr = CopyFileViews(sourceFileMap, targets, opts.NumTargets, copyStart, copyLength,
+	                        allocatedRanges, numAllocatedRanges, opts.Threads,
+	                        opts.Checksum, opts.WriteBehind, &copyStats);
+
+copy_done:
+	/* Cloned ranges were left out of the copy like the holes. */
+	copyStats.BytesCloned = bytesCloned;
+	copyStats.BytesSkipped -= MIN(bytesCloned, copyStats.BytesSkipped);
+	copyStats.SourceCrc ^= cloneCrc;
+	if (ERROR_SUCCESS != lastErr)
 		goto error_return;
-	}
-	SetWaitableTimer(statsTimer, &statsFreq, 0, NULL, NULL, FALSE);
-
-	/* Read the source and write to the target using a sliding window over the
-	 * files. This allows the OS to only allocate blocks for mapped segments we
-	 * actually wrote data to. It's fast for reading because there are zero
-	 * memory copies involved and Windows can simply DMA the data directly to a
-	 * physical page and map it to our address space. It's super fast for
-	 * writing because only pages we actually write to in the target VA window
-	 * get backed with a physical page and blocks allocated in the file system.
-	 * The kernel never needs to copy memory, or even map a system address, and
-	 * can simply DMA the physical page to disk whenever it decides to flush
-	 * it's dirty page cache. Of course if we're operating on a file over the
-	 * network or there are filter drivers scanning all IO (i.e. virus scanner)
-	 * then things aren't quite as efficient on the backend, but it's still way
-	 * better than using ReadFiles/WriteFile. */
-	while (bytesProcessed < (UINT64)sourceFileSize.QuadPart) {
-		currentMapSize = (SIZE_T)MIN(MAX_FILE_VIEW_SIZE, (UINT64)sourceFileSize.QuadPart - bytesProcessed);
-		currentMapAlignedDownSize = ALIGN_DOWN_BY(currentMapSize, sizeof(tmpULP));
-
-		sourceViewBase = MapViewOfFile(sourceFileMap,
-		                               FILE_MAP_READ,
-		                               (DWORD)(bytesProcessed >> 32),
-		                               (DWORD)bytesProcessed,
-		                               currentMapSize);
-		if (!sourceViewBase) {
-			lastErr = GetLastError();
-			LogError(L"Failed MapViewOfFile with lastErr %lu (0x%08lx)", lastErr, lastErr);
-			goto error_return;
-		}
-
-		targetViewBase = MapViewOfFile(targetFileMap,
-		                               FILE_MAP_WRITE,
-		                               (DWORD)(bytesProcessed >> 32),
-		                               (DWORD)bytesProcessed,
-		                               currentMapSize);
-		if (!targetViewBase) {
-			lastErr = GetLastError();
-			LogError(L"Failed MapViewOfFile with lastErr %lu (0x%08lx)", lastErr, lastErr);
-			goto error_return;
-		}
-
-		/* Need to put i here or the compiler will complain since it thinks it
-		 * could be used unitialized in the __except block. It won't be
-		 * uninitialized, but sometimes it's better not to fight the compiler.
-		 */
-		i = 0;
-		__try {
-			for (; i < currentMapAlignedDownSize; i += sizeof(tmpULP)) {
-				/* Assignment to local ensures only a single deref */
-				tmpULP = *(ULONG_PTR *)(sourceViewBase + i);
-				if (tmpULP)
-					*(ULONG_PTR *)(targetViewBase + i) = tmpULP;
-			}
-
-			/* Take care of any remaining data at the end of a view that is
-			 * smaller than a ULONG_PTR */
-			for (; i < currentMapSize; ++i) {
-				/* Assignment to local ensures only a single deref */
-				tmpChar = *(sourceViewBase + i);
-				if (tmpChar)
-					*(targetViewBase + i) = tmpChar;
-			}
-		} __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR
-		                               ?  EXCEPTION_EXECUTE_HANDLER
-		                               :  EXCEPTION_CONTINUE_SEARCH) {
-			bytesProcessed += i;
-			LogError(L"Failed to read or write to files at offset: %llu", bytesProcessed);
-			goto error_return;
-		}
 
-		bytesProcessed += currentMapSize;
+	/* Finished copying file. Start clean up. */
+	if (sourceFileMap)
+		(void)CloseHandle(sourceFileMap);
+	sourceFileMap = NULL;
 
-		lastErr = WaitForSingleObject(statsTimer, 0);
-		if (WAIT_OBJECT_0 == lastErr) {
-			LogInfo(L"Copied: %8.2f MiB of %8.2f MiB\n", (double)bytesProcessed / 1048576.0, sourceFileSizeMiB);
-			(void)SetWaitableTimer(statsTimer, &statsFreq, 0, NULL, NULL, FALSE);
-		} else if (WAIT_TIMEOUT != lastErr) {
-			LogError(L"Unexpected WaitForSingleObject return 0x%08lX GetLastError 0x%08lX in wait call for statsTimer\n",
-				lastErr, GetLastError());
-			goto error_return;
-		}
+	(void)CloseHandle(sourceFile);
+	sourceFile = NULL;
 
-		if (!UnmapViewOfFile(sourceViewBase)) {
+	targetFile = NULL;
+	for (t = 0; t < opts.NumTargets; ++t) {
+		if (targets[t].Map)
+			(void)CloseHandle(targets[t].Map);
+		targets[t].Map = NULL;
+		if (NULL == targets[t].File)
+			continue;
+
+		/* Set timestamps on target from source file. Shards cannot tell
+		 * which of them finishes last, so they leave it to whoever runs
+		 * them. */
+		if (ERROR_SUCCESS == targets[t].Error && !opts.Ranged
+		    && !SetFileTime(targets[t].File, &ftCreate, &ftAccess, &ftWrite)) {
 			lastErr = GetLastError();
-			LogError(L"Failed UnmapViewOfFile with lastErr %lu (0x%08lx)", lastErr, lastErr);
-			goto error_return;
+			LogError(L"Failed to write file time values to target file with lastErr %lu (0x%08lx)\n", lastErr, lastErr);
 		}
-		sourceViewBase = NULL;
-		if (!UnmapViewOfFile(targetViewBase)) {
+
+		/* Flush buffers on target file */
+		if (ERROR_SUCCESS == targets[t].Error && !FlushFileBuffers(targets[t].File)) {
 			lastErr = GetLastError();
-			LogError(L"Failed UnmapViewOfFile with lastErr %lu (0x%08lx)", lastErr, lastErr);
-			goto error_return;
+			LogError(L"WARNING: Failed FlushFileBuffers on target file with lastErr %lu.\n", lastErr);
 		}
-		targetViewBase = NULL;
-	}
 
-	/* Finished copying file. Start clean up. */
-	(void)CloseHandle(sourceFileMap);
-	sourceFileMap = NULL;
-	(void)CloseHandle(targetFileMap);
-	targetFileMap = NULL;
+		(void)CloseHandle(targets[t].File);
+		targets[t].File = NULL;
 
-	/* Set timestamps on target from source file. */
-	if (!SetFileTime(targetFile, &ftCreate, &ftAccess, &ftWrite)) {
-		lastErr = GetLastError();
-		LogError(L"Failed to write file time values to target file with lastErr %lu (0x%08lx)\n", lastErr, lastErr);
+		if (ERROR_SUCCESS == targets[t].Error && opts.Verify) {
+			targets[t].Error = VerifyFileChecksum(targets[t].FileName,
+			                                      (UINT64)sourceFileSize.QuadPart,
+			                                      Crc32cFinal(copyStats.SourceCrc,
+			                                                  (UINT64)sourceFileSize.QuadPart));
+		}
 	}
 
-	(void)CloseHandle(sourceFile);
-	sourceFile = NULL;
-
-	/* Flush buffers on target file */
-	if (!FlushFileBuffers(targetFile)) {
-		lastErr = GetLastError();
-		LogError(L"WARNING: Failed FlushFileBuffers on target file with lastErr %lu.\n", lastErr);
+	/* With a single target its failure is the failure of the copy. */
+	if (1 == opts.NumTargets && ERROR_SUCCESS != targets[0].Error) {
+		lastErr = targets[0].Error;
+		goto error_return;
 	}
 
-	(void)CloseHandle(targetFile);
-	targetFile = NULL;
-
 out_stats:
+	if (opts.ShardResult && !SaveShardResult(&opts, (UINT64)sourceFileSize.QuadPart,
+	                                         clusterSize, copyLength,
+	                                         copyStats.BytesRead, copyStats.BytesWritten,
+	                                         ERROR_SUCCESS)) {
+		retVal = EXIT_FAILURE;
+		goto func_return;
+	}
+
 	seconds = ElapsedQPCInSeconds(startQPC, GetQPCVal());
 	hours = seconds / (60 * 60);
 	seconds = seconds % (60 * 60);
@@ -361,32 +654,68 @@ out_stats:
 
 	LogInfo(L"Sparse file copy complete.\n"
 	        L"%llu hours, %llu minutes, %llu seconds.\n"
-	        L"%16llu bytes read\n%16.2f MiB read\n%16.2f GiB read\n",
+	        L"%16llu bytes read\n%16.2f MiB read\n%16.2f GiB read\n"
+	        L"%16.2f MiB of holes skipped\n%16.2f MiB cloned\n",
 	        hours, minutes, seconds,
-	        bytesProcessed, (double)bytesProcessed / 1048576.0, (double)bytesProcessed / 1073741824.0);
+	        copyStats.BytesRead, (double)copyStats.BytesRead / 1048576.0,
+	        (double)copyStats.BytesRead / 1073741824.0,
+	        (double)copyStats.BytesSkipped / 1048576.0,
+	        (double)copyStats.BytesCloned / 1048576.0);
+	if (opts.Update) {
+		/* Whatever was neither written nor deallocated was left alone. */
+		LogInfo(L"%16.2f MiB written\n%16.2f MiB deallocated\n%16.2f MiB unchanged\n",
+		        (double)copyStats.BytesWritten / 1048576.0,
+		        (double)copyStats.BytesPunched / 1048576.0,
+		        (double)((UINT64)sourceFileSize.QuadPart
+		                 - MIN((UINT64)sourceFileSize.QuadPart,
+		                       copyStats.BytesWritten + copyStats.BytesPunched)) / 1048576.0);
+	}
+	if (opts.Checksum) {
+		digest = Crc32cFinal(copyStats.SourceCrc, (UINT64)sourceFileSize.QuadPart);
+		LogInfo(L"        %08lx CRC32C of the source\n", (unsigned long)digest);
+	}
 
 	retVal = EXIT_SUCCESS;
+	if (1 < opts.NumTargets) {
+		for (t = 0; t < opts.NumTargets; ++t) {
+			if (ERROR_SUCCESS == targets[t].Error) {
+				LogInfo(L"%16.2f MiB written to %s\n",
+				        (double)targets[t].BytesWritten / 1048576.0, targets[t].FileName);
+			} else {
+				LogInfo(L"%16.2f MiB written to %s, which failed with lastErr %lu (0x%08lx)\n",
+				        (double)targets[t].BytesWritten / 1048576.0, targets[t].FileName,
+				        targets[t].Error, targets[t].Error);
+				retVal = EXIT_FAILURE;
+			}
+		}
+	}
 
 	goto func_return;
 
 error_return:
 	retVal = EXIT_FAILURE;
+	/* The coordinator has to learn about a shard that failed too. */
+	if (opts.ShardResult && clusterSize) {
+		(void)SaveShardResult(&opts, (UINT64)sourceFileSize.QuadPart, clusterSize,
+		                      copyLength, copyStats.BytesRead, copyStats.BytesWritten,
+		                      ERROR_SUCCESS == lastErr ? ERROR_GEN_FAILURE : lastErr);
+	}
 
 func_return:
-	if (targetViewBase)
-		(void)UnmapViewOfFile(targetViewBase);
-	if (sourceViewBase)
-		(void)UnmapViewOfFile(sourceViewBase);
-	if (targetFileMap)
-		(void)CloseHandle(targetFileMap);
+	free(allocatedRanges);
+	for (t = 0; t < opts.NumTargets; ++t) {
+		if (targets[t].Map)
+			(void)CloseHandle(targets[t].Map);
+	}
 	if (sourceFileMap)
 		(void)CloseHandle(sourceFileMap);
 	if (sourceFile)
 		(void)CloseHandle(sourceFile);
-	if (targetFile)
-		(void)CloseHandle(targetFile);
-	if (statsTimer)
-		(void)CloseHandle(statsTimer);
+	for (t = 0; t < opts.NumTargets; ++t) {
+		if (targets[t].File)
+			(void)CloseHandle(targets[t].File);
+	}
+	QosStop();
 	return retVal;
 }
 
@@ -0,0 +1,300 @@
+/* Standard BSD license disclaimer.
+
+Copyright(c) 2016-2021, Lance D. Stringham
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Declarations shared between the CopySparse translation units. Nothing in
+ * here is meant for consumption outside of CopySparse. */
+
+#pragma once
+
+#ifndef COPYSPARSE_H
+#define COPYSPARSE_H
+
+#include <windows.h>
+
+#include <SparseFileLib.h>
+
+/* I came up with 512 MiB so the contiguous VA space required for file mappings
+ * would fit in both 32 and 64 bit processes. Since VA space is limited in
+ * 32-bit processes we need to be careful not to pick a value that is too large
+ * since Windows loads various libraries into the process memory and randomizes
+ * the address layout throughout the address space. There may be much better
+ * values that could be picked for 32-bit processes. I didn't spend any real
+ * time trying to find a good one and just picked it based on the factors noted
+ * above.
+*/
+#define MAX_FILE_VIEW_SIZE (512 * 1024 * 1024)
+
+/* Upper bound on the number of copy threads. */
+#define MAX_COPY_THREADS    64
+
+/* Upper bound on the number of targets one copy writes. */
+#define MAX_COPY_TARGETS    16
+
+/* View offsets have to be multiples of the allocation granularity. Extents
+ * are widened to it for both engines. */
+#define COPY_VIEW_ALIGNMENT     (64 * 1024)
+/* Progress is logged this often while copying. */
+#define COPY_STATS_INTERVAL_MS  (10 * 1000)
+
+/* The mapped engine skips source pages of this size that are all zeros, so
+ * the matching target pages are never faulted in or dirtied. */
+#define COPY_ZERO_BLOCK_SIZE    4096
+/* It copies a view in chunks this large so a paging error can be placed to
+ * within one chunk. */
+#define COPY_KERNEL_CHUNK       (1024 * 1024)
+
+/* Default and upper bound of the reads and writes the async engine keeps in
+ * flight at once. */
+#define DEFAULT_COPY_QUEUE_DEPTH    16
+#define MAX_COPY_QUEUE_DEPTH        256
+
+
+typedef enum COPY_ENGINE_TYPE {
+	/* Memory mapped views, copied word by word. The default. */
+	CopyEngineMapped = 0,
+	/* Overlapped reads into buffers and writes of the data clusters only. */
+	CopyEngineAsync,
+} COPY_ENGINE_TYPE;
+
+
+typedef struct COPYSPARSE_OPTIONS {
+	LPWSTR      SourceFileName;
+	/* The first target, and all of them. Only plain copies take more than
+	 * one. */
+	LPWSTR      TargetFileName;
+	LPWSTR      *TargetFileNames;
+	DWORD       NumTargets;
+	/* Only copy [RangeOffset, RangeOffset + RangeLength) into a target that
+	 * already has the size of the source, sharing both files with the
+	 * processes copying the other shards. */
+	BOOL        Ranged;
+	UINT64      RangeOffset;
+	UINT64      RangeLength;
+	/* Only create the sparse target at the size of the source. */
+	BOOL        Presize;
+	/* Write what was done to this file for MakeSparse --merge-shards. */
+	LPWSTR      ShardResult;
+	/* Number of threads copying views at once; 1 unless --threads is given. */
+	DWORD       Threads;
+	/* Copy the data even where the volume could clone it. */
+	BOOL        NoClone;
+	COPY_ENGINE_TYPE Engine;
+	/* Async engine only: I/O kept in flight, and whether both files bypass
+	 * the cache. */
+	DWORD       QueueDepth;
+	BOOL        Unbuffered;
+	/* Bring an existing target in line with the source, writing only what
+	 * differs, instead of creating a new one. */
+	BOOL        Update;
+	/* Hash the source while copying it, and with Verify read the allocated
+	 * parts of the target back afterwards to compare. */
+	BOOL        Checksum;
+	BOOL        Verify;
+	/* View engine only: flush each view of the targets once it is copied,
+	 * holding the copy back while more than this many bytes of a target are
+	 * dirty. 0 leaves the write back to the cache manager. */
+	UINT64      WriteBehind;
+	QOS_OPTIONS Qos;
+} COPYSPARSE_OPTIONS, *PCOPYSPARSE_OPTIONS;
+
+
+typedef struct COPY_STATS {
+	/* Bytes of the source read, including those of a view that failed. */
+	UINT64      BytesRead;
+	/* Bytes of nonzero data written to the target. */
+	UINT64      BytesWritten;
+	/* Bytes never read since the source has no storage allocated there. */
+	UINT64      BytesSkipped;
+	/* Bytes shared with the source through block cloning instead. */
+	UINT64      BytesCloned;
+	/* Update only: bytes of the target deallocated since the source has
+	 * zeros there. */
+	UINT64      BytesPunched;
+	UINT64      ViewsCopied;
+	/* Raw CRC32C of the source data relative to the end of the copied range,
+	 * see Crc32cUpdate. Pieces are combined with XOR. */
+	UINT32      SourceCrc;
+} COPY_STATS, *PCOPY_STATS;
+
+/* One of the files a copy writes. */
+typedef struct COPY_TARGET {
+	LPCWSTR     FileName;
+	HANDLE      File;
+	HANDLE      Map;
+	/* Bytes of nonzero data written to this target and the first error it
+	 * hit. A target with an error is left alone from then on. */
+	UINT64      BytesWritten;
+	DWORD       Error;
+} COPY_TARGET, *PCOPY_TARGET;
+
+/* Turn the allocated ranges inside [Offset, End) into the extents to copy:
+ * widened to COPY_VIEW_ALIGNMENT, clipped to the range and with the ones
+ * that touch joined. Without Ranges the whole range is one extent. Free
+ * *Extents with free(). */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD
+CopyBuildExtents(
+	_In_        UINT64                  Offset,
+	_In_        UINT64                  End,
+	_In_reads_opt_(NumRanges)
+	            const ALLOCATED_RANGE   *Ranges,
+	_In_        SIZE_T                  NumRanges,
+	_Out_       PALLOCATED_RANGE        *Extents,
+	_Out_       SIZE_T                  *NumExtents
+	);
+
+/* Copy the nonzero data of [Offset, Offset + Length) from SourceMap to the
+ * Map of every target without an Error, one source view per worker at a
+ * time, on Threads threads. If Ranges is given only the parts of it that lie
+ * in one of the NumRanges allocated ranges of the source are read; the
+ * targets have to read as zeros everywhere else already. Progress is logged
+ * every 10 seconds. Stats are those of every worker added up and are valid
+ * on failure too; the source is only hashed into them if Checksum is set.
+ * With MaxDirty every copied view is flushed in the background and the
+ * workers wait while more than MaxDirty bytes of a target are dirty; all of
+ * it is flushed before returning. A target that fails gets its Error set and
+ * is dropped. The first error reading the source, or the failure of the
+ * last target, stops the workers after their current view and is
+ * returned. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD
+CopyFileViews(
+	_In_        HANDLE          SourceMap,
+	_Inout_updates_(NumTargets)
+	            PCOPY_TARGET    Targets,
+	_In_        DWORD           NumTargets,
+	_In_        UINT64          Offset,
+	_In_        UINT64          Length,
+	_In_reads_opt_(NumRanges)
+	            const ALLOCATED_RANGE *Ranges,
+	_In_        SIZE_T          NumRanges,
+	_In_        DWORD           Threads,
+	_In_        BOOL            Checksum,
+	_In_        UINT64          MaxDirty,
+	_Out_       PCOPY_STATS     Stats
+	);
+
+/* Copy the nonzero data of [Offset, Offset + Length) from Source to Target
+ * with overlapped reads into QueueDepth buffers, writing only the runs of
+ * clusters that are not all zeros. Both handles have to be opened with
+ * FILE_FLAG_OVERLAPPED, and with FILE_FLAG_NO_BUFFERING too if Unbuffered is
+ * set. Ranges and Stats are as for CopyFileViews. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD
+CopyFileAsync(
+	_In_        HANDLE          Source,
+	_In_        HANDLE          Target,
+	_In_        UINT64          FileSize,
+	_In_        SIZE_T          ClusterSize,
+	_In_        UINT64          Offset,
+	_In_        UINT64          Length,
+	_In_reads_opt_(NumRanges)
+	            const ALLOCATED_RANGE *Ranges,
+	_In_        SIZE_T          NumRanges,
+	_In_        DWORD           QueueDepth,
+	_In_        BOOL            Unbuffered,
+	_In_        BOOL            Checksum,
+	_Out_       PCOPY_STATS     Stats
+	);
+
+/* Clone the allocated Ranges of Source into the same place in Target, which
+ * has to be as large as FileSize already. Ranges is left holding what still
+ * has to be copied: everything, unless both files are on one volume that
+ * supports block cloning, otherwise just the ranges whose clone failed.
+ * With SourceCrc the cloned data is read back from Source and hashed into
+ * it; a failed read is the only error returned, and leaves Ranges
+ * undefined. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD
+CloneAllocatedRanges(
+	_In_        HANDLE              Source,
+	_In_        HANDLE              Target,
+	_In_        UINT64              FileSize,
+	_In_        SIZE_T              ClusterSize,
+	_Inout_updates_(*NumRanges)
+	            PALLOCATED_RANGE    Ranges,
+	_Inout_     SIZE_T              *NumRanges,
+	_Out_       UINT64              *BytesCloned,
+	_Inout_opt_ UINT32              *SourceCrc
+	);
+
+/* Bring Target, which has to be sparse and FileSize bytes long already, in
+ * line with Source. Both are read side by side a chunk at a time and
+ * compared a cluster at a time; only the clusters that differ are written,
+ * or deallocated where the source is zero. Target clusters outside the
+ * allocated Ranges of the source are deallocated without being read. Both
+ * handles have to be opened with FILE_FLAG_OVERLAPPED. Stats and Checksum
+ * are as for CopyFileViews. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD
+UpdateFileDelta(
+	_In_        HANDLE          Source,
+	_In_        HANDLE          Target,
+	_In_        UINT64          FileSize,
+	_In_        SIZE_T          ClusterSize,
+	_In_reads_opt_(NumRanges)
+	            const ALLOCATED_RANGE *Ranges,
+	_In_        SIZE_T          NumRanges,
+	_In_        BOOL            Checksum,
+	_Out_       PCOPY_STATS     Stats
+	);
+
+/* XOR the raw CRC32C of [Offset, Offset + Length) of File, relative to End,
+ * into RawCrc. File may be opened for overlapped or unbuffered I/O; Offset
+ * has to be a multiple of the sector size for the latter. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD
+ChecksumFileRange(
+	_In_        HANDLE              File,
+	_In_        UINT64              Offset,
+	_In_        UINT64              Length,
+	_In_        UINT64              End,
+	_Inout_     UINT32              *RawCrc
+	);
+
+/* Read the allocated ranges of FileName back, bypassing the cache, and
+ * compare their CRC32C with Expected. Returns ERROR_CRC if they differ. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD
+VerifyFileChecksum(
+	_In_        LPCWSTR             FileName,
+	_In_        UINT64              FileSize,
+	_In_        UINT32              Expected
+	);
+
+#endif // COPYSPARSE_H
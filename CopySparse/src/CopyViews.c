@@ -0,0 +1,736 @@
+/* Standard BSD license disclaimer.
+
+Copyright(c) 2016-2021, Lance D. Stringham
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "targetver.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "CopySparse.h"
+
+/* Views are handed out to the workers in file order. Every worker maps its
+ * own source view and a view of every target, copies the nonzero data and
+ * comes back for the next one, so the page faults of one view never hold up
+ * the others. Views only cover the allocated extents of the source, widened
+ * to the view alignment, so holes are never faulted in. With several
+ * targets each source page is read and tested for zeros once and written to
+ * all of them; the cache manager writes the files back independently, so
+ * targets on different devices are written at the same time. A target that
+ * fails is dropped and the rest carry on.
+ *
+ * Left alone the cache manager lets dirty pages pile up to the system limit
+ * and then writes them back in bursts that stall everything else on the
+ * host. With write-behind every target gets a thread that flushes each view
+ * once it has been copied, and the workers wait before their next view
+ * while more than the cap of a target is still dirty. FlushViewOfFile waits
+ * for the writes it starts, which is why it runs on a thread of its own;
+ * the workers go on copying while it writes. */
+
+/* Blocks of COPY_ZERO_BLOCK_SIZE in one COPY_KERNEL_CHUNK. */
+#define COPY_BLOCKS_PER_CHUNK   (COPY_KERNEL_CHUNK / COPY_ZERO_BLOCK_SIZE)
+
+/* Copied views waiting to be flushed, per target. */
+#define WRITE_BEHIND_QUEUE_DEPTH    32
+/* The flush thread maps at most this much of a view at a time, and no more
+ * than a view on 32-bit builds, where it counts towards the view budget. */
+#define WRITE_BEHIND_CHUNK          (64 * 1024 * 1024)
+
+
+typedef struct WRITE_BEHIND_RANGE {
+	UINT64              Offset;
+	SIZE_T              Size;
+	/* Bytes the copy wrote to the range. */
+	UINT64              Dirty;
+} WRITE_BEHIND_RANGE, *PWRITE_BEHIND_RANGE;
+
+typedef struct WRITE_BEHIND {
+	PCOPY_TARGET        Target;
+	UINT64              MaxDirty;
+	SIZE_T              ChunkSize;
+	/* NULL when write-behind is off for the target. */
+	HANDLE              Thread;
+
+	/* Everything below is guarded by Lock. */
+	CRITICAL_SECTION    Lock;
+	CONDITION_VARIABLE  WorkAvailable;
+	CONDITION_VARIABLE  DirtyDropped;
+	WRITE_BEHIND_RANGE  Queue[WRITE_BEHIND_QUEUE_DEPTH];
+	DWORD               Head;
+	DWORD               Count;
+	/* Bytes written by the copy and not flushed yet. */
+	UINT64              Dirty;
+	BOOL                Stopping;
+	DWORD               Error;
+} WRITE_BEHIND, *PWRITE_BEHIND;
+
+
+typedef struct COPY_POOL {
+	HANDLE              SourceMap;
+	PCOPY_TARGET        Targets;
+	DWORD               NumTargets;
+	PALLOCATED_RANGE    Extents;
+	SIZE_T              NumExtents;
+	SIZE_T              ViewSize;
+	/* Hash the views too; their CRCs are shifted to the end of the range. */
+	BOOL                Checksum;
+	UINT64              End;
+	/* Flushes the views of each target after they are copied. */
+	WRITE_BEHIND        WriteBehind[MAX_COPY_TARGETS];
+
+	/* Everything below is guarded by Lock, as are BytesWritten and Error of
+	 * the targets. */
+	CRITICAL_SECTION    Lock;
+	SIZE_T              NextExtent;
+	UINT64              NextOffset;
+	COPY_STATS          Totals;
+	DWORD               FirstError;
+} COPY_POOL, *PCOPY_POOL;
+
+
+/* Catch in-page errors and note the address that could not be paged in. */
+static int
+InPageErrorFilter(
+	_In_        DWORD                   Code,
+	_In_        PEXCEPTION_POINTERS     Info,
+	_Out_       ULONG_PTR               *Address
+	)
+{
+	if (EXCEPTION_IN_PAGE_ERROR != Code)
+		return EXCEPTION_CONTINUE_SEARCH;
+	*Address = Info->ExceptionRecord->ExceptionInformation[1];
+	return EXCEPTION_EXECUTE_HANDLER;
+}
+
+
+/* Flush [Offset, Offset + Size) of the target of WriteBehind. */
+static DWORD
+FlushTargetRange(
+	_In_        PWRITE_BEHIND   WriteBehind,
+	_In_        UINT64          Offset,
+	_In_        SIZE_T          Size
+	)
+{
+	char        *viewBase;
+	SIZE_T      done, chunk;
+	DWORD       errRet;
+
+	errRet = ERROR_SUCCESS;
+
+	for (done = 0; done < Size && ERROR_SUCCESS == errRet; done += chunk) {
+		chunk = MIN(Size - done, WriteBehind->ChunkSize);
+		/* Only the dirty pages are written; mapping the range again does
+		 * not fault in any of them. */
+		viewBase = MapViewOfFile(WriteBehind->Target->Map,
+		                         FILE_MAP_WRITE,
+		                         (DWORD)((Offset + done) >> 32),
+		                         (DWORD)(Offset + done),
+		                         chunk);
+		if (!viewBase) {
+			errRet = GetLastError();
+			LogError(L"Failed MapViewOfFile for %s with lastErr %lu (0x%08lx)",
+			         WriteBehind->Target->FileName, errRet, errRet);
+			break;
+		}
+		if (!FlushViewOfFile(viewBase, chunk)) {
+			errRet = GetLastError();
+			LogError(L"Failed FlushViewOfFile for %s with lastErr %lu (0x%08lx)",
+			         WriteBehind->Target->FileName, errRet, errRet);
+		}
+		if (!UnmapViewOfFile(viewBase) && ERROR_SUCCESS == errRet) {
+			errRet = GetLastError();
+			LogError(L"Failed UnmapViewOfFile with lastErr %lu (0x%08lx)", errRet, errRet);
+		}
+	}
+
+	return errRet;
+}
+
+
+static DWORD WINAPI
+WriteBehindThread(
+	_In_        LPVOID      Parameter
+	)
+{
+	PWRITE_BEHIND       writeBehind = Parameter;
+	WRITE_BEHIND_RANGE  range;
+	DWORD               err;
+
+	for (;;) {
+		EnterCriticalSection(&writeBehind->Lock);
+		while (0 == writeBehind->Count && !writeBehind->Stopping)
+			(void)SleepConditionVariableCS(&writeBehind->WorkAvailable,
+			                               &writeBehind->Lock, INFINITE);
+		if (0 == writeBehind->Count) {
+			LeaveCriticalSection(&writeBehind->Lock);
+			break;
+		}
+		range = writeBehind->Queue[writeBehind->Head];
+		writeBehind->Head = (writeBehind->Head + 1) % WRITE_BEHIND_QUEUE_DEPTH;
+		--writeBehind->Count;
+		/* Once the target failed its remaining views are not worth writing. */
+		err = writeBehind->Error;
+		LeaveCriticalSection(&writeBehind->Lock);
+
+		if (ERROR_SUCCESS == err)
+			err = FlushTargetRange(writeBehind, range.Offset, range.Size);
+
+		EnterCriticalSection(&writeBehind->Lock);
+		writeBehind->Dirty -= range.Dirty;
+		if (ERROR_SUCCESS == writeBehind->Error)
+			writeBehind->Error = err;
+		LeaveCriticalSection(&writeBehind->Lock);
+		WakeAllConditionVariable(&writeBehind->DirtyDropped);
+	}
+
+	return 0;
+}
+
+
+/* Start the flush thread of Target. Without it the copy goes on as if
+ * write-behind was off for the target. */
+static void
+WriteBehindStart(
+	_Out_       PWRITE_BEHIND   WriteBehind,
+	_In_        PCOPY_TARGET    Target,
+	_In_        UINT64          MaxDirty,
+	_In_        SIZE_T          ChunkSize
+	)
+{
+	memset(WriteBehind, 0, sizeof(*WriteBehind));
+	WriteBehind->Target = Target;
+	WriteBehind->MaxDirty = MaxDirty;
+	WriteBehind->ChunkSize = ChunkSize;
+	InitializeCriticalSection(&WriteBehind->Lock);
+	InitializeConditionVariable(&WriteBehind->WorkAvailable);
+	InitializeConditionVariable(&WriteBehind->DirtyDropped);
+
+	WriteBehind->Thread = CreateThread(NULL, 0, WriteBehindThread, WriteBehind, 0, NULL);
+	if (NULL == WriteBehind->Thread) {
+		LogError(L"Failed CreateThread with error %#llx, %s is written back without "
+		         L"write-behind\n", (long long)GetLastError(), Target->FileName);
+	}
+}
+
+
+/* Queue the Dirty bytes the copy wrote to [Offset, Offset + Size) for
+ * flushing, then wait while more than the cap of the target is dirty.
+ * Returns the first error flushing the target. */
+static DWORD
+WriteBehindQueue(
+	_Inout_     PWRITE_BEHIND   WriteBehind,
+	_In_        UINT64          Offset,
+	_In_        SIZE_T          Size,
+	_In_        UINT64          Dirty
+	)
+{
+	PWRITE_BEHIND_RANGE range;
+	DWORD               errRet;
+
+	if (NULL == WriteBehind->Thread)
+		return ERROR_SUCCESS;
+
+	EnterCriticalSection(&WriteBehind->Lock);
+	while (WRITE_BEHIND_QUEUE_DEPTH == WriteBehind->Count)
+		(void)SleepConditionVariableCS(&WriteBehind->DirtyDropped,
+		                               &WriteBehind->Lock, INFINITE);
+	range = &WriteBehind->Queue[(WriteBehind->Head + WriteBehind->Count)
+	                            % WRITE_BEHIND_QUEUE_DEPTH];
+	range->Offset = Offset;
+	range->Size = Size;
+	range->Dirty = Dirty;
+	++WriteBehind->Count;
+	WriteBehind->Dirty += Dirty;
+	WakeConditionVariable(&WriteBehind->WorkAvailable);
+
+	/* A view larger than the cap only waits for its own flush. */
+	while (WriteBehind->MaxDirty < WriteBehind->Dirty && ERROR_SUCCESS == WriteBehind->Error)
+		(void)SleepConditionVariableCS(&WriteBehind->DirtyDropped,
+		                               &WriteBehind->Lock, INFINITE);
+	errRet = WriteBehind->Error;
+	LeaveCriticalSection(&WriteBehind->Lock);
+
+	return errRet;
+}
+
+
+/* Flush what is still queued, stop the thread and return the first error
+ * flushing the target. */
+static DWORD
+WriteBehindStop(
+	_Inout_     PWRITE_BEHIND   WriteBehind
+	)
+{
+	DWORD       errRet;
+
+	if (WriteBehind->Thread) {
+		EnterCriticalSection(&WriteBehind->Lock);
+		WriteBehind->Stopping = TRUE;
+		LeaveCriticalSection(&WriteBehind->Lock);
+		WakeConditionVariable(&WriteBehind->WorkAvailable);
+		(void)WaitForSingleObject(WriteBehind->Thread, INFINITE);
+		(void)CloseHandle(WriteBehind->Thread);
+		WriteBehind->Thread = NULL;
+	}
+	errRet = WriteBehind->Error;
+	DeleteCriticalSection(&WriteBehind->Lock);
+
+	return errRet;
+}
+
+
+/* Copy one source view to the targets whose entry in TargetErrors is
+ * ERROR_SUCCESS. A target that fails gets its error there and BytesWritten
+ * holds what each target got. The return value is for errors of the source,
+ * which end the view for all targets. Stats are valid on failure too. */
+static DWORD
+CopyViewPair(
+	_In_        PCOPY_POOL      Pool,
+	_In_        UINT64          Offset,
+	_In_        SIZE_T          Size,
+	_Out_       PCOPY_STATS     Stats,
+	_Inout_updates_(Pool->NumTargets)
+	            DWORD           *TargetErrors,
+	_Out_writes_(Pool->NumTargets)
+	            UINT64          *BytesWritten
+	)
+{
+	char        *sourceViewBase;
+	char        *targetViewBase[MAX_COPY_TARGETS];
+	BYTE        blockMap[COPY_BLOCKS_PER_CHUNK];
+	SIZE_T      i, chunk;
+	UINT64      bytesWritten;
+	ULONG_PTR   faultAddress;
+	UINT32      crc;
+	DWORD       t, numLive, errRet;
+
+	memset(Stats, 0, sizeof(*Stats));
+	memset(BytesWritten, 0, Pool->NumTargets * sizeof(*BytesWritten));
+	memset(targetViewBase, 0, sizeof(targetViewBase));
+	errRet = ERROR_SUCCESS;
+
+	bytesWritten = 0;
+	crc = 0;
+
+	QosThrottle(QosClassRead, Size);
+
+	sourceViewBase = MapViewOfFile(Pool->SourceMap,
+	                               FILE_MAP_READ,
+	                               (DWORD)(Offset >> 32),
+	                               (DWORD)Offset,
+	                               Size);
+	if (!sourceViewBase) {
+		errRet = GetLastError();
+		LogError(L"Failed MapViewOfFile with lastErr %lu (0x%08lx)", errRet, errRet);
+		goto func_return;
+	}
+
+	for (t = 0; t < Pool->NumTargets; ++t) {
+		if (ERROR_SUCCESS != TargetErrors[t])
+			continue;
+		targetViewBase[t] = MapViewOfFile(Pool->Targets[t].Map,
+		                                  FILE_MAP_WRITE,
+		                                  (DWORD)(Offset >> 32),
+		                                  (DWORD)Offset,
+		                                  Size);
+		if (!targetViewBase[t]) {
+			TargetErrors[t] = GetLastError();
+			LogError(L"Failed MapViewOfFile for %s with lastErr %lu (0x%08lx)",
+			         Pool->Targets[t].FileName, TargetErrors[t], TargetErrors[t]);
+		}
+	}
+
+	/* Need to put i here or the compiler will complain since it thinks it
+	 * could be used unitialized in the __except block. It won't be
+	 * uninitialized, but sometimes it's better not to fight the compiler.
+	 */
+	i = 0;
+	faultAddress = 0;
+	/* Views start on the allocation granularity, so every page lines up for
+	 * the vector kernel. All zero pages are skipped whole and data pages are
+	 * streamed past the cache since they are not read again. */
+	for (; i < Size && ERROR_SUCCESS == errRet; i += chunk) {
+		chunk = MIN(Size - i, COPY_KERNEL_CHUNK);
+		memset(blockMap, BLOCK_MAP_UNKNOWN, sizeof(blockMap));
+
+		/* Hashing first leaves the chunk in the cache for the copies. */
+		__try {
+			if (Pool->Checksum)
+				crc = Crc32cUpdate(crc, sourceViewBase + i, chunk);
+		} __except (InPageErrorFilter(GetExceptionCode(), GetExceptionInformation(),
+		                              &faultAddress)) {
+			LogError(L"Failed to read the source at offset: %llu", Offset + i);
+			errRet = ERROR_READ_FAULT;
+			break;
+		}
+
+		numLive = 0;
+		for (t = 0; t < Pool->NumTargets; ++t) {
+			if (!targetViewBase[t] || ERROR_SUCCESS != TargetErrors[t])
+				continue;
+			++numLive;
+			__try {
+				BytesWritten[t] += CopyNonZeroBlocksEx(targetViewBase[t] + i,
+				                                       sourceViewBase + i,
+				                                       chunk,
+				                                       COPY_ZERO_BLOCK_SIZE,
+				                                       blockMap);
+			} __except (InPageErrorFilter(GetExceptionCode(), GetExceptionInformation(),
+			                              &faultAddress)) {
+				if (faultAddress - (ULONG_PTR)sourceViewBase < Size) {
+					/* Without the source no target can go on. */
+					LogError(L"Failed to read the source at offset: %llu", Offset + i);
+					errRet = ERROR_READ_FAULT;
+					break;
+				}
+				/* Only this target is lost; the others carry on. */
+				LogError(L"Failed to write %s at offset: %llu",
+				         Pool->Targets[t].FileName, Offset + i);
+				TargetErrors[t] = ERROR_WRITE_FAULT;
+			}
+		}
+		if (0 == numLive)
+			break;
+	}
+
+	for (t = 0; t < Pool->NumTargets; ++t)
+		bytesWritten += BytesWritten[t];
+	Stats->BytesRead = (ERROR_SUCCESS == errRet) ? Size : i;
+	Stats->BytesWritten = bytesWritten;
+	Stats->ViewsCopied = (ERROR_SUCCESS == errRet);
+	if (Pool->Checksum && ERROR_SUCCESS == errRet)
+		Stats->SourceCrc = Crc32cShift(crc, Pool->End - (Offset + Size));
+
+	/* The dirty pages are written back later, by the cache manager or by
+	 * write-behind, but holding back the next view keeps the long run rate
+	 * in check. */
+	QosThrottle(QosClassWrite, bytesWritten);
+
+func_return:
+	for (t = 0; t < Pool->NumTargets; ++t) {
+		if (targetViewBase[t] && !UnmapViewOfFile(targetViewBase[t])
+		    && ERROR_SUCCESS == TargetErrors[t]) {
+			TargetErrors[t] = GetLastError();
+			LogError(L"Failed UnmapViewOfFile with lastErr %lu (0x%08lx)",
+			         TargetErrors[t], TargetErrors[t]);
+		}
+	}
+	if (sourceViewBase && !UnmapViewOfFile(sourceViewBase) && ERROR_SUCCESS == errRet) {
+		errRet = GetLastError();
+		LogError(L"Failed UnmapViewOfFile with lastErr %lu (0x%08lx)", errRet, errRet);
+	}
+	return errRet;
+}
+
+
+static DWORD WINAPI
+CopyWorkerThread(
+	_In_        LPVOID      Parameter
+	)
+{
+	PCOPY_POOL          pool = Parameter;
+	PALLOCATED_RANGE    extent;
+	COPY_STATS          stats;
+	UINT64              offset;
+	UINT64              bytesWritten[MAX_COPY_TARGETS];
+	DWORD               targetErrors[MAX_COPY_TARGETS];
+	SIZE_T              size;
+	DWORD               t, numLive, lastTargetErr, errRet;
+
+	for (;;) {
+		/* Throttled copies use smaller views so the limits are enforced
+		 * smoothly instead of in bursts of whole views. */
+		size = QosChunkSize(QosClassWrite,
+		                    QosChunkSize(QosClassRead, pool->ViewSize, COPY_VIEW_ALIGNMENT),
+		                    COPY_VIEW_ALIGNMENT);
+
+		EnterCriticalSection(&pool->Lock);
+		if (ERROR_SUCCESS != pool->FirstError || pool->NextExtent >= pool->NumExtents) {
+			LeaveCriticalSection(&pool->Lock);
+			break;
+		}
+		extent = &pool->Extents[pool->NextExtent];
+		offset = pool->NextOffset;
+		size = (SIZE_T)MIN(size, extent->Offset + extent->Length - offset);
+		pool->NextOffset += size;
+		if (pool->NextOffset == extent->Offset + extent->Length
+		    && ++pool->NextExtent < pool->NumExtents)
+			pool->NextOffset = pool->Extents[pool->NextExtent].Offset;
+		for (t = 0; t < pool->NumTargets; ++t)
+			targetErrors[t] = pool->Targets[t].Error;
+		LeaveCriticalSection(&pool->Lock);
+
+		errRet = CopyViewPair(pool, offset, size, &stats, targetErrors, bytesWritten);
+
+		/* Views without data have nothing to flush. */
+		for (t = 0; t < pool->NumTargets; ++t) {
+			if (bytesWritten[t] && ERROR_SUCCESS == targetErrors[t])
+				targetErrors[t] = WriteBehindQueue(&pool->WriteBehind[t], offset, size,
+				                                   bytesWritten[t]);
+		}
+
+		EnterCriticalSection(&pool->Lock);
+		pool->Totals.BytesRead    += stats.BytesRead;
+		pool->Totals.BytesWritten += stats.BytesWritten;
+		pool->Totals.ViewsCopied  += stats.ViewsCopied;
+		pool->Totals.SourceCrc    ^= stats.SourceCrc;
+		numLive = 0;
+		lastTargetErr = ERROR_SUCCESS;
+		for (t = 0; t < pool->NumTargets; ++t) {
+			pool->Targets[t].BytesWritten += bytesWritten[t];
+			if (ERROR_SUCCESS == pool->Targets[t].Error)
+				pool->Targets[t].Error = targetErrors[t];
+			if (ERROR_SUCCESS == pool->Targets[t].Error)
+				++numLive;
+			else
+				lastTargetErr = pool->Targets[t].Error;
+		}
+		/* Once every target has failed there is nothing left to copy to. */
+		if (0 == numLive && ERROR_SUCCESS == errRet)
+			errRet = lastTargetErr;
+		if (ERROR_SUCCESS != errRet && ERROR_SUCCESS == pool->FirstError)
+			pool->FirstError = errRet;
+		LeaveCriticalSection(&pool->Lock);
+
+		if (ERROR_SUCCESS != errRet)
+			break;
+	}
+
+	return 0;
+}
+
+
+_Use_decl_annotations_
+DWORD
+CopyBuildExtents(
+	UINT64                  Offset,
+	UINT64                  End,
+	const ALLOCATED_RANGE   *Ranges,
+	SIZE_T                  NumRanges,
+	PALLOCATED_RANGE        *Extents,
+	SIZE_T                  *NumExtents
+	)
+{
+	PALLOCATED_RANGE    extents, last;
+	UINT64              start, stop;
+	SIZE_T              numExtents, i;
+
+	*Extents = NULL;
+	*NumExtents = 0;
+
+	extents = malloc(MAX(NumRanges, 1) * sizeof(*extents));
+	if (NULL == extents)
+		return ERROR_NOT_ENOUGH_MEMORY;
+
+	numExtents = 0;
+	if (NULL == Ranges) {
+		if (End > Offset) {
+			extents[0].Offset = Offset;
+			extents[0].Length = End - Offset;
+			numExtents = 1;
+		}
+		goto func_return;
+	}
+
+	for (i = 0; i < NumRanges; ++i) {
+		start = Ranges[i].Offset - Ranges[i].Offset % COPY_VIEW_ALIGNMENT;
+		stop  = Ranges[i].Offset + Ranges[i].Length + COPY_VIEW_ALIGNMENT - 1;
+		start = MAX(start, Offset);
+		stop  = MIN(stop - stop % COPY_VIEW_ALIGNMENT, End);
+		if (stop <= start)
+			continue;
+
+		last = numExtents ? &extents[numExtents - 1] : NULL;
+		if (last && start <= last->Offset + last->Length) {
+			last->Length = MAX(stop, last->Offset + last->Length) - last->Offset;
+			continue;
+		}
+		extents[numExtents].Offset = start;
+		extents[numExtents].Length = stop - start;
+		++numExtents;
+	}
+
+func_return:
+	*Extents = extents;
+	*NumExtents = numExtents;
+	return ERROR_SUCCESS;
+}
+
+
+_Use_decl_annotations_
+DWORD
+CopyFileViews(
+	HANDLE                  SourceMap,
+	PCOPY_TARGET            Targets,
+	DWORD                   NumTargets,
+	UINT64                  Offset,
+	UINT64                  Length,
+	const ALLOCATED_RANGE   *Ranges,
+	SIZE_T                  NumRanges,
+	DWORD                   Threads,
+	BOOL                    Checksum,
+	UINT64                  MaxDirty,
+	PCOPY_STATS             Stats
+	)
+{
+	COPY_POOL   pool;
+	HANDLE      threads[MAX_COPY_THREADS];
+	COPY_STATS  totals;
+	UINT64      extentBytes;
+	SIZE_T      j;
+	DWORD       numThreads, numLive, i, t, wait, err, errRet;
+
+	assert(0 < Threads && Threads <= MAX_COPY_THREADS);
+	assert(0 < NumTargets && NumTargets <= MAX_COPY_TARGETS);
+
+	memset(Stats, 0, sizeof(*Stats));
+	memset(&pool, 0, sizeof(pool));
+	pool.SourceMap  = SourceMap;
+	pool.Targets    = Targets;
+	pool.NumTargets = NumTargets;
+	pool.ViewSize   = MAX_FILE_VIEW_SIZE;
+	pool.Checksum   = Checksum;
+	pool.End        = Offset + Length;
+#ifndef _WIN64
+	/* Every worker maps a source view and one view per target at once, and
+	 * with write-behind the flush thread of every target maps up to a view
+	 * too. All of them have to fit in the address space a single view was
+	 * sized for. */
+	pool.ViewSize = MAX_FILE_VIEW_SIZE
+	              / (Threads * (1 + NumTargets) + (MaxDirty ? NumTargets : 0));
+	pool.ViewSize = MAX(ALIGN_DOWN_BY(pool.ViewSize, COPY_VIEW_ALIGNMENT),
+	                    COPY_VIEW_ALIGNMENT);
+#endif
+	InitializeCriticalSection(&pool.Lock);
+
+	errRet = CopyBuildExtents(Offset, Offset + Length, Ranges, NumRanges,
+	                          &pool.Extents, &pool.NumExtents);
+	if (ERROR_SUCCESS != errRet) {
+		LogError(L"Failed to allocate copy extents\n");
+		goto func_return;
+	}
+	extentBytes = 0;
+	for (j = 0; j < pool.NumExtents; ++j)
+		extentBytes += pool.Extents[j].Length;
+	pool.Totals.BytesSkipped = Length - extentBytes;
+	if (pool.NumExtents)
+		pool.NextOffset = pool.Extents[0].Offset;
+	if (Ranges) {
+		LogInfo(L"Copying %8.2f MiB in %llu allocated extents; %8.2f MiB need no copying.\n",
+		        (double)extentBytes / 1048576.0, (UINT64)pool.NumExtents,
+		        (double)pool.Totals.BytesSkipped / 1048576.0);
+	}
+
+	/* Targets that failed before the copy never get a view to flush. */
+	if (MaxDirty) {
+		for (t = 0; t < NumTargets; ++t) {
+			if (ERROR_SUCCESS == Targets[t].Error)
+				WriteBehindStart(&pool.WriteBehind[t], &Targets[t], MaxDirty,
+				                 MIN(WRITE_BEHIND_CHUNK, pool.ViewSize));
+		}
+	}
+
+	for (i = 0; i < Threads; ++i) {
+		threads[i] = CreateThread(NULL, 0, CopyWorkerThread, &pool, 0, NULL);
+		if (NULL == threads[i]) {
+			LogError(L"Failed CreateThread with error %#llx\n",
+			         (long long)GetLastError());
+			break;
+		}
+	}
+	numThreads = i;
+
+	/* The copy just runs with fewer threads if some could not be created. */
+	if (0 == numThreads) {
+		errRet = ERROR_NOT_ENOUGH_MEMORY;
+		goto func_return;
+	}
+
+	for (;;) {
+		wait = WaitForMultipleObjects(numThreads, threads, TRUE, COPY_STATS_INTERVAL_MS);
+		if (WAIT_TIMEOUT != wait)
+			break;
+		EnterCriticalSection(&pool.Lock);
+		totals = pool.Totals;
+		LeaveCriticalSection(&pool.Lock);
+		LogInfo(L"Copied: %8.2f MiB of %8.2f MiB\n",
+		        (double)totals.BytesRead / 1048576.0, (double)extentBytes / 1048576.0);
+	}
+	if (WAIT_FAILED == wait) {
+		LogError(L"Unexpected WaitForMultipleObjects return 0x%08lX GetLastError 0x%08lX "
+		         L"in wait call for copy threads\n", wait, GetLastError());
+		/* Stopping the workers is all that is left to do. */
+		EnterCriticalSection(&pool.Lock);
+		pool.FirstError = ERROR_GEN_FAILURE;
+		LeaveCriticalSection(&pool.Lock);
+		for (i = 0; i < numThreads; ++i)
+			(void)WaitForSingleObject(threads[i], INFINITE);
+	}
+
+	for (i = 0; i < numThreads; ++i)
+		(void)CloseHandle(threads[i]);
+
+	errRet = pool.FirstError;
+
+func_return:
+	/* Whatever is still queued is flushed before the targets are finished,
+	 * which leaves little for their final FlushFileBuffers. */
+	for (t = 0; t < NumTargets; ++t) {
+		if (NULL == pool.WriteBehind[t].Target)
+			continue;
+		err = WriteBehindStop(&pool.WriteBehind[t]);
+		if (ERROR_SUCCESS == Targets[t].Error)
+			Targets[t].Error = err;
+	}
+	/* A target lost here is only the failure of the copy if it was the
+	 * last one. */
+	if (ERROR_SUCCESS == errRet && MaxDirty) {
+		numLive = 0;
+		err = ERROR_SUCCESS;
+		for (t = 0; t < NumTargets; ++t) {
+			if (ERROR_SUCCESS == Targets[t].Error)
+				++numLive;
+			else
+				err = Targets[t].Error;
+		}
+		if (0 == numLive)
+			errRet = err;
+	}
+	*Stats = pool.Totals;
+	free(pool.Extents);
+	DeleteCriticalSection(&pool.Lock);
+	return errRet;
+}
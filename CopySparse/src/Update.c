@@ -0,0 +1,442 @@
+/* Standard BSD license disclaimer.
+
+Copyright(c) 2016-2021, Lance D. Stringham
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "targetver.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+// Necessary due to WIN32_LEAN_AND_MEAN
+#include <winioctl.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "CopySparse.h"
+
+/* Delta update of an existing target.
+ *
+ * The source and the target are read side by side, a few chunks ahead of
+ * the one being compared, so both streams are busy at once. Each chunk is
+ * compared a cluster at a time and only runs of clusters that differ touch
+ * the target: data is written, clusters the source now has as zeros are
+ * deallocated. Holes of the source are never read; whatever the target has
+ * allocated there is deallocated up front. */
+
+#define UPDATE_CHUNK_SIZE   (1024 * 1024)
+/* Chunk pairs being read while one is compared. */
+#define UPDATE_SLOTS        4
+
+typedef enum UPDATE_RUN_KIND {
+	UpdateRunNone = 0,
+	UpdateRunWrite,
+	UpdateRunPunch,
+} UPDATE_RUN_KIND;
+
+typedef struct UPDATE_SLOT {
+	OVERLAPPED  SourceOverlapped;
+	OVERLAPPED  TargetOverlapped;
+	PBYTE       SourceBuffer;
+	PBYTE       TargetBuffer;
+	UINT64      Offset;
+	DWORD       Length;
+	BOOL        Busy;
+} UPDATE_SLOT, *PUPDATE_SLOT;
+
+typedef struct UPDATE_STATE {
+	HANDLE              Source;
+	HANDLE              Target;
+	UINT64              FileSize;
+	DWORD               Unit;
+	BOOL                Checksum;
+	PALLOCATED_RANGE    Extents;
+	SIZE_T              NumExtents;
+	SIZE_T              NextExtent;
+	UINT64              NextOffset;
+	COPY_STATS          Stats;
+} UPDATE_STATE, *PUPDATE_STATE;
+
+
+/* Deallocate [Offset, Offset + Length) of Target; it reads as zeros after. */
+static DWORD
+ZeroTargetRange(
+	_In_        HANDLE      Target,
+	_In_        UINT64      Offset,
+	_In_        UINT64      Length
+	)
+{
+	FILE_ZERO_DATA_INFORMATION  zeroInfo;
+	DWORD                       errRet;
+
+	zeroInfo.FileOffset.QuadPart = (LONGLONG)Offset;
+	zeroInfo.BeyondFinalZero.QuadPart = (LONGLONG)(Offset + Length);
+	errRet = DeviceIoControlSync(Target,
+	                             FSCTL_SET_ZERO_DATA,
+	                             &zeroInfo,
+	                             sizeof(zeroInfo),
+	                             NULL,
+	                             0,
+	                             NULL);
+	if (ERROR_SUCCESS != errRet) {
+		LogError(L"Failed FSCTL_SET_ZERO_DATA at offset %llu with lastErr %lu (0x%08lx)\n",
+		         Offset, errRet, errRet);
+	}
+	return errRet;
+}
+
+
+/* Deallocate whatever the target has allocated outside the extents of the
+ * source; the source holds only zeros there. */
+static DWORD
+PunchOutsideExtents(
+	_Inout_     PUPDATE_STATE   Update
+	)
+{
+	PALLOCATED_RANGE    ranges;
+	ALLOCATED_RANGE     wholeFile;
+	const ALLOCATED_RANGE *range, *extent;
+	SIZE_T              numRanges, i, j;
+	UINT64              pos, end, stop;
+	DWORD               errRet;
+
+	/* Without the target's ranges every gap gets deallocated. */
+	errRet = QueryAllocatedRanges(Update->Target, 0, Update->FileSize, &ranges, &numRanges);
+	if (ERROR_SUCCESS != errRet) {
+		wholeFile.Offset = 0;
+		wholeFile.Length = Update->FileSize;
+		numRanges = 1;
+	}
+
+	errRet = ERROR_SUCCESS;
+	j = 0;
+	for (i = 0; i < numRanges && ERROR_SUCCESS == errRet; ++i) {
+		range = ranges ? &ranges[i] : &wholeFile;
+		pos = range->Offset;
+		end = range->Offset + range->Length;
+
+		/* Both lists are sorted; walk the extents alongside. */
+		while (pos < end && ERROR_SUCCESS == errRet) {
+			while (j < Update->NumExtents
+			       && Update->Extents[j].Offset + Update->Extents[j].Length <= pos)
+				++j;
+			extent = (j < Update->NumExtents) ? &Update->Extents[j] : NULL;
+
+			if (extent && extent->Offset <= pos) {
+				pos = extent->Offset + extent->Length;
+				continue;
+			}
+			stop = extent ? MIN(extent->Offset, end) : end;
+			errRet = ZeroTargetRange(Update->Target, pos, stop - pos);
+			if (ERROR_SUCCESS == errRet)
+				Update->Stats.BytesPunched += stop - pos;
+			pos = stop;
+		}
+	}
+
+	free(ranges);
+	return errRet;
+}
+
+
+/* Start reading the next chunk of both files into Slot. The slot stays idle
+ * once there is none. */
+static DWORD
+StartReads(
+	_Inout_     PUPDATE_STATE   Update,
+	_Inout_     PUPDATE_SLOT    Slot
+	)
+{
+	PALLOCATED_RANGE    extent;
+	HANDLE              sourceEvent, targetEvent;
+	DWORD               bytes, errRet;
+
+	Slot->Busy = FALSE;
+	if (Update->NextExtent >= Update->NumExtents)
+		return ERROR_SUCCESS;
+
+	extent = &Update->Extents[Update->NextExtent];
+	Slot->Offset = Update->NextOffset;
+	Slot->Length = (DWORD)MIN(UPDATE_CHUNK_SIZE,
+	                          extent->Offset + extent->Length - Slot->Offset);
+	Update->NextOffset += Slot->Length;
+	if (Update->NextOffset == extent->Offset + extent->Length
+	    && ++Update->NextExtent < Update->NumExtents)
+		Update->NextOffset = Update->Extents[Update->NextExtent].Offset;
+
+	QosThrottle(QosClassRead, 2 * (UINT64)Slot->Length);
+
+	sourceEvent = Slot->SourceOverlapped.hEvent;
+	targetEvent = Slot->TargetOverlapped.hEvent;
+	memset(&Slot->SourceOverlapped, 0, sizeof(Slot->SourceOverlapped));
+	Slot->SourceOverlapped.Offset = (DWORD)Slot->Offset;
+	Slot->SourceOverlapped.OffsetHigh = (DWORD)(Slot->Offset >> 32);
+	Slot->SourceOverlapped.hEvent = sourceEvent;
+	Slot->TargetOverlapped = Slot->SourceOverlapped;
+	Slot->TargetOverlapped.hEvent = targetEvent;
+
+	if (!ReadFile(Update->Source, Slot->SourceBuffer, Slot->Length, NULL, &Slot->SourceOverlapped)) {
+		errRet = GetLastError();
+		if (ERROR_IO_PENDING != errRet) {
+			LogError(L"Failed ReadFile at offset %llu with lastErr %lu (0x%08lx)\n",
+			         Slot->Offset, errRet, errRet);
+			return errRet;
+		}
+	}
+	if (!ReadFile(Update->Target, Slot->TargetBuffer, Slot->Length, NULL, &Slot->TargetOverlapped)) {
+		errRet = GetLastError();
+		if (ERROR_IO_PENDING != errRet) {
+			/* The source read may still be in flight into the buffer. */
+			(void)GetOverlappedResult(Update->Source, &Slot->SourceOverlapped, &bytes, TRUE);
+			LogError(L"Failed ReadFile at offset %llu with lastErr %lu (0x%08lx)\n",
+			         Slot->Offset, errRet, errRet);
+			return errRet;
+		}
+	}
+	Slot->Busy = TRUE;
+	return ERROR_SUCCESS;
+}
+
+
+/* Wait for the reads of Slot. Returns the bytes of the source and target
+ * that came back. */
+static DWORD
+WaitForReads(
+	_In_        PUPDATE_STATE   Update,
+	_Inout_     PUPDATE_SLOT    Slot,
+	_Out_       DWORD           *SourceBytes,
+	_Out_       DWORD           *TargetBytes
+	)
+{
+	DWORD lastErr, errRet;
+
+	errRet = ERROR_SUCCESS;
+	Slot->Busy = FALSE;
+	if (!GetOverlappedResult(Update->Source, &Slot->SourceOverlapped, SourceBytes, TRUE)) {
+		errRet = GetLastError();
+		*SourceBytes = 0;
+	}
+	/* A target read past its end simply matches nothing. */
+	if (!GetOverlappedResult(Update->Target, &Slot->TargetOverlapped, TargetBytes, TRUE)) {
+		lastErr = GetLastError();
+		*TargetBytes = 0;
+		if (ERROR_HANDLE_EOF != lastErr && ERROR_SUCCESS == errRet)
+			errRet = lastErr;
+	}
+	if (ERROR_SUCCESS != errRet) {
+		LogError(L"Failed to read files at offset %llu with lastErr %lu (0x%08lx)\n",
+		         Slot->Offset, errRet, errRet);
+	}
+	return errRet;
+}
+
+
+/* Write or deallocate [Start, End) of the chunk in Slot. */
+static DWORD
+FlushRun(
+	_Inout_     PUPDATE_STATE   Update,
+	_In_        PUPDATE_SLOT    Slot,
+	_In_        UPDATE_RUN_KIND Kind,
+	_In_        DWORD           Start,
+	_In_        DWORD           End
+	)
+{
+	DWORD errRet;
+
+	if (UpdateRunWrite == Kind) {
+		QosThrottle(QosClassWrite, End - Start);
+		errRet = WriteFileSync(Update->Target, Slot->Offset + Start,
+		                       Slot->SourceBuffer + Start, End - Start);
+		if (ERROR_SUCCESS != errRet) {
+			LogError(L"Failed WriteFile at offset %llu with lastErr %lu (0x%08lx)\n",
+			         Slot->Offset + Start, errRet, errRet);
+			return errRet;
+		}
+		Update->Stats.BytesWritten += End - Start;
+	} else if (UpdateRunPunch == Kind) {
+		errRet = ZeroTargetRange(Update->Target, Slot->Offset + Start, End - Start);
+		if (ERROR_SUCCESS != errRet)
+			return errRet;
+		Update->Stats.BytesPunched += End - Start;
+	}
+	return ERROR_SUCCESS;
+}
+
+
+/* Compare the chunk in Slot a unit at a time and bring the target in line. */
+static DWORD
+UpdateChunk(
+	_Inout_     PUPDATE_STATE   Update,
+	_In_        PUPDATE_SLOT    Slot,
+	_In_        DWORD           SourceBytes,
+	_In_        DWORD           TargetBytes
+	)
+{
+	UPDATE_RUN_KIND kind, runKind;
+	DWORD           pos, len, runStart, errRet;
+
+	SourceBytes = MIN(SourceBytes, Slot->Length);
+	Update->Stats.BytesRead += SourceBytes;
+	Update->Stats.ViewsCopied++;
+	if (Update->Checksum) {
+		Update->Stats.SourceCrc ^= Crc32cShift(Crc32cUpdate(0, Slot->SourceBuffer, SourceBytes),
+		                                       Update->FileSize - (Slot->Offset + SourceBytes));
+	}
+
+	runKind = UpdateRunNone;
+	runStart = 0;
+	for (pos = 0; pos < SourceBytes; pos += len) {
+		len = MIN(Update->Unit, SourceBytes - pos);
+		if (pos + len <= TargetBytes
+		    && 0 == memcmp(Slot->SourceBuffer + pos, Slot->TargetBuffer + pos, len))
+			kind = UpdateRunNone;
+		else if (IsZeroBuf(Slot->SourceBuffer + pos, len))
+			kind = UpdateRunPunch;
+		else
+			kind = UpdateRunWrite;
+
+		if (kind != runKind) {
+			errRet = FlushRun(Update, Slot, runKind, runStart, pos);
+			if (ERROR_SUCCESS != errRet)
+				return errRet;
+			runKind = kind;
+			runStart = pos;
+		}
+	}
+	return FlushRun(Update, Slot, runKind, runStart, SourceBytes);
+}
+
+
+_Use_decl_annotations_
+DWORD
+UpdateFileDelta(
+	HANDLE                  Source,
+	HANDLE                  Target,
+	UINT64                  FileSize,
+	SIZE_T                  ClusterSize,
+	const ALLOCATED_RANGE   *Ranges,
+	SIZE_T                  NumRanges,
+	BOOL                    Checksum,
+	PCOPY_STATS             Stats
+	)
+{
+	UPDATE_STATE    update;
+	UPDATE_SLOT     slots[UPDATE_SLOTS];
+	PUPDATE_SLOT    slot;
+	UINT64          extentBytes, lastStatsQPCVal;
+	SIZE_T          j;
+	DWORD           sourceBytes, targetBytes, i, errRet;
+
+	memset(Stats, 0, sizeof(*Stats));
+	memset(&update, 0, sizeof(update));
+	memset(slots, 0, sizeof(slots));
+	update.Source   = Source;
+	update.Target   = Target;
+	update.FileSize = FileSize;
+	update.Unit     = (DWORD)MIN(ClusterSize, COPY_VIEW_ALIGNMENT);
+	update.Checksum = Checksum;
+
+	errRet = CopyBuildExtents(0, FileSize, Ranges, NumRanges,
+	                          &update.Extents, &update.NumExtents);
+	if (ERROR_SUCCESS != errRet) {
+		LogError(L"Failed to allocate copy extents\n");
+		goto func_return;
+	}
+	extentBytes = 0;
+	for (j = 0; j < update.NumExtents; ++j)
+		extentBytes += update.Extents[j].Length;
+	update.Stats.BytesSkipped = FileSize - extentBytes;
+	if (update.NumExtents)
+		update.NextOffset = update.Extents[0].Offset;
+	LogInfo(L"Comparing %8.2f MiB in %llu allocated extents.\n",
+	        (double)extentBytes / 1048576.0, (UINT64)update.NumExtents);
+
+	errRet = PunchOutsideExtents(&update);
+	if (ERROR_SUCCESS != errRet)
+		goto func_return;
+
+	/* Page aligned like the async engine's buffers. */
+	for (i = 0; i < UPDATE_SLOTS; ++i) {
+		slots[i].SourceBuffer = VirtualAlloc(NULL, 2 * UPDATE_CHUNK_SIZE,
+		                                     MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		slots[i].SourceOverlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+		slots[i].TargetOverlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+		if (NULL == slots[i].SourceBuffer || NULL == slots[i].SourceOverlapped.hEvent
+		    || NULL == slots[i].TargetOverlapped.hEvent) {
+			errRet = GetLastError();
+			LogError(L"Failed to allocate update buffers with lastErr %lu (0x%08lx)\n",
+			         errRet, errRet);
+			goto func_return;
+		}
+		slots[i].TargetBuffer = slots[i].SourceBuffer + UPDATE_CHUNK_SIZE;
+	}
+
+	for (i = 0; i < UPDATE_SLOTS && ERROR_SUCCESS == errRet; ++i)
+		errRet = StartReads(&update, &slots[i]);
+
+	/* Chunks complete in the order they were started; the slots go round. */
+	lastStatsQPCVal = GetQPCVal();
+	for (i = 0; ERROR_SUCCESS == errRet; i = (i + 1) % UPDATE_SLOTS) {
+		slot = &slots[i];
+		if (!slot->Busy)
+			break;
+
+		errRet = WaitForReads(&update, slot, &sourceBytes, &targetBytes);
+		if (ERROR_SUCCESS == errRet)
+			errRet = UpdateChunk(&update, slot, sourceBytes, targetBytes);
+		if (ERROR_SUCCESS == errRet)
+			errRet = StartReads(&update, slot);
+
+		if (ElapsedQPCInMillisec(lastStatsQPCVal, GetQPCVal()) >= COPY_STATS_INTERVAL_MS) {
+			LogInfo(L"Compared: %8.2f MiB of %8.2f MiB, %8.2f MiB written\n",
+			        (double)update.Stats.BytesRead / 1048576.0,
+			        (double)extentBytes / 1048576.0,
+			        (double)update.Stats.BytesWritten / 1048576.0);
+			lastStatsQPCVal = GetQPCVal();
+		}
+	}
+
+func_return:
+	*Stats = update.Stats;
+	for (i = 0; i < UPDATE_SLOTS; ++i) {
+		/* The buffers of reads still in flight cannot be freed under them. */
+		if (slots[i].Busy)
+			(void)WaitForReads(&update, &slots[i], &sourceBytes, &targetBytes);
+		if (slots[i].SourceBuffer)
+			(void)VirtualFree(slots[i].SourceBuffer, 0, MEM_RELEASE);
+		if (slots[i].SourceOverlapped.hEvent)
+			(void)CloseHandle(slots[i].SourceOverlapped.hEvent);
+		if (slots[i].TargetOverlapped.hEvent)
+			(void)CloseHandle(slots[i].TargetOverlapped.hEvent);
+	}
+	free(update.Extents);
+	return errRet;
+}
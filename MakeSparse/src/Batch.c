@@ -0,0 +1,870 @@
+/* Standard BSD license disclaimer.
+
+Copyright(c) 2016-2021, Lance D. Stringham
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "targetver.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <wctype.h>
+#include <errno.h>
+
+#include <assert.h>
+
+#include "MakeSparse.h"
+
+/* Batch mode.
+ *
+ * Every input file is collected up front and sorted largest first. Workers
+ * start files in that order as long as the estimated memory for their cluster
+ * maps fits under the limit; a file is always started when nothing else is
+ * holding memory so one huge file cannot stall the batch.
+ *
+ * Files larger than BATCH_SPLIT_THRESHOLD are split into BATCH_RANGE_SIZE
+ * ranges once opened. The opening worker pushes the ranges onto the bottom of
+ * its own deque and works through them from there while idle workers steal
+ * from the top. Every range of a file marks the same zero map and whichever
+ * worker finishes the last one deallocates and closes the file. Workers look
+ * for range work before starting another file so open files, and the memory
+ * they hold, are finished as soon as possible.
+ *
+ * Each deque has its own lock. Tasks cover gigabytes of a file so the locks are
+ * taken rarely and a lock free deque would buy nothing. */
+
+/* Files above this size are analyzed by several workers at once. */
+#define BATCH_SPLIT_THRESHOLD       (16ull * 1024 * 1024 * 1024)
+
+/* Size of each range of a split file. A multiple of the view size used by
+ * BuildSparseMapEx and of SPARSE_MAP_RANGE_ALIGNMENT. */
+#define BATCH_RANGE_SIZE            (4ull * 1024 * 1024 * 1024)
+
+#define TASK_DEQUE_INITIAL_SIZE     64
+#define FILE_LIST_INITIAL_SIZE      256
+
+/* Longest line accepted from a file list; the longest path Windows allows. */
+#define LIST_LINE_MAX               32768
+
+typedef struct BATCH_FILE {
+	LPWSTR          Path;
+	UINT64          Size;
+	UINT64          MemoryCharge;
+	TARGET_FILE     Target;
+	volatile LONG   RangesRemaining;
+	volatile LONG   Error;
+	/* Unchanged since the scan cache recorded it; nothing was opened.
+	 * CachedReclaimable is what that earlier run found. */
+	BOOL            Cached;
+	UINT64          CachedReclaimable;
+} BATCH_FILE, *PBATCH_FILE;
+
+typedef struct BATCH_RANGE {
+	PBATCH_FILE     File;
+	UINT64          Offset;
+	UINT64          Length;
+} BATCH_RANGE, *PBATCH_RANGE;
+
+typedef struct TASK_DEQUE {
+	CRITICAL_SECTION    Lock;
+	PBATCH_RANGE        Ranges;
+	SIZE_T              Size;
+	SIZE_T              Top;
+	SIZE_T              Count;
+} TASK_DEQUE, *PTASK_DEQUE;
+
+typedef struct BATCH_POOL *PBATCH_POOL;
+
+typedef struct BATCH_WORKER {
+	PBATCH_POOL     Pool;
+	DWORD           Index;
+	HANDLE          Thread;
+	TASK_DEQUE      Deque;
+} BATCH_WORKER, *PBATCH_WORKER;
+
+typedef struct BATCH_POOL {
+	const MAKESPARSE_OPTIONS    *Options;
+	DWORD                       NumWorkers;
+	PBATCH_WORKER               Workers;
+	/* Bounds the number of files being read or deallocated at once. */
+	HANDLE                      IoSlots;
+	PBATCH_FILE                 *Files;
+	SIZE_T                      NumFiles;
+	/* NULL without Options->ScanCachePath. */
+	PSCAN_CACHE                 Cache;
+
+	/* Everything below is guarded by Lock. */
+	CRITICAL_SECTION            Lock;
+	CONDITION_VARIABLE          WorkAvailable;
+	SIZE_T                      NextFile;
+	SIZE_T                      FilesRemaining;
+	SIZE_T                      QueuedRanges;
+	UINT64                      MemoryInUse;
+	UINT64                      FilesFailed;
+	UINT64                      FilesCached;
+	UINT64                      CachedBytes;
+	UINT64                      CachedReclaimable;
+	DWORD                       FirstError;
+	ZERO_DISPATCH_STATS         Totals;
+} BATCH_POOL;
+
+typedef struct FILE_LIST {
+	PBATCH_FILE     *Files;
+	SIZE_T          Count;
+	SIZE_T          Size;
+	/* Inputs that could not be enumerated. Already logged. */
+	UINT64          Errors;
+} FILE_LIST, *PFILE_LIST;
+
+
+static DWORD
+DequePushBottom(
+	_Inout_     PTASK_DEQUE         Deque,
+	_In_        const BATCH_RANGE   *Range
+	)
+{
+	PBATCH_RANGE    newRanges;
+	SIZE_T          newSize, i;
+	DWORD           errRet;
+
+	errRet = ERROR_SUCCESS;
+	EnterCriticalSection(&Deque->Lock);
+
+	if (Deque->Count == Deque->Size) {
+		newSize = Deque->Size ? Deque->Size * 2 : TASK_DEQUE_INITIAL_SIZE;
+		newRanges = malloc(newSize * sizeof(*newRanges));
+		if (NULL == newRanges) {
+			errRet = ERROR_NOT_ENOUGH_MEMORY;
+			goto func_return;
+		}
+		/* Unwrap the ring so Top starts at zero again. */
+		for (i = 0; i < Deque->Count; ++i)
+			newRanges[i] = Deque->Ranges[(Deque->Top + i) % Deque->Size];
+		free(Deque->Ranges);
+		Deque->Ranges = newRanges;
+		Deque->Size = newSize;
+		Deque->Top = 0;
+	}
+
+	Deque->Ranges[(Deque->Top + Deque->Count) % Deque->Size] = *Range;
+	Deque->Count++;
+
+func_return:
+	LeaveCriticalSection(&Deque->Lock);
+	return errRet;
+}
+
+
+static BOOL
+DequePopBottom(
+	_Inout_     PTASK_DEQUE     Deque,
+	_Out_       PBATCH_RANGE    Range
+	)
+{
+	BOOL found;
+
+	EnterCriticalSection(&Deque->Lock);
+	found = (0 != Deque->Count);
+	if (found) {
+		Deque->Count--;
+		*Range = Deque->Ranges[(Deque->Top + Deque->Count) % Deque->Size];
+	}
+	LeaveCriticalSection(&Deque->Lock);
+
+	return found;
+}
+
+
+static BOOL
+DequeStealTop(
+	_Inout_     PTASK_DEQUE     Deque,
+	_Out_       PBATCH_RANGE    Range
+	)
+{
+	BOOL found;
+
+	EnterCriticalSection(&Deque->Lock);
+	found = (0 != Deque->Count);
+	if (found) {
+		*Range = Deque->Ranges[Deque->Top];
+		Deque->Top = (Deque->Top + 1) % Deque->Size;
+		Deque->Count--;
+	}
+	LeaveCriticalSection(&Deque->Lock);
+
+	return found;
+}
+
+
+/* The deque push happens under the pool lock so a thief can never account for
+ * a range before it has been counted. */
+static DWORD
+PoolPushRange(
+	_Inout_     PBATCH_WORKER       Worker,
+	_In_        const BATCH_RANGE   *Range
+	)
+{
+	PBATCH_POOL pool;
+	DWORD       errRet;
+
+	pool = Worker->Pool;
+
+	EnterCriticalSection(&pool->Lock);
+	errRet = DequePushBottom(&Worker->Deque, Range);
+	if (ERROR_SUCCESS == errRet) {
+		pool->QueuedRanges++;
+		WakeConditionVariable(&pool->WorkAvailable);
+	}
+	LeaveCriticalSection(&pool->Lock);
+
+	return errRet;
+}
+
+
+/* Get the next piece of work: a range from this worker's deque, a range stolen
+ * from another worker or, failing both, the next file if its memory fits.
+ * Returns FALSE once every file is done. */
+static BOOL
+GetNextWork(
+	_Inout_     PBATCH_WORKER   Worker,
+	_Out_       PBATCH_RANGE    Range,
+	_Out_       PBATCH_FILE     *NewFile
+	)
+{
+	PBATCH_POOL pool;
+	PBATCH_FILE file;
+	DWORD       i;
+	BOOL        found, more;
+
+	pool = Worker->Pool;
+	*NewFile = NULL;
+
+	for (;;) {
+		found = DequePopBottom(&Worker->Deque, Range);
+		/* Start with the next worker so thieves spread out over victims. */
+		for (i = 1; !found && i < pool->NumWorkers; ++i) {
+			found = DequeStealTop(&pool->Workers[(Worker->Index + i) % pool->NumWorkers].Deque,
+			                      Range);
+		}
+
+		EnterCriticalSection(&pool->Lock);
+
+		if (found) {
+			pool->QueuedRanges--;
+			LeaveCriticalSection(&pool->Lock);
+			return TRUE;
+		}
+
+		if (pool->NextFile < pool->NumFiles) {
+			file = pool->Files[pool->NextFile];
+			if (0 == pool->Options->MaxMemory
+			    || 0 == pool->MemoryInUse
+			    || pool->MemoryInUse + file->MemoryCharge <= pool->Options->MaxMemory) {
+				pool->NextFile++;
+				pool->MemoryInUse += file->MemoryCharge;
+				LeaveCriticalSection(&pool->Lock);
+				*NewFile = file;
+				return TRUE;
+			}
+		}
+
+		/* Nothing to do until a range is pushed, memory is released or the
+		 * last file finishes. */
+		if (0 == pool->QueuedRanges && pool->FilesRemaining)
+			(void)SleepConditionVariableCS(&pool->WorkAvailable, &pool->Lock, INFINITE);
+
+		more = (0 != pool->FilesRemaining);
+		LeaveCriticalSection(&pool->Lock);
+
+		if (!more)
+			return FALSE;
+	}
+}
+
+
+static void
+FinishFile(
+	_Inout_     PBATCH_WORKER   Worker,
+	_Inout_     PBATCH_FILE     File
+	)
+{
+	PBATCH_POOL         pool;
+	ZERO_DISPATCH_STATS stats;
+	DWORD               errRet;
+
+	pool = Worker->Pool;
+	errRet = (DWORD)File->Error;
+
+	if (File->Cached) {
+		memset(&stats, 0, sizeof(stats));
+		goto account_return;
+	}
+
+	if (ERROR_SUCCESS == errRet) {
+		(void)WaitForSingleObject(pool->IoSlots, INFINITE);
+		errRet = TargetFileDeallocate(pool->Options, &File->Target);
+		(void)ReleaseSemaphore(pool->IoSlots, 1, NULL);
+	}
+	TargetFileClose(pool->Options, &File->Target);
+	stats = File->Target.DispatchStats;
+
+	if (ERROR_SUCCESS == errRet) {
+		LogInfo(L"%s: dispatched %llu zero ranges covering %8.2f MiB.\n",
+		        File->Path, stats.RangesQueued,
+		        (double)stats.BytesZeroed / 1048576.0);
+	} else {
+		LogError(L"%s: failed with error %#llx\n", File->Path, (long long)errRet);
+	}
+
+	TargetFileFree(&File->Target);
+
+	/* A file that vanished or cannot be opened has nothing to record. */
+	if (pool->Cache && ERROR_SUCCESS != ScanCacheRecord(pool->Cache, File->Path,
+	                                                    errRet, stats.BytesZeroed)) {
+		LogError(L"WARNING: %s is not added to the scan cache.\n", File->Path);
+	}
+
+account_return:
+	EnterCriticalSection(&pool->Lock);
+	pool->MemoryInUse -= File->MemoryCharge;
+	pool->FilesRemaining--;
+	if (File->Cached) {
+		pool->FilesCached++;
+		pool->CachedBytes += File->Size;
+		pool->CachedReclaimable += File->CachedReclaimable;
+	}
+	if (ERROR_SUCCESS != errRet) {
+		pool->FilesFailed++;
+		if (ERROR_SUCCESS == pool->FirstError)
+			pool->FirstError = errRet;
+	}
+	pool->Totals.RangesQueued    += stats.RangesQueued;
+	pool->Totals.RangesCompleted += stats.RangesCompleted;
+	pool->Totals.RangesFailed    += stats.RangesFailed;
+	pool->Totals.BytesZeroed     += stats.BytesZeroed;
+	pool->Totals.RangesChanged   += stats.RangesChanged;
+	pool->Totals.RangesLocked    += stats.RangesLocked;
+	/* Freed memory may let a waiting worker start the next file and the
+	 * last file lets everybody exit. */
+	WakeAllConditionVariable(&pool->WorkAvailable);
+	LeaveCriticalSection(&pool->Lock);
+}
+
+
+static void
+RunRange(
+	_Inout_     PBATCH_WORKER       Worker,
+	_In_        const BATCH_RANGE   *Range
+	)
+{
+	PBATCH_POOL pool;
+	PBATCH_FILE file;
+	DWORD       errRet;
+
+	pool = Worker->Pool;
+	file = Range->File;
+
+	/* Once any range has failed the file will not be modified so the
+	 * remaining ranges only need to be accounted for. */
+	if (ERROR_SUCCESS == file->Error) {
+		(void)WaitForSingleObject(pool->IoSlots, INFINITE);
+		errRet = TargetFileScan(&file->Target, Range->Offset, Range->Length, NULL);
+		(void)ReleaseSemaphore(pool->IoSlots, 1, NULL);
+
+		if (ERROR_SUCCESS != errRet) {
+			LogError(L"Failed to analyze %s at offset 0x%016llX with error %#llx\n",
+			         file->Path, Range->Offset, (long long)errRet);
+			(void)InterlockedCompareExchange(&file->Error, (LONG)errRet, ERROR_SUCCESS);
+		}
+	}
+
+	if (0 == InterlockedDecrement(&file->RangesRemaining))
+		FinishFile(Worker, file);
+}
+
+
+static void
+StartFile(
+	_Inout_     PBATCH_WORKER   Worker,
+	_Inout_     PBATCH_FILE     File
+	)
+{
+	BATCH_RANGE range;
+	UINT64      numRanges, i;
+	DWORD       errRet;
+
+	if (Worker->Pool->Cache
+	    && ScanCacheLookup(Worker->Pool->Cache, File->Path, &File->CachedReclaimable)) {
+		File->Cached = TRUE;
+		File->RangesRemaining = 0;
+		FinishFile(Worker, File);
+		return;
+	}
+
+	errRet = TargetFileOpen(Worker->Pool->Options, File->Path, &File->Target);
+	if (ERROR_SUCCESS != errRet) {
+		File->Error = (LONG)errRet;
+		File->RangesRemaining = 0;
+		FinishFile(Worker, File);
+		return;
+	}
+
+	range.File = File;
+
+	if (File->Target.FileSize <= BATCH_SPLIT_THRESHOLD) {
+		File->RangesRemaining = 1;
+		range.Offset = 0;
+		range.Length = 0;
+		RunRange(Worker, &range);
+		return;
+	}
+
+	numRanges = (File->Target.FileSize + BATCH_RANGE_SIZE - 1) / BATCH_RANGE_SIZE;
+	File->RangesRemaining = (LONG)numRanges;
+
+	/* Pushed back to front so this worker continues forwards through the
+	 * file while thieves take ranges from the far end. */
+	range.Length = BATCH_RANGE_SIZE;
+	for (i = numRanges - 1; i > 0; --i) {
+		range.Offset = i * BATCH_RANGE_SIZE;
+		if (ERROR_SUCCESS != PoolPushRange(Worker, &range))
+			RunRange(Worker, &range);
+	}
+
+	range.Offset = 0;
+	RunRange(Worker, &range);
+}
+
+
+static DWORD WINAPI
+BatchWorkerThread(
+	LPVOID      Param
+	)
+{
+	PBATCH_WORKER   worker;
+	BATCH_RANGE     range;
+	PBATCH_FILE     newFile;
+
+	worker = Param;
+
+	while (GetNextWork(worker, &range, &newFile)) {
+		if (newFile)
+			StartFile(worker, newFile);
+		else
+			RunRange(worker, &range);
+	}
+
+	return 0;
+}
+
+
+/* Both maps of a file, one bit per cluster each. The real cluster size is not
+ * known until the file is opened so assume the common default. */
+static UINT64
+EstimateMemoryCharge(
+	_In_        UINT64      FileSize
+	)
+{
+	return 2 * ((FileSize / DEFAULT_FS_CLUSTER_SIZE) / 8 + sizeof(LONG));
+}
+
+
+static DWORD
+FileListAdd(
+	_Inout_     PFILE_LIST  List,
+	_In_        LPCWSTR     Path,
+	_In_        UINT64      Size
+	)
+{
+	PBATCH_FILE *newFiles;
+	PBATCH_FILE file;
+	SIZE_T      newSize;
+
+	if (List->Count == List->Size) {
+		newSize = List->Size ? List->Size * 2 : FILE_LIST_INITIAL_SIZE;
+		newFiles = realloc(List->Files, newSize * sizeof(*newFiles));
+		if (NULL == newFiles)
+			return ERROR_NOT_ENOUGH_MEMORY;
+		List->Files = newFiles;
+		List->Size = newSize;
+	}
+
+	file = calloc(1, sizeof(*file));
+	if (NULL == file)
+		return ERROR_NOT_ENOUGH_MEMORY;
+
+	file->Path = _wcsdup(Path);
+	if (NULL == file->Path) {
+		free(file);
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+	file->Size = Size;
+	file->MemoryCharge = EstimateMemoryCharge(Size);
+
+	List->Files[List->Count++] = file;
+	return ERROR_SUCCESS;
+}
+
+
+/* Add every non-empty file below Directory. Junctions and symbolic links are
+ * not followed; they can loop or lead outside of the requested tree. Errors
+ * enumerating a directory are logged and counted but do not stop the walk;
+ * only running out of memory does. */
+static DWORD
+CollectDirectory(
+	_Inout_     PFILE_LIST  List,
+	_In_        LPCWSTR     Directory
+	)
+{
+	WIN32_FIND_DATAW    findData;
+	HANDLE              find;
+	LPWSTR              path;
+	SIZE_T              pathSize;
+	UINT64              size;
+	DWORD               errRet;
+
+	/* Room for the separator, the longest name and the terminator. */
+	pathSize = wcslen(Directory) + 1 + MAX_PATH + 1;
+	path = malloc(pathSize * sizeof(*path));
+	if (NULL == path)
+		return ERROR_NOT_ENOUGH_MEMORY;
+
+	(void)swprintf_s(path, pathSize, L"%s\\*", Directory);
+
+	find = FindFirstFileW(path, &findData);
+	if (INVALID_HANDLE_VALUE == find) {
+		errRet = GetLastError();
+		LogError(L"Failed to enumerate %s with error %#llx\n",
+		         Directory, (long long)errRet);
+		List->Errors++;
+		errRet = ERROR_SUCCESS;
+		goto func_return;
+	}
+
+	do {
+		if (!wcscmp(findData.cFileName, L".") || !wcscmp(findData.cFileName, L".."))
+			continue;
+		if (findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+			continue;
+		/* Manifests and deadline progress files of earlier runs are ours,
+		 * not data. */
+		if (ManifestIsSidecar(findData.cFileName)
+		    || DeadlineIsProgressFile(findData.cFileName))
+			continue;
+
+		(void)swprintf_s(path, pathSize, L"%s\\%s", Directory, findData.cFileName);
+
+		if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			errRet = CollectDirectory(List, path);
+		} else {
+			size = ((UINT64)findData.nFileSizeHigh << 32) | findData.nFileSizeLow;
+			errRet = size ? FileListAdd(List, path, size) : ERROR_SUCCESS;
+		}
+		if (ERROR_SUCCESS != errRet)
+			goto cleanup_return;
+	} while (FindNextFileW(find, &findData));
+
+	errRet = GetLastError();
+	if (ERROR_NO_MORE_FILES != errRet) {
+		LogError(L"Failed to enumerate %s with error %#llx\n",
+		         Directory, (long long)errRet);
+		List->Errors++;
+	}
+	errRet = ERROR_SUCCESS;
+
+cleanup_return:
+	(void)FindClose(find);
+
+func_return:
+	free(path);
+	return errRet;
+}
+
+
+/* Add every file named in ListFile, one path per line. Blank lines and lines
+ * starting with # are ignored. Directories are collected recursively. The file
+ * may be ANSI, UTF-8 or UTF-16 with a byte order mark. */
+static DWORD
+CollectListFile(
+	_Inout_     PFILE_LIST  List,
+	_In_        LPCWSTR     ListFile
+	)
+{
+	WIN32_FILE_ATTRIBUTE_DATA   attrs;
+	FILE                        *fp;
+	LPWSTR                      line, path;
+	SIZE_T                      len;
+	UINT64                      size;
+	DWORD                       errRet;
+
+	errRet = ERROR_SUCCESS;
+
+	line = malloc(LIST_LINE_MAX * sizeof(*line));
+	if (NULL == line)
+		return ERROR_NOT_ENOUGH_MEMORY;
+
+	fp = _wfopen(ListFile, L"rt, ccs=UTF-8");
+	if (NULL == fp) {
+		LogError(L"Failed to open file list %s with errno %d\n", ListFile, errno);
+		List->Errors++;
+		goto func_return;
+	}
+
+	while (fgetws(line, LIST_LINE_MAX, fp)) {
+		path = line;
+		while (iswspace(*path))
+			++path;
+		len = wcslen(path);
+		while (len && iswspace(path[len - 1]))
+			path[--len] = L'\0';
+		if (0 == len || L'#' == *path)
+			continue;
+
+		if (!GetFileAttributesExW(path, GetFileExInfoStandard, &attrs)) {
+			LogError(L"Skipping %s, error %#llx\n", path, (long long)GetLastError());
+			List->Errors++;
+			continue;
+		}
+
+		if (attrs.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			errRet = CollectDirectory(List, path);
+		} else {
+			size = ((UINT64)attrs.nFileSizeHigh << 32) | attrs.nFileSizeLow;
+			errRet = size ? FileListAdd(List, path, size) : ERROR_SUCCESS;
+		}
+		if (ERROR_SUCCESS != errRet)
+			goto cleanup_return;
+	}
+
+	if (ferror(fp)) {
+		LogError(L"Failed reading file list %s\n", ListFile);
+		List->Errors++;
+	}
+
+cleanup_return:
+	(void)fclose(fp);
+
+func_return:
+	free(line);
+	return errRet;
+}
+
+
+static int __cdecl
+CompareFileSizeDescending(
+	_In_        const void  *A,
+	_In_        const void  *B
+	)
+{
+	const BATCH_FILE *a = *(const PBATCH_FILE *)A, *b = *(const PBATCH_FILE *)B;
+
+	if (a->Size > b->Size)
+		return -1;
+	return (a->Size < b->Size);
+}
+
+
+_Use_decl_annotations_
+DWORD
+RunBatch(
+	const MAKESPARSE_OPTIONS    *Options
+	)
+{
+	FILE_LIST       list;
+	BATCH_POOL      pool;
+	SYSTEM_INFO     sysInfo;
+	UINT64          startQPCVal, totalSize, hours, minutes, seconds;
+	DWORD           errRet, numThreads, maxIo, i;
+	SIZE_T          j;
+
+	startQPCVal = GetQPCVal();
+	memset(&list, 0, sizeof(list));
+	memset(&pool, 0, sizeof(pool));
+	numThreads = 0;
+
+	if (Options->RecurseRoot) {
+		LogInfo(L"Collecting files under %s\n", Options->RecurseRoot);
+		errRet = CollectDirectory(&list, Options->RecurseRoot);
+		if (ERROR_SUCCESS != errRet)
+			goto enumerate_failed;
+	}
+
+	if (Options->ListFile) {
+		LogInfo(L"Collecting files listed in %s\n", Options->ListFile);
+		errRet = CollectListFile(&list, Options->ListFile);
+		if (ERROR_SUCCESS != errRet)
+			goto enumerate_failed;
+	}
+
+	if (0 == list.Count) {
+		LogInfo(L"No files to process.\n");
+		errRet = list.Errors ? ERROR_FILE_NOT_FOUND : ERROR_SUCCESS;
+		goto func_return;
+	}
+
+	qsort(list.Files, list.Count, sizeof(*list.Files), CompareFileSizeDescending);
+
+	totalSize = 0;
+	for (j = 0; j < list.Count; ++j)
+		totalSize += list.Files[j]->Size;
+
+	if (Options->Threads) {
+		pool.NumWorkers = Options->Threads;
+	} else {
+		GetSystemInfo(&sysInfo);
+		pool.NumWorkers = MIN(MAX(sysInfo.dwNumberOfProcessors, 1), MAX_BATCH_THREADS);
+	}
+	maxIo = Options->MaxIo ? Options->MaxIo : pool.NumWorkers;
+
+	LogInfo(L"Processing %llu files totalling %8.2f GiB with %lu threads.\n",
+	        (UINT64)list.Count, (double)totalSize / 1073741824.0, pool.NumWorkers);
+
+	pool.Options        = Options;
+	pool.Files          = list.Files;
+	pool.NumFiles       = list.Count;
+	pool.FilesRemaining = list.Count;
+	pool.FirstError     = ERROR_SUCCESS;
+	InitializeCriticalSection(&pool.Lock);
+	InitializeConditionVariable(&pool.WorkAvailable);
+
+	if (Options->ScanCachePath) {
+		errRet = ScanCacheOpen(Options->ScanCachePath, Options, &pool.Cache);
+		if (ERROR_SUCCESS != errRet) {
+			LogError(L"Failed to open scan cache %s with error %#llx\n",
+			         Options->ScanCachePath, (long long)errRet);
+			goto cleanup_return;
+		}
+	}
+
+	pool.IoSlots = CreateSemaphoreW(NULL, (LONG)maxIo, (LONG)maxIo, NULL);
+	if (NULL == pool.IoSlots) {
+		errRet = GetLastError();
+		LogError(L"Failed CreateSemaphoreW with error %#llx\n", (long long)errRet);
+		goto cleanup_return;
+	}
+
+	pool.Workers = calloc(pool.NumWorkers, sizeof(*pool.Workers));
+	if (NULL == pool.Workers) {
+		errRet = ERROR_NOT_ENOUGH_MEMORY;
+		LogError(L"Failed to allocate worker pool\n");
+		goto cleanup_return;
+	}
+
+	/* Every deque has to exist before the first worker goes stealing. */
+	for (i = 0; i < pool.NumWorkers; ++i) {
+		pool.Workers[i].Pool = &pool;
+		pool.Workers[i].Index = i;
+		InitializeCriticalSection(&pool.Workers[i].Deque.Lock);
+	}
+
+	for (i = 0; i < pool.NumWorkers; ++i) {
+		pool.Workers[i].Thread = CreateThread(NULL, 0, BatchWorkerThread,
+		                                      &pool.Workers[i], 0, NULL);
+		if (NULL == pool.Workers[i].Thread) {
+			LogError(L"Failed CreateThread with error %#llx\n",
+			         (long long)GetLastError());
+			break;
+		}
+	}
+	numThreads = i;
+
+	/* Workers without a thread never push anything so their empty deques do
+	 * no harm; the batch just runs with fewer threads. */
+	if (0 == numThreads) {
+		errRet = ERROR_NOT_ENOUGH_MEMORY;
+		goto cleanup_return;
+	}
+
+	for (i = 0; i < numThreads; ++i) {
+		(void)WaitForSingleObject(pool.Workers[i].Thread, INFINITE);
+		(void)CloseHandle(pool.Workers[i].Thread);
+	}
+
+	seconds = ElapsedQPCInSeconds(startQPCVal, GetQPCVal());
+	hours = seconds / (60 * 60);
+	seconds = seconds % (60 * 60);
+	minutes = seconds / 60;
+	seconds = seconds % 60;
+	LogInfo(L"Processed %llu files, %llu failed. Dispatched %llu zero ranges "
+	        L"covering %8.2f MiB. %llu ranges failed.\n"
+	        L"Completed processing in: %llu hours, %llu minutes, %llu seconds\n",
+	        (UINT64)list.Count, pool.FilesFailed, pool.Totals.RangesQueued,
+	        (double)pool.Totals.BytesZeroed / 1048576.0, pool.Totals.RangesFailed,
+	        hours, minutes, seconds);
+	if (Options->Online) {
+		LogInfo(L"Skipped %llu ranges that changed and %llu ranges locked by "
+		        L"another process.\n",
+		        pool.Totals.RangesChanged, pool.Totals.RangesLocked);
+	}
+	if (pool.Cache) {
+		LogInfo(L"Skipped %llu unchanged files totalling %8.2f GiB found in the scan "
+		        L"cache. %8.2f MiB of them was reclaimed when they were processed.\n",
+		        pool.FilesCached, (double)pool.CachedBytes / 1073741824.0,
+		        (double)pool.CachedReclaimable / 1048576.0);
+		errRet = ScanCacheSave(pool.Cache);
+		if (ERROR_SUCCESS != errRet) {
+			LogError(L"WARNING: Failed to save scan cache %s with error %#llx\n",
+			         Options->ScanCachePath, (long long)errRet);
+		}
+	}
+
+	errRet = pool.FirstError;
+	if (ERROR_SUCCESS == errRet && list.Errors)
+		errRet = ERROR_FILE_NOT_FOUND;
+
+cleanup_return:
+	if (pool.Workers) {
+		for (i = 0; i < pool.NumWorkers; ++i) {
+			DeleteCriticalSection(&pool.Workers[i].Deque.Lock);
+			free(pool.Workers[i].Deque.Ranges);
+		}
+		free(pool.Workers);
+	}
+	if (pool.IoSlots)
+		(void)CloseHandle(pool.IoSlots);
+	ScanCacheFree(pool.Cache);
+	DeleteCriticalSection(&pool.Lock);
+	goto func_return;
+
+enumerate_failed:
+	LogError(L"Failed to collect files with error %#llx\n", (long long)errRet);
+
+func_return:
+	for (j = 0; j < list.Count; ++j) {
+		free(list.Files[j]->Path);
+		free(list.Files[j]);
+	}
+	free(list.Files);
+
+	return errRet;
+}
@@ -0,0 +1,464 @@
+/* Standard BSD license disclaimer.
+
+Copyright(c) 2016-2021, Lance D. Stringham
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "targetver.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+// Necessary due to WIN32_LEAN_AND_MEAN
+#include <winioctl.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "MakeSparse.h"
+
+/* Compaction of the data left behind once zero ranges are deallocated.
+ *
+ * Punching many small holes leaves the remaining data of a file in extents
+ * that are scattered over the volume, so a sequential read of the file turns
+ * into random I/O. The extents are taken from FSCTL_GET_RETRIEVAL_POINTERS,
+ * which only reports allocated clusters, so holes are never touched. The file
+ * is walked in windows of allocated data and every window whose physically
+ * contiguous pieces are small on average is moved with FSCTL_MOVE_FILE into a
+ * single free run of the volume, each extent directly following the previous
+ * one. FSCTL_MOVE_FILE is the defragmentation interface: the data stays
+ * consistent for other handles while it moves, but it needs a handle to the
+ * volume and so administrative rights. */
+
+/* Allocated data considered together when deciding whether to move it. */
+#define COMPACT_WINDOW_SIZE         (64 * 1024 * 1024)
+/* Windows are moved when their contiguous pieces average less than this. */
+#define COMPACT_MIN_PIECE_SIZE      (4 * 1024 * 1024)
+/* Volume bitmap bytes read at once while looking for free space. */
+#define COMPACT_BITMAP_BUFFER_SIZE  (1024 * 1024)
+/* Retrieval pointer extents read at once. */
+#define COMPACT_EXTENTS_PER_READ    1024
+
+#define FILE_EXTENTS_INITIAL_SIZE   1024
+
+typedef struct FILE_EXTENT {
+	UINT64      Vcn;
+	UINT64      Lcn;
+	UINT64      Count;
+} FILE_EXTENT, *PFILE_EXTENT;
+
+
+/* Read the allocated extents of File. Extents that continue each other both
+ * in the file and on the volume are merged. */
+static DWORD
+GetFileExtents(
+	_In_        HANDLE          File,
+	_Outptr_result_maybenull_
+	            PFILE_EXTENT    *Extents,
+	_Out_       SIZE_T          *NumExtents
+	)
+{
+	STARTING_VCN_INPUT_BUFFER   in;
+	PRETRIEVAL_POINTERS_BUFFER  out;
+	PFILE_EXTENT                extents, newExtents, last;
+	SIZE_T                      numExtents, size;
+	UINT64                      vcn;
+	DWORD                       outSize, bytes, i, err;
+
+	*Extents = NULL;
+	*NumExtents = 0;
+
+	extents = NULL;
+	numExtents = 0;
+	size = 0;
+
+	outSize = FIELD_OFFSET(RETRIEVAL_POINTERS_BUFFER, Extents)
+	        + COMPACT_EXTENTS_PER_READ * sizeof(out->Extents[0]);
+	out = malloc(outSize);
+	if (NULL == out)
+		return ERROR_NOT_ENOUGH_MEMORY;
+
+	in.StartingVcn.QuadPart = 0;
+	do {
+		err = DeviceIoControlSync(File,
+		                          FSCTL_GET_RETRIEVAL_POINTERS,
+		                          &in,
+		                          sizeof(in),
+		                          out,
+		                          outSize,
+		                          &bytes);
+		/* Files without any allocated clusters have nothing to report. */
+		if (ERROR_HANDLE_EOF == err) {
+			err = ERROR_SUCCESS;
+			break;
+		}
+		if (ERROR_SUCCESS != err && ERROR_MORE_DATA != err)
+			goto error_return;
+		if (0 == out->ExtentCount)
+			break;
+
+		vcn = out->StartingVcn.QuadPart;
+		for (i = 0; i < out->ExtentCount; ++i) {
+			/* Holes, and the compressed remainder of compression units,
+			 * report an LCN of -1. */
+			if (-1 != out->Extents[i].Lcn.QuadPart) {
+				last = numExtents ? &extents[numExtents - 1] : NULL;
+				if (last && last->Vcn + last->Count == vcn
+				    && last->Lcn + last->Count == (UINT64)out->Extents[i].Lcn.QuadPart) {
+					last->Count += out->Extents[i].NextVcn.QuadPart - vcn;
+				} else {
+					if (numExtents == size) {
+						size = size ? size * 2 : FILE_EXTENTS_INITIAL_SIZE;
+						newExtents = realloc(extents, size * sizeof(*extents));
+						if (NULL == newExtents) {
+							err = ERROR_NOT_ENOUGH_MEMORY;
+							goto error_return;
+						}
+						extents = newExtents;
+					}
+					extents[numExtents].Vcn   = vcn;
+					extents[numExtents].Lcn   = out->Extents[i].Lcn.QuadPart;
+					extents[numExtents].Count = out->Extents[i].NextVcn.QuadPart - vcn;
+					numExtents++;
+				}
+			}
+			vcn = out->Extents[i].NextVcn.QuadPart;
+		}
+		in.StartingVcn.QuadPart = vcn;
+	} while (ERROR_MORE_DATA == err);
+
+	free(out);
+	*Extents = extents;
+	*NumExtents = numExtents;
+	return ERROR_SUCCESS;
+
+error_return:
+	free(out);
+	free(extents);
+	return err;
+}
+
+
+/* Number of extents that do not start where the previous one ends on the
+ * volume. Each of them costs a sequential reader a seek. */
+static UINT64
+CountFragments(
+	_In_reads_(NumExtents)
+	            const FILE_EXTENT   *Extents,
+	_In_        SIZE_T              NumExtents
+	)
+{
+	UINT64  fragments;
+	SIZE_T  i;
+
+	fragments = NumExtents ? 1 : 0;
+	for (i = 1; i < NumExtents; ++i) {
+		if (Extents[i - 1].Lcn + Extents[i - 1].Count != Extents[i].Lcn)
+			fragments++;
+	}
+	return fragments;
+}
+
+
+/* Look for Count free clusters in a row in [From, To) of the volume. Returns
+ * ERROR_DISK_FULL if there are none. */
+static DWORD
+SearchFreeRun(
+	_In_        HANDLE                  Volume,
+	_Out_writes_bytes_(COMPACT_BITMAP_BUFFER_SIZE)
+	            PVOLUME_BITMAP_BUFFER   Bitmap,
+	_In_        UINT64                  From,
+	_In_        UINT64                  To,
+	_In_        UINT64                  Count,
+	_Out_       UINT64                  *Lcn
+	)
+{
+	STARTING_LCN_INPUT_BUFFER   in;
+	UINT64                      lcn, start, bits, i, runStart, runLength;
+	DWORD                       bytes, err;
+
+	runStart = From;
+	runLength = 0;
+
+	for (lcn = From; lcn < To; lcn = start + i) {
+		in.StartingLcn.QuadPart = lcn;
+		err = DeviceIoControlSync(Volume,
+		                          FSCTL_GET_VOLUME_BITMAP,
+		                          &in,
+		                          sizeof(in),
+		                          Bitmap,
+		                          COMPACT_BITMAP_BUFFER_SIZE,
+		                          &bytes);
+		if (ERROR_SUCCESS != err && ERROR_MORE_DATA != err)
+			return err;
+		if (bytes <= FIELD_OFFSET(VOLUME_BITMAP_BUFFER, Buffer))
+			break;
+
+		/* The returned bitmap starts on a byte boundary at or before lcn. */
+		start = Bitmap->StartingLcn.QuadPart;
+		bits = MIN((UINT64)Bitmap->BitmapSize.QuadPart,
+		           (UINT64)(bytes - FIELD_OFFSET(VOLUME_BITMAP_BUFFER, Buffer)) * 8);
+		bits = MIN(bits, To - start);
+
+		for (i = lcn - start; i < bits; ++i) {
+			if (!(i & 7) && i + 8 <= bits && 0xFF == Bitmap->Buffer[i >> 3]) {
+				runLength = 0;
+				i += 7;
+				continue;
+			}
+			if (Bitmap->Buffer[i >> 3] & (1 << (i & 7))) {
+				runLength = 0;
+				continue;
+			}
+			if (0 == runLength)
+				runStart = start + i;
+			if (++runLength == Count) {
+				*Lcn = runStart;
+				return ERROR_SUCCESS;
+			}
+		}
+
+		if (ERROR_MORE_DATA != err)
+			break;
+	}
+
+	return ERROR_DISK_FULL;
+}
+
+
+/* Find Count free clusters in a row, preferring the part of the volume after
+ * Hint so the data stays near where it was. */
+static DWORD
+FindFreeRun(
+	_In_        HANDLE                  Volume,
+	_Out_writes_bytes_(COMPACT_BITMAP_BUFFER_SIZE)
+	            PVOLUME_BITMAP_BUFFER   Bitmap,
+	_In_        UINT64                  Hint,
+	_In_        UINT64                  Count,
+	_Out_       UINT64                  *Lcn
+	)
+{
+	DWORD err;
+
+	err = SearchFreeRun(Volume, Bitmap, Hint, UINT64_MAX, Count, Lcn);
+	if (ERROR_DISK_FULL == err && Hint)
+		err = SearchFreeRun(Volume, Bitmap, 0, Hint, Count, Lcn);
+	return err;
+}
+
+
+/* Open the volume Path lives on for the defragmentation requests. */
+static DWORD
+OpenVolumeOf(
+	_In_        LPCWSTR     Path,
+	_Out_       HANDLE      *Volume
+	)
+{
+	WCHAR   mountPoint[MAX_PATH];
+	WCHAR   volumeName[MAX_PATH];
+	size_t  len;
+
+	*Volume = NULL;
+
+	if (!GetVolumePathNameW(Path, mountPoint, ARRAYSIZE(mountPoint))
+	    || !GetVolumeNameForVolumeMountPointW(mountPoint, volumeName,
+	                                          ARRAYSIZE(volumeName)))
+		return GetLastError();
+
+	/* The volume device itself, not its root directory. */
+	len = wcslen(volumeName);
+	if (len && L'\\' == volumeName[len - 1])
+		volumeName[len - 1] = L'\0';
+
+	*Volume = CreateFileW(volumeName,
+	                      GENERIC_READ,
+	                      FILE_SHARE_READ | FILE_SHARE_WRITE,
+	                      NULL,
+	                      OPEN_EXISTING,
+	                      0,
+	                      NULL);
+	if (INVALID_HANDLE_VALUE == *Volume) {
+		*Volume = NULL;
+		return GetLastError();
+	}
+
+	return ERROR_SUCCESS;
+}
+
+
+/* Move the extents [First, End) back to back into free space. */
+static DWORD
+MoveWindow(
+	_In_        HANDLE                  Volume,
+	_In_        HANDLE                  File,
+	_Out_writes_bytes_(COMPACT_BITMAP_BUFFER_SIZE)
+	            PVOLUME_BITMAP_BUFFER   Bitmap,
+	_In_reads_(End)
+	            const FILE_EXTENT       *Extents,
+	_In_        SIZE_T                  First,
+	_In_        SIZE_T                  End,
+	_In_        UINT64                  Clusters,
+	_In_        SIZE_T                  ClusterSize
+	)
+{
+	MOVE_FILE_DATA  move;
+	UINT64          lcn, moved, count;
+	SIZE_T          i;
+	DWORD           err;
+
+	err = FindFreeRun(Volume, Bitmap, Extents[First].Lcn, Clusters, &lcn);
+	if (ERROR_SUCCESS != err)
+		return err;
+
+	for (i = First; i < End; ++i) {
+		/* ClusterCount is a DWORD. */
+		for (moved = 0; moved < Extents[i].Count; moved += count) {
+			count = MIN(Extents[i].Count - moved, MAXDWORD);
+			QosThrottle(QosClassWrite, count * ClusterSize);
+
+			memset(&move, 0, sizeof(move));
+			move.FileHandle = File;
+			move.StartingVcn.QuadPart = Extents[i].Vcn + moved;
+			move.StartingLcn.QuadPart = lcn;
+			move.ClusterCount = (DWORD)count;
+			err = DeviceIoControlSync(Volume,
+			                          FSCTL_MOVE_FILE,
+			                          &move,
+			                          sizeof(move),
+			                          NULL,
+			                          0,
+			                          NULL);
+			if (ERROR_SUCCESS != err)
+				return err;
+			lcn += count;
+		}
+	}
+
+	return ERROR_SUCCESS;
+}
+
+
+_Use_decl_annotations_
+DWORD
+CompactFile(
+	HANDLE          File,
+	LPCWSTR         Path,
+	SIZE_T          ClusterSize,
+	UINT64          Budget,
+	PCOMPACT_STATS  Stats
+	)
+{
+	PVOLUME_BITMAP_BUFFER   bitmap;
+	PFILE_EXTENT            extents;
+	SIZE_T                  numExtents, first, end;
+	UINT64                  windowClusters, clusters, pieces, budgetClusters;
+	HANDLE                  volume;
+	DWORD                   err;
+
+	memset(Stats, 0, sizeof(*Stats));
+	bitmap = NULL;
+	extents = NULL;
+	volume = NULL;
+
+	err = GetFileExtents(File, &extents, &numExtents);
+	if (ERROR_SUCCESS != err) {
+		LogError(L"Failed FSCTL_GET_RETRIEVAL_POINTERS on %s with error %#llx\n",
+		         Path, (long long)err);
+		goto func_return;
+	}
+	Stats->ExtentsBefore = numExtents;
+	Stats->FragmentsBefore = CountFragments(extents, numExtents);
+
+	err = OpenVolumeOf(Path, &volume);
+	if (ERROR_SUCCESS != err) {
+		LogError(L"Failed to open the volume of %s with error %#llx\n",
+		         Path, (long long)err);
+		goto func_return;
+	}
+
+	bitmap = malloc(COMPACT_BITMAP_BUFFER_SIZE);
+	if (NULL == bitmap) {
+		err = ERROR_NOT_ENOUGH_MEMORY;
+		goto func_return;
+	}
+
+	windowClusters = MAX(COMPACT_WINDOW_SIZE / ClusterSize, 1);
+	budgetClusters = Budget / ClusterSize;
+
+	for (first = 0; first < numExtents; first = end) {
+		clusters = 0;
+		for (end = first; end < numExtents && clusters < windowClusters; ++end)
+			clusters += extents[end].Count;
+
+		pieces = CountFragments(extents + first, end - first);
+		if (pieces < 2 || clusters * ClusterSize / pieces >= COMPACT_MIN_PIECE_SIZE)
+			continue;
+
+		if (clusters > budgetClusters) {
+			LogInfo(L"Compaction budget used up.\n");
+			break;
+		}
+
+		err = MoveWindow(volume, File, bitmap, extents, first, end, clusters, ClusterSize);
+		if (ERROR_SUCCESS != err) {
+			/* The window stays as it was, or partly moved, which is just as
+			 * valid. Free space may simply have been taken meanwhile. */
+			if (0 == Stats->RegionsFailed) {
+				LogError(L"WARNING: Failed to move data of %s with error %#llx\n",
+				         Path, (long long)err);
+			}
+			Stats->RegionsFailed++;
+			/* Without the privilege nothing is going to move. */
+			if (ERROR_PRIVILEGE_NOT_HELD == err)
+				goto func_return;
+			continue;
+		}
+
+		Stats->RegionsCompacted++;
+		Stats->BytesMoved += clusters * ClusterSize;
+		budgetClusters -= clusters;
+	}
+
+	free(extents);
+	err = GetFileExtents(File, &extents, &numExtents);
+	if (ERROR_SUCCESS != err) {
+		LogError(L"Failed FSCTL_GET_RETRIEVAL_POINTERS on %s with error %#llx\n",
+		         Path, (long long)err);
+		goto func_return;
+	}
+	Stats->ExtentsAfter = numExtents;
+	Stats->FragmentsAfter = CountFragments(extents, numExtents);
+
+func_return:
+	if (volume)
+		(void)CloseHandle(volume);
+	free(bitmap);
+	free(extents);
+	return err;
+}
@@ -0,0 +1,516 @@
+/* Standard BSD license disclaimer.
+
+Copyright(c) 2016-2021, Lance D. Stringham
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "targetver.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <wctype.h>
+#include <errno.h>
+
+#include "MakeSparse.h"
+
+/* Deadline mode.
+ *
+ * The file is split into regions. Each region's yield is estimated cheaply:
+ * clusters that are already holes are known from the allocation query, and a
+ * few evenly spaced samples of the allocated part give the share of zeros.
+ * Regions are then analyzed and deallocated one at a time, best estimate
+ * first, so whatever the deadline cuts off is the least promising part.
+ *
+ * A region is only started if, at the rate seen so far, it will finish in
+ * time. Finished regions are recorded in a progress file next to the target
+ * so the next run continues with the rest; once every region is done the
+ * file is removed and the run after that starts over. */
+
+/* A multiple of the view size and of SPARSE_MAP_RANGE_ALIGNMENT. */
+#define DEADLINE_REGION_SIZE        (256ull * 1024 * 1024)
+#define DEADLINE_SAMPLE_SIZE        (64 * 1024)
+#define DEADLINE_SAMPLES_PER_REGION 8
+/* Sampling may take at most this part of the time budget, as a divisor.
+ * Regions not sampled by then are assumed to be like the average. */
+#define DEADLINE_SAMPLING_SHARE     10
+/* Progress is saved at least this often while regions are processed. */
+#define DEADLINE_SAVE_INTERVAL_MS   (30 * 1000)
+
+#define DEADLINE_PROGRESS_VERSION   1
+#define DEADLINE_LINE_MAX           128
+
+typedef struct DEADLINE_REGION {
+	UINT64      Offset;
+	UINT64      Length;
+	UINT64      AllocatedBytes;
+	UINT64      ExpectedBytes;
+	BOOL        Sampled;
+	BOOL        Done;
+} DEADLINE_REGION, *PDEADLINE_REGION;
+
+
+static int __cdecl
+CompareExpectedDescending(
+	_In_        const void  *A,
+	_In_        const void  *B
+	)
+{
+	const DEADLINE_REGION *a = A, *b = B;
+
+	if (a->ExpectedBytes != b->ExpectedBytes)
+		return (a->ExpectedBytes > b->ExpectedBytes) ? -1 : 1;
+	if (a->Offset < b->Offset)
+		return -1;
+	return (a->Offset > b->Offset);
+}
+
+
+static int __cdecl
+CompareOffset(
+	_In_        const void  *A,
+	_In_        const void  *B
+	)
+{
+	const DEADLINE_REGION *a = A, *b = B;
+
+	if (a->Offset < b->Offset)
+		return -1;
+	return (a->Offset > b->Offset);
+}
+
+
+/* Bytes of the clusters [First, End) that have storage allocated. */
+static UINT64
+AllocatedBytes(
+	_In_        const TARGET_FILE   *Target,
+	_In_        UINT64              First,
+	_In_        UINT64              End
+	)
+{
+	UINT64 cluster, runEnd, unallocated;
+
+	if (NULL == Target->PunchMap)
+		return (End - First) * Target->ClusterSize;
+
+	unallocated = 0;
+	for (cluster = First; cluster < End; cluster = runEnd) {
+		runEnd = MIN(ClusterMapRunEnd(Target->PunchMap, cluster), End);
+		if (ClusterMapIsMarkedZero(Target->PunchMap, cluster))
+			unallocated += runEnd - cluster;
+	}
+	return (End - First - unallocated) * Target->ClusterSize;
+}
+
+
+/* Read the samples of Region and count its allocated clusters that hold only
+ * zeros. Holes are left out of both counts. */
+static DWORD
+SampleRegion(
+	_In_        const TARGET_FILE   *Target,
+	_In_        const DEADLINE_REGION *Region,
+	_Out_writes_bytes_(DEADLINE_SAMPLE_SIZE)
+	            PBYTE               Buffer,
+	_Out_       UINT64              *ClustersSampled,
+	_Out_       UINT64              *ClustersZero
+	)
+{
+	UINT64  offset, cluster;
+	DWORD   bytes, pos, length, i;
+	DWORD   errRet;
+
+	*ClustersSampled = *ClustersZero = 0;
+
+	for (i = 0; i < DEADLINE_SAMPLES_PER_REGION; ++i) {
+		offset = Region->Offset
+		         + ((Region->Length / DEADLINE_SAMPLES_PER_REGION * i)
+		            & ~(UINT64)(DEADLINE_SAMPLE_SIZE - 1));
+		QosThrottle(QosClassRead, DEADLINE_SAMPLE_SIZE);
+		errRet = ReadFileSync(Target->Handle, offset, Buffer, DEADLINE_SAMPLE_SIZE, &bytes);
+		if (ERROR_SUCCESS != errRet)
+			return errRet;
+
+		for (pos = 0; pos < bytes; pos += length) {
+			length = (DWORD)MIN(Target->ClusterSize, bytes - pos);
+			cluster = (offset + pos) / Target->ClusterSize;
+			if (Target->PunchMap && ClusterMapIsMarkedZero(Target->PunchMap, cluster))
+				continue;
+			(*ClustersSampled)++;
+			if (IsZeroBuf(Buffer + pos, length))
+				(*ClustersZero)++;
+		}
+	}
+
+	return ERROR_SUCCESS;
+}
+
+
+static LPWSTR
+ProgressPath(
+	_In_z_      LPCWSTR     Path
+	)
+{
+	LPWSTR  progressPath;
+	SIZE_T  size;
+
+	size = wcslen(Path) + ARRAYSIZE(DEADLINE_PROGRESS_SUFFIX);
+	progressPath = malloc(size * sizeof(*progressPath));
+	if (progressPath)
+		(void)swprintf_s(progressPath, size, L"%s%s", Path, DEADLINE_PROGRESS_SUFFIX);
+	return progressPath;
+}
+
+
+/* Mark the regions an earlier run finished. Regions is in file order. A
+ * progress file for a different file size or region size is ignored. */
+static void
+LoadProgress(
+	_In_z_      LPCWSTR             ProgressFile,
+	_In_        const TARGET_FILE   *Target,
+	_Inout_updates_(NumRegions)
+	            PDEADLINE_REGION    Regions,
+	_In_        SIZE_T              NumRegions,
+	_Out_       SIZE_T              *NumDone
+	)
+{
+	WCHAR   line[DEADLINE_LINE_MAX];
+	WCHAR   *key, *value, *end;
+	FILE    *fp;
+	UINT64  version, fileSize, regionSize, offset, length;
+	SIZE_T  i;
+	BOOL    valid;
+
+	*NumDone = 0;
+	version = fileSize = regionSize = 0;
+
+	fp = _wfopen(ProgressFile, L"rt, ccs=UTF-8");
+	if (NULL == fp)
+		return;
+
+	valid = TRUE;
+	while (valid && fgetws(line, DEADLINE_LINE_MAX, fp)) {
+		key = line;
+		while (iswspace(*key))
+			++key;
+		end = key + wcslen(key);
+		while (end > key && iswspace(*(end - 1)))
+			*--end = L'\0';
+		if (L'\0' == *key || L'#' == *key)
+			continue;
+
+		value = wcschr(key, L'=');
+		valid = FALSE;
+		if (NULL == value)
+			break;
+		*value++ = L'\0';
+		for (end = value - 1; end > key && iswspace(*(end - 1)); --end)
+			*(end - 1) = L'\0';
+		while (iswspace(*value))
+			++value;
+
+		if (!wcscmp(key, L"done")) {
+			/* Only trusted once the header has been checked. */
+			if (DEADLINE_PROGRESS_VERSION != version
+			    || Target->FileSize != fileSize || DEADLINE_REGION_SIZE != regionSize)
+				break;
+			errno = 0;
+			offset = _wcstoui64(value, &end, 10);
+			if (end == value || !iswspace(*end) || ERANGE == errno)
+				break;
+			value = end;
+			length = _wcstoui64(value, &end, 10);
+			if (end == value || L'\0' != *end || ERANGE == errno)
+				break;
+			/* Regions are in file order and done runs cover whole ones. */
+			for (i = 0; i < NumRegions; ++i) {
+				if (Regions[i].Offset >= offset
+				    && Regions[i].Offset - offset < length
+				    && !Regions[i].Done) {
+					Regions[i].Done = TRUE;
+					(*NumDone)++;
+				}
+			}
+			valid = TRUE;
+		} else if (!wcscmp(key, L"version")) {
+			valid = ParseSizeArg(value, &version);
+		} else if (!wcscmp(key, L"file_size")) {
+			valid = ParseSizeArg(value, &fileSize);
+		} else if (!wcscmp(key, L"region_size")) {
+			valid = ParseSizeArg(value, &regionSize);
+		}
+	}
+	(void)fclose(fp);
+
+	if (!valid) {
+		LogInfo(L"Ignoring progress file %s; it is damaged or was written for "
+		        L"another file size.\n", ProgressFile);
+		for (i = 0; i < NumRegions; ++i)
+			Regions[i].Done = FALSE;
+		*NumDone = 0;
+	}
+}
+
+
+/* Record the finished regions, joining neighbours into one line. Regions is
+ * in file order. */
+static DWORD
+SaveProgress(
+	_In_z_      LPCWSTR             ProgressFile,
+	_In_        const TARGET_FILE   *Target,
+	_In_reads_(NumRegions)
+	            const DEADLINE_REGION *Regions,
+	_In_        SIZE_T              NumRegions
+	)
+{
+	FILE    *fp;
+	UINT64  start, end;
+	SIZE_T  i;
+	DWORD   errRet;
+
+	fp = _wfopen(ProgressFile, L"wt, ccs=UTF-8");
+	if (NULL == fp)
+		return (ENOENT == errno) ? ERROR_PATH_NOT_FOUND : ERROR_OPEN_FAILED;
+
+	fwprintf(fp, L"version = %d\n", DEADLINE_PROGRESS_VERSION);
+	fwprintf(fp, L"file_size = %llu\n", Target->FileSize);
+	fwprintf(fp, L"region_size = %llu\n", DEADLINE_REGION_SIZE);
+
+	for (i = 0; i < NumRegions; ) {
+		if (!Regions[i].Done) {
+			++i;
+			continue;
+		}
+		start = Regions[i].Offset;
+		end = start;
+		for (; i < NumRegions && Regions[i].Done && Regions[i].Offset == end; ++i)
+			end += Regions[i].Length;
+		fwprintf(fp, L"done = %llu %llu\n", start, end - start);
+	}
+
+	errRet = ferror(fp) ? ERROR_WRITE_FAULT : ERROR_SUCCESS;
+	if (0 != fclose(fp) && ERROR_SUCCESS == errRet)
+		errRet = ERROR_WRITE_FAULT;
+	return errRet;
+}
+
+
+_Use_decl_annotations_
+BOOL
+DeadlineIsProgressFile(
+	LPCWSTR     Path
+	)
+{
+	SIZE_T len, suffixLen;
+
+	len = wcslen(Path);
+	suffixLen = ARRAYSIZE(DEADLINE_PROGRESS_SUFFIX) - 1;
+	return len >= suffixLen && !_wcsicmp(Path + len - suffixLen, DEADLINE_PROGRESS_SUFFIX);
+}
+
+
+_Use_decl_annotations_
+DWORD
+DeadlineSparseRanges(
+	const MAKESPARSE_OPTIONS    *Options,
+	PTARGET_FILE                Target
+	)
+{
+	PDEADLINE_REGION    regions, region;
+	LPWSTR              progressFile;
+	PBYTE               sample;
+	SIZE_T              numRegions, numDone, numProcessed, i;
+	UINT64              budgetMs, startQPCVal, lastSaveQPCVal, elapsedMs, scanMs;
+	UINT64              sampledTotal, zeroTotal, sampled, zero, cs;
+	UINT64              expectedAll, expectedDone, bytesDone, bytesScanned, zeroedBefore;
+	DWORD               errRet, saveErr;
+
+	startQPCVal = GetQPCVal();
+	budgetMs = (UINT64)Options->DeadlineSeconds * 1000;
+	cs = Target->ClusterSize;
+
+	regions = NULL;
+	sample = NULL;
+	progressFile = NULL;
+	errRet = ERROR_SUCCESS;
+
+	numRegions = (SIZE_T)((Target->FileSize + DEADLINE_REGION_SIZE - 1) / DEADLINE_REGION_SIZE);
+	if (0 == numRegions)
+		return ERROR_SUCCESS;
+
+	regions = calloc(numRegions, sizeof(*regions));
+	sample = malloc(DEADLINE_SAMPLE_SIZE);
+	progressFile = ProgressPath(Target->Path);
+	if (NULL == regions || NULL == sample || NULL == progressFile) {
+		errRet = ERROR_NOT_ENOUGH_MEMORY;
+		LogError(L"Failed to allocate deadline regions\n");
+		goto func_return;
+	}
+
+	for (i = 0; i < numRegions; ++i) {
+		regions[i].Offset = i * DEADLINE_REGION_SIZE;
+		regions[i].Length = MIN(DEADLINE_REGION_SIZE, Target->FileSize - regions[i].Offset);
+	}
+	LoadProgress(progressFile, Target, regions, numRegions, &numDone);
+	if (numDone) {
+		LogInfo(L"Continuing from %s: %llu of %llu regions already done.\n",
+		        progressFile, (UINT64)numDone, (UINT64)numRegions);
+	}
+
+	/* Estimate. Regions without allocated clusters have nothing to give. */
+	sampledTotal = zeroTotal = 0;
+	for (i = 0; i < numRegions; ++i) {
+		region = &regions[i];
+		if (region->Done)
+			continue;
+		region->AllocatedBytes = AllocatedBytes(Target,
+		                                        region->Offset / cs,
+		                                        (region->Offset + region->Length + cs - 1) / cs);
+		if (0 == region->AllocatedBytes
+		    || ElapsedQPCInMillisec(startQPCVal, GetQPCVal()) > budgetMs / DEADLINE_SAMPLING_SHARE)
+			continue;
+
+		errRet = SampleRegion(Target, region, sample, &sampled, &zero);
+		if (ERROR_SUCCESS != errRet) {
+			LogError(L"Failed to sample %s at offset %llu with error %#llx\n",
+			         Target->Path, region->Offset, (long long)errRet);
+			goto func_return;
+		}
+		if (sampled) {
+			region->ExpectedBytes = region->AllocatedBytes * zero / sampled;
+			region->Sampled = TRUE;
+		}
+		sampledTotal += sampled;
+		zeroTotal += zero;
+	}
+
+	expectedAll = 0;
+	for (i = 0; i < numRegions; ++i) {
+		region = &regions[i];
+		if (!region->Done && region->AllocatedBytes && !region->Sampled && sampledTotal)
+			region->ExpectedBytes = region->AllocatedBytes * zeroTotal / sampledTotal;
+		if (!region->Done)
+			expectedAll += region->ExpectedBytes;
+	}
+
+	LogInfo(L"Estimated %8.2f MiB reclaimable in %llu regions; sampled %llu clusters "
+	        L"in %llu ms.\n",
+	        (double)expectedAll / 1048576.0, (UINT64)(numRegions - numDone),
+	        sampledTotal, ElapsedQPCInMillisec(startQPCVal, GetQPCVal()));
+
+	qsort(regions, numRegions, sizeof(*regions), CompareExpectedDescending);
+
+	/* Work through the regions while the budget lasts. */
+	numProcessed = 0;
+	expectedDone = bytesDone = bytesScanned = scanMs = 0;
+	zeroedBefore = Target->DispatchStats.BytesZeroed;
+	lastSaveQPCVal = GetQPCVal();
+	for (i = 0; i < numRegions; ++i) {
+		region = &regions[i];
+		if (region->Done)
+			continue;
+
+		/* Nothing allocated, nothing to do, and no time needed for it. */
+		if (0 == region->AllocatedBytes) {
+			region->Done = TRUE;
+			continue;
+		}
+
+		elapsedMs = ElapsedQPCInMillisec(startQPCVal, GetQPCVal());
+		if (elapsedMs >= budgetMs
+		    || (bytesScanned
+		        && elapsedMs + region->Length * scanMs / bytesScanned > budgetMs))
+			break;
+
+		errRet = TargetFileScan(Target, region->Offset, region->Length, NULL);
+		if (ERROR_SUCCESS != errRet) {
+			LogError(L"Failed to analyze %s at offset %llu with error %#llx\n",
+			         Target->Path, region->Offset, (long long)errRet);
+			break;
+		}
+		errRet = TargetFileDeallocateRange(Options, Target,
+		                                   region->Offset / cs,
+		                                   (region->Offset + region->Length + cs - 1) / cs);
+		if (ERROR_SUCCESS != errRet)
+			break;
+
+		region->Done = TRUE;
+		numProcessed++;
+		expectedDone += region->ExpectedBytes;
+		bytesDone += region->Length;
+		bytesScanned += region->Length;
+		scanMs += ElapsedQPCInMillisec(startQPCVal, GetQPCVal()) - elapsedMs;
+
+		if (ElapsedQPCInMillisec(lastSaveQPCVal, GetQPCVal()) >= DEADLINE_SAVE_INTERVAL_MS) {
+			qsort(regions, numRegions, sizeof(*regions), CompareOffset);
+			(void)SaveProgress(progressFile, Target, regions, numRegions);
+			qsort(regions, numRegions, sizeof(*regions), CompareExpectedDescending);
+			lastSaveQPCVal = GetQPCVal();
+		}
+	}
+
+	LogInfo(L"Processed %llu regions covering %8.2f MiB in %llu seconds. Reclaimed "
+	        L"%8.2f MiB against %8.2f MiB expected from them; %8.2f MiB expected "
+	        L"remain.\n",
+	        (UINT64)numProcessed, (double)bytesDone / 1048576.0,
+	        ElapsedQPCInSeconds(startQPCVal, GetQPCVal()),
+	        (double)(Target->DispatchStats.BytesZeroed - zeroedBefore) / 1048576.0,
+	        (double)expectedDone / 1048576.0,
+	        (double)(expectedAll - expectedDone) / 1048576.0);
+
+	/* Record where we stopped, or start over next time once all is done. */
+	numDone = 0;
+	for (i = 0; i < numRegions; ++i)
+		numDone += regions[i].Done;
+	if (numDone == numRegions) {
+		LogInfo(L"Every region is done.\n");
+		if (!DeleteFileW(progressFile) && ERROR_FILE_NOT_FOUND != GetLastError()) {
+			LogError(L"WARNING: Failed to delete progress file %s with error %#llx\n",
+			         progressFile, (long long)GetLastError());
+		}
+	} else {
+		qsort(regions, numRegions, sizeof(*regions), CompareOffset);
+		saveErr = SaveProgress(progressFile, Target, regions, numRegions);
+		if (ERROR_SUCCESS != saveErr) {
+			LogError(L"WARNING: Failed to save progress file %s with error %#llx\n",
+			         progressFile, (long long)saveErr);
+		} else {
+			LogInfo(L"Stopped with %llu regions left, recorded in %s.\n",
+			        (UINT64)(numRegions - numDone), progressFile);
+		}
+	}
+
+func_return:
+	free(progressFile);
+	free(sample);
+	free(regions);
+	return errRet;
+}
@@ -0,0 +1,548 @@
+/* Standard BSD license disclaimer.
+
+Copyright(c) 2016-2021, Lance D. Stringham
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "targetver.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <assert.h>
+
+#include "MakeSparse.h"
+
+/* Guest file system awareness for raw disk images.
+ *
+ * The partition table of the image is read (MBR or GPT, or none for an image
+ * of a bare file system) and every partition holding an ext2/3/4 file system
+ * has its block group bitmaps read. Blocks the guest has not allocated hold
+ * nothing it will ever read back, so they can be deallocated like zeros
+ * whatever stale data they contain. Only whole host clusters of free guest
+ * blocks are reported.
+ *
+ * Anything unexpected makes a file system count as fully used rather than
+ * risk deallocating live guest data: a journal needing recovery, an unclean
+ * state, the meta_bg and bigalloc layouts, and groups whose bitmap was never
+ * initialized. */
+
+#define GUEST_SECTOR_SIZE           512
+
+/* Sector sizes a GPT header is looked for with. */
+static const DWORD GptSectorSizes[] = { 512, 4096 };
+
+#define MBR_SIGNATURE_OFFSET        510
+#define MBR_PARTITION_TABLE_OFFSET  446
+#define MBR_PARTITION_COUNT         4
+#define MBR_PARTITION_ENTRY_SIZE    16
+#define MBR_TYPE_EXTENDED_CHS       0x05
+#define MBR_TYPE_EXTENDED_LBA       0x0F
+#define MBR_TYPE_GPT_PROTECTIVE     0xEE
+
+#define GPT_SIGNATURE               "EFI PART"
+/* More partition entry bytes than any sane table has. */
+#define GPT_MAX_ENTRY_BYTES         (1024 * 1024)
+
+#define EXT4_SUPERBLOCK_OFFSET      1024
+#define EXT4_SUPERBLOCK_SIZE        1024
+#define EXT4_MAGIC                  0xEF53
+#define EXT4_VALID_FS               0x0001
+#define EXT4_ERROR_FS               0x0002
+#define EXT4_INCOMPAT_RECOVER       0x00000004
+#define EXT4_INCOMPAT_META_BG       0x00000010
+#define EXT4_INCOMPAT_64BIT         0x00000080
+#define EXT4_RO_COMPAT_GDT_CSUM     0x00000010
+#define EXT4_RO_COMPAT_BIGALLOC     0x00000200
+#define EXT4_RO_COMPAT_METADATA_CSUM 0x00000400
+#define EXT4_BG_BLOCK_UNINIT        0x0002
+#define EXT4_MIN_DESC_SIZE          32
+#define EXT4_MIN_DESC_SIZE_64BIT    64
+#define EXT4_MAX_DESC_SIZE          1024
+
+/* Group descriptors read at once. */
+#define GUEST_DESC_BUFFER_SIZE      (64 * 1024)
+/* Largest ext4 block size. */
+#define EXT4_MAX_BLOCK_SIZE         (64 * 1024)
+
+#define FREE_RUNS_INITIAL_SIZE      1024
+
+typedef struct GUEST_SCAN {
+	HANDLE          File;
+	UINT64          FileSize;
+	SIZE_T          ClusterSize;
+	/* Free byte range waiting to be extended by an adjacent one. */
+	UINT64          PendingStart;
+	UINT64          PendingEnd;
+	PCLUSTER_RUN    Runs;
+	SIZE_T          NumRuns;
+	SIZE_T          RunsSize;
+	BYTE            *Buffer;
+} GUEST_SCAN, *PGUEST_SCAN;
+
+
+static UINT16
+GetLE16(
+	_In_        const BYTE  *Ptr
+	)
+{
+	return (UINT16)(Ptr[0] | (Ptr[1] << 8));
+}
+
+
+static UINT32
+GetLE32(
+	_In_        const BYTE  *Ptr
+	)
+{
+	return (UINT32)Ptr[0] | ((UINT32)Ptr[1] << 8)
+	     | ((UINT32)Ptr[2] << 16) | ((UINT32)Ptr[3] << 24);
+}
+
+
+static UINT64
+GetLE64(
+	_In_        const BYTE  *Ptr
+	)
+{
+	return (UINT64)GetLE32(Ptr) | ((UINT64)GetLE32(Ptr + 4) << 32);
+}
+
+
+/* Read exactly Size bytes at Offset. Running into the end of the image is
+ * reported as ERROR_HANDLE_EOF. */
+static DWORD
+ReadImage(
+	_In_        PGUEST_SCAN     Scan,
+	_In_        UINT64          Offset,
+	_Out_writes_bytes_(Size)
+	            PVOID           Buffer,
+	_In_        DWORD           Size
+	)
+{
+	DWORD   bytesRead, err;
+
+	err = ReadFileSync(Scan->File, Offset, Buffer, Size, &bytesRead);
+	if (ERROR_SUCCESS == err && bytesRead != Size)
+		err = ERROR_HANDLE_EOF;
+	return err;
+}
+
+
+/* Turn the pending byte range into the whole clusters it covers. */
+static DWORD
+FlushPendingRun(
+	_Inout_     PGUEST_SCAN     Scan
+	)
+{
+	PCLUSTER_RUN    newRuns;
+	SIZE_T          newSize;
+	UINT64          first, end;
+
+	first = (Scan->PendingStart + Scan->ClusterSize - 1) / Scan->ClusterSize;
+	/* The final cluster of the image only needs covering up to its end. */
+	if (Scan->PendingEnd >= Scan->FileSize)
+		end = (Scan->FileSize + Scan->ClusterSize - 1) / Scan->ClusterSize;
+	else
+		end = Scan->PendingEnd / Scan->ClusterSize;
+
+	Scan->PendingStart = Scan->PendingEnd = 0;
+
+	if (first >= end)
+		return ERROR_SUCCESS;
+
+	if (Scan->NumRuns == Scan->RunsSize) {
+		newSize = Scan->RunsSize ? Scan->RunsSize * 2 : FREE_RUNS_INITIAL_SIZE;
+		newRuns = realloc(Scan->Runs, newSize * sizeof(*newRuns));
+		if (NULL == newRuns)
+			return ERROR_NOT_ENOUGH_MEMORY;
+		Scan->Runs = newRuns;
+		Scan->RunsSize = newSize;
+	}
+
+	Scan->Runs[Scan->NumRuns].First = first;
+	Scan->Runs[Scan->NumRuns].End = end;
+	Scan->NumRuns++;
+	return ERROR_SUCCESS;
+}
+
+
+/* Record [Start, End) as free. Ranges must be added in increasing order. */
+static DWORD
+AddFreeRange(
+	_Inout_     PGUEST_SCAN     Scan,
+	_In_        UINT64          Start,
+	_In_        UINT64          End
+	)
+{
+	DWORD err;
+
+	if (Start == Scan->PendingEnd && Scan->PendingStart != Scan->PendingEnd) {
+		Scan->PendingEnd = End;
+		return ERROR_SUCCESS;
+	}
+
+	if (Scan->PendingStart != Scan->PendingEnd) {
+		err = FlushPendingRun(Scan);
+		if (ERROR_SUCCESS != err)
+			return err;
+	}
+
+	Scan->PendingStart = Start;
+	Scan->PendingEnd = End;
+	return ERROR_SUCCESS;
+}
+
+
+/* Add the free blocks of the ext2/3/4 file system starting at PartStart, if
+ * there is one. File systems that cannot be trusted are logged and skipped. */
+static DWORD
+ScanExt4(
+	_Inout_     PGUEST_SCAN     Scan,
+	_In_        UINT64          PartStart,
+	_In_        UINT64          PartEnd,
+	_Out_       UINT64          *FreeBytes
+	)
+{
+	BYTE    sb[EXT4_SUPERBLOCK_SIZE];
+	BYTE    *descs, *bitmap, *desc;
+	UINT64  blocksCount, firstDataBlock, numGroups, group, groupFirst, gdtOffset,
+	        bitmapBlock, bytesInBuffer, bufferOffset, blockOffset;
+	UINT32  blockSize, blocksPerGroup, groupBlocks, incompat, roCompat, b, run;
+	UINT16  state, flags, descSize;
+	BOOL    is64Bit, haveCsum;
+	DWORD   err;
+
+	*FreeBytes = 0;
+
+	if (PartEnd - PartStart < EXT4_SUPERBLOCK_OFFSET + EXT4_SUPERBLOCK_SIZE)
+		return ERROR_SUCCESS;
+
+	err = ReadImage(Scan, PartStart + EXT4_SUPERBLOCK_OFFSET, sb, sizeof(sb));
+	if (ERROR_HANDLE_EOF == err)
+		return ERROR_SUCCESS;
+	if (ERROR_SUCCESS != err)
+		return err;
+
+	if (EXT4_MAGIC != GetLE16(sb + 0x38))
+		return ERROR_SUCCESS;
+
+	firstDataBlock = GetLE32(sb + 0x14);
+	blocksPerGroup = GetLE32(sb + 0x20);
+	state          = GetLE16(sb + 0x3A);
+	incompat       = GetLE32(sb + 0x60);
+	roCompat       = GetLE32(sb + 0x64);
+	is64Bit        = 0 != (incompat & EXT4_INCOMPAT_64BIT);
+	haveCsum       = 0 != (roCompat & (EXT4_RO_COMPAT_GDT_CSUM | EXT4_RO_COMPAT_METADATA_CSUM));
+	blocksCount    = GetLE32(sb + 0x04);
+	if (is64Bit)
+		blocksCount |= (UINT64)GetLE32(sb + 0x150) << 32;
+	descSize = is64Bit ? GetLE16(sb + 0xFE) : EXT4_MIN_DESC_SIZE;
+
+	blockSize = 0;
+	if (GetLE32(sb + 0x18) <= 6)
+		blockSize = 1024u << GetLE32(sb + 0x18);
+
+	if (0 == blockSize
+	    || 0 == blocksPerGroup || blocksPerGroup > blockSize * 8
+	    || firstDataBlock >= blocksCount
+	    || descSize < (is64Bit ? EXT4_MIN_DESC_SIZE_64BIT : EXT4_MIN_DESC_SIZE)
+	    || descSize > EXT4_MAX_DESC_SIZE || (descSize & (descSize - 1))
+	    || blocksCount > (PartEnd - PartStart) / blockSize) {
+		LogInfo(L"Ignoring ext file system at offset 0x%016llX with an invalid "
+		        L"superblock.\n", PartStart);
+		return ERROR_SUCCESS;
+	}
+
+	if (!(state & EXT4_VALID_FS) || (state & EXT4_ERROR_FS)
+	    || (incompat & EXT4_INCOMPAT_RECOVER)) {
+		LogInfo(L"Ignoring ext file system at offset 0x%016llX: it was not cleanly "
+		        L"unmounted.\n", PartStart);
+		return ERROR_SUCCESS;
+	}
+
+	if ((incompat & EXT4_INCOMPAT_META_BG) || (roCompat & EXT4_RO_COMPAT_BIGALLOC)) {
+		LogInfo(L"Ignoring ext file system at offset 0x%016llX: meta_bg and "
+		        L"bigalloc are not supported.\n", PartStart);
+		return ERROR_SUCCESS;
+	}
+
+	numGroups = (blocksCount - firstDataBlock + blocksPerGroup - 1) / blocksPerGroup;
+	gdtOffset = PartStart + (firstDataBlock + 1) * blockSize;
+
+	descs = Scan->Buffer;
+	bitmap = Scan->Buffer + GUEST_DESC_BUFFER_SIZE;
+	bytesInBuffer = 0;
+	bufferOffset = 0;
+
+	for (group = 0; group < numGroups; ++group) {
+		if (bufferOffset == bytesInBuffer) {
+			bytesInBuffer = MIN(GUEST_DESC_BUFFER_SIZE, (numGroups - group) * descSize);
+			err = ReadImage(Scan, gdtOffset + group * descSize, descs, (DWORD)bytesInBuffer);
+			if (ERROR_SUCCESS != err)
+				goto read_failed;
+			bufferOffset = 0;
+		}
+		desc = descs + bufferOffset;
+		bufferOffset += descSize;
+
+		bitmapBlock = GetLE32(desc + 0x00);
+		if (is64Bit)
+			bitmapBlock |= (UINT64)GetLE32(desc + 0x20) << 32;
+		flags = GetLE16(desc + 0x12);
+
+		groupFirst  = firstDataBlock + group * blocksPerGroup;
+		groupBlocks = (UINT32)MIN(blocksPerGroup, blocksCount - groupFirst);
+
+		/* Without a checksum the flag cannot be trusted, and with one the
+		 * bitmap of an uninitialized group holds nothing useful. */
+		if ((haveCsum && (flags & EXT4_BG_BLOCK_UNINIT))
+		    || bitmapBlock < firstDataBlock || bitmapBlock >= blocksCount)
+			continue;
+
+		err = ReadImage(Scan, PartStart + bitmapBlock * blockSize, bitmap, blockSize);
+		if (ERROR_SUCCESS != err)
+			goto read_failed;
+
+		for (b = 0; b < groupBlocks; b += run) {
+			/* Whole bytes at a time where possible. */
+			if (!(b & 7) && b + 8 <= groupBlocks && (0x00 == bitmap[b >> 3] || 0xFF == bitmap[b >> 3]))
+				run = 8;
+			else
+				run = 1;
+			if (bitmap[b >> 3] & (1 << (b & 7)))
+				continue;
+
+			blockOffset = PartStart + (groupFirst + b) * blockSize;
+			err = AddFreeRange(Scan, blockOffset, blockOffset + (UINT64)run * blockSize);
+			if (ERROR_SUCCESS != err)
+				return err;
+			*FreeBytes += (UINT64)run * blockSize;
+		}
+	}
+
+	return ERROR_SUCCESS;
+
+read_failed:
+	LogError(L"Failed to read ext file system metadata at offset 0x%016llX with "
+	         L"error %#llx\n", PartStart, (long long)err);
+	return err;
+}
+
+
+typedef struct GUEST_PARTITION {
+	UINT64      Start;
+	UINT64      End;
+} GUEST_PARTITION, *PGUEST_PARTITION;
+
+static int __cdecl
+ComparePartitionStart(
+	_In_        const void  *A,
+	_In_        const void  *B
+	)
+{
+	const GUEST_PARTITION *a = A, *b = B;
+
+	if (a->Start < b->Start)
+		return -1;
+	return (a->Start > b->Start);
+}
+
+
+/* Fill Parts from the GPT of the image. Returns FALSE if there is none. */
+static BOOL
+ReadGpt(
+	_Inout_     PGUEST_SCAN         Scan,
+	_Out_writes_to_(MaxParts, *NumParts)
+	            PGUEST_PARTITION    Parts,
+	_In_        SIZE_T              MaxParts,
+	_Out_       SIZE_T              *NumParts
+	)
+{
+	BYTE    *entry;
+	UINT64  entriesLba, firstLba, lastLba;
+	UINT32  numEntries, entrySize, i, s;
+	DWORD   sectorSize, bytes;
+	int     j;
+
+	*NumParts = 0;
+
+	for (s = 0; s < ARRAYSIZE(GptSectorSizes); ++s) {
+		sectorSize = GptSectorSizes[s];
+		if (ERROR_SUCCESS != ReadImage(Scan, sectorSize, Scan->Buffer, GUEST_SECTOR_SIZE))
+			continue;
+		if (memcmp(Scan->Buffer, GPT_SIGNATURE, 8))
+			continue;
+
+		entriesLba = GetLE64(Scan->Buffer + 0x48);
+		numEntries = GetLE32(Scan->Buffer + 0x50);
+		entrySize  = GetLE32(Scan->Buffer + 0x54);
+		if (entrySize < 0x30 || (UINT64)numEntries * entrySize > GPT_MAX_ENTRY_BYTES)
+			return FALSE;
+
+		bytes = numEntries * entrySize;
+		if (ERROR_SUCCESS != ReadImage(Scan, entriesLba * sectorSize, Scan->Buffer, bytes))
+			return FALSE;
+
+		for (i = 0; i < numEntries && *NumParts < MaxParts; ++i) {
+			entry = Scan->Buffer + (SIZE_T)i * entrySize;
+			/* An all zero type GUID marks an unused entry. */
+			for (j = 0; j < 16 && !entry[j]; ++j)
+				;
+			if (16 == j)
+				continue;
+			firstLba = GetLE64(entry + 0x20);
+			lastLba  = GetLE64(entry + 0x28);
+			if (lastLba < firstLba)
+				continue;
+			Parts[*NumParts].Start = firstLba * sectorSize;
+			Parts[*NumParts].End   = (lastLba + 1) * sectorSize;
+			(*NumParts)++;
+		}
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+
+/* Largest number of partitions looked at in one image. */
+#define GUEST_MAX_PARTITIONS        128
+
+_Use_decl_annotations_
+DWORD
+GuestFsFindFreeRuns(
+	HANDLE          File,
+	UINT64          FileSize,
+	SIZE_T          ClusterSize,
+	PCLUSTER_RUN    *Runs,
+	SIZE_T          *NumRuns
+	)
+{
+	GUEST_SCAN      scan;
+	GUEST_PARTITION parts[GUEST_MAX_PARTITIONS];
+	SIZE_T          numParts, i;
+	UINT64          freeBytes, totalFree;
+	BYTE            *entry;
+	BOOL            haveMbr;
+	DWORD           err;
+
+	*Runs = NULL;
+	*NumRuns = 0;
+
+	memset(&scan, 0, sizeof(scan));
+	scan.File = File;
+	scan.FileSize = FileSize;
+	scan.ClusterSize = ClusterSize;
+	numParts = 0;
+	totalFree = 0;
+
+	/* Descriptors and one bitmap block, or a whole GPT entry array. */
+	scan.Buffer = malloc(MAX(GUEST_DESC_BUFFER_SIZE + EXT4_MAX_BLOCK_SIZE, GPT_MAX_ENTRY_BYTES));
+	if (NULL == scan.Buffer)
+		return ERROR_NOT_ENOUGH_MEMORY;
+
+	err = ReadImage(&scan, 0, scan.Buffer, GUEST_SECTOR_SIZE);
+	if (ERROR_SUCCESS != err && ERROR_HANDLE_EOF != err)
+		goto func_return;
+
+	haveMbr = (ERROR_SUCCESS == err
+	           && 0x55 == scan.Buffer[MBR_SIGNATURE_OFFSET]
+	           && 0xAA == scan.Buffer[MBR_SIGNATURE_OFFSET + 1]);
+
+	if (haveMbr && MBR_TYPE_GPT_PROTECTIVE == scan.Buffer[MBR_PARTITION_TABLE_OFFSET + 4]) {
+		if (!ReadGpt(&scan, parts, ARRAYSIZE(parts), &numParts))
+			LogInfo(L"Protective MBR found but no valid GPT.\n");
+	} else if (haveMbr) {
+		for (i = 0; i < MBR_PARTITION_COUNT; ++i) {
+			entry = scan.Buffer + MBR_PARTITION_TABLE_OFFSET + i * MBR_PARTITION_ENTRY_SIZE;
+			if (0 == entry[4] || 0 == GetLE32(entry + 12))
+				continue;
+			if (MBR_TYPE_EXTENDED_CHS == entry[4] || MBR_TYPE_EXTENDED_LBA == entry[4]) {
+				LogInfo(L"Logical partitions in extended partitions are not scanned.\n");
+				continue;
+			}
+			parts[numParts].Start = (UINT64)GetLE32(entry + 8) * GUEST_SECTOR_SIZE;
+			parts[numParts].End   = parts[numParts].Start
+			                      + (UINT64)GetLE32(entry + 12) * GUEST_SECTOR_SIZE;
+			numParts++;
+		}
+	}
+
+	/* No partition table; the image may be a bare file system. */
+	if (0 == numParts) {
+		parts[0].Start = 0;
+		parts[0].End = FileSize;
+		numParts = 1;
+	}
+
+	/* Free ranges have to be added in order. */
+	qsort(parts, numParts, sizeof(*parts), ComparePartitionStart);
+
+	for (i = 0; i < numParts; ++i) {
+		if (parts[i].Start >= FileSize || parts[i].End > FileSize
+		    || (i && parts[i].Start < parts[i - 1].End)) {
+			LogInfo(L"Skipping partition 0x%016llX - 0x%016llX outside the image or "
+			        L"overlapping another.\n", parts[i].Start, parts[i].End);
+			parts[i].End = parts[i].Start;
+			continue;
+		}
+
+		err = ScanExt4(&scan, parts[i].Start, parts[i].End, &freeBytes);
+		if (ERROR_SUCCESS != err)
+			goto func_return;
+		if (freeBytes) {
+			LogInfo(L"ext file system at offset 0x%016llX has %8.2f MiB of free blocks.\n",
+			        parts[i].Start, (double)freeBytes / 1048576.0);
+		}
+		totalFree += freeBytes;
+	}
+
+	if (scan.PendingStart != scan.PendingEnd) {
+		err = FlushPendingRun(&scan);
+		if (ERROR_SUCCESS != err)
+			goto func_return;
+	}
+
+	if (0 == totalFree)
+		LogInfo(L"No free guest file system blocks found.\n");
+
+	*Runs = scan.Runs;
+	*NumRuns = scan.NumRuns;
+	scan.Runs = NULL;
+	err = ERROR_SUCCESS;
+
+func_return:
+	free(scan.Runs);
+	free(scan.Buffer);
+	return err;
+}
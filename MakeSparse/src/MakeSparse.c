@@ -40,11 +40,15 @@ THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <stdint.h>
 #include <inttypes.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
 
 #include <assert.h>
 
 #include <SparseFileLib.h>
 
+#include "MakeSparse.h"
+
 #define DEFAULT_EXE_NAME        L"MakeSparse.exe"
 
 /* TODO probably never: Handle file analysis and deallocation for files roughly
@@ -52,108 +56,101 @@ THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  * running into memory issues with only 2 GiB of usable memory normally
  * available to the process. */
 
-/* This value will be used if the cluster size of the filesystem cannot be
- * determined automatically. */
-#define DEFAULT_FS_CLUSTER_SIZE     4096
-
 /* 10 seconds in milliseconds */
 #define STATS_TIMER_INTERVAL_MS  (10 * 1000)
 
+/* Clusters known to need no analysis are only skipped in pieces at least this
+ * large. Smaller ones are cheaper to read than to map around. */
+#define SCAN_SKIP_MIN            (1024 * 1024)
+
+
+/* Progress of a walk over a zero cluster map. Keeping this outside of
+ * FindZeroRuns lets the map be walked piecewise with runs spanning calls. */
+typedef struct ZERO_RUN_STATE {
+	UINT64              FileSize;
+	SIZE_T              ClusterSize;
+	const PUNCH_POLICY  *Policy;
+	UINT64              NextCluster;
+	INT64               FirstClusterInSequence;
+} ZERO_RUN_STATE, *PZERO_RUN_STATE;
+
+
+static void
+InitZeroRunState(
+	_Out_   PZERO_RUN_STATE     State,
+	_In_    UINT64              FileSize,
+	_In_    SIZE_T              ClusterSize,
+	_In_    const PUNCH_POLICY  *Policy
+	)
+{
+	State->FileSize               = FileSize;
+	State->ClusterSize            = ClusterSize;
+	State->Policy                 = Policy;
+	State->NextCluster            = 0;
+	State->FirstClusterInSequence = -1;
+}
+
 
 static DWORD
-SetSparseRange(
-	_In_    HANDLE      FileHandle,
-	_In_    LONGLONG    FileOffset,
-	_In_    LONGLONG    BeyondFinalZero
+EmitZeroRun(
+	_Inout_     PZERO_RUN_STATE     State,
+	_In_        UINT64              EndCluster,
+	_In_        PZERO_RUN_CALLBACK  Callback,
+	_Inout_opt_ PVOID               Context
 	)
 {
-	DWORD   errRet;
+	UINT64 start, end;
 
-	FILE_ZERO_DATA_INFORMATION fzdi;
+	start = (UINT64)State->FirstClusterInSequence * State->ClusterSize;
+	end   = MIN(EndCluster * State->ClusterSize, State->FileSize);
+	State->FirstClusterInSequence = -1;
 
-	fzdi.FileOffset.QuadPart      = FileOffset;
-	fzdi.BeyondFinalZero.QuadPart = BeyondFinalZero;
+	if (!PunchPolicyTrimRun(State->Policy, State->ClusterSize, State->FileSize,
+	                        &start, &end))
+		return ERROR_SUCCESS;
 
-	if (!DeviceIoControl(FileHandle,
-	                     FSCTL_SET_ZERO_DATA,
-	                     &fzdi,
-	                     sizeof(fzdi),
-	                     NULL,
-	                     0,
-	                     NULL,
-	                     NULL))
-	{
-		errRet = GetLastError();
-	} else {
-		errRet = ERROR_SUCCESS;
-	}
-	return errRet;
+	return Callback(Context, start, end);
 }
 
-// TODO: come back and completely rewrite this logic!
-/* TODO: Definitively determine if this should send a zero ioctl for every
- * empty cluster or only for larger cluster groups. Also need to see if cluster
- * groups should be aligned. */
+
+/* Walk the map from where the last call left off up to, but not including,
+ * EndCluster and report every completed run of zero clusters. A run still open
+ * at EndCluster is carried over to the next call unless it reaches the end of
+ * the file. */
 static DWORD
-SetSparseRanges(
-	_Inout_ HANDLE          FileHandle,
-	_In_    UINT64          FileSize,
-	_In_    SIZE_T          ClusterSize,
-	_In_    DWORD           MinClusterGroup,
-	_In_    PCLUSTER_MAP    ZeroClusterMap
+FindZeroRuns(
+	_Inout_     PZERO_RUN_STATE     State,
+	_In_        PCLUSTER_MAP        ZeroClusterMap,
+	_In_        UINT64              EndCluster,
+	_In_        PZERO_RUN_CALLBACK  Callback,
+	_Inout_opt_ PVOID               Context
 	)
 {
-	UINT64  i, numClusters, runtBytes;
-	INT64   firstClusterInSequence;
+	UINT64  i, numClusters;
 	DWORD   errRet;
 
 	errRet = ERROR_SUCCESS;
 
-	numClusters = FileSize / ClusterSize;
-	firstClusterInSequence = -1;
+	/* A trailing partial cluster counts as a cluster of its own. */
+	numClusters = (State->FileSize + State->ClusterSize - 1) / State->ClusterSize;
+	EndCluster = MIN(EndCluster, numClusters);
 
-	for (i = 0; i < numClusters; ++i) {
+	for (i = State->NextCluster; i < EndCluster; ++i) {
 		if (ClusterMapIsMarkedZero(ZeroClusterMap, i)) {
-			if (firstClusterInSequence < 0)
-				firstClusterInSequence = (INT64)i;
-		} else {
-			if ((firstClusterInSequence >= 0)
-				&& (MinClusterGroup <= (i - firstClusterInSequence))) {
-				errRet = SetSparseRange(FileHandle,
-				                        firstClusterInSequence * ClusterSize,
-				                        i * ClusterSize);
-				if (errRet != ERROR_SUCCESS) {
-					LogError(L"Error %#llx returned from SetSparseRange call.\n",
-					         (long long)errRet);
-					goto func_return;
-				}
-			}
-			firstClusterInSequence = -1;
+			if (State->FirstClusterInSequence < 0)
+				State->FirstClusterInSequence = (INT64)i;
+		} else if (State->FirstClusterInSequence >= 0) {
+			errRet = EmitZeroRun(State, i, Callback, Context);
+			if (errRet != ERROR_SUCCESS)
+				goto func_return;
 		}
-		// TODO: replace this.
-		//LogProgressOnInterval(IoCbShared);
 	}
 
-	runtBytes = FileSize % ClusterSize;
-	if (runtBytes) {
-		if (!ClusterMapIsMarkedZero(ZeroClusterMap, i)) {
-			runtBytes = 0;
-		}
-		// Don't bother zeroing a runt by itself.
-	}
-	if ((firstClusterInSequence >= 0)
-		&& (MinClusterGroup <= (i - firstClusterInSequence))) {
-		errRet = SetSparseRange(FileHandle,
-		                        firstClusterInSequence * ClusterSize,
-		                        (i * ClusterSize) + runtBytes);
-		if (errRet != ERROR_SUCCESS) {
-			LogError(L"Error %#llx returned from SetSparseRange call.\n",
-			         (long long)errRet);
-			goto func_return;
-		}
-	}
+	if (i == numClusters && State->FirstClusterInSequence >= 0)
+		errRet = EmitZeroRun(State, i, Callback, Context);
 
 func_return:
+	State->NextCluster = i;
 	return errRet;
 }
 
@@ -163,37 +160,1261 @@ SetSparseAttribute(
 	_In_    HANDLE  FileHandle
 	)
 {
-	DWORD                  errRet, tmp;
 	FILE_SET_SPARSE_BUFFER fssb;
 
 	fssb.SetSparse = TRUE;
-	if (!DeviceIoControl(FileHandle,
-		                 FSCTL_SET_SPARSE,
-		                 &fssb,
-		                 sizeof(fssb),
-		                 NULL,
-		                 0,
-		                 &tmp,
-		                 NULL))
-	{
+	return DeviceIoControlSync(FileHandle,
+	                           FSCTL_SET_SPARSE,
+	                           &fssb,
+	                           sizeof(fssb),
+	                           NULL,
+	                           0,
+	                           NULL);
+}
+
+
+/* Where selected zero runs are sent. The sparse attribute is only set once
+ * the first run turns up so a file with nothing to deallocate is left alone. */
+typedef struct ZERO_RUN_SINK {
+	HANDLE          FileHandle;
+	PZERO_DISPATCH  Dispatch;
+	BOOL            SparseAttributeSet;
+} ZERO_RUN_SINK, *PZERO_RUN_SINK;
+
+
+static DWORD
+QueueZeroRun(
+	_Inout_opt_ PVOID       Context,
+	_In_        UINT64      FileOffset,
+	_In_        UINT64      BeyondFinalZero
+	)
+{
+	PZERO_RUN_SINK  sink;
+	DWORD           errRet;
+
+	sink = Context;
+
+	if (!sink->SparseAttributeSet) {
+		errRet = SetSparseAttribute(sink->FileHandle);
+		if (ERROR_SUCCESS != errRet) {
+			LogError(L"Error %#llx from SetSparseAttribute call.\n",
+			         (long long)errRet);
+			return errRet;
+		}
+		sink->SparseAttributeSet = TRUE;
+	}
+
+	errRet = ZeroDispatchQueue(sink->Dispatch, FileOffset, BeyondFinalZero);
+	if (errRet != ERROR_SUCCESS) {
+		LogError(L"Error %#llx returned from ZeroDispatchQueue call.\n",
+		         (long long)errRet);
+	}
+	return errRet;
+}
+
+
+/* Report the ranges Policy selects from ZeroClusterMap to Callback in file
+ * order. */
+static DWORD
+SelectZeroRuns(
+	_In_        UINT64              FileSize,
+	_In_        SIZE_T              ClusterSize,
+	_In_        const PUNCH_POLICY  *Policy,
+	_In_        PCLUSTER_MAP        ZeroClusterMap,
+	_In_        PZERO_RUN_CALLBACK  Callback,
+	_Inout_opt_ PVOID               Context
+	)
+{
+	ZERO_RUN_STATE  runState;
+	PRANGE_SELECTOR selector;
+	DWORD           errRet;
+
+	InitZeroRunState(&runState, FileSize, ClusterSize, Policy);
+
+	if (0 == Policy->MaxRanges)
+		return FindZeroRuns(&runState, ZeroClusterMap, UINT64_MAX,
+		                    Callback, Context);
+
+	/* Capped; the largest runs are only known once the whole map is seen. */
+	selector = RangeSelectorCreate(Policy->MaxRanges);
+	if (NULL == selector)
+		return GetLastError();
+
+	errRet = FindZeroRuns(&runState, ZeroClusterMap, UINT64_MAX,
+	                      RangeSelectorAdd, selector);
+	if (ERROR_SUCCESS == errRet)
+		errRet = RangeSelectorEnumerate(selector, Callback, Context);
+
+	RangeSelectorFree(selector);
+	return errRet;
+}
+
+
+static DWORD
+SetSparseRanges(
+	_Inout_ PZERO_RUN_SINK      Sink,
+	_In_    UINT64              FileSize,
+	_In_    SIZE_T              ClusterSize,
+	_In_    const PUNCH_POLICY  *Policy,
+	_In_    PCLUSTER_MAP        ZeroClusterMap
+	)
+{
+	DWORD errRet;
+
+	errRet = SelectZeroRuns(FileSize, ClusterSize, Policy, ZeroClusterMap,
+	                        QueueZeroRun, Sink);
+	if (errRet != ERROR_SUCCESS)
+		return errRet;
+
+	/* Individual range failures have already been reported by the
+	 * dispatcher as they completed. */
+	return ZeroDispatchDrain(Sink->Dispatch);
+}
+
+
+typedef struct POLICY_TALLY {
+	UINT64      Ranges;
+	UINT64      Bytes;
+} POLICY_TALLY, *PPOLICY_TALLY;
+
+
+static DWORD
+TallyZeroRun(
+	_Inout_opt_ PVOID       Context,
+	_In_        UINT64      FileOffset,
+	_In_        UINT64      BeyondFinalZero
+	)
+{
+	PPOLICY_TALLY tally = Context;
+
+	tally->Ranges++;
+	tally->Bytes += BeyondFinalZero - FileOffset;
+	return ERROR_SUCCESS;
+}
+
+
+/* Print how many zero requests and how many bytes a set of common policies,
+ * and the one given on the command line, would deallocate. The first row
+ * with no minimum and no alignment is everything the analysis found. */
+static DWORD
+PrintPolicyReport(
+	_In_    UINT64              FileSize,
+	_In_    SIZE_T              ClusterSize,
+	_In_    const PUNCH_POLICY  *Selected,
+	_In_    PCLUSTER_MAP        ZeroClusterMap
+	)
+{
+	static const PUNCH_POLICY presets[] = {
+		{ 0,                0,                  0 },
+		{ 64 * 1024,        0,                  0 },
+		{ 64 * 1024,        64 * 1024,          0 },
+		{ 1024 * 1024,      0,                  0 },
+		{ 1024 * 1024,      1024 * 1024,        0 },
+	};
+	PUNCH_POLICY    policy;
+	POLICY_TALLY    tally;
+	DWORD           i, errRet;
+
+	LogInfo(L"Punch policy report:\n"
+	        L"          %14s %14s %12s %12s %14s\n",
+	        L"Min run", L"Align", L"Max ranges", L"Requests", L"Reclaimed MiB");
+
+	for (i = 0; i <= ARRAYSIZE(presets); ++i) {
+		policy = (i == ARRAYSIZE(presets)) ? *Selected : presets[i];
+		PunchPolicyNormalize(&policy, ClusterSize);
+
+		memset(&tally, 0, sizeof(tally));
+		errRet = SelectZeroRuns(FileSize, ClusterSize, &policy, ZeroClusterMap,
+		                        TallyZeroRun, &tally);
+		if (ERROR_SUCCESS != errRet) {
+			LogError(L"Error %#llx evaluating punch policy.\n", (long long)errRet);
+			return errRet;
+		}
+
+		LogInfo(L"%-9s %14llu %14llu %12llu %12llu %14.2f\n",
+		        (i == ARRAYSIZE(presets)) ? L"selected" : L"",
+		        policy.MinRunLength, policy.Alignment, policy.MaxRanges,
+		        tally.Ranges, (double)tally.Bytes / 1048576.0);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+
+/* Pipelined mode.
+ *
+ * The scan hands each view to PipelineViewComplete once it has been unmapped.
+ * Completed zero runs from that view are pushed onto a bounded queue and a
+ * dispatch thread feeds them to the zero dispatcher while the scan moves on to
+ * the next view. Because runs are only ever taken from views the scan has
+ * already unmapped, nothing is deallocated underneath a live mapping. A run
+ * that crosses the end of a view is held back until the scan closes it.
+ *
+ * The scan is throttled so it never gets more than MaxLag bytes ahead of the
+ * oldest run that has not yet been handed to the dispatcher.
+ *
+ * If the file's unallocated clusters are known, PunchMap starts out as that
+ * map and is overwritten a view at a time with the zero clusters that are
+ * still allocated, which is what the runs are then taken from. */
+
+/* Number of zero runs that can wait between the scan and the dispatch thread. */
+#define PIPELINE_RUN_QUEUE_SIZE     4096
+
+typedef struct PIPELINE_RUN {
+	UINT64      FileOffset;
+	UINT64      BeyondFinalZero;
+} PIPELINE_RUN;
+
+typedef struct PIPELINE {
+	CRITICAL_SECTION    Lock;
+	CONDITION_VARIABLE  RunsQueued;
+	CONDITION_VARIABLE  RunsTaken;
+	ZERO_RUN_SINK       Sink;
+	ZERO_RUN_STATE      RunState;
+	PCLUSTER_MAP        PunchMap;
+	UINT64              MaxLag;
+	DWORD               Error;
+	DWORD               DispatchResult;
+	BOOL                ScanComplete;
+	DWORD               Head;
+	DWORD               Count;
+	PIPELINE_RUN        Runs[PIPELINE_RUN_QUEUE_SIZE];
+} PIPELINE, *PPIPELINE;
+
+
+static DWORD
+PipelineQueueRun(
+	_Inout_opt_ PVOID       Context,
+	_In_        UINT64      FileOffset,
+	_In_        UINT64      BeyondFinalZero
+	)
+{
+	PPIPELINE   pipeline;
+	DWORD       idx, errRet;
+
+	pipeline = Context;
+
+	EnterCriticalSection(&pipeline->Lock);
+
+	while (PIPELINE_RUN_QUEUE_SIZE == pipeline->Count
+	       && ERROR_SUCCESS == pipeline->Error)
+		(void)SleepConditionVariableCS(&pipeline->RunsTaken, &pipeline->Lock, INFINITE);
+
+	errRet = pipeline->Error;
+	if (ERROR_SUCCESS == errRet) {
+		idx = (pipeline->Head + pipeline->Count) % PIPELINE_RUN_QUEUE_SIZE;
+		pipeline->Runs[idx].FileOffset      = FileOffset;
+		pipeline->Runs[idx].BeyondFinalZero = BeyondFinalZero;
+		pipeline->Count++;
+		WakeConditionVariable(&pipeline->RunsQueued);
+	}
+
+	LeaveCriticalSection(&pipeline->Lock);
+
+	return errRet;
+}
+
+
+static BOOL __stdcall
+PipelineViewComplete(
+	_In_opt_    PVOID           Context,
+	_In_        PCLUSTER_MAP    ClusterMap,
+	_In_        UINT64          ViewOffset,
+	_In_        UINT64          ViewLength
+	)
+{
+	PPIPELINE       pipeline;
+	PCLUSTER_MAP    runMap;
+	UINT64          scanFrontier, endCluster;
+	DWORD           errRet;
+
+	pipeline = Context;
+	scanFrontier = ViewOffset + ViewLength;
+	runMap = ClusterMap;
+	errRet = ERROR_SUCCESS;
+
+	if (scanFrontier >= pipeline->RunState.FileSize)
+		endCluster = UINT64_MAX;
+	else
+		endCluster = scanFrontier / pipeline->RunState.ClusterSize;
+
+	if (pipeline->PunchMap) {
+		if (!ClusterMapAndNot(pipeline->PunchMap, ClusterMap, pipeline->PunchMap,
+		                      pipeline->RunState.NextCluster, endCluster))
+			errRet = GetLastError();
+		runMap = pipeline->PunchMap;
+	}
+
+	if (ERROR_SUCCESS == errRet)
+		errRet = FindZeroRuns(&pipeline->RunState, runMap, endCluster,
+		                      PipelineQueueRun, pipeline);
+
+	EnterCriticalSection(&pipeline->Lock);
+
+	if (ERROR_SUCCESS == errRet) {
+		while (pipeline->Count
+		       && ERROR_SUCCESS == pipeline->Error
+		       && (scanFrontier - pipeline->Runs[pipeline->Head].FileOffset) > pipeline->MaxLag)
+			(void)SleepConditionVariableCS(&pipeline->RunsTaken, &pipeline->Lock, INFINITE);
+		errRet = pipeline->Error;
+	}
+
+	LeaveCriticalSection(&pipeline->Lock);
+
+	return (ERROR_SUCCESS == errRet);
+}
+
+
+static DWORD WINAPI
+PipelineDispatchThread(
+	LPVOID      Param
+	)
+{
+	PPIPELINE       pipeline;
+	PIPELINE_RUN    run;
+	DWORD           errRet, drainErr;
+
+	pipeline = Param;
+	errRet = ERROR_SUCCESS;
+
+	EnterCriticalSection(&pipeline->Lock);
+	for (;;) {
+		while (0 == pipeline->Count
+		       && !pipeline->ScanComplete
+		       && ERROR_SUCCESS == pipeline->Error)
+			(void)SleepConditionVariableCS(&pipeline->RunsQueued, &pipeline->Lock, INFINITE);
+
+		if (ERROR_SUCCESS != pipeline->Error || 0 == pipeline->Count)
+			break;
+
+		run = pipeline->Runs[pipeline->Head];
+		LeaveCriticalSection(&pipeline->Lock);
+
+		errRet = QueueZeroRun(&pipeline->Sink, run.FileOffset, run.BeyondFinalZero);
+
+		EnterCriticalSection(&pipeline->Lock);
+		/* The run only leaves the queue once the dispatcher owns it so the
+		 * lag check in the scan accounts for it until then. */
+		pipeline->Head = (pipeline->Head + 1) % PIPELINE_RUN_QUEUE_SIZE;
+		pipeline->Count--;
+		if (ERROR_SUCCESS != errRet && ERROR_SUCCESS == pipeline->Error)
+			pipeline->Error = errRet;
+		WakeAllConditionVariable(&pipeline->RunsTaken);
+	}
+	LeaveCriticalSection(&pipeline->Lock);
+
+	/* Anything already handed over has to finish regardless of errors. */
+	drainErr = ZeroDispatchDrain(pipeline->Sink.Dispatch);
+	pipeline->DispatchResult = (ERROR_SUCCESS != errRet) ? errRet : drainErr;
+
+	return 0;
+}
+
+
+/* Get the dispatcher of Target, creating it on first use. A file handle can
+ * only be bound to one completion port, so every deallocation of the file
+ * shares it until TargetFileClose frees it. */
+static DWORD
+TargetFileDispatch(
+	_In_        const MAKESPARSE_OPTIONS    *Options,
+	_Inout_     PTARGET_FILE                Target,
+	_Out_       PZERO_DISPATCH              *Dispatch
+	)
+{
+	DWORD   errRet;
+
+	if (NULL == Target->Dispatch) {
+		Target->Dispatch = ZeroDispatchCreate(Target->Handle, Options->ZeroQueueDepth,
+		                                      Options->Online ? ZERO_DISPATCH_VERIFY : 0);
+		if (NULL == Target->Dispatch) {
+			errRet = GetLastError();
+			LogError(L"Failed ZeroDispatchCreate with error %#llx\n", (long long)errRet);
+			*Dispatch = NULL;
+			return errRet;
+		}
+	}
+
+	*Dispatch = Target->Dispatch;
+	return ERROR_SUCCESS;
+}
+
+
+/* Analyze the file and dispatch zero ranges at the same time. On return the
+ * zero map is complete and every dispatched range has finished. */
+static DWORD
+PipelinedSparseRanges(
+	_In_    const MAKESPARSE_OPTIONS    *Options,
+	_Inout_ PTARGET_FILE                Target
+	)
+{
+	PPIPELINE           pipeline;
+	SPARSE_MAP_PARAMS   params;
+	PCLUSTER_MAP        zeroMap;
+	SIZE_T              clusterSize;
+	HANDLE              dispatchThread;
+	DWORD               errRet;
+	BOOL                scanned;
+
+	dispatchThread = NULL;
+
+	pipeline = calloc(1, sizeof(*pipeline));
+	if (NULL == pipeline)
+		return ERROR_NOT_ENOUGH_MEMORY;
+
+	InitializeCriticalSection(&pipeline->Lock);
+	InitializeConditionVariable(&pipeline->RunsQueued);
+	InitializeConditionVariable(&pipeline->RunsTaken);
+	pipeline->Sink.FileHandle = Target->Handle;
+	pipeline->PunchMap        = Target->PunchMap;
+	pipeline->MaxLag          = Options->PipelineMaxLag;
+	pipeline->Error           = ERROR_SUCCESS;
+	InitZeroRunState(&pipeline->RunState, Target->FileSize, Target->ClusterSize,
+	                 &Target->Policy);
+
+	errRet = TargetFileDispatch(Options, Target, &pipeline->Sink.Dispatch);
+	if (ERROR_SUCCESS != errRet)
+		goto func_return;
+
+	dispatchThread = CreateThread(NULL, 0, PipelineDispatchThread, pipeline, 0, NULL);
+	if (NULL == dispatchThread) {
 		errRet = GetLastError();
+		LogError(L"Failed CreateThread with error %#llx\n", (long long)errRet);
+		goto func_return;
+	}
+
+	memset(&params, 0, sizeof(params));
+	params.StatsStream            = stdout;
+	params.StatsFrequencyMillisec = STATS_TIMER_INTERVAL_MS;
+	params.ViewCallback           = PipelineViewComplete;
+	params.CallbackContext        = pipeline;
+	params.ExistingMap            = Target->ZeroMap;
+	params.Dedupe                 = Target->Dedupe;
+
+	clusterSize = Target->ClusterSize;
+	scanned = BuildSparseMapEx(Target->Handle, &params, &clusterSize, &zeroMap);
+	errRet = scanned ? ERROR_SUCCESS : GetLastError();
+
+	EnterCriticalSection(&pipeline->Lock);
+	pipeline->ScanComplete = TRUE;
+	/* Stop dispatching if the scan failed, other than because dispatch
+	 * already failed and cancelled it. */
+	if (!scanned && ERROR_SUCCESS == pipeline->Error)
+		pipeline->Error = errRet;
+	WakeAllConditionVariable(&pipeline->RunsQueued);
+	LeaveCriticalSection(&pipeline->Lock);
+
+	if (WAIT_OBJECT_0 != WaitForSingleObject(dispatchThread, INFINITE)) {
+		errRet = GetLastError();
+		LogError(L"Failed WaitForSingleObject on dispatch thread with error %#llx\n",
+		         (long long)errRet);
+		/* The thread still references the pipeline; it cannot be freed. */
+		return errRet;
+	}
+
+	if (!scanned) {
+		if (ERROR_CANCELLED == errRet && ERROR_SUCCESS != pipeline->DispatchResult)
+			errRet = pipeline->DispatchResult;
+		LogError(L"Failed BuildSparseMapEx with error %#llx\n", (long long)errRet);
 	} else {
-		errRet = ERROR_SUCCESS;
+		errRet = pipeline->DispatchResult;
+		Target->PunchMapReady = TRUE;
+	}
+
+func_return:
+	if (dispatchThread)
+		(void)CloseHandle(dispatchThread);
+	if (pipeline->Sink.Dispatch)
+		ZeroDispatchGetStats(pipeline->Sink.Dispatch, &Target->DispatchStats);
+	DeleteCriticalSection(&pipeline->Lock);
+	free(pipeline);
+
+	return errRet;
+}
+
+
+/* Add Runs, which must be in increasing order, to the clusters the scan skips.
+ * Takes ownership of Runs. */
+static DWORD
+AddSkipRuns(
+	_Inout_     PTARGET_FILE    Target,
+	_In_reads_(NumRuns) _Post_invalid_
+	            PCLUSTER_RUN    Runs,
+	_In_        SIZE_T          NumRuns
+	)
+{
+	PCLUSTER_RUN    merged, a, b, next;
+	SIZE_T          numMerged, ia, ib;
+
+	if (0 == Target->NumSkipRuns) {
+		free(Target->SkipRuns);
+		Target->SkipRuns = Runs;
+		Target->NumSkipRuns = NumRuns;
+		return ERROR_SUCCESS;
+	}
+
+	merged = malloc((Target->NumSkipRuns + NumRuns) * sizeof(*merged));
+	if (NULL == merged) {
+		free(Runs);
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	/* Union of both lists, joining runs that touch or overlap. */
+	a = Target->SkipRuns;
+	b = Runs;
+	numMerged = 0;
+	for (ia = ib = 0; ia < Target->NumSkipRuns || ib < NumRuns; ) {
+		if (ib == NumRuns || (ia < Target->NumSkipRuns && a[ia].First <= b[ib].First))
+			next = &a[ia++];
+		else
+			next = &b[ib++];
+
+		if (numMerged && next->First <= merged[numMerged - 1].End)
+			merged[numMerged - 1].End = MAX(merged[numMerged - 1].End, next->End);
+		else
+			merged[numMerged++] = *next;
+	}
+
+	free(Target->SkipRuns);
+	free(Runs);
+	Target->SkipRuns = merged;
+	Target->NumSkipRuns = numMerged;
+	return ERROR_SUCCESS;
+}
+
+
+/* Fingerprint the allocation of the file as it is now and compare it with the
+ * manifest of the last run. An unchanged file is skipped, and with
+ * --manifest-chunks so are the chunks of a changed one whose allocation is
+ * the same. Skipped holes are marked in the zero map for the benefit of -m. A
+ * missing or unusable manifest just means everything is analyzed. */
+static DWORD
+TargetFileCompareManifest(
+	_In_        const MAKESPARSE_OPTIONS    *Options,
+	_Inout_     PTARGET_FILE                Target
+	)
+{
+	MANIFEST        old;
+	PCLUSTER_RUN    runs;
+	LPWSTR          manifestPath;
+	SIZE_T          numRuns, i;
+	UINT64          cluster, end, unchanged;
+	DWORD           errRet;
+
+	errRet = ManifestReadIdentity(Target->Handle, &Target->Manifest.Header);
+	if (ERROR_SUCCESS == errRet) {
+		errRet = ManifestHashChunks(Target->PunchMap, NULL, Target->FileSize,
+		                            Target->ClusterSize, &Target->Manifest);
+	}
+	if (ERROR_SUCCESS != errRet) {
+		LogError(L"Failed to fingerprint %s with error %#llx\n",
+		         Target->Path, (long long)errRet);
+		return errRet;
+	}
+	Target->Manifest.Header.MinRunLength = Target->Policy.MinRunLength;
+	Target->Manifest.Header.Alignment    = Target->Policy.Alignment;
+	Target->Manifest.Header.MaxRanges    = Target->Policy.MaxRanges;
+	Target->ManifestEnabled = TRUE;
+
+	manifestPath = ManifestPath(Target->Path);
+	if (NULL == manifestPath)
+		return ERROR_NOT_ENOUGH_MEMORY;
+	errRet = ManifestLoad(manifestPath, &old);
+	free(manifestPath);
+	if (ERROR_FILE_NOT_FOUND == errRet) {
+		return ERROR_SUCCESS;
+	} else if (ERROR_SUCCESS != errRet) {
+		LogInfo(L"Ignoring manifest of %s, error %#llx.\n",
+		        Target->Path, (long long)errRet);
+		return ERROR_SUCCESS;
+	}
+
+	if (ManifestFileUnchanged(&old, &Target->Manifest)) {
+		ManifestFree(&old);
+		Target->FileUnchanged = TRUE;
+		runs = malloc(sizeof(*runs));
+		if (NULL == runs)
+			return ERROR_NOT_ENOUGH_MEMORY;
+		runs[0].First = 0;
+		runs[0].End = (Target->FileSize + Target->ClusterSize - 1) / Target->ClusterSize;
+		numRuns = 1;
+	} else if (Options->ManifestChunks) {
+		errRet = ManifestUnchangedRuns(&old, &Target->Manifest, &runs, &numRuns);
+		ManifestFree(&old);
+		if (ERROR_SUCCESS != errRet)
+			return errRet;
+	} else {
+		/* Data overwritten in place with zeros leaves the allocation as it
+		 * was, so nothing of a changed file is known to be unchanged. */
+		ManifestFree(&old);
+		LogInfo(L"%s: changed since the last run.\n", Target->Path);
+		return ERROR_SUCCESS;
+	}
+
+	unchanged = 0;
+	for (i = 0; i < numRuns; ++i) {
+		unchanged += runs[i].End - runs[i].First;
+		for (cluster = runs[i].First; cluster < runs[i].End; cluster = end) {
+			end = MIN(ClusterMapRunEnd(Target->PunchMap, cluster), runs[i].End);
+			if (ClusterMapIsMarkedZero(Target->PunchMap, cluster))
+				ClusterMapMarkClusters(Target->ZeroMap, cluster, end);
+		}
+	}
+
+	LogInfo(L"%s: %8.2f MiB unchanged since the last run%s.\n",
+	        Target->Path,
+	        (double)(unchanged * Target->ClusterSize) / 1048576.0,
+	        Target->FileUnchanged ? L", nothing to do" : L"");
+
+	return AddSkipRuns(Target, runs, numRuns);
+}
+
+
+_Use_decl_annotations_
+DWORD
+TargetFileOpen(
+	const MAKESPARSE_OPTIONS    *Options,
+	LPCWSTR                     Path,
+	PTARGET_FILE                Target
+	)
+{
+	LARGE_INTEGER   flSz;
+	PCLUSTER_RUN    runs;
+	SIZE_T          i, numRuns;
+	DWORD           errRet;
+
+	memset(Target, 0, sizeof(*Target));
+	Target->Path = Path;
+	Target->Policy = Options->Policy;
+
+	/* Online mode lets the file stay in use. Every range is verified again
+	 * before it is deallocated so concurrent writes are not lost. Shards only
+	 * ever touch their own clusters so they need no verification. */
+	Target->Handle = OpenFileWithSharing(Path,
+	                                     (Options->Online || Options->Ranged)
+	                                         ? FILE_SHARE_READ | FILE_SHARE_WRITE : 0,
+	                                     FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_OVERLAPPED,
+	                                     &flSz,
+	                                     &Target->ClusterSize,
+	                                     &Target->CreationTime,
+	                                     &Target->LastAccessTime,
+	                                     &Target->LastWriteTime);
+	if (NULL == Target->Handle) {
+		errRet = GetLastError();
+		LogError(L"Failed to open file %s with error %#llx\n",
+		         Path, (long long)errRet);
+		return errRet;
+	}
+	Target->FileSize = (UINT64)flSz.QuadPart;
+
+	if (Target->ClusterSize == 0) {
+		Target->ClusterSize = DEFAULT_FS_CLUSTER_SIZE;
+		LogInfo(L"Unable to determine cluster size of file system for %s. "
+		        L"Using default cluster size: %ld\n",
+		        Path, (LONG)Target->ClusterSize);
+	}
+
+	PunchPolicyNormalize(&Target->Policy, Target->ClusterSize);
+
+	/* Clusters that are already holes read back as zeros. Knowing them up
+	 * front avoids deallocating them again on every run over the file. */
+	if (!BuildUnallocatedMap(Target->Handle, Target->ClusterSize, &Target->PunchMap)) {
+		LogInfo(L"Unable to query allocated ranges of %s, error %#llx. "
+		        L"All zero clusters will be deallocated.\n",
+		        Path, (long long)GetLastError());
+		Target->PunchMap = NULL;
+	}
+
+	Target->ZeroMap = ClusterMapAllocate((DWORD)Target->ClusterSize, Target->FileSize);
+	if (NULL == Target->ZeroMap) {
+		errRet = GetLastError();
+		LogError(L"Failed to allocate cluster map for %s with error %#llx\n",
+		         Path, (long long)errRet);
+		return errRet;
+	}
+
+	if (Options->DedupeIndex) {
+		Target->Dedupe = DedupeFileCreate(Options->DedupeIndex,
+		                                  Path,
+		                                  Target->ClusterSize,
+		                                  Options->DedupeClone);
+		if (NULL == Target->Dedupe) {
+			errRet = GetLastError();
+			LogError(L"Failed DedupeFileCreate for %s with error %#llx\n",
+			         Path, (long long)errRet);
+			return errRet;
+		}
+	}
+
+	/* Marked before any scan starts since ClusterMapMarkClusters is not safe
+	 * against the concurrent updates of batch mode. */
+	if (Options->GuestFs) {
+		errRet = GuestFsFindFreeRuns(Target->Handle,
+		                             Target->FileSize,
+		                             Target->ClusterSize,
+		                             &runs,
+		                             &numRuns);
+		if (ERROR_SUCCESS != errRet) {
+			LogError(L"Failed to read guest file systems of %s with error %#llx\n",
+			         Path, (long long)errRet);
+			return errRet;
+		}
+		for (i = 0; i < numRuns; ++i)
+			ClusterMapMarkClusters(Target->ZeroMap, runs[i].First, runs[i].End);
+		errRet = AddSkipRuns(Target, runs, numRuns);
+		if (ERROR_SUCCESS != errRet)
+			return errRet;
+	}
+
+	if (Options->Manifest && Target->PunchMap) {
+		errRet = TargetFileCompareManifest(Options, Target);
+		if (ERROR_SUCCESS != errRet)
+			return errRet;
+	} else if (Options->Manifest) {
+		LogInfo(L"No manifest is kept for %s since its allocation is unknown.\n", Path);
 	}
+
+	return ERROR_SUCCESS;
+}
+
+
+static DWORD
+ScanRange(
+	_Inout_     PTARGET_FILE    Target,
+	_In_        UINT64          RangeOffset,
+	_In_        UINT64          RangeLength,
+	_In_opt_    FILE            *StatsStream
+	)
+{
+	SPARSE_MAP_PARAMS   params;
+	PCLUSTER_MAP        zeroMap;
+	SIZE_T              clusterSize;
+
+	memset(&params, 0, sizeof(params));
+	params.StatsStream            = StatsStream;
+	params.StatsFrequencyMillisec = STATS_TIMER_INTERVAL_MS;
+	params.RangeOffset            = RangeOffset;
+	params.RangeLength            = RangeLength;
+	params.ExistingMap            = Target->ZeroMap;
+	params.Dedupe                 = Target->Dedupe;
+
+	clusterSize = Target->ClusterSize;
+	if (!BuildSparseMapEx(Target->Handle, &params, &clusterSize, &zeroMap))
+		return GetLastError();
+
+	return ERROR_SUCCESS;
+}
+
+
+_Use_decl_annotations_
+DWORD
+TargetFileScan(
+	PTARGET_FILE    Target,
+	UINT64          RangeOffset,
+	UINT64          RangeLength,
+	FILE            *StatsStream
+	)
+{
+	PCLUSTER_RUN    runs;
+	SIZE_T          numRuns, i, lo, hi;
+	UINT64          clusterSize, align, end, pos, scanEnd, skipEnd, runStart, runEnd,
+	                skipStart, skipStop, skipped;
+	DWORD           errRet;
+
+	if (0 == Target->NumSkipRuns)
+		return ScanRange(Target, RangeOffset, RangeLength, StatsStream);
+
+	/* Scan around the skipped clusters. Pieces of the range start on the
+	 * boundary BuildSparseMapEx requires. */
+	runs        = Target->SkipRuns;
+	numRuns     = Target->NumSkipRuns;
+	clusterSize = Target->ClusterSize;
+	align       = MAX(clusterSize, SPARSE_MAP_RANGE_ALIGNMENT);
+
+	end = Target->FileSize;
+	if (RangeLength && RangeLength < end - RangeOffset)
+		end = RangeOffset + RangeLength;
+
+	/* First run ending after the start of the range. */
+	lo = 0;
+	hi = numRuns;
+	while (lo < hi) {
+		i = lo + (hi - lo) / 2;
+		if (runs[i].End * clusterSize <= RangeOffset)
+			lo = i + 1;
+		else
+			hi = i;
+	}
+
+	skipped = 0;
+	for (pos = RangeOffset, i = lo; pos < end; pos = skipEnd) {
+		scanEnd = skipEnd = end;
+
+		for (; i < numRuns; ++i) {
+			runStart = MAX(runs[i].First * clusterSize, pos);
+			runEnd   = MIN(runs[i].End * clusterSize, end);
+			if (runStart >= end)
+				break;
+
+			skipStart = ((runStart + align - 1) / align) * align;
+			skipStop  = (runEnd == end) ? end : runEnd - runEnd % align;
+			if (skipStop > skipStart && skipStop - skipStart >= SCAN_SKIP_MIN) {
+				scanEnd = skipStart;
+				skipEnd = skipStop;
+				++i;
+				break;
+			}
+		}
+
+		if (scanEnd > pos) {
+			errRet = ScanRange(Target, pos, scanEnd - pos, NULL);
+			if (ERROR_SUCCESS != errRet)
+				return errRet;
+		}
+		skipped += skipEnd - scanEnd;
+	}
+
+	if (StatsStream) {
+		fwprintf(StatsStream,
+		         L"Analyzed: %8.2f MiB. Skipped %8.2f MiB known to need no analysis.\n",
+		         (double)(end - RangeOffset - skipped) / 1048576.0,
+		         (double)skipped / 1048576.0);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+
+/* The map deallocation should work from: the zero clusters that still have
+ * storage allocated if that is known, otherwise every zero cluster. */
+static DWORD
+TargetFileRunMap(
+	_Inout_ PTARGET_FILE    Target,
+	_Out_   PCLUSTER_MAP    *RunMap
+	)
+{
+	*RunMap = Target->ZeroMap;
+
+	if (NULL == Target->PunchMap)
+		return ERROR_SUCCESS;
+
+	if (!Target->PunchMapReady) {
+		if (!ClusterMapAndNot(Target->PunchMap, Target->ZeroMap, Target->PunchMap,
+		                      0, UINT64_MAX))
+			return GetLastError();
+		Target->PunchMapReady = TRUE;
+	}
+
+	*RunMap = Target->PunchMap;
+	return ERROR_SUCCESS;
+}
+
+
+_Use_decl_annotations_
+DWORD
+TargetFileDeallocate(
+	const MAKESPARSE_OPTIONS    *Options,
+	PTARGET_FILE                Target
+	)
+{
+	ZERO_RUN_SINK   sink;
+	PCLUSTER_MAP    runMap, unallocMap;
+	UINT64          bytesCloned;
+	DWORD           errRet, cloneErr;
+
+	errRet = TargetFileRunMap(Target, &runMap);
+	if (ERROR_SUCCESS != errRet) {
+		LogError(L"Failed ClusterMapAndNot with error %#llx\n", (long long)errRet);
+		return errRet;
+	}
+
+	memset(&sink, 0, sizeof(sink));
+	sink.FileHandle = Target->Handle;
+	errRet = TargetFileDispatch(Options, Target, &sink.Dispatch);
+	if (ERROR_SUCCESS != errRet)
+		return errRet;
+
+	errRet = SetSparseRanges(&sink,
+	                         Target->FileSize,
+	                         Target->ClusterSize,
+	                         &Target->Policy,
+	                         runMap);
+
+	ZeroDispatchGetStats(sink.Dispatch, &Target->DispatchStats);
+
+	/* Cloning is an extra; the file is fine without it. */
+	if (ERROR_SUCCESS == errRet && Options->DedupeClone && Target->Dedupe) {
+		cloneErr = DedupeFileClone(Target->Dedupe, Target->Handle, &bytesCloned);
+		Target->Modified |= (0 != bytesCloned);
+		if (ERROR_SUCCESS != cloneErr) {
+			LogError(L"WARNING: Block cloning is not available for %s, error %#llx\n",
+			         Target->Path, (long long)cloneErr);
+		}
+	}
+
+	/* Fingerprint the allocation the run leaves behind for the next one. */
+	if (ERROR_SUCCESS == errRet && Target->ManifestEnabled && !Target->FileUnchanged) {
+		if (BuildUnallocatedMap(Target->Handle, Target->ClusterSize, &unallocMap)) {
+			Target->ManifestReady = ERROR_SUCCESS == ManifestHashChunks(unallocMap,
+			                                                            Target->ZeroMap,
+			                                                            Target->FileSize,
+			                                                            Target->ClusterSize,
+			                                                            &Target->Manifest);
+			ClusterMapFree(unallocMap);
+		}
+		if (!Target->ManifestReady)
+			LogError(L"WARNING: No manifest is saved for %s.\n", Target->Path);
+	}
+
+	return errRet;
+}
+
+
+_Use_decl_annotations_
+DWORD
+TargetFileDeallocateRange(
+	const MAKESPARSE_OPTIONS    *Options,
+	PTARGET_FILE                Target,
+	UINT64                      FirstCluster,
+	UINT64                      EndCluster
+	)
+{
+	ZERO_RUN_SINK       sink;
+	ZERO_RUN_STATE      runState;
+	PCLUSTER_MAP        runMap;
+	DWORD               errRet;
+
+	assert(0 == Target->Policy.MaxRanges);
+
+	/* Only this range of the punch map is turned into allocated zeros; the
+	 * rest keeps describing unallocated clusters until it is analyzed. */
+	runMap = Target->ZeroMap;
+	if (Target->PunchMap) {
+		if (!ClusterMapAndNot(Target->PunchMap, Target->ZeroMap, Target->PunchMap,
+		                      FirstCluster, EndCluster)) {
+			errRet = GetLastError();
+			LogError(L"Failed ClusterMapAndNot with error %#llx\n", (long long)errRet);
+			return errRet;
+		}
+		runMap = Target->PunchMap;
+	}
+
+	/* Every range shares the dispatcher, and with it the stats. */
+	memset(&sink, 0, sizeof(sink));
+	sink.FileHandle = Target->Handle;
+	errRet = TargetFileDispatch(Options, Target, &sink.Dispatch);
+	if (ERROR_SUCCESS != errRet)
+		return errRet;
+
+	/* A run still open at the end of the range is cut there. */
+	InitZeroRunState(&runState, Target->FileSize, Target->ClusterSize, &Target->Policy);
+	runState.NextCluster = FirstCluster;
+	errRet = FindZeroRuns(&runState, runMap, EndCluster, QueueZeroRun, &sink);
+	if (ERROR_SUCCESS == errRet && runState.FirstClusterInSequence >= 0)
+		errRet = EmitZeroRun(&runState, runState.NextCluster, QueueZeroRun, &sink);
+	if (ERROR_SUCCESS == errRet)
+		errRet = ZeroDispatchDrain(sink.Dispatch);
+	else
+		(void)ZeroDispatchDrain(sink.Dispatch);
+
+	ZeroDispatchGetStats(sink.Dispatch, &Target->DispatchStats);
+
 	return errRet;
 }
 
 
+static void
+TargetFileSaveManifest(
+	_Inout_     PTARGET_FILE    Target
+	)
+{
+	HANDLE  hFile;
+	LPWSTR  manifestPath;
+	DWORD   errRet;
+
+	hFile = CreateFileW(Target->Path,
+	                    FILE_READ_ATTRIBUTES,
+	                    FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+	                    NULL,
+	                    OPEN_EXISTING,
+	                    FILE_ATTRIBUTE_NORMAL,
+	                    NULL);
+	if (INVALID_HANDLE_VALUE == hFile) {
+		errRet = GetLastError();
+		goto error_return;
+	}
+	errRet = ManifestReadIdentity(hFile, &Target->Manifest.Header);
+	(void)CloseHandle(hFile);
+	if (ERROR_SUCCESS != errRet)
+		goto error_return;
+
+	manifestPath = ManifestPath(Target->Path);
+	if (NULL == manifestPath) {
+		errRet = ERROR_NOT_ENOUGH_MEMORY;
+		goto error_return;
+	}
+	errRet = ManifestSave(manifestPath, &Target->Manifest);
+	free(manifestPath);
+	if (ERROR_SUCCESS != errRet)
+		goto error_return;
+
+	return;
+
+error_return:
+	LogError(L"WARNING: Failed to save manifest of %s with error %#llx\n",
+	         Target->Path, (long long)errRet);
+}
+
+
+_Use_decl_annotations_
+void
+TargetFileClose(
+	const MAKESPARSE_OPTIONS    *Options,
+	PTARGET_FILE                Target
+	)
+{
+	if (NULL == Target->Handle)
+		return;
+
+	/* Reset modified and access timestamps if preserve filetimes specified */
+	if (Options->PreserveFileTimes) {
+		if (0 == SetFileTime(Target->Handle, NULL, &Target->LastAccessTime,
+		                     &Target->LastWriteTime)) {
+			LogError(L"WARNING: Failed to preserve file times on %s.\n", Target->Path);
+		}
+	}
+
+	/* Flush buffers on file. Nothing was written if no ranges were sent and
+	 * nothing was cloned or moved. */
+	if ((Target->DispatchStats.RangesQueued || Target->Modified)
+	    && !FlushFileBuffers(Target->Handle)) {
+		LogError(L"WARNING: Failed FlushFileBuffers on %s with lastErr %lu.\n",
+		         Target->Path, GetLastError());
+	}
+
+	if (Target->Dispatch)
+		ZeroDispatchFree(Target->Dispatch);
+	Target->Dispatch = NULL;
+
+	// What would we do if this failed anyways?
+	(void)CloseHandle(Target->Handle);
+	Target->Handle = NULL;
+
+	/* Closing the handle may update the timestamps and USN, so the identity
+	 * saved is read afterwards. */
+	if (Target->ManifestReady)
+		TargetFileSaveManifest(Target);
+}
+
+
+_Use_decl_annotations_
+void
+TargetFileFree(
+	PTARGET_FILE    Target
+	)
+{
+	if (Target->Dispatch)
+		ZeroDispatchFree(Target->Dispatch);
+	if (Target->Handle)
+		(void)CloseHandle(Target->Handle);
+	if (Target->ZeroMap)
+		ClusterMapFree(Target->ZeroMap);
+	if (Target->PunchMap)
+		ClusterMapFree(Target->PunchMap);
+	free(Target->SkipRuns);
+	ManifestFree(&Target->Manifest);
+	if (Target->Dedupe)
+		DedupeFileFree(Target->Dedupe);
+	memset(Target, 0, sizeof(*Target));
+}
+
+
+static void
+PrintDedupeReport(
+	_In_    PDEDUPE_INDEX   Index
+	)
+{
+	DEDUPE_STATS stats;
+
+	DedupeIndexGetStats(Index, &stats);
+	LogInfo(L"Hashed %llu data clusters. %8.2f MiB duplicate, %8.2f MiB probably "
+	        L"duplicate; %llu clusters did not fit the index.\n",
+	        stats.ClustersHashed,
+	        (double)stats.DuplicateBytes / 1048576.0,
+	        (double)stats.ProbableDuplicateBytes / 1048576.0,
+	        stats.ClustersNotIndexed);
+	if (stats.BytesCloned || stats.BytesNotCloned) {
+		LogInfo(L"Cloned %8.2f MiB of duplicate data, %8.2f MiB left as is.\n",
+		        (double)stats.BytesCloned / 1048576.0,
+		        (double)stats.BytesNotCloned / 1048576.0);
+	}
+}
+
+
+_Use_decl_annotations_
+BOOL
+PrintMap(
+	const MAKESPARSE_OPTIONS    *Options,
+	PCLUSTER_MAP                ZeroMap
+	)
+{
+	FILE    *fp;
+	DWORD   errRet;
+
+	fp = stdout;
+	if (Options->MapFile) {
+		fp = _wfopen(Options->MapFile, L"wb");
+		if (NULL == fp) {
+			LogError(L"Failed to open map file %s with errno %d\n",
+			         Options->MapFile, errno);
+			return FALSE;
+		}
+	} else {
+		LogInfo(L"Printing sparse cluster map\n");
+	}
+
+	errRet = ClusterMapExport(ZeroMap, fp, Options->MapFormat);
+	if (ERROR_SUCCESS != errRet)
+		LogError(L"Failed to write cluster map with error %#llx\n", (long long)errRet);
+
+	if (fp != stdout && fclose(fp) && ERROR_SUCCESS == errRet) {
+		LogError(L"Failed to write cluster map file %s with errno %d\n",
+		         Options->MapFile, errno);
+		errRet = ERROR_WRITE_FAULT;
+	}
+
+	return ERROR_SUCCESS == errRet;
+}
+
+
+static BOOL
+SaveShardResult(
+	_In_        const MAKESPARSE_OPTIONS    *Options,
+	_In_        const TARGET_FILE           *Target,
+	_In_        UINT64                      RangeOffset,
+	_In_        UINT64                      RangeLength,
+	_In_        DWORD                       Error
+	)
+{
+	SHARD_RESULT    result;
+	DWORD           errRet;
+
+	memset(&result, 0, sizeof(result));
+	wcscpy_s(result.Tool, ARRAYSIZE(result.Tool), L"MakeSparse");
+	result.FileSize      = Target->FileSize;
+	result.ClusterSize   = Target->ClusterSize;
+	result.RangeOffset   = RangeOffset;
+	result.RangeLength   = RangeLength;
+	result.Error         = Error;
+	result.BytesRead     = RangeLength;
+	result.BytesWritten  = Target->DispatchStats.BytesZeroed;
+	result.RangesWritten = Target->DispatchStats.RangesQueued;
+
+	errRet = ShardResultSave(Options->ShardResult, &result, Target->ZeroMap);
+	if (ERROR_SUCCESS != errRet) {
+		LogError(L"Failed to write shard result %s with error %#llx\n",
+		         Options->ShardResult, (long long)errRet);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+
 static VOID
 PrintUsageInfo(
 	_In_    LPWSTR      ExeName
 	)
 {
 	// TODO: Make this better.
-	LogInfo(L"%s [-p] [-m] Path\\To\\FileToMakeSparse.ext\n"
+	LogInfo(L"%s [-p | --online] [-m] [--map-format FORMAT] [--map-file MapFile]\n"
+	        L"\t[--queue-depth N] [--pipeline [--max-lag SIZE]]\n"
+	        L"\t[--min-run SIZE] [--align SIZE] [--max-ranges N] [--policy-report]\n"
+	        L"\t[--compact [--compact-budget SIZE]]\n"
+	        L"\t[--range OFFSET:LENGTH] [--shard-result Shard.txt]\n"
+	        L"\t[--deadline SECONDS]\n"
+	        L"\tPath\\To\\FileToMakeSparse.ext\n"
+	        L"%s [-p | --online] [--queue-depth N] [--min-run SIZE] [--align SIZE]\n"
+	        L"\t[--max-ranges N] [--threads N] [--max-io N] [--max-mem SIZE]\n"
+	        L"\t[--scan-cache Cache.db] [--recurse Path\\To\\Directory]\n"
+	        L"\t[--list FileList.txt]\n"
+	        L"%s [-p] [--queue-depth N] [--min-run SIZE] [--align SIZE]\n"
+	        L"\t[--max-ranges N] [--threads N] [--settle SECONDS]\n"
+	        L"\t--watch Path\\To\\Directory\n"
+	        L"\tAll forms also accept [--guest-fs] [--background] [--max-read SIZE]\n"
+	        L"\t[--dedupe | --dedupe-clone] [--dedupe-mem SIZE]\n"
+	        L"\t[--manifest | --manifest-chunks]\n"
+	        L"\t[--max-write SIZE] [--max-punch N] [--qos-file QosLimits.txt]\n"
+	        L"%s [-m] [--map-format FORMAT] [--map-file MapFile]\n"
+	        L"\t--merge-shards Shard.txt [Shard.txt ...]\n"
 	        L"\tSpecify -p to preserve file timestamps.\n"
-	        L"\tSpecify -m to print map of zero clusters.\n",
-	        ExeName);
+	        L"\tSpecify -m to print map of zero clusters. --map-format selects a\n"
+	        L"\t  bit grid (grid, the default), one line per run (runs) or JSON\n"
+	        L"\t  extents (json); --map-file writes the map to a file instead of\n"
+	        L"\t  the console. Both imply -m.\n"
+	        L"\tSpecify --online to process files other processes have open. Each\n"
+	        L"\t  range is locked and read again, 256K at a time, just before it is\n"
+	        L"\t  deallocated and skipped if it changed. WARNING: while a piece is\n"
+	        L"\t  locked, I/O other processes make to it fails with\n"
+	        L"\t  ERROR_LOCK_VIOLATION, so their writers must retry.\n"
+	        L"\tSpecify --guest-fs for raw disk images. Blocks the ext2/3/4 file\n"
+	        L"\t  systems inside report free are deallocated without being read.\n"
+	        L"\t  Not available with --online or --pipeline.\n"
+	        L"\tSpecify --manifest to keep a %s file next to each file\n"
+	        L"\t  and skip it if it has not changed since; a changed file has all\n"
+	        L"\t  of its data analyzed again. --manifest-chunks only analyzes the\n"
+	        L"\t  4M chunks of it whose allocation changed, missing data that was\n"
+	        L"\t  overwritten with zeros in the others.\n"
+	        L"\t  Not available with --online, --pipeline or --watch.\n"
+	        L"\tSpecify --queue-depth to set the number of zero range requests kept\n"
+	        L"\t  in flight to the file system (1 - %d, default %d).\n"
+	        L"\tSpecify --pipeline to dispatch zero ranges while the file is still\n"
+	        L"\t  being analyzed. --max-lag limits how far analysis may run ahead\n"
+	        L"\t  of dispatch (default 2G).\n"
+	        L"\tSpecify --min-run to leave zero runs shorter than SIZE allocated.\n"
+	        L"\tSpecify --align to only deallocate whole SIZE aligned chunks, such\n"
+	        L"\t  as the allocation unit of a thin provisioned disk.\n"
+	        L"\tSpecify --max-ranges to only deallocate the N largest zero runs.\n"
+	        L"\t  Not available with --pipeline.\n"
+	        L"\tSpecify --dedupe to report data clusters that duplicate others in\n"
+	        L"\t  the same or an earlier file, using at most --dedupe-mem bytes\n"
+	        L"\t  (default 256M) for the index. --dedupe-clone also shares them\n"
+	        L"\t  through block cloning on ReFS. Not available with --pipeline or\n"
+	        L"\t  --watch; --dedupe-clone not with --online.\n"
+	        L"\tSpecify --compact to move the data left between the deallocated\n"
+	        L"\t  ranges together on the volume, moving at most --compact-budget\n"
+	        L"\t  bytes (default 4G). Needs administrative rights.\n"
+	        L"\tSpecify --range to only process LENGTH bytes (0 for the rest of the\n"
+	        L"\t  file) starting at OFFSET, so several processes or machines can\n"
+	        L"\t  share one file. Both must be multiples of 64K and of the\n"
+	        L"\t  cluster size. Not available with -p, --max-ranges, --guest-fs,\n"
+	        L"\t  --manifest, --compact, --dedupe-clone or --pipeline.\n"
+	        L"\t  --shard-result writes what was done to a file, and\n"
+	        L"\t  --merge-shards combines those files into one report and map.\n"
+	        L"\tSpecify --deadline to stop after about SECONDS seconds. The parts\n"
+	        L"\t  of the file expected to free the most are done first, and the\n"
+	        L"\t  next run with --deadline continues with the rest, as recorded\n"
+	        L"\t  in a %s file. Not available with --pipeline,\n"
+	        L"\t  --policy-report, --max-ranges, --range, --manifest, --dedupe\n"
+	        L"\t  or --compact.\n"
+	        L"\tSpecify --policy-report to print what a set of policies would\n"
+	        L"\t  deallocate without modifying the file.\n"
+	        L"\tSpecify --recurse to process every file under a directory and\n"
+	        L"\t  --list to process every file named in a text file, one per line.\n"
+	        L"\t  --threads sets the number of worker threads (default one per\n"
+	        L"\t  processor), --max-io the number of files being read or\n"
+	        L"\t  deallocated at once and --max-mem the memory allowed for the\n"
+	        L"\t  cluster maps of files in progress.\n"
+	        L"\t  --scan-cache keeps the results in a database shared by every\n"
+	        L"\t  run using it; files whose size and last write time are what\n"
+	        L"\t  it recorded are skipped without being read. Not available with\n"
+	        L"\t  --dedupe.\n"
+	        L"\tSpecify --watch to keep processing files under a directory as they\n"
+	        L"\t  are written until Ctrl+C is pressed. A file is processed once it\n"
+	        L"\t  has not been modified for --settle seconds (default %d) and\n"
+	        L"\t  nobody has it open. --threads defaults to 2.\n"
+	        QOS_USAGE_TEXT,
+	        ExeName, ExeName, ExeName, ExeName, MANIFEST_SUFFIX,
+	        MAX_ZERO_QUEUE_DEPTH, DEFAULT_ZERO_QUEUE_DEPTH,
+	        DEADLINE_PROGRESS_SUFFIX, DEFAULT_WATCH_SETTLE_SECONDS);
 }
 
 
@@ -206,21 +1427,23 @@ PrintUsageInfo(
 _Success_(return == 0)
 static int
 ParseCommandLine(
-	_In_        int         argc,
-	_In_        WCHAR       **argv,
+	_In_        int                 argc,
+	_In_        WCHAR               **argv,
 	_Out_ _Post_valid_
-	            LPWSTR      *InvocationName,
-	_Out_       BOOL        *PreserveFileTimes,
-	_Out_       BOOL        *PrintSparseMap,
-	_Out_       LPWSTR      *FileName
+	            LPWSTR              *InvocationName,
+	_Out_       PMAKESPARSE_OPTIONS Options
 	)
 {
-	int     ret, i;
-	BOOL    flTimes, sMap;
+	int                 ret, i;
+	UINT64              tmp;
+	MAKESPARSE_OPTIONS  opts;
 
 	ret = -1;
-	flTimes = 0;
-	sMap = 0;
+	memset(&opts, 0, sizeof(opts));
+	opts.ZeroQueueDepth = DEFAULT_ZERO_QUEUE_DEPTH;
+	opts.MapFormat = ClusterMapFormatGrid;
+	opts.PipelineMaxLag = DEFAULT_PIPELINE_MAX_LAG;
+	opts.SettleSeconds = DEFAULT_WATCH_SETTLE_SECONDS;
 
 	/* Check for funny business with the invocation method */
 	if (argc) {
@@ -231,23 +1454,223 @@ ParseCommandLine(
 	}
 
 	/* Validate we have expected number of arguments. */
-	if (argc < 2 || argc > 4 ) {
+	if (argc < 2) {
 		goto func_return;
 	}
 
-	for (i = 1; i < (argc - 1); ++i) {
+	for (i = 1; i < argc; ++i) {
 		if (!wcscmp(argv[i], L"-p")) {
-			flTimes = 1;
+			opts.PreserveFileTimes = TRUE;
 		} else if (!wcscmp(argv[i], L"-m")) {
-			sMap = 1;
-		} else {
+			opts.PrintSparseMap = TRUE;
+		} else if (!wcscmp(argv[i], L"--map-format")) {
+			if (++i >= argc)
+				goto func_return;
+			if (!wcscmp(argv[i], L"runs"))
+				opts.MapFormat = ClusterMapFormatRuns;
+			else if (!wcscmp(argv[i], L"json"))
+				opts.MapFormat = ClusterMapFormatJson;
+			else if (!wcscmp(argv[i], L"grid"))
+				opts.MapFormat = ClusterMapFormatGrid;
+			else
+				goto func_return;
+			opts.PrintSparseMap = TRUE;
+		} else if (!wcscmp(argv[i], L"--map-file")) {
+			if (++i >= argc)
+				goto func_return;
+			opts.MapFile = argv[i];
+			opts.PrintSparseMap = TRUE;
+		} else if (!wcscmp(argv[i], L"--queue-depth")) {
+			if (++i >= argc || !ParseSizeArg(argv[i], &tmp)
+			    || !tmp || MAX_ZERO_QUEUE_DEPTH < tmp)
+				goto func_return;
+			opts.ZeroQueueDepth = (DWORD)tmp;
+		} else if (!wcscmp(argv[i], L"--pipeline")) {
+			opts.Pipeline = TRUE;
+		} else if (!wcscmp(argv[i], L"--max-lag")) {
+			if (++i >= argc || !ParseSizeArg(argv[i], &tmp) || !tmp)
+				goto func_return;
+			opts.PipelineMaxLag = tmp;
+		} else if (!wcscmp(argv[i], L"--min-run")) {
+			if (++i >= argc || !ParseSizeArg(argv[i], &opts.Policy.MinRunLength))
+				goto func_return;
+		} else if (!wcscmp(argv[i], L"--align")) {
+			if (++i >= argc || !ParseSizeArg(argv[i], &opts.Policy.Alignment))
+				goto func_return;
+		} else if (!wcscmp(argv[i], L"--max-ranges")) {
+			if (++i >= argc || !ParseSizeArg(argv[i], &tmp) || !tmp)
+				goto func_return;
+			opts.Policy.MaxRanges = tmp;
+		} else if (!wcscmp(argv[i], L"--policy-report")) {
+			opts.PolicyReport = TRUE;
+		} else if (!wcscmp(argv[i], L"--recurse")) {
+			if (++i >= argc)
+				goto func_return;
+			opts.RecurseRoot = argv[i];
+		} else if (!wcscmp(argv[i], L"--list")) {
+			if (++i >= argc)
+				goto func_return;
+			opts.ListFile = argv[i];
+		} else if (!wcscmp(argv[i], L"--threads")) {
+			if (++i >= argc || !ParseSizeArg(argv[i], &tmp)
+			    || !tmp || MAX_BATCH_THREADS < tmp)
+				goto func_return;
+			opts.Threads = (DWORD)tmp;
+		} else if (!wcscmp(argv[i], L"--max-io")) {
+			if (++i >= argc || !ParseSizeArg(argv[i], &tmp)
+			    || !tmp || MAX_BATCH_THREADS < tmp)
+				goto func_return;
+			opts.MaxIo = (DWORD)tmp;
+		} else if (!wcscmp(argv[i], L"--max-mem")) {
+			if (++i >= argc || !ParseSizeArg(argv[i], &tmp) || !tmp)
+				goto func_return;
+			opts.MaxMemory = tmp;
+		} else if (!wcscmp(argv[i], L"--online")) {
+			opts.Online = TRUE;
+		} else if (!wcscmp(argv[i], L"--guest-fs")) {
+			opts.GuestFs = TRUE;
+		} else if (!wcscmp(argv[i], L"--range")) {
+			if (++i >= argc
+			    || !ParseRangeArg(argv[i], &opts.RangeOffset, &opts.RangeLength))
+				goto func_return;
+			opts.Ranged = TRUE;
+		} else if (!wcscmp(argv[i], L"--shard-result")) {
+			if (++i >= argc)
+				goto func_return;
+			opts.ShardResult = argv[i];
+		} else if (!wcscmp(argv[i], L"--merge-shards")) {
+			/* Everything after it names a shard result. */
+			opts.ShardFiles = &argv[i + 1];
+			opts.NumShardFiles = argc - (i + 1);
+			if (0 == opts.NumShardFiles)
+				goto func_return;
+			break;
+		} else if (!wcscmp(argv[i], L"--scan-cache")) {
+			if (++i >= argc)
+				goto func_return;
+			opts.ScanCachePath = argv[i];
+		} else if (!wcscmp(argv[i], L"--manifest")) {
+			opts.Manifest = TRUE;
+		} else if (!wcscmp(argv[i], L"--manifest-chunks")) {
+			opts.Manifest = TRUE;
+			opts.ManifestChunks = TRUE;
+		} else if (!wcscmp(argv[i], L"--dedupe")) {
+			opts.Dedupe = TRUE;
+		} else if (!wcscmp(argv[i], L"--dedupe-clone")) {
+			opts.Dedupe = TRUE;
+			opts.DedupeClone = TRUE;
+		} else if (!wcscmp(argv[i], L"--dedupe-mem")) {
+			if (++i >= argc || !ParseSizeArg(argv[i], &opts.DedupeMemory)
+			    || !opts.DedupeMemory)
+				goto func_return;
+		} else if (!wcscmp(argv[i], L"--compact")) {
+			opts.Compact = TRUE;
+		} else if (!wcscmp(argv[i], L"--compact-budget")) {
+			if (++i >= argc || !ParseSizeArg(argv[i], &opts.CompactBudget))
+				goto func_return;
+		} else if (!wcscmp(argv[i], L"--watch")) {
+			if (++i >= argc)
+				goto func_return;
+			opts.WatchRoot = argv[i];
+		} else if (!wcscmp(argv[i], L"--settle")) {
+			if (++i >= argc || !ParseSizeArg(argv[i], &tmp) || MAXDWORD / 1000 < tmp)
+				goto func_return;
+			opts.SettleSeconds = (DWORD)tmp;
+		} else if (!wcscmp(argv[i], L"--deadline")) {
+			if (++i >= argc || !ParseSizeArg(argv[i], &tmp)
+			    || !tmp || MAXDWORD / 1000 < tmp)
+				goto func_return;
+			opts.DeadlineSeconds = (DWORD)tmp;
+		} else if (argv[i][0] != L'-' && NULL == opts.FileName) {
+			opts.FileName = argv[i];
+		} else if (QosArgConsumed != QosParseArg(argc, argv, &i, &opts.Qos)) {
 			goto func_return;
 		}
 	}
 
-	*PreserveFileTimes = flTimes;
-	*PrintSparseMap = sMap;
-	*FileName = argv[i];
+	/* Both need the whole map before anything is deallocated. */
+	if (opts.Pipeline && (opts.Policy.MaxRanges || opts.PolicyReport))
+		goto func_return;
+
+	/* Restoring the timestamps would undo those of other writers, and watch
+	 * mode only processes files nobody has open. */
+	if (opts.Online && (opts.PreserveFileTimes || opts.WatchRoot))
+		goto func_return;
+
+	/* Free guest blocks rarely hold zeros, so the online re-read would skip
+	 * them, and the pipeline scans the file on its own. */
+	if (opts.GuestFs && (opts.Online || opts.Pipeline))
+		goto func_return;
+
+	if (opts.CompactBudget && !opts.Compact)
+		goto func_return;
+
+	/* Other writers would change the file behind the fingerprints, and the
+	 * pipeline deallocates before the whole allocation is known. */
+	if (opts.Manifest && (opts.Online || opts.Pipeline || opts.WatchRoot))
+		goto func_return;
+
+	/* The pipeline scans on its own and a watched tree never ends. Cloning
+	 * compares and clones in two steps, which other writers could race. */
+	if (opts.Dedupe && (opts.Pipeline || opts.WatchRoot))
+		goto func_return;
+	if (opts.DedupeClone && opts.Online)
+		goto func_return;
+	/* A shard only sees part of the file, so nothing that needs all of it
+	 * works: picking the largest ranges, free guest blocks and manifests
+	 * of the whole file, moving data around, cloning from other shards'
+	 * data or the pipeline's own scan. Restoring the timestamps would undo
+	 * the other shards' writes. */
+	if (opts.Ranged
+	    && (opts.Policy.MaxRanges || opts.GuestFs || opts.Manifest || opts.Compact
+	        || opts.DedupeClone || opts.Pipeline || opts.PreserveFileTimes))
+		goto func_return;
+
+	/* Deadline mode picks its own regions and deallocates each on its own,
+	 * so nothing that needs the whole map or scans on its own fits. */
+	if (opts.DeadlineSeconds
+	    && (opts.Pipeline || opts.PolicyReport || opts.Policy.MaxRanges || opts.Ranged
+	        || opts.Manifest || opts.Dedupe || opts.Compact))
+		goto func_return;
+
+	if (opts.NumShardFiles) {
+		if (opts.FileName || opts.RecurseRoot || opts.ListFile || opts.WatchRoot
+		    || opts.Ranged || opts.ShardResult || opts.Dedupe)
+			goto func_return;
+		goto options_valid;
+	}
+
+	/* Files skipped through the scan cache never reach the index. */
+	if (opts.Dedupe && opts.ScanCachePath)
+		goto func_return;
+	if (opts.DedupeMemory && !opts.Dedupe)
+		goto func_return;
+	if (0 == opts.DedupeMemory)
+		opts.DedupeMemory = DEFAULT_DEDUPE_MEMORY;
+	if (0 == opts.CompactBudget)
+		opts.CompactBudget = DEFAULT_COMPACT_BUDGET;
+
+	/* Exactly one of a single file, batch input or a watched directory. The
+	 * per-file outputs and pipelining only make sense for a single file. */
+	if (opts.WatchRoot) {
+		if (opts.FileName || opts.RecurseRoot || opts.ListFile
+		    || opts.PrintSparseMap || opts.Pipeline || opts.PolicyReport
+		    || opts.Compact || opts.ScanCachePath
+		    || opts.MaxIo || opts.MaxMemory)
+			goto func_return;
+	} else if (opts.RecurseRoot || opts.ListFile) {
+		if (opts.FileName || opts.PrintSparseMap || opts.Pipeline
+		    || opts.PolicyReport || opts.Compact)
+			goto func_return;
+	} else if (NULL == opts.FileName || opts.ScanCachePath
+	           || opts.Threads || opts.MaxIo || opts.MaxMemory) {
+		goto func_return;
+	}
+	if (NULL == opts.FileName && (opts.Ranged || opts.ShardResult || opts.DeadlineSeconds))
+		goto func_return;
+
+options_valid:
+	*Options = opts;
 	ret = 0;
 
 func_return:
@@ -261,79 +1684,133 @@ wmain(
 	WCHAR       **argv
 	)
 {
-	SIZE_T          fsClusterSize;
-	HANDLE          fl;
-	BOOL            prsvTm, printSparseMap;
-	LPWSTR          invocationName, flName;
-	FILETIME        tmCrt;
-	FILETIME        tmAcc;
-	FILETIME        tmWrt;
-	LARGE_INTEGER   flSz;
-	UINT64          startQPCVal, hours, minutes, seconds;
-	DWORD           errRet;
-	PCLUSTER_MAP    zeroClusterMap;
-	int             retVal;
-
-	fl = NULL;
-	zeroClusterMap = NULL;
+	LPWSTR              invocationName;
+	MAKESPARSE_OPTIONS  opts;
+	TARGET_FILE         target;
+	UINT64              startQPCVal, hours, minutes, seconds;
+	UINT64              rangeOffset, rangeLength;
+	DWORD               errRet;
+	PCLUSTER_MAP        runMap;
+	COMPACT_STATS       compactStats;
+	int                 retVal;
+
+	memset(&target, 0, sizeof(target));
+	rangeOffset = rangeLength = 0;
+	errRet = ERROR_SUCCESS;
 
 	SparseFileLibInit();
 
 	startQPCVal = GetQPCVal();
 
-	if (ParseCommandLine(argc, argv, &invocationName,
-	                     &prsvTm, &printSparseMap, &flName)) {
+	if (ParseCommandLine(argc, argv, &invocationName, &opts)) {
 		PrintUsageInfo(invocationName);
 		return EXIT_FAILURE;
 	}
 
-	LogInfo(L"Opening file %s\n", flName);
+	if (ERROR_SUCCESS != QosStart(&opts.Qos))
+		return EXIT_FAILURE;
 
-	fl = OpenFileExclusive(flName,
-	                       FILE_FLAG_SEQUENTIAL_SCAN,
-	                       &flSz,
-	                       &fsClusterSize,
-	                       &tmCrt,
-	                       &tmAcc,
-	                       &tmWrt);
-	if (NULL == fl) {
-		LogError(L"Failed to open file %s with error %#llx\n",
-		         flName, (long long)GetLastError());
-		goto error_return;
+	if (opts.Dedupe) {
+		opts.DedupeIndex = DedupeIndexCreate(opts.DedupeMemory);
+		if (NULL == opts.DedupeIndex) {
+			LogError(L"Failed DedupeIndexCreate with error %#llx\n",
+			         (long long)GetLastError());
+			retVal = EXIT_FAILURE;
+			goto func_return;
+		}
 	}
 
-	if (fsClusterSize == 0) {
-		fsClusterSize = DEFAULT_FS_CLUSTER_SIZE;
-		LogInfo(L"Unable to determine cluster size of file system. "
-		        L"Using default cluster size: %ld\n",
-		        (LONG)fsClusterSize);
-	} else {
-		LogInfo(L"Cluster size: %ld\n", (LONG)fsClusterSize);
+	if (opts.NumShardFiles) {
+		retVal = (ERROR_SUCCESS == RunMergeShards(&opts)) ? EXIT_SUCCESS : EXIT_FAILURE;
+		goto func_return;
 	}
 
-	LogInfo(L"Starting file analysis.\n");
-	if (!BuildSparseMap(fl, stdout, STATS_TIMER_INTERVAL_MS, &fsClusterSize,
-	                    &zeroClusterMap)) {
-		LogError(L"Failed BuildSparseMap with error %#llx\n",
-		         (long long)GetLastError());
-		goto error_return;
+	if (opts.WatchRoot) {
+		retVal = (ERROR_SUCCESS == RunWatch(&opts)) ? EXIT_SUCCESS : EXIT_FAILURE;
+		goto func_return;
 	}
 
-	LogInfo(L"Completed file analysis. Starting to dispatch zero ranges to file system.\n");
+	if (NULL == opts.FileName) {
+		retVal = (ERROR_SUCCESS == RunBatch(&opts)) ? EXIT_SUCCESS : EXIT_FAILURE;
+		goto func_return;
+	}
 
-	// TODO: Don't blindly set this if no zero clusters detected.
-	errRet = SetSparseAttribute(fl);
-	if (ERROR_SUCCESS != errRet) {
-		LogError(L"Error %#llx from SetSparseAttribute call.\n",
-		         (long long)errRet);
+	LogInfo(L"Opening file %s\n", opts.FileName);
+
+	if (ERROR_SUCCESS != TargetFileOpen(&opts, opts.FileName, &target))
 		goto error_return;
+
+	LogInfo(L"Cluster size: %ld\n", (LONG)target.ClusterSize);
+
+	/* Without --range the whole file is the one shard. */
+	rangeOffset = 0;
+	rangeLength = target.FileSize;
+	if (opts.Ranged) {
+		rangeOffset = opts.RangeOffset;
+		rangeLength = opts.RangeLength;
+		if (!ShardRangeResolve(target.FileSize, target.ClusterSize,
+		                       rangeOffset, &rangeLength)) {
+			LogError(L"Range %llu:%llu does not fit the file or is not a multiple "
+			         L"of %llu bytes.\n",
+			         opts.RangeOffset, opts.RangeLength,
+			         (UINT64)MAX(target.ClusterSize, SPARSE_MAP_RANGE_ALIGNMENT));
+			errRet = ERROR_INVALID_PARAMETER;
+			goto error_return;
+		}
+		LogInfo(L"Processing %8.2f MiB starting at offset %llu.\n",
+		        (double)rangeLength / 1048576.0, rangeOffset);
+	}
+
+	LogInfo(L"Starting file analysis.\n");
+	if (opts.Pipeline) {
+		errRet = PipelinedSparseRanges(&opts, &target);
+		LogInfo(L"Completed file analysis.\n");
+	} else if (opts.DeadlineSeconds) {
+		errRet = DeadlineSparseRanges(&opts, &target);
+		LogInfo(L"Completed file analysis.\n");
+	} else {
+		/* An empty shard is only possible for an empty file, where zero
+		 * already means the whole of it. */
+		errRet = TargetFileScan(&target, rangeOffset, rangeLength, stdout);
+		if (ERROR_SUCCESS != errRet) {
+			LogError(L"Failed BuildSparseMap with error %#llx\n",
+			         (long long)errRet);
+			goto error_return;
+		}
+
+		if (opts.PolicyReport) {
+			LogInfo(L"Completed file analysis.\n");
+			errRet = TargetFileRunMap(&target, &runMap);
+			if (ERROR_SUCCESS != errRet) {
+				LogError(L"Failed ClusterMapAndNot with error %#llx\n",
+				         (long long)errRet);
+				goto error_return;
+			}
+			if (ERROR_SUCCESS != PrintPolicyReport(target.FileSize,
+			                                       target.ClusterSize,
+			                                       &target.Policy,
+			                                       runMap))
+				goto error_return;
+			retVal = EXIT_SUCCESS;
+			goto func_return;
+		}
+
+		LogInfo(L"Completed file analysis. Starting to dispatch zero ranges to file system.\n");
+
+		errRet = TargetFileDeallocate(&opts, &target);
+	}
+
+	LogInfo(L"Dispatched %llu zero ranges covering %8.2f MiB. %llu ranges failed.\n",
+	        target.DispatchStats.RangesQueued,
+	        (double)target.DispatchStats.BytesZeroed / 1048576.0,
+	        target.DispatchStats.RangesFailed);
+	if (opts.Online) {
+		LogInfo(L"Skipped %llu ranges that changed and %llu ranges locked by "
+		        L"another process.\n",
+		        target.DispatchStats.RangesChanged,
+		        target.DispatchStats.RangesLocked);
 	}
 
-	errRet = SetSparseRanges(fl,
-	                         (UINT64)flSz.QuadPart,
-	                         fsClusterSize,
-	                         1,
-	                         zeroClusterMap);
 	if (ERROR_SUCCESS != errRet) {
 		LogError(L"Error %#llx from SetSparseRanges call.\n",
 		          (long long)errRet);
@@ -342,21 +1819,39 @@ wmain(
 
 	LogInfo(L"Marking zero ranges complete.\n");
 
-	/* Reset modified and access timestamps if preserve filetimes specified */
-	if (prsvTm) {
-		if (0 == SetFileTime(fl, NULL, &tmAcc, &tmWrt)) {
-			LogError(L"WARNING: Failed to preserve file times on file.\n");
+	if (0 == target.DispatchStats.RangesQueued)
+		LogInfo(L"No allocated zero ranges found. File contents left untouched.\n");
+
+	if (opts.Compact) {
+		LogInfo(L"Starting compaction.\n");
+		errRet = CompactFile(target.Handle,
+		                     opts.FileName,
+		                     target.ClusterSize,
+		                     opts.CompactBudget,
+		                     &compactStats);
+		target.Modified |= (0 != compactStats.BytesMoved);
+		if (ERROR_SUCCESS != errRet) {
+			LogError(L"WARNING: Compaction of %s failed with error %#llx\n",
+			         opts.FileName, (long long)errRet);
+		} else {
+			LogInfo(L"Moved %llu regions covering %8.2f MiB. %llu regions failed.\n"
+			        L"Extents: %llu before, %llu after. Fragments: %llu before, "
+			        L"%llu after.\n",
+			        compactStats.RegionsCompacted,
+			        (double)compactStats.BytesMoved / 1048576.0,
+			        compactStats.RegionsFailed,
+			        compactStats.ExtentsBefore, compactStats.ExtentsAfter,
+			        compactStats.FragmentsBefore, compactStats.FragmentsAfter);
 		}
 	}
 
-	/* Flush buffers on file */
-	if (!FlushFileBuffers(fl)) {
-		LogError(L"WARNING: Failed FlushFileBuffers on target file with lastErr %lu.\n", GetLastError());
-	}
+	TargetFileClose(&opts, &target);
 
-	// What would we do if this failed anyways?
-	(void)CloseHandle(fl);
-	fl = NULL;
+	if (opts.ShardResult && !SaveShardResult(&opts, &target, rangeOffset, rangeLength,
+	                                         ERROR_SUCCESS)) {
+		retVal = EXIT_FAILURE;
+		goto func_return;
+	}
 
 	seconds = ElapsedQPCInSeconds(startQPCVal, GetQPCVal());
 	hours = seconds / (60 * 60);
@@ -366,25 +1861,27 @@ wmain(
 	LogInfo(L"Completed processing in: %llu hours, %llu minutes, %llu seconds\n",
 	        hours, minutes, seconds);
 
-	if (printSparseMap) {
-		LogInfo(L"Printing sparse cluster map\n");
-		ClusterMapPrint(zeroClusterMap, stdout);
-	}
-
-	ClusterMapFree(zeroClusterMap);
-	zeroClusterMap = NULL;
+	if (opts.PrintSparseMap && !PrintMap(&opts, target.ZeroMap))
+		goto error_return;
 
 	retVal = EXIT_SUCCESS;
 	goto func_return;
 
 error_return:
 	retVal = EXIT_FAILURE;
+	/* The coordinator has to learn about a shard that failed too. */
+	if (opts.ShardResult && target.ZeroMap) {
+		(void)SaveShardResult(&opts, &target, rangeOffset, rangeLength,
+		                      ERROR_SUCCESS == errRet ? ERROR_GEN_FAILURE : errRet);
+	}
 
 func_return:
-	if (fl)
-		(void)CloseHandle(fl);
-	if (zeroClusterMap)
-		ClusterMapFree(zeroClusterMap);
+	TargetFileFree(&target);
+	if (opts.DedupeIndex) {
+		PrintDedupeReport(opts.DedupeIndex);
+		DedupeIndexFree(opts.DedupeIndex);
+	}
+	QosStop();
 
 	return retVal;
 }
@@ -0,0 +1,686 @@
+/* Standard BSD license disclaimer.
+
+Copyright(c) 2016-2021, Lance D. Stringham
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Declarations shared between the MakeSparse translation units. Nothing in
+ * here is meant for consumption outside of MakeSparse. */
+
+#pragma once
+
+#ifndef MAKESPARSE_H
+#define MAKESPARSE_H
+
+#include <windows.h>
+
+#include <SparseFileLib.h>
+
+/* Default number of FSCTL_SET_ZERO_DATA requests allowed in flight at once. */
+#define DEFAULT_ZERO_QUEUE_DEPTH    16
+/* Upper bound on the queue depth that can be requested on the command line. */
+#define MAX_ZERO_QUEUE_DEPTH        1024
+
+
+typedef struct ZERO_DISPATCH *PZERO_DISPATCH;
+
+typedef struct ZERO_DISPATCH_STATS {
+	UINT64      RangesQueued;
+	UINT64      RangesCompleted;
+	UINT64      RangesFailed;
+	UINT64      BytesZeroed;
+	/* Ranges ZERO_DISPATCH_VERIFY skipped because they were no longer all
+	 * zeros, or because another handle held a lock on part of them. */
+	UINT64      RangesChanged;
+	UINT64      RangesLocked;
+} ZERO_DISPATCH_STATS, *PZERO_DISPATCH_STATS;
+
+/* Re-read every range just before it is deallocated and skip it unless it
+ * still reads as zeros. Ranges are split into pieces of at most 256K that are
+ * checked and deallocated on their own, and each piece is locked against I/O
+ * through other handles from its check until its request completes. Writes
+ * through another process's mapped view are not stopped by the lock. The
+ * stats count pieces. */
+#define ZERO_DISPATCH_VERIFY        0x00000001
+
+/* Create a dispatcher that issues zero range requests against FileHandle with
+ * at most MaxInFlight requests outstanding. FileHandle must have been opened
+ * with FILE_FLAG_OVERLAPPED and must not already be associated with an I/O
+ * completion port. The dispatcher binds FileHandle to a completion port of its
+ * own for the life of the handle, so only one dispatcher can ever be created
+ * per handle, even after the first is freed; keep it for as long as the
+ * handle is used. Flags is zero or ZERO_DISPATCH_VERIFY. Returns NULL on
+ * failure; check GetLastError. */
+_Success_(return != NULL)
+PZERO_DISPATCH
+ZeroDispatchCreate(
+	_In_        HANDLE          FileHandle,
+	_In_        DWORD           MaxInFlight,
+	_In_        DWORD           Flags
+	);
+
+/* Queue the range [FileOffset, BeyondFinalZero) to be deallocated. Blocks only
+ * when MaxInFlight requests are already outstanding. Failures of individual
+ * ranges are logged and counted but do not fail the call; a non-success return
+ * means the dispatcher itself can no longer make progress. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD
+ZeroDispatchQueue(
+	_Inout_     PZERO_DISPATCH  Dispatch,
+	_In_        UINT64          FileOffset,
+	_In_        UINT64          BeyondFinalZero
+	);
+
+/* Wait for every queued range to complete. Returns the first error any range
+ * or the dispatcher itself failed with, or ERROR_SUCCESS. */
+_Must_inspect_result_
+DWORD
+ZeroDispatchDrain(
+	_Inout_     PZERO_DISPATCH  Dispatch
+	);
+
+void
+ZeroDispatchGetStats(
+	_In_        PZERO_DISPATCH          Dispatch,
+	_Out_       PZERO_DISPATCH_STATS    Stats
+	);
+
+/* Any requests still in flight are waited on before the dispatcher is freed. */
+void
+ZeroDispatchFree(
+	_In_ _Post_invalid_
+	            PZERO_DISPATCH  Dispatch
+	);
+
+
+/* Called for every range of zero clusters selected for deallocation. */
+typedef DWORD (*PZERO_RUN_CALLBACK)(
+	_Inout_opt_ PVOID       Context,
+	_In_        UINT64      FileOffset,
+	_In_        UINT64      BeyondFinalZero
+	);
+
+/* Decides which runs of zero clusters are worth deallocating. Punching every
+ * isolated cluster fragments the file, so runs can be required to have a
+ * minimum length, be trimmed to a reclaim granularity such as a thin
+ * provisioning chunk or compression unit, and be limited in number. */
+typedef struct PUNCH_POLICY {
+	/* Runs shorter than this once aligned are left allocated. */
+	UINT64      MinRunLength;
+	/* Deallocated ranges start and end on a multiple of this unless they end
+	 * at the end of the file. */
+	UINT64      Alignment;
+	/* Only the largest MaxRanges runs are deallocated. Zero for no limit. */
+	UINT64      MaxRanges;
+} PUNCH_POLICY, *PPUNCH_POLICY;
+
+/* Fill in defaults and round the policy to whole clusters. Zero values mean a
+ * single cluster. */
+void
+PunchPolicyNormalize(
+	_Inout_     PPUNCH_POLICY   Policy,
+	_In_        SIZE_T          ClusterSize
+	);
+
+/* Apply the length and alignment rules to the zero run [*Start, *End).
+ * Returns FALSE if nothing of the run should be deallocated. */
+_Success_(return == TRUE)
+BOOL
+PunchPolicyTrimRun(
+	_In_        const PUNCH_POLICY  *Policy,
+	_In_        SIZE_T              ClusterSize,
+	_In_        UINT64              FileSize,
+	_Inout_     UINT64              *Start,
+	_Inout_     UINT64              *End
+	);
+
+/* Keeps the largest MaxRanges ranges handed to it. RangeSelectorAdd matches
+ * PZERO_RUN_CALLBACK with the selector as the context. */
+typedef struct RANGE_SELECTOR *PRANGE_SELECTOR;
+
+_Success_(return != NULL)
+PRANGE_SELECTOR
+RangeSelectorCreate(
+	_In_        UINT64          MaxRanges
+	);
+
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD
+RangeSelectorAdd(
+	_Inout_opt_ PVOID           Selector,
+	_In_        UINT64          FileOffset,
+	_In_        UINT64          BeyondFinalZero
+	);
+
+/* Report the kept ranges in file order. Stops at the first callback error.
+ * Ordering the ranges destroys the heap so nothing may be added afterwards. */
+_Must_inspect_result_
+DWORD
+RangeSelectorEnumerate(
+	_Inout_     PRANGE_SELECTOR     Selector,
+	_In_        PZERO_RUN_CALLBACK  Callback,
+	_Inout_opt_ PVOID               Context
+	);
+
+void
+RangeSelectorFree(
+	_In_ _Post_invalid_
+	            PRANGE_SELECTOR Selector
+	);
+
+
+
+/* This value will be used if the cluster size of the filesystem cannot be
+ * determined automatically. */
+#define DEFAULT_FS_CLUSTER_SIZE     4096
+
+/* Default distance the scan may run ahead of dispatch in pipelined mode. */
+#define DEFAULT_PIPELINE_MAX_LAG    (2ull * 1024 * 1024 * 1024)
+
+typedef struct MAKESPARSE_OPTIONS {
+	BOOL            PreserveFileTimes;
+	BOOL            PrintSparseMap;
+	CLUSTER_MAP_FORMAT  MapFormat;
+	/* The map goes to stdout if NULL. */
+	LPWSTR          MapFile;
+	BOOL            Pipeline;
+	BOOL            PolicyReport;
+	/* Share the file with other processes and verify each range just before
+	 * deallocating it. */
+	BOOL            Online;
+	/* Treat blocks a guest file system inside a disk image has not allocated
+	 * as zeros. */
+	BOOL            GuestFs;
+	/* Move fragmented data together once the zero ranges are deallocated. */
+	BOOL            Compact;
+	UINT64          CompactBudget;
+	/* Find duplicate data clusters within and across files, and with
+	 * DedupeClone share them through block cloning. DedupeIndex is created
+	 * from DedupeMemory once the command line is parsed. */
+	BOOL            Dedupe;
+	BOOL            DedupeClone;
+	UINT64          DedupeMemory;
+	PDEDUPE_INDEX   DedupeIndex;
+	/* Keep a sidecar manifest and only analyze what changed since it was
+	 * written. With ManifestChunks the chunks of a changed file whose
+	 * allocation is the same are skipped too, missing data zeroed in place
+	 * there. */
+	BOOL            Manifest;
+	BOOL            ManifestChunks;
+	/* Batch mode. Database of earlier results used to skip files that have
+	 * not changed since. */
+	LPWSTR          ScanCachePath;
+	/* Single file mode. Only process [RangeOffset, RangeOffset + RangeLength)
+	 * and share the file with the processes handling the other shards. */
+	BOOL            Ranged;
+	UINT64          RangeOffset;
+	UINT64          RangeLength;
+	/* Write what was done to this file for --merge-shards. */
+	LPWSTR          ShardResult;
+	/* Merge the shard result files instead of processing a file. */
+	LPWSTR          *ShardFiles;
+	int             NumShardFiles;
+	/* Single file mode. Work on the most promising regions first and stop
+	 * once this many seconds have passed. */
+	DWORD           DeadlineSeconds;
+	DWORD           ZeroQueueDepth;
+	UINT64          PipelineMaxLag;
+	PUNCH_POLICY    Policy;
+	LPWSTR          FileName;
+	/* Batch mode. Either or both inputs may be given instead of FileName. */
+	LPWSTR          RecurseRoot;
+	LPWSTR          ListFile;
+	DWORD           Threads;
+	DWORD           MaxIo;
+	UINT64          MaxMemory;
+	/* Watch mode. Replaces FileName and the batch inputs. */
+	LPWSTR          WatchRoot;
+	DWORD           SettleSeconds;
+	QOS_OPTIONS     Qos;
+} MAKESPARSE_OPTIONS, *PMAKESPARSE_OPTIONS;
+
+
+/* Clusters [First, End). */
+typedef struct CLUSTER_RUN {
+	UINT64      First;
+	UINT64      End;
+} CLUSTER_RUN, *PCLUSTER_RUN;
+
+/* Find the clusters of the raw disk image File that only hold blocks its
+ * guest file systems have not allocated. Partitions are found through an MBR
+ * or GPT, or the image is taken as a bare file system; ext2, ext3 and ext4
+ * are understood. The runs are returned in increasing order and are freed by
+ * the caller. Finding no file system is not an error. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD
+GuestFsFindFreeRuns(
+	_In_        HANDLE          File,
+	_In_        UINT64          FileSize,
+	_In_        SIZE_T          ClusterSize,
+	_Outptr_result_maybenull_
+	            PCLUSTER_RUN    *Runs,
+	_Out_       SIZE_T          *NumRuns
+	);
+
+
+/* Files are compared with their manifest in chunks of this size. A multiple
+ * of SPARSE_MAP_RANGE_ALIGNMENT and of every cluster size. */
+#define MANIFEST_CHUNK_SIZE         (4 * 1024 * 1024)
+/* Appended to the path of a file to name its manifest. */
+#define MANIFEST_SUFFIX             L".sparsemanifest"
+
+/* State of a chunk when the manifest was written. */
+#define MANIFEST_CHUNK_UNKNOWN      0
+/* Not a single allocated cluster. */
+#define MANIFEST_CHUNK_HOLE         1
+/* No zero clusters. */
+#define MANIFEST_CHUNK_DATA         2
+/* Both zero and data clusters. */
+#define MANIFEST_CHUNK_MIXED        3
+
+typedef struct MANIFEST_HEADER {
+	UINT32      Magic;
+	UINT32      Version;
+	UINT64      FileSize;
+	UINT64      ClusterSize;
+	UINT64      ChunkSize;
+	UINT64      NumChunks;
+	UINT64      FileIndex;
+	UINT32      VolumeSerial;
+	UINT32      Reserved;
+	FILETIME    LastWriteTime;
+	/* USN of the file's last change journal record, zero without a journal. */
+	INT64       Usn;
+	/* The punch policy of the run that wrote the manifest. */
+	UINT64      MinRunLength;
+	UINT64      Alignment;
+	UINT64      MaxRanges;
+} MANIFEST_HEADER, *PMANIFEST_HEADER;
+
+typedef struct MANIFEST_CHUNK {
+	/* Fingerprint of which clusters of the chunk are allocated. */
+	UINT64      AllocationHash;
+	UINT64      State;
+} MANIFEST_CHUNK, *PMANIFEST_CHUNK;
+
+typedef struct MANIFEST {
+	MANIFEST_HEADER Header;
+	PMANIFEST_CHUNK Chunks;
+} MANIFEST, *PMANIFEST;
+
+/* Path of the manifest of the file at Path, or NULL if out of memory. Freed by
+ * the caller. */
+_Success_(return != NULL)
+LPWSTR
+ManifestPath(
+	_In_z_      LPCWSTR             Path
+	);
+
+/* Whether Path names a manifest rather than a file to process. */
+BOOL
+ManifestIsSidecar(
+	_In_z_      LPCWSTR             Path
+	);
+
+/* Fill in the identity, last write time and USN of File. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD
+ManifestReadIdentity(
+	_In_        HANDLE              File,
+	_Inout_     PMANIFEST_HEADER    Header
+	);
+
+/* Replace the chunks of Manifest with fingerprints of UnallocatedMap. Chunk
+ * states are taken from ZeroMap if given. Manifest must be zeroed or hold a
+ * previous result. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD
+ManifestHashChunks(
+	_In_        PCLUSTER_MAP        UnallocatedMap,
+	_In_opt_    PCLUSTER_MAP        ZeroMap,
+	_In_        UINT64              FileSize,
+	_In_        SIZE_T              ClusterSize,
+	_Inout_     PMANIFEST           Manifest
+	);
+
+/* ERROR_FILE_NOT_FOUND if there is no manifest and ERROR_INVALID_DATA if it
+ * cannot be used. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD
+ManifestLoad(
+	_In_z_      LPCWSTR             Path,
+	_Out_       PMANIFEST           Manifest
+	);
+
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD
+ManifestSave(
+	_In_z_      LPCWSTR             Path,
+	_In_        const MANIFEST      *Manifest
+	);
+
+void
+ManifestFree(
+	_Inout_     PMANIFEST           Manifest
+	);
+
+/* TRUE if nothing about the file has changed since Old was written. */
+BOOL
+ManifestFileUnchanged(
+	_In_        const MANIFEST      *Old,
+	_In_        const MANIFEST      *Current
+	);
+
+/* The clusters of the chunks whose allocation is the same in Old and Current
+ * and whose state Old recorded, in increasing order. Data overwritten in place
+ * with zeros in those chunks goes unseen. Freed by the caller. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD
+ManifestUnchangedRuns(
+	_In_        const MANIFEST      *Old,
+	_In_        const MANIFEST      *Current,
+	_Outptr_result_maybenull_
+	            PCLUSTER_RUN        *Runs,
+	_Out_       SIZE_T              *NumRuns
+	);
+
+
+/* Results of earlier batch runs shared by every process using the same
+ * database file. Lookups and records may be made from any thread. */
+typedef struct SCAN_CACHE *PSCAN_CACHE;
+
+typedef struct SCAN_CACHE_STATS {
+	UINT64      RecordsLoaded;
+	UINT64      Hits;
+	UINT64      Misses;
+	UINT64      RecordsWritten;
+	UINT64      RecordsSaved;
+} SCAN_CACHE_STATS, *PSCAN_CACHE_STATS;
+
+/* Open or create the database at Path and load it. Records are only valid for
+ * runs with the same punch policy and options as Options. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD
+ScanCacheOpen(
+	_In_z_      LPCWSTR                     Path,
+	_In_        const MAKESPARSE_OPTIONS    *Options,
+	_Outptr_    PSCAN_CACHE                 *Cache
+	);
+
+/* TRUE if the file at Path was processed successfully and has not changed
+ * since. Only the attributes of the file are read. */
+BOOL
+ScanCacheLookup(
+	_Inout_     PSCAN_CACHE     Cache,
+	_In_z_      LPCWSTR         Path,
+	_Out_       UINT64          *ReclaimableBytes
+	);
+
+/* Record the result of processing the file at Path. Call once the file is
+ * closed so its last write time is final. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD
+ScanCacheRecord(
+	_Inout_     PSCAN_CACHE     Cache,
+	_In_z_      LPCWSTR         Path,
+	_In_        DWORD           Outcome,
+	_In_        UINT64          ReclaimableBytes
+	);
+
+/* Merge the records of this run into the database file. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD
+ScanCacheSave(
+	_Inout_     PSCAN_CACHE     Cache
+	);
+
+void
+ScanCacheGetStats(
+	_In_        PSCAN_CACHE         Cache,
+	_Out_       PSCAN_CACHE_STATS   Stats
+	);
+
+void
+ScanCacheFree(
+	_In_opt_ _Post_invalid_
+	            PSCAN_CACHE     Cache
+	);
+
+
+/* Default memory given to the dedupe fingerprint index. */
+#define DEFAULT_DEDUPE_MEMORY       (256 * 1024 * 1024)
+
+/* Default amount of data compaction may move in one file. */
+#define DEFAULT_COMPACT_BUDGET      (4ull * 1024 * 1024 * 1024)
+
+typedef struct COMPACT_STATS {
+	/* Allocated extents of the file, and how many of them do not follow the
+	 * previous one on the volume. Holes split extents without costing a
+	 * sequential reader anything, so the second count is what matters. */
+	UINT64      ExtentsBefore;
+	UINT64      FragmentsBefore;
+	UINT64      ExtentsAfter;
+	UINT64      FragmentsAfter;
+	UINT64      RegionsCompacted;
+	UINT64      RegionsFailed;
+	UINT64      BytesMoved;
+} COMPACT_STATS, *PCOMPACT_STATS;
+
+/* Move the scattered data of File into contiguous runs of the volume, moving
+ * at most Budget bytes. Only allocated clusters are moved. Needs the rights to
+ * open the volume of Path. Failures to move individual regions are counted,
+ * not returned. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD
+CompactFile(
+	_In_        HANDLE          File,
+	_In_        LPCWSTR         Path,
+	_In_        SIZE_T          ClusterSize,
+	_In_        UINT64          Budget,
+	_Out_       PCOMPACT_STATS  Stats
+	);
+
+
+/* A file being made sparse. Processing is split into open, analysis of one or
+ * more ranges, deallocation and close so batch mode can analyze disjoint
+ * ranges of one file on several threads. */
+typedef struct TARGET_FILE {
+	LPCWSTR             Path;
+	HANDLE              Handle;
+	UINT64              FileSize;
+	SIZE_T              ClusterSize;
+	FILETIME            CreationTime;
+	FILETIME            LastAccessTime;
+	FILETIME            LastWriteTime;
+	/* Options->Policy normalized for this file's cluster size. */
+	PUNCH_POLICY        Policy;
+	PCLUSTER_MAP        ZeroMap;
+	/* Unallocated clusters, turned in place into the allocated zero clusters
+	 * once PunchMapReady is set. NULL if the file system cannot say. */
+	PCLUSTER_MAP        PunchMap;
+	BOOL                PunchMapReady;
+	/* Clusters that are never read: free guest file system clusters, which
+	 * are marked in the zero map up front, and chunks the manifest shows
+	 * have not changed. */
+	PCLUSTER_RUN        SkipRuns;
+	SIZE_T              NumSkipRuns;
+	/* With Options->Manifest and a file system that reports allocation. The
+	 * fingerprints are those of the file as it is now once ManifestReady is
+	 * set; FileUnchanged means there is nothing to analyze or write. */
+	MANIFEST            Manifest;
+	BOOL                ManifestEnabled;
+	BOOL                ManifestReady;
+	BOOL                FileUnchanged;
+	/* NULL unless Options->DedupeIndex is set. */
+	PDEDUPE_FILE        Dedupe;
+	/* Created by the first deallocation and kept until the file is closed,
+	 * since Handle can only ever be bound to one dispatcher. DispatchStats
+	 * covers every deallocation made through it. */
+	PZERO_DISPATCH      Dispatch;
+	ZERO_DISPATCH_STATS DispatchStats;
+	/* Clusters were cloned or moved, which also has to be flushed. */
+	BOOL                Modified;
+} TARGET_FILE, *PTARGET_FILE;
+
+/* Open Path and allocate its maps. Failures are logged. TargetFileFree must be
+ * called even if this fails. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD
+TargetFileOpen(
+	_In_        const MAKESPARSE_OPTIONS    *Options,
+	_In_        LPCWSTR                     Path,
+	_Out_       PTARGET_FILE                Target
+	);
+
+/* Analyze [RangeOffset, RangeOffset + RangeLength) into the zero map. A zero
+ * RangeLength means up to the end of the file. Disjoint ranges may be
+ * analyzed concurrently. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD
+TargetFileScan(
+	_Inout_     PTARGET_FILE    Target,
+	_In_        UINT64          RangeOffset,
+	_In_        UINT64          RangeLength,
+	_In_opt_    FILE            *StatsStream
+	);
+
+/* Deallocate the zero runs the policy selects once analysis is complete, then
+ * clone duplicate ranges if Options->DedupeClone is set. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD
+TargetFileDeallocate(
+	_In_        const MAKESPARSE_OPTIONS    *Options,
+	_Inout_     PTARGET_FILE                Target
+	);
+
+/* Deallocate the zero runs the policy selects within clusters [FirstCluster,
+ * EndCluster), which must have been analyzed. Runs crossing either end are cut
+ * there. Adds to Target->DispatchStats. Not for policies with MaxRanges. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD
+TargetFileDeallocateRange(
+	_In_        const MAKESPARSE_OPTIONS    *Options,
+	_Inout_     PTARGET_FILE                Target,
+	_In_        UINT64                      FirstCluster,
+	_In_        UINT64                      EndCluster
+	);
+
+/* Restore timestamps if requested, flush if anything was deallocated, cloned
+ * or moved and close the file. */
+void
+TargetFileClose(
+	_In_        const MAKESPARSE_OPTIONS    *Options,
+	_Inout_     PTARGET_FILE                Target
+	);
+
+void
+TargetFileFree(
+	_Inout_     PTARGET_FILE    Target
+	);
+
+
+/* Write the zero map in the requested format to stdout or the map file. */
+_Success_(return == TRUE)
+BOOL
+PrintMap(
+	_In_        const MAKESPARSE_OPTIONS    *Options,
+	_In_        PCLUSTER_MAP                ZeroMap
+	);
+
+/* Combine the shard results named by Options->ShardFiles into one report and,
+ * with Options->PrintSparseMap, one map. Returns ERROR_SUCCESS only if every
+ * shard succeeded and together they cover the whole file exactly once. */
+_Must_inspect_result_
+DWORD
+RunMergeShards(
+	_In_        const MAKESPARSE_OPTIONS    *Options
+	);
+
+
+/* Appended to the path of a file to name the record of a deadline run. */
+#define DEADLINE_PROGRESS_SUFFIX    L".sparseprogress"
+
+/* Analyze and deallocate the regions of an open file in the order of their
+ * estimated savings until Options->DeadlineSeconds have passed. Regions
+ * finished are recorded next to the file and skipped by the next run. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD
+DeadlineSparseRanges(
+	_In_        const MAKESPARSE_OPTIONS    *Options,
+	_Inout_     PTARGET_FILE                Target
+	);
+
+/* Whether Path names a deadline progress file rather than a file to process. */
+BOOL
+DeadlineIsProgressFile(
+	_In_z_      LPCWSTR             Path
+	);
+
+
+/* Upper bound on the worker threads and concurrent I/O of batch mode. */
+#define MAX_BATCH_THREADS           64
+
+/* Process every file named by Options->RecurseRoot and Options->ListFile.
+ * Returns ERROR_SUCCESS if every file was processed successfully. */
+_Must_inspect_result_
+DWORD
+RunBatch(
+	_In_        const MAKESPARSE_OPTIONS    *Options
+	);
+
+
+/* Default time a watched file must go unmodified before it is processed. */
+#define DEFAULT_WATCH_SETTLE_SECONDS    30
+
+/* Watch Options->WatchRoot and everything below it, processing files once
+ * they stop changing, until Ctrl+C is pressed. Returns ERROR_SUCCESS unless
+ * watching itself failed; per-file failures are only logged. */
+_Must_inspect_result_
+DWORD
+RunWatch(
+	_In_        const MAKESPARSE_OPTIONS    *Options
+	);
+
+#endif // MAKESPARSE_H
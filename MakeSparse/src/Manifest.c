@@ -0,0 +1,427 @@
+/* Standard BSD license disclaimer.
+
+Copyright(c) 2016-2021, Lance D. Stringham
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "targetver.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+// Necessary due to WIN32_LEAN_AND_MEAN
+#include <winioctl.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "MakeSparse.h"
+
+/* Sidecar manifests for incremental runs.
+ *
+ * Once a file has been processed its manifest records who the file is (volume
+ * serial number and file index), its size, last write time and change journal
+ * USN, the punch policy, and for every chunk a fingerprint of which clusters
+ * are allocated along with whether the chunk held zeros.
+ *
+ * A later run first compares the identity: if the file's USN, or its last
+ * write time on volumes without a journal, is what was recorded, nothing has
+ * changed and the file is not read at all. Otherwise the whole file is
+ * analyzed again, since data overwritten in place with zeros leaves the
+ * allocation as it was. With --manifest-chunks only the chunks whose
+ * allocation fingerprint differs are, accepting that miss: every cluster a
+ * run deallocates is a hole afterwards, so data written into one does show up
+ * as a changed fingerprint. */
+
+#define MANIFEST_MAGIC              0x464D534Du     /* "MSMF" */
+#define MANIFEST_VERSION            1
+
+/* Offsets of the Usn field in USN_RECORD_V2 and USN_RECORD_V3. Only V2 is
+ * declared for the targeted Windows version; ReFS answers with V3. */
+#define USN_RECORD_V2_USN_OFFSET    24
+#define USN_RECORD_V3_USN_OFFSET    40
+/* A record with the longest file name fits. */
+#define USN_RECORD_BUFFER_SIZE      (64 + (MAX_PATH + 1) * sizeof(WCHAR))
+
+#define MANIFEST_HASH_PRIME         0x100000001B3ull
+
+
+_Use_decl_annotations_
+LPWSTR
+ManifestPath(
+	LPCWSTR     Path
+	)
+{
+	LPWSTR  manifestPath;
+	SIZE_T  size;
+
+	size = wcslen(Path) + ARRAYSIZE(MANIFEST_SUFFIX);
+	manifestPath = malloc(size * sizeof(*manifestPath));
+	if (manifestPath)
+		(void)swprintf_s(manifestPath, size, L"%s%s", Path, MANIFEST_SUFFIX);
+	return manifestPath;
+}
+
+
+_Use_decl_annotations_
+BOOL
+ManifestIsSidecar(
+	LPCWSTR     Path
+	)
+{
+	SIZE_T len, suffixLen;
+
+	len = wcslen(Path);
+	suffixLen = ARRAYSIZE(MANIFEST_SUFFIX) - 1;
+	return len >= suffixLen && !_wcsicmp(Path + len - suffixLen, MANIFEST_SUFFIX);
+}
+
+
+_Use_decl_annotations_
+DWORD
+ManifestReadIdentity(
+	HANDLE              File,
+	PMANIFEST_HEADER    Header
+	)
+{
+	BY_HANDLE_FILE_INFORMATION  info;
+	BYTE                        record[USN_RECORD_BUFFER_SIZE];
+	DWORD                       bytes;
+
+	if (!GetFileInformationByHandle(File, &info))
+		return GetLastError();
+
+	Header->VolumeSerial  = info.dwVolumeSerialNumber;
+	Header->FileIndex     = ((UINT64)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+	Header->LastWriteTime = info.ftLastWriteTime;
+
+	/* No journal, or a file system without one, leaves the last write time
+	 * as the only hint. */
+	Header->Usn = 0;
+	if (ERROR_SUCCESS == DeviceIoControlSync(File,
+	                                         FSCTL_READ_FILE_USN_DATA,
+	                                         NULL,
+	                                         0,
+	                                         record,
+	                                         sizeof(record),
+	                                         &bytes)) {
+		if (2 == ((PUSN_RECORD)record)->MajorVersion && bytes >= USN_RECORD_V2_USN_OFFSET + 8)
+			memcpy(&Header->Usn, record + USN_RECORD_V2_USN_OFFSET, sizeof(Header->Usn));
+		else if (3 == ((PUSN_RECORD)record)->MajorVersion && bytes >= USN_RECORD_V3_USN_OFFSET + 8)
+			memcpy(&Header->Usn, record + USN_RECORD_V3_USN_OFFSET, sizeof(Header->Usn));
+	}
+
+	return ERROR_SUCCESS;
+}
+
+
+_Use_decl_annotations_
+DWORD
+ManifestHashChunks(
+	PCLUSTER_MAP    UnallocatedMap,
+	PCLUSTER_MAP    ZeroMap,
+	UINT64          FileSize,
+	SIZE_T          ClusterSize,
+	PMANIFEST       Manifest
+	)
+{
+	PMANIFEST_CHUNK chunks;
+	UINT64          numChunks, numClusters, clustersPerChunk, chunk, first, end,
+	                cluster, runEnd, hash, unallocated, zero;
+
+	numChunks = (FileSize + MANIFEST_CHUNK_SIZE - 1) / MANIFEST_CHUNK_SIZE;
+	numClusters = (FileSize + ClusterSize - 1) / ClusterSize;
+	clustersPerChunk = MANIFEST_CHUNK_SIZE / ClusterSize;
+
+	chunks = calloc((SIZE_T)numChunks, sizeof(*chunks));
+	if (NULL == chunks)
+		return ERROR_NOT_ENOUGH_MEMORY;
+
+	for (chunk = 0; chunk < numChunks; ++chunk) {
+		first = chunk * clustersPerChunk;
+		end = MIN(first + clustersPerChunk, numClusters);
+
+		/* FNV style over the run boundaries within the chunk. */
+		hash = 0xCBF29CE484222325ull;
+		unallocated = 0;
+		for (cluster = first; cluster < end; cluster = runEnd) {
+			runEnd = MIN(ClusterMapRunEnd(UnallocatedMap, cluster), end);
+			if (ClusterMapIsMarkedZero(UnallocatedMap, cluster)) {
+				unallocated += runEnd - cluster;
+				hash = (hash ^ (cluster - first)) * MANIFEST_HASH_PRIME;
+				hash = (hash ^ (runEnd - first)) * MANIFEST_HASH_PRIME;
+			}
+		}
+		chunks[chunk].AllocationHash = hash;
+
+		chunks[chunk].State = MANIFEST_CHUNK_UNKNOWN;
+		if (unallocated == end - first) {
+			chunks[chunk].State = MANIFEST_CHUNK_HOLE;
+		} else if (ZeroMap) {
+			zero = 0;
+			for (cluster = first; cluster < end && !zero; cluster = runEnd) {
+				runEnd = MIN(ClusterMapRunEnd(ZeroMap, cluster), end);
+				if (ClusterMapIsMarkedZero(ZeroMap, cluster))
+					zero = runEnd - cluster;
+			}
+			chunks[chunk].State = zero ? MANIFEST_CHUNK_MIXED : MANIFEST_CHUNK_DATA;
+		}
+	}
+
+	free(Manifest->Chunks);
+	Manifest->Chunks            = chunks;
+	Manifest->Header.Magic      = MANIFEST_MAGIC;
+	Manifest->Header.Version    = MANIFEST_VERSION;
+	Manifest->Header.FileSize   = FileSize;
+	Manifest->Header.ClusterSize = ClusterSize;
+	Manifest->Header.ChunkSize  = MANIFEST_CHUNK_SIZE;
+	Manifest->Header.NumChunks  = numChunks;
+	return ERROR_SUCCESS;
+}
+
+
+_Use_decl_annotations_
+DWORD
+ManifestLoad(
+	LPCWSTR     Path,
+	PMANIFEST   Manifest
+	)
+{
+	HANDLE          file;
+	LARGE_INTEGER   size;
+	UINT64          chunkBytes;
+	DWORD           bytes, err;
+
+	memset(Manifest, 0, sizeof(*Manifest));
+
+	file = CreateFileW(Path,
+	                   GENERIC_READ,
+	                   FILE_SHARE_READ,
+	                   NULL,
+	                   OPEN_EXISTING,
+	                   FILE_FLAG_SEQUENTIAL_SCAN,
+	                   NULL);
+	if (INVALID_HANDLE_VALUE == file)
+		return GetLastError();
+
+	err = ERROR_INVALID_DATA;
+	if (!GetFileSizeEx(file, &size)) {
+		err = GetLastError();
+		goto func_return;
+	}
+
+	if (!ReadFile(file, &Manifest->Header, sizeof(Manifest->Header), &bytes, NULL)) {
+		err = GetLastError();
+		goto func_return;
+	}
+	if (bytes != sizeof(Manifest->Header)
+	    || MANIFEST_MAGIC != Manifest->Header.Magic
+	    || MANIFEST_VERSION != Manifest->Header.Version
+	    || MANIFEST_CHUNK_SIZE != Manifest->Header.ChunkSize
+	    || Manifest->Header.NumChunks
+	       != (Manifest->Header.FileSize + MANIFEST_CHUNK_SIZE - 1) / MANIFEST_CHUNK_SIZE)
+		goto func_return;
+
+	chunkBytes = Manifest->Header.NumChunks * sizeof(*Manifest->Chunks);
+	if ((UINT64)size.QuadPart != sizeof(Manifest->Header) + chunkBytes
+	    || chunkBytes > MAXDWORD)
+		goto func_return;
+
+	Manifest->Chunks = malloc((SIZE_T)chunkBytes);
+	if (NULL == Manifest->Chunks) {
+		err = ERROR_NOT_ENOUGH_MEMORY;
+		goto func_return;
+	}
+	if (!ReadFile(file, Manifest->Chunks, (DWORD)chunkBytes, &bytes, NULL)) {
+		err = GetLastError();
+		goto func_return;
+	}
+	if (bytes == chunkBytes)
+		err = ERROR_SUCCESS;
+
+func_return:
+	(void)CloseHandle(file);
+	if (ERROR_SUCCESS != err)
+		ManifestFree(Manifest);
+	return err;
+}
+
+
+_Use_decl_annotations_
+DWORD
+ManifestSave(
+	LPCWSTR             Path,
+	const MANIFEST      *Manifest
+	)
+{
+	HANDLE  file;
+	LPWSTR  tmpPath;
+	SIZE_T  size;
+	DWORD   chunkBytes, bytes, err;
+
+	/* Written next to the manifest and renamed over it, so a crash never
+	 * leaves a manifest that describes only part of the file. */
+	size = wcslen(Path) + 5;
+	tmpPath = malloc(size * sizeof(*tmpPath));
+	if (NULL == tmpPath)
+		return ERROR_NOT_ENOUGH_MEMORY;
+	(void)swprintf_s(tmpPath, size, L"%s.tmp", Path);
+
+	file = CreateFileW(tmpPath,
+	                   GENERIC_WRITE,
+	                   0,
+	                   NULL,
+	                   CREATE_ALWAYS,
+	                   FILE_ATTRIBUTE_NORMAL,
+	                   NULL);
+	if (INVALID_HANDLE_VALUE == file) {
+		err = GetLastError();
+		goto func_return;
+	}
+
+	chunkBytes = (DWORD)(Manifest->Header.NumChunks * sizeof(*Manifest->Chunks));
+	err = ERROR_SUCCESS;
+	if (!WriteFile(file, &Manifest->Header, sizeof(Manifest->Header), &bytes, NULL)
+	    || (chunkBytes && !WriteFile(file, Manifest->Chunks, chunkBytes, &bytes, NULL))
+	    || !FlushFileBuffers(file))
+		err = GetLastError();
+	(void)CloseHandle(file);
+
+	if (ERROR_SUCCESS == err
+	    && !MoveFileExW(tmpPath, Path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+		err = GetLastError();
+	if (ERROR_SUCCESS != err)
+		(void)DeleteFileW(tmpPath);
+
+func_return:
+	free(tmpPath);
+	return err;
+}
+
+
+_Use_decl_annotations_
+void
+ManifestFree(
+	PMANIFEST   Manifest
+	)
+{
+	free(Manifest->Chunks);
+	memset(Manifest, 0, sizeof(*Manifest));
+}
+
+
+/* Whether the chunks of Old can be compared with those of Current at all. */
+static BOOL
+ManifestSameFile(
+	_In_        const MANIFEST  *Old,
+	_In_        const MANIFEST  *Current
+	)
+{
+	return Old->Header.VolumeSerial == Current->Header.VolumeSerial
+	    && Old->Header.FileIndex    == Current->Header.FileIndex
+	    && Old->Header.ClusterSize  == Current->Header.ClusterSize
+	    && Old->Header.MinRunLength == Current->Header.MinRunLength
+	    && Old->Header.Alignment    == Current->Header.Alignment
+	    && Old->Header.MaxRanges    == Current->Header.MaxRanges;
+}
+
+
+_Use_decl_annotations_
+BOOL
+ManifestFileUnchanged(
+	const MANIFEST  *Old,
+	const MANIFEST  *Current
+	)
+{
+	if (!ManifestSameFile(Old, Current) || Old->Header.FileSize != Current->Header.FileSize)
+		return FALSE;
+
+	/* The journal sees every change. Without one, fall back on the time. */
+	if (Old->Header.Usn || Current->Header.Usn)
+		return Old->Header.Usn == Current->Header.Usn;
+
+	return Old->Header.LastWriteTime.dwLowDateTime == Current->Header.LastWriteTime.dwLowDateTime
+	    && Old->Header.LastWriteTime.dwHighDateTime == Current->Header.LastWriteTime.dwHighDateTime;
+}
+
+
+_Use_decl_annotations_
+DWORD
+ManifestUnchangedRuns(
+	const MANIFEST  *Old,
+	const MANIFEST  *Current,
+	PCLUSTER_RUN    *Runs,
+	SIZE_T          *NumRuns
+	)
+{
+	PCLUSTER_RUN    runs;
+	UINT64          numChunks, clustersPerChunk, chunk, first, end, numClusters;
+	SIZE_T          numRuns;
+
+	*Runs = NULL;
+	*NumRuns = 0;
+
+	if (!ManifestSameFile(Old, Current))
+		return ERROR_SUCCESS;
+
+	/* A chunk cut short by either size has changed length. */
+	numChunks = MIN(Old->Header.FileSize, Current->Header.FileSize) / MANIFEST_CHUNK_SIZE;
+	if (Old->Header.FileSize == Current->Header.FileSize)
+		numChunks = Current->Header.NumChunks;
+
+	runs = malloc((SIZE_T)MAX(numChunks, 1) * sizeof(*runs));
+	if (NULL == runs)
+		return ERROR_NOT_ENOUGH_MEMORY;
+
+	clustersPerChunk = MANIFEST_CHUNK_SIZE / Current->Header.ClusterSize;
+	numClusters = (Current->Header.FileSize + Current->Header.ClusterSize - 1)
+	            / Current->Header.ClusterSize;
+	numRuns = 0;
+
+	for (chunk = 0; chunk < numChunks; ++chunk) {
+		/* A chunk the last run could not classify was never fully
+		 * analyzed. */
+		if (MANIFEST_CHUNK_UNKNOWN == Old->Chunks[chunk].State
+		    || Old->Chunks[chunk].AllocationHash != Current->Chunks[chunk].AllocationHash)
+			continue;
+
+		first = chunk * clustersPerChunk;
+		end = MIN(first + clustersPerChunk, numClusters);
+		if (numRuns && runs[numRuns - 1].End == first) {
+			runs[numRuns - 1].End = end;
+		} else {
+			runs[numRuns].First = first;
+			runs[numRuns].End = end;
+			numRuns++;
+		}
+	}
+
+	*Runs = runs;
+	*NumRuns = numRuns;
+	return ERROR_SUCCESS;
+}
@@ -0,0 +1,292 @@
+/* Standard BSD license disclaimer.
+
+Copyright(c) 2016-2021, Lance D. Stringham
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "targetver.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <assert.h>
+
+#include "MakeSparse.h"
+
+/* Initial number of entries allocated by a range selector. The array doubles
+ * from here up to the selector's limit. */
+#define RANGE_SELECTOR_INITIAL_SIZE     1024
+
+typedef struct SELECTED_RANGE {
+	UINT64      Start;
+	UINT64      End;
+} SELECTED_RANGE;
+
+/* The kept ranges form a min-heap on length so the smallest kept range can be
+ * displaced in O(log n) when a larger one turns up. */
+struct RANGE_SELECTOR {
+	UINT64          MaxRanges;
+	SIZE_T          Count;
+	SIZE_T          Allocated;
+	SELECTED_RANGE  *Ranges;
+};
+
+
+_Use_decl_annotations_
+void
+PunchPolicyNormalize(
+	PPUNCH_POLICY   Policy,
+	SIZE_T          ClusterSize
+	)
+{
+	if (Policy->Alignment < ClusterSize)
+		Policy->Alignment = ClusterSize;
+	else if (Policy->Alignment % ClusterSize) {
+		Policy->Alignment += ClusterSize - (Policy->Alignment % ClusterSize);
+		LogInfo(L"Alignment is not a multiple of the cluster size. "
+		        L"Using %llu bytes.\n", Policy->Alignment);
+	}
+
+	if (Policy->MinRunLength < ClusterSize)
+		Policy->MinRunLength = ClusterSize;
+}
+
+
+_Use_decl_annotations_
+BOOL
+PunchPolicyTrimRun(
+	const PUNCH_POLICY  *Policy,
+	SIZE_T              ClusterSize,
+	UINT64              FileSize,
+	UINT64              *Start,
+	UINT64              *End
+	)
+{
+	UINT64 start, end;
+
+	start = *Start + Policy->Alignment - 1;
+	start -= start % Policy->Alignment;
+
+	/* Nothing follows a run that reaches the end of the file so there is no
+	 * later data to fragment; leave the tail as is. */
+	end = *End;
+	if (end < FileSize)
+		end -= end % Policy->Alignment;
+
+	if (end <= start)
+		return FALSE;
+
+	/* Only whole clusters count towards the minimum length so a trailing runt
+	 * is never zeroed by itself. */
+	if ((end - start) - ((end - start) % ClusterSize) < Policy->MinRunLength)
+		return FALSE;
+
+	*Start = start;
+	*End = end;
+	return TRUE;
+}
+
+
+_Use_decl_annotations_
+PRANGE_SELECTOR
+RangeSelectorCreate(
+	UINT64          MaxRanges
+	)
+{
+	PRANGE_SELECTOR selector;
+
+	assert(MaxRanges);
+
+	selector = calloc(1, sizeof(*selector));
+	if (NULL == selector)
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+	else
+		selector->MaxRanges = MaxRanges;
+
+	return selector;
+}
+
+
+static UINT64
+RangeLength(
+	_In_        const SELECTED_RANGE    *Range
+	)
+{
+	return Range->End - Range->Start;
+}
+
+
+static void
+SiftDown(
+	_Inout_     PRANGE_SELECTOR Selector,
+	_In_        SIZE_T          Idx
+	)
+{
+	SELECTED_RANGE  tmp;
+	SIZE_T          child;
+
+	for (;;) {
+		child = 2 * Idx + 1;
+		if (child >= Selector->Count)
+			break;
+		if (child + 1 < Selector->Count
+		    && RangeLength(&Selector->Ranges[child + 1]) < RangeLength(&Selector->Ranges[child]))
+			++child;
+		if (RangeLength(&Selector->Ranges[Idx]) <= RangeLength(&Selector->Ranges[child]))
+			break;
+		tmp = Selector->Ranges[Idx];
+		Selector->Ranges[Idx] = Selector->Ranges[child];
+		Selector->Ranges[child] = tmp;
+		Idx = child;
+	}
+}
+
+
+static void
+SiftUp(
+	_Inout_     PRANGE_SELECTOR Selector,
+	_In_        SIZE_T          Idx
+	)
+{
+	SELECTED_RANGE  tmp;
+	SIZE_T          parent;
+
+	while (Idx) {
+		parent = (Idx - 1) / 2;
+		if (RangeLength(&Selector->Ranges[parent]) <= RangeLength(&Selector->Ranges[Idx]))
+			break;
+		tmp = Selector->Ranges[Idx];
+		Selector->Ranges[Idx] = Selector->Ranges[parent];
+		Selector->Ranges[parent] = tmp;
+		Idx = parent;
+	}
+}
+
+
+_Use_decl_annotations_
+DWORD
+RangeSelectorAdd(
+	PVOID           Selector,
+	UINT64          FileOffset,
+	UINT64          BeyondFinalZero
+	)
+{
+	PRANGE_SELECTOR selector;
+	SELECTED_RANGE  *newRanges;
+	SIZE_T          newSize;
+
+	selector = Selector;
+
+	if (selector->Count == selector->MaxRanges) {
+		/* Full; replace the smallest kept range if this one is larger. */
+		if (BeyondFinalZero - FileOffset <= RangeLength(&selector->Ranges[0]))
+			return ERROR_SUCCESS;
+		selector->Ranges[0].Start = FileOffset;
+		selector->Ranges[0].End   = BeyondFinalZero;
+		SiftDown(selector, 0);
+		return ERROR_SUCCESS;
+	}
+
+	if (selector->Count == selector->Allocated) {
+		newSize = selector->Allocated ? selector->Allocated * 2
+		                              : RANGE_SELECTOR_INITIAL_SIZE;
+		if (newSize > selector->MaxRanges)
+			newSize = (SIZE_T)selector->MaxRanges;
+		if (newSize > SIZE_MAX / sizeof(*newRanges))
+			return ERROR_NOT_ENOUGH_MEMORY;
+		newRanges = realloc(selector->Ranges, newSize * sizeof(*newRanges));
+		if (NULL == newRanges)
+			return ERROR_NOT_ENOUGH_MEMORY;
+		selector->Ranges = newRanges;
+		selector->Allocated = newSize;
+	}
+
+	selector->Ranges[selector->Count].Start = FileOffset;
+	selector->Ranges[selector->Count].End   = BeyondFinalZero;
+	SiftUp(selector, selector->Count);
+	selector->Count++;
+
+	return ERROR_SUCCESS;
+}
+
+
+static int __cdecl
+CompareRangeStart(
+	_In_        const void  *A,
+	_In_        const void  *B
+	)
+{
+	const SELECTED_RANGE *a = A, *b = B;
+
+	if (a->Start < b->Start)
+		return -1;
+	return (a->Start > b->Start);
+}
+
+
+_Use_decl_annotations_
+DWORD
+RangeSelectorEnumerate(
+	PRANGE_SELECTOR     Selector,
+	PZERO_RUN_CALLBACK  Callback,
+	PVOID               Context
+	)
+{
+	SIZE_T  i;
+	DWORD   errRet;
+
+	qsort(Selector->Ranges, Selector->Count, sizeof(*Selector->Ranges),
+	      CompareRangeStart);
+
+	for (i = 0; i < Selector->Count; ++i) {
+		errRet = Callback(Context, Selector->Ranges[i].Start,
+		                  Selector->Ranges[i].End);
+		if (ERROR_SUCCESS != errRet)
+			return errRet;
+	}
+
+	return ERROR_SUCCESS;
+}
+
+
+_Use_decl_annotations_
+void
+RangeSelectorFree(
+	PRANGE_SELECTOR Selector
+	)
+{
+	if (NULL == Selector)
+		return;
+
+	free(Selector->Ranges);
+	free(Selector);
+}
@@ -0,0 +1,562 @@
+/* Standard BSD license disclaimer.
+
+Copyright(c) 2016-2021, Lance D. Stringham
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "targetver.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "MakeSparse.h"
+
+/* Cross-run cache of batch results.
+ *
+ * One record per file, keyed by volume serial number and file index, holds
+ * the file's size and last write time as they were after it was processed,
+ * the outcome and the bytes found reclaimable. A file whose size and last
+ * write time still match a successful record is skipped; it is only opened
+ * for its attributes, never read. Records also carry a fingerprint of the
+ * options that decide what gets deallocated so changing them invalidates the
+ * cache.
+ *
+ * The database is a header followed by the records in no particular order.
+ * It is read whole under a shared lock when the batch starts and kept in an
+ * open addressed table. Saving takes an exclusive lock, reads the file again
+ * to pick up what other processes saved in the meantime, keeps our own
+ * records where both have one and rewrites the file in place. A checksum
+ * guards against a save that was interrupted; a damaged database is simply
+ * started over. */
+
+#define SCAN_CACHE_MAGIC            0x43534D53u     /* "SMSC" */
+#define SCAN_CACHE_VERSION          1
+
+#define SCAN_CACHE_INITIAL_SLOTS    1024
+
+/* Records are read and written in pieces of this size. */
+#define SCAN_CACHE_IO_SIZE          (16 * 1024 * 1024)
+
+#define SCAN_CACHE_HASH_PRIME       0x100000001B3ull
+#define SCAN_CACHE_HASH_BASIS       0xCBF29CE484222325ull
+
+typedef struct SCAN_CACHE_HEADER {
+	UINT32      Magic;
+	UINT32      Version;
+	UINT64      NumRecords;
+	UINT64      Checksum;
+} SCAN_CACHE_HEADER, *PSCAN_CACHE_HEADER;
+
+typedef struct SCAN_CACHE_RECORD {
+	UINT64      FileIndex;
+	UINT32      VolumeSerial;
+	/* Win32 error code of the run that wrote the record. */
+	UINT32      Outcome;
+	UINT64      FileSize;
+	FILETIME    LastWriteTime;
+	UINT64      OptionsHash;
+	UINT64      ReclaimableBytes;
+} SCAN_CACHE_RECORD, *PSCAN_CACHE_RECORD;
+
+typedef struct SCAN_CACHE_SLOT {
+	SCAN_CACHE_RECORD   Record;
+	BOOL                Used;
+	/* Written by this process, so it wins over what is on disk. */
+	BOOL                Dirty;
+} SCAN_CACHE_SLOT, *PSCAN_CACHE_SLOT;
+
+typedef struct SCAN_CACHE {
+	HANDLE              File;
+	LPCWSTR             Path;
+	UINT64              OptionsHash;
+	/* Guards everything below. */
+	SRWLOCK             Lock;
+	PSCAN_CACHE_SLOT    Slots;
+	SIZE_T              NumSlots;
+	SIZE_T              NumUsed;
+	SCAN_CACHE_STATS    Stats;
+} SCAN_CACHE;
+
+
+static UINT64
+HashBytes(
+	_In_        UINT64      Hash,
+	_In_reads_bytes_(Length)
+	            const void  *Data,
+	_In_        SIZE_T      Length
+	)
+{
+	const BYTE  *bytes;
+	SIZE_T      i;
+
+	bytes = Data;
+	for (i = 0; i < Length; ++i)
+		Hash = (Hash ^ bytes[i]) * SCAN_CACHE_HASH_PRIME;
+	return Hash;
+}
+
+
+static SIZE_T
+SlotOf(
+	_In_        const SCAN_CACHE    *Cache,
+	_In_        UINT32              VolumeSerial,
+	_In_        UINT64              FileIndex
+	)
+{
+	PSCAN_CACHE_SLOT    slot;
+	UINT64              hash;
+	SIZE_T              i;
+
+	hash = (FileIndex ^ ((UINT64)VolumeSerial << 32)) * SCAN_CACHE_HASH_PRIME;
+	hash ^= hash >> 29;
+	for (i = (SIZE_T)hash & (Cache->NumSlots - 1); ; i = (i + 1) & (Cache->NumSlots - 1)) {
+		slot = &Cache->Slots[i];
+		if (!slot->Used
+		    || (slot->Record.FileIndex == FileIndex && slot->Record.VolumeSerial == VolumeSerial))
+			return i;
+	}
+}
+
+
+/* Make room for one more record. */
+static DWORD
+Reserve(
+	_Inout_     PSCAN_CACHE     Cache
+	)
+{
+	PSCAN_CACHE_SLOT    oldSlots;
+	SIZE_T              oldNumSlots, i, j;
+
+	/* At most three quarters full so probes stay short. */
+	if (Cache->NumSlots && (Cache->NumUsed + 1) * 4 <= Cache->NumSlots * 3)
+		return ERROR_SUCCESS;
+
+	oldSlots = Cache->Slots;
+	oldNumSlots = Cache->NumSlots;
+	Cache->NumSlots = oldNumSlots ? oldNumSlots * 2 : SCAN_CACHE_INITIAL_SLOTS;
+	Cache->Slots = calloc(Cache->NumSlots, sizeof(*Cache->Slots));
+	if (NULL == Cache->Slots) {
+		Cache->Slots = oldSlots;
+		Cache->NumSlots = oldNumSlots;
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	for (i = 0; i < oldNumSlots; ++i) {
+		if (oldSlots[i].Used) {
+			j = SlotOf(Cache, oldSlots[i].Record.VolumeSerial, oldSlots[i].Record.FileIndex);
+			Cache->Slots[j] = oldSlots[i];
+		}
+	}
+	free(oldSlots);
+
+	return ERROR_SUCCESS;
+}
+
+
+/* Read every record of the database into the table. Records of files this
+ * process has written are left alone. A database that is empty or damaged
+ * contributes nothing. Must be called under a lock on the file. */
+static DWORD
+LoadRecords(
+	_Inout_     PSCAN_CACHE     Cache
+	)
+{
+	SCAN_CACHE_HEADER   header;
+	PSCAN_CACHE_RECORD  records;
+	PSCAN_CACHE_SLOT    slot;
+	LARGE_INTEGER       fileSize;
+	UINT64              offset, total, checksum, i;
+	DWORD               chunk, bytes, errRet;
+
+	records = NULL;
+
+	if (!GetFileSizeEx(Cache->File, &fileSize))
+		return GetLastError();
+	if (0 == fileSize.QuadPart)
+		return ERROR_SUCCESS;
+
+	errRet = ReadFileSync(Cache->File, 0, &header, sizeof(header), &bytes);
+	if (ERROR_SUCCESS != errRet)
+		return errRet;
+	if (sizeof(header) != bytes
+	    || SCAN_CACHE_MAGIC != header.Magic
+	    || SCAN_CACHE_VERSION != header.Version
+	    || (UINT64)fileSize.QuadPart - sizeof(header) != header.NumRecords * sizeof(*records))
+		goto invalid_return;
+
+	total = header.NumRecords * sizeof(*records);
+	if (total > SIZE_MAX)
+		return ERROR_NOT_ENOUGH_MEMORY;
+	records = malloc((SIZE_T)MAX(total, 1));
+	if (NULL == records)
+		return ERROR_NOT_ENOUGH_MEMORY;
+
+	for (offset = 0; offset < total; offset += chunk) {
+		chunk = (DWORD)MIN(total - offset, SCAN_CACHE_IO_SIZE);
+		errRet = ReadFileSync(Cache->File, sizeof(header) + offset,
+		                      (PBYTE)records + offset, chunk, &bytes);
+		if (ERROR_SUCCESS != errRet)
+			goto func_return;
+		if (chunk != bytes)
+			goto invalid_return;
+	}
+
+	checksum = HashBytes(SCAN_CACHE_HASH_BASIS, records, (SIZE_T)total);
+	if (checksum != header.Checksum)
+		goto invalid_return;
+
+	for (i = 0; i < header.NumRecords; ++i) {
+		errRet = Reserve(Cache);
+		if (ERROR_SUCCESS != errRet)
+			goto func_return;
+		slot = &Cache->Slots[SlotOf(Cache, records[i].VolumeSerial, records[i].FileIndex)];
+		if (slot->Dirty)
+			continue;
+		if (!slot->Used)
+			Cache->NumUsed++;
+		slot->Record = records[i];
+		slot->Used = TRUE;
+	}
+
+	errRet = ERROR_SUCCESS;
+	goto func_return;
+
+invalid_return:
+	LogInfo(L"Scan cache %s is damaged and will be rebuilt.\n", Cache->Path);
+	errRet = ERROR_SUCCESS;
+
+func_return:
+	free(records);
+	return errRet;
+}
+
+
+static DWORD
+LockDatabase(
+	_In_        HANDLE      File,
+	_In_        BOOL        Exclusive
+	)
+{
+	OVERLAPPED ovrlp;
+
+	memset(&ovrlp, 0, sizeof(ovrlp));
+	if (!LockFileEx(File, Exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0, 0, MAXDWORD, MAXDWORD, &ovrlp))
+		return GetLastError();
+	return ERROR_SUCCESS;
+}
+
+
+static void
+UnlockDatabase(
+	_In_        HANDLE      File
+	)
+{
+	OVERLAPPED ovrlp;
+
+	memset(&ovrlp, 0, sizeof(ovrlp));
+	(void)UnlockFileEx(File, 0, MAXDWORD, MAXDWORD, &ovrlp);
+}
+
+
+/* Volume serial number, file index, size and last write time of Path, read
+ * without opening its data. */
+static DWORD
+ReadFileKey(
+	_In_z_      LPCWSTR             Path,
+	_Out_       PSCAN_CACHE_RECORD  Key
+	)
+{
+	BY_HANDLE_FILE_INFORMATION  info;
+	HANDLE                      hFile;
+	DWORD                       errRet;
+
+	memset(Key, 0, sizeof(*Key));
+
+	hFile = CreateFileW(Path,
+	                    FILE_READ_ATTRIBUTES,
+	                    FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+	                    NULL,
+	                    OPEN_EXISTING,
+	                    FILE_ATTRIBUTE_NORMAL,
+	                    NULL);
+	if (INVALID_HANDLE_VALUE == hFile)
+		return GetLastError();
+
+	errRet = ERROR_SUCCESS;
+	if (GetFileInformationByHandle(hFile, &info)) {
+		Key->VolumeSerial  = info.dwVolumeSerialNumber;
+		Key->FileIndex     = ((UINT64)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+		Key->FileSize      = ((UINT64)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+		Key->LastWriteTime = info.ftLastWriteTime;
+	} else {
+		errRet = GetLastError();
+	}
+
+	(void)CloseHandle(hFile);
+	return errRet;
+}
+
+
+_Use_decl_annotations_
+DWORD
+ScanCacheOpen(
+	LPCWSTR                     Path,
+	const MAKESPARSE_OPTIONS    *Options,
+	PSCAN_CACHE                 *Cache
+	)
+{
+	PSCAN_CACHE cache;
+	DWORD       errRet;
+
+	*Cache = NULL;
+
+	cache = calloc(1, sizeof(*cache));
+	if (NULL == cache)
+		return ERROR_NOT_ENOUGH_MEMORY;
+	InitializeSRWLock(&cache->Lock);
+	cache->Path = Path;
+
+	/* Everything that changes what a run over an unchanged file would do. */
+	cache->OptionsHash = HashBytes(SCAN_CACHE_HASH_BASIS, &Options->Policy,
+	                               sizeof(Options->Policy));
+	cache->OptionsHash = HashBytes(cache->OptionsHash, &Options->GuestFs,
+	                               sizeof(Options->GuestFs));
+	cache->OptionsHash = HashBytes(cache->OptionsHash, &Options->DedupeClone,
+	                               sizeof(Options->DedupeClone));
+
+	cache->File = CreateFileW(Path,
+	                          GENERIC_READ | GENERIC_WRITE,
+	                          FILE_SHARE_READ | FILE_SHARE_WRITE,
+	                          NULL,
+	                          OPEN_ALWAYS,
+	                          FILE_ATTRIBUTE_NORMAL,
+	                          NULL);
+	if (INVALID_HANDLE_VALUE == cache->File) {
+		errRet = GetLastError();
+		cache->File = NULL;
+		goto error_return;
+	}
+
+	errRet = LockDatabase(cache->File, FALSE);
+	if (ERROR_SUCCESS != errRet)
+		goto error_return;
+	errRet = LoadRecords(cache);
+	UnlockDatabase(cache->File);
+	if (ERROR_SUCCESS != errRet)
+		goto error_return;
+
+	cache->Stats.RecordsLoaded = cache->NumUsed;
+	*Cache = cache;
+	return ERROR_SUCCESS;
+
+error_return:
+	ScanCacheFree(cache);
+	return errRet;
+}
+
+
+_Use_decl_annotations_
+BOOL
+ScanCacheLookup(
+	PSCAN_CACHE     Cache,
+	LPCWSTR         Path,
+	UINT64          *ReclaimableBytes
+	)
+{
+	SCAN_CACHE_RECORD   key;
+	PSCAN_CACHE_SLOT    slot;
+	BOOL                hit;
+
+	*ReclaimableBytes = 0;
+	if (ERROR_SUCCESS != ReadFileKey(Path, &key))
+		return FALSE;
+
+	hit = FALSE;
+	AcquireSRWLockShared(&Cache->Lock);
+	if (Cache->NumSlots) {
+		slot = &Cache->Slots[SlotOf(Cache, key.VolumeSerial, key.FileIndex)];
+		hit = slot->Used
+		      && ERROR_SUCCESS == slot->Record.Outcome
+		      && Cache->OptionsHash == slot->Record.OptionsHash
+		      && key.FileSize == slot->Record.FileSize
+		      && 0 == CompareFileTime(&key.LastWriteTime, &slot->Record.LastWriteTime);
+		if (hit)
+			*ReclaimableBytes = slot->Record.ReclaimableBytes;
+	}
+	ReleaseSRWLockShared(&Cache->Lock);
+
+	if (hit)
+		InterlockedIncrement64((volatile LONG64 *)&Cache->Stats.Hits);
+	else
+		InterlockedIncrement64((volatile LONG64 *)&Cache->Stats.Misses);
+
+	return hit;
+}
+
+
+_Use_decl_annotations_
+DWORD
+ScanCacheRecord(
+	PSCAN_CACHE     Cache,
+	LPCWSTR         Path,
+	DWORD           Outcome,
+	UINT64          ReclaimableBytes
+	)
+{
+	SCAN_CACHE_RECORD   record;
+	PSCAN_CACHE_SLOT    slot;
+	DWORD               errRet;
+
+	/* Read after the file is closed so the last write time is the one our
+	 * own changes left behind. */
+	errRet = ReadFileKey(Path, &record);
+	if (ERROR_SUCCESS != errRet)
+		return errRet;
+	record.Outcome          = Outcome;
+	record.OptionsHash      = Cache->OptionsHash;
+	record.ReclaimableBytes = ReclaimableBytes;
+
+	AcquireSRWLockExclusive(&Cache->Lock);
+	errRet = Reserve(Cache);
+	if (ERROR_SUCCESS == errRet) {
+		slot = &Cache->Slots[SlotOf(Cache, record.VolumeSerial, record.FileIndex)];
+		if (!slot->Used)
+			Cache->NumUsed++;
+		slot->Record = record;
+		slot->Used   = TRUE;
+		slot->Dirty  = TRUE;
+		Cache->Stats.RecordsWritten++;
+	}
+	ReleaseSRWLockExclusive(&Cache->Lock);
+
+	return errRet;
+}
+
+
+_Use_decl_annotations_
+DWORD
+ScanCacheSave(
+	PSCAN_CACHE     Cache
+	)
+{
+	SCAN_CACHE_HEADER   header;
+	PSCAN_CACHE_RECORD  records;
+	LARGE_INTEGER       zero;
+	SIZE_T              numRecords, i;
+	UINT64              offset, total;
+	DWORD               chunk, bytes, errRet;
+
+	if (0 == Cache->Stats.RecordsWritten)
+		return ERROR_SUCCESS;
+
+	records = NULL;
+
+	errRet = LockDatabase(Cache->File, TRUE);
+	if (ERROR_SUCCESS != errRet)
+		return errRet;
+
+	/* Pick up whatever other processes saved since we loaded. */
+	errRet = LoadRecords(Cache);
+	if (ERROR_SUCCESS != errRet)
+		goto func_return;
+
+	records = malloc(MAX(Cache->NumUsed, 1) * sizeof(*records));
+	if (NULL == records) {
+		errRet = ERROR_NOT_ENOUGH_MEMORY;
+		goto func_return;
+	}
+	numRecords = 0;
+	for (i = 0; i < Cache->NumSlots; ++i) {
+		if (Cache->Slots[i].Used)
+			records[numRecords++] = Cache->Slots[i].Record;
+	}
+
+	total = (UINT64)numRecords * sizeof(*records);
+	header.Magic      = SCAN_CACHE_MAGIC;
+	header.Version    = SCAN_CACHE_VERSION;
+	header.NumRecords = numRecords;
+	header.Checksum   = HashBytes(SCAN_CACHE_HASH_BASIS, records, (SIZE_T)total);
+
+	zero.QuadPart = 0;
+	if (!SetFilePointerEx(Cache->File, zero, NULL, FILE_BEGIN)
+	    || !WriteFile(Cache->File, &header, sizeof(header), &bytes, NULL)) {
+		errRet = GetLastError();
+		goto func_return;
+	}
+	for (offset = 0; offset < total; offset += chunk) {
+		chunk = (DWORD)MIN(total - offset, SCAN_CACHE_IO_SIZE);
+		if (!WriteFile(Cache->File, (PBYTE)records + offset, chunk, &bytes, NULL)) {
+			errRet = GetLastError();
+			goto func_return;
+		}
+	}
+	if (!SetEndOfFile(Cache->File) || !FlushFileBuffers(Cache->File)) {
+		errRet = GetLastError();
+		goto func_return;
+	}
+
+	Cache->Stats.RecordsSaved = numRecords;
+	errRet = ERROR_SUCCESS;
+
+func_return:
+	UnlockDatabase(Cache->File);
+	free(records);
+	return errRet;
+}
+
+
+_Use_decl_annotations_
+void
+ScanCacheGetStats(
+	PSCAN_CACHE         Cache,
+	PSCAN_CACHE_STATS   Stats
+	)
+{
+	AcquireSRWLockShared(&Cache->Lock);
+	*Stats = Cache->Stats;
+	ReleaseSRWLockShared(&Cache->Lock);
+}
+
+
+_Use_decl_annotations_
+void
+ScanCacheFree(
+	PSCAN_CACHE     Cache
+	)
+{
+	if (NULL == Cache)
+		return;
+	if (Cache->File)
+		(void)CloseHandle(Cache->File);
+	free(Cache->Slots);
+	free(Cache);
+}
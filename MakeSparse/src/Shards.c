@@ -0,0 +1,213 @@
+/* Standard BSD license disclaimer.
+
+Copyright(c) 2016-2021, Lance D. Stringham
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "targetver.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "MakeSparse.h"
+
+/* Merging shard results.
+ *
+ * Every process given a --range writes what it did to its own result file.
+ * The coordinator reads them all back, checks they describe the same file and
+ * cover it exactly once, and reports the totals as if a single process had
+ * done the work. MakeSparse shards also list the zero runs they found, which
+ * are put back together into one cluster map. */
+
+typedef struct LOADED_SHARD {
+	LPCWSTR         Path;
+	SHARD_RESULT    Result;
+} LOADED_SHARD, *PLOADED_SHARD;
+
+
+static int __cdecl
+CompareShardOffset(
+	_In_        const void  *A,
+	_In_        const void  *B
+	)
+{
+	const LOADED_SHARD *a = *(const PLOADED_SHARD *)A, *b = *(const PLOADED_SHARD *)B;
+
+	if (a->Result.RangeOffset < b->Result.RangeOffset)
+		return -1;
+	return (a->Result.RangeOffset > b->Result.RangeOffset);
+}
+
+
+/* Mark every zero run of every shard. */
+static DWORD
+MergeShardMaps(
+	_In_        const MAKESPARSE_OPTIONS    *Options,
+	_In_reads_(NumShards)
+	            PLOADED_SHARD               *Shards,
+	_In_        SIZE_T                      NumShards
+	)
+{
+	const SHARD_RESULT  *result;
+	PCLUSTER_MAP        zeroMap;
+	UINT64              cs, j;
+	SIZE_T              i;
+	DWORD               errRet;
+
+	cs = Shards[0]->Result.ClusterSize;
+	zeroMap = ClusterMapAllocate((DWORD)cs, Shards[0]->Result.FileSize);
+	if (NULL == zeroMap) {
+		errRet = GetLastError();
+		LogError(L"Failed to allocate cluster map with error %#llx\n", (long long)errRet);
+		return errRet;
+	}
+
+	for (i = 0; i < NumShards; ++i) {
+		result = &Shards[i]->Result;
+		for (j = 0; j < result->NumZeroRuns; ++j) {
+			ClusterMapMarkClusters(zeroMap,
+			                       result->ZeroRuns[j].Offset / cs,
+			                       (result->ZeroRuns[j].Offset + result->ZeroRuns[j].Length
+			                        + cs - 1) / cs);
+		}
+	}
+
+	errRet = PrintMap(Options, zeroMap) ? ERROR_SUCCESS : ERROR_WRITE_FAULT;
+	ClusterMapFree(zeroMap);
+	return errRet;
+}
+
+
+_Use_decl_annotations_
+DWORD
+RunMergeShards(
+	const MAKESPARSE_OPTIONS    *Options
+	)
+{
+	PLOADED_SHARD   shards, *sorted, first;
+	SIZE_T          numLoaded, i;
+	UINT64          covered, end, bytesRead, bytesWritten, rangesWritten, shardsFailed;
+	DWORD           errRet;
+
+	errRet = ERROR_SUCCESS;
+	numLoaded = 0;
+	bytesRead = bytesWritten = rangesWritten = shardsFailed = 0;
+
+	shards = calloc(Options->NumShardFiles, sizeof(*shards));
+	sorted = calloc(Options->NumShardFiles, sizeof(*sorted));
+	if (NULL == shards || NULL == sorted) {
+		errRet = ERROR_NOT_ENOUGH_MEMORY;
+		LogError(L"Failed to allocate shard list\n");
+		goto func_return;
+	}
+
+	for (i = 0; i < (SIZE_T)Options->NumShardFiles; ++i) {
+		shards[i].Path = Options->ShardFiles[i];
+		errRet = ShardResultLoad(shards[i].Path, &shards[i].Result);
+		if (ERROR_SUCCESS != errRet) {
+			LogError(L"Failed to read shard result %s with error %#llx\n",
+			         shards[i].Path, (long long)errRet);
+			goto func_return;
+		}
+		sorted[numLoaded++] = &shards[i];
+	}
+
+	/* Every shard has to be of the same file as the first. */
+	first = sorted[0];
+	for (i = 1; i < numLoaded; ++i) {
+		if (wcscmp(sorted[i]->Result.Tool, first->Result.Tool)
+		    || sorted[i]->Result.FileSize != first->Result.FileSize
+		    || sorted[i]->Result.ClusterSize != first->Result.ClusterSize) {
+			LogError(L"Shard result %s does not describe the same file as %s\n",
+			         sorted[i]->Path, first->Path);
+			errRet = ERROR_INVALID_DATA;
+			goto func_return;
+		}
+	}
+
+	qsort(sorted, numLoaded, sizeof(*sorted), CompareShardOffset);
+
+	/* Gaps and overlaps are reported but still merged so the totals show
+	 * what was done. */
+	covered = 0;
+	for (i = 0; i < numLoaded; ++i) {
+		if (sorted[i]->Result.RangeOffset > covered) {
+			LogError(L"No shard covers [%llu, %llu).\n",
+			         covered, sorted[i]->Result.RangeOffset);
+			errRet = ERROR_INVALID_DATA;
+		} else if (sorted[i]->Result.RangeOffset < covered) {
+			LogError(L"Shard result %s overlaps an earlier shard.\n", sorted[i]->Path);
+			errRet = ERROR_INVALID_DATA;
+		}
+		end = sorted[i]->Result.RangeOffset + sorted[i]->Result.RangeLength;
+		covered = MAX(covered, end);
+
+		if (ERROR_SUCCESS != sorted[i]->Result.Error) {
+			LogError(L"Shard %s at offset %llu failed with error %#llx\n",
+			         sorted[i]->Path, sorted[i]->Result.RangeOffset,
+			         (long long)sorted[i]->Result.Error);
+			shardsFailed++;
+		}
+		bytesRead     += sorted[i]->Result.BytesRead;
+		bytesWritten  += sorted[i]->Result.BytesWritten;
+		rangesWritten += sorted[i]->Result.RangesWritten;
+	}
+	if (covered < first->Result.FileSize) {
+		LogError(L"No shard covers [%llu, %llu).\n", covered, first->Result.FileSize);
+		errRet = ERROR_INVALID_DATA;
+	}
+
+	LogInfo(L"Merged %llu %s shards of a %8.2f MiB file, %llu failed.\n"
+	        L"Read %8.2f MiB; wrote %8.2f MiB in %llu ranges.\n",
+	        (UINT64)numLoaded, first->Result.Tool,
+	        (double)first->Result.FileSize / 1048576.0, shardsFailed,
+	        (double)bytesRead / 1048576.0,
+	        (double)bytesWritten / 1048576.0, rangesWritten);
+
+	if (Options->PrintSparseMap) {
+		if (ERROR_SUCCESS != MergeShardMaps(Options, sorted, numLoaded))
+			errRet = ERROR_WRITE_FAULT;
+	}
+
+	if (ERROR_SUCCESS == errRet && shardsFailed)
+		errRet = ERROR_GEN_FAILURE;
+
+func_return:
+	if (shards) {
+		for (i = 0; i < (SIZE_T)Options->NumShardFiles; ++i)
+			ShardResultFree(&shards[i].Result);
+	}
+	free(shards);
+	free(sorted);
+	return errRet;
+}
@@ -0,0 +1,667 @@
+/* Standard BSD license disclaimer.
+
+Copyright(c) 2016-2021, Lance D. Stringham
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "targetver.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <wctype.h>
+
+#include <assert.h>
+
+#include "MakeSparse.h"
+
+/* Watch mode.
+ *
+ * The main thread reads change notifications for the watched tree and records
+ * the files they name in a fixed size table. A file becomes due once it has
+ * gone SettleSeconds without a notification; every new notification pushes
+ * that back again. Worker threads take due files and check them before doing
+ * any work: a file written to more recently than the settle time, or that
+ * anybody still has open, is put back to be checked again later. A file left
+ * exactly as MakeSparse last left it is skipped, which also swallows the
+ * notifications our own deallocation generates.
+ *
+ * Memory stays flat however busy the tree is. The table never grows; when it
+ * is full, finished entries are recycled oldest first and notifications for
+ * new files are dropped while every entry is waiting or in progress. Dropped
+ * files, like ones lost to a notification buffer overflow, are picked up the
+ * next time they change. Each worker holds the maps of at most one file. */
+
+/* Entries in the table of known files. */
+#define WATCH_MAX_ENTRIES           4096
+
+/* Size of the notification buffer. Larger buffers fail on network shares. */
+#define WATCH_BUFFER_SIZE           (64 * 1024)
+
+#define WATCH_DEFAULT_THREADS       2
+
+/* 100ns FILETIME intervals per millisecond. */
+#define FILETIME_PER_MS             10000ull
+
+typedef enum WATCH_STATE {
+	WatchFree = 0,
+	/* Waiting for DueTick. */
+	WatchPending,
+	/* A worker is processing the file. */
+	WatchBusy,
+	/* Processed; kept so our own changes to it are recognized. */
+	WatchDone
+} WATCH_STATE;
+
+typedef struct WATCH_ENTRY {
+	LPWSTR          Path;
+	ULONG           Hash;
+	WATCH_STATE     State;
+	/* Notified while busy; check again once the worker is done. */
+	BOOL            Dirty;
+	ULONGLONG       DueTick;
+	ULONGLONG       LastTick;
+	/* Size and write time of the file when we last finished with it. */
+	BOOL            HaveDoneRecord;
+	UINT64          DoneSize;
+	FILETIME        DoneWriteTime;
+} WATCH_ENTRY, *PWATCH_ENTRY;
+
+typedef struct WATCH_CONTEXT {
+	const MAKESPARSE_OPTIONS    *Options;
+	ULONGLONG                   SettleMs;
+	WATCH_ENTRY                 *Entries;
+
+	/* Everything below is guarded by Lock. */
+	CRITICAL_SECTION            Lock;
+	CONDITION_VARIABLE          WorkAvailable;
+	BOOL                        Stop;
+	UINT64                      EventsDropped;
+	UINT64                      FilesProcessed;
+	UINT64                      FilesFailed;
+	UINT64                      BytesZeroed;
+} WATCH_CONTEXT, *PWATCH_CONTEXT;
+
+/* Signalled by the console control handler. */
+static HANDLE StopEvent;
+
+
+static BOOL WINAPI
+WatchCtrlHandler(
+	DWORD       CtrlType
+	)
+{
+	switch (CtrlType) {
+	case CTRL_C_EVENT:
+	case CTRL_BREAK_EVENT:
+	case CTRL_CLOSE_EVENT:
+	case CTRL_SHUTDOWN_EVENT:
+		(void)SetEvent(StopEvent);
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+
+/* File names on Windows compare case insensitively. */
+static ULONG
+HashPath(
+	_In_        LPCWSTR     Path
+	)
+{
+	ULONG hash = 2166136261u;
+
+	while (*Path) {
+		hash ^= (ULONG)towupper(*Path++);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+
+/* Caller holds the lock. */
+static PWATCH_ENTRY
+FindEntry(
+	_In_        PWATCH_CONTEXT  Ctx,
+	_In_        LPCWSTR         Path,
+	_In_        ULONG           Hash
+	)
+{
+	SIZE_T i;
+
+	for (i = 0; i < WATCH_MAX_ENTRIES; ++i) {
+		if (WatchFree != Ctx->Entries[i].State
+		    && Hash == Ctx->Entries[i].Hash
+		    && !_wcsicmp(Path, Ctx->Entries[i].Path))
+			return &Ctx->Entries[i];
+	}
+	return NULL;
+}
+
+
+static void
+ReleaseEntry(
+	_Inout_     PWATCH_ENTRY    Entry
+	)
+{
+	free(Entry->Path);
+	memset(Entry, 0, sizeof(*Entry));
+}
+
+
+/* Caller holds the lock. Returns a free entry, recycling the finished entry
+ * least recently used if the table is full, or NULL if every entry is in use. */
+static PWATCH_ENTRY
+AllocateEntry(
+	_Inout_     PWATCH_CONTEXT  Ctx
+	)
+{
+	PWATCH_ENTRY    oldest;
+	SIZE_T          i;
+
+	oldest = NULL;
+	for (i = 0; i < WATCH_MAX_ENTRIES; ++i) {
+		if (WatchFree == Ctx->Entries[i].State)
+			return &Ctx->Entries[i];
+		if (WatchDone == Ctx->Entries[i].State
+		    && (NULL == oldest || Ctx->Entries[i].LastTick < oldest->LastTick))
+			oldest = &Ctx->Entries[i];
+	}
+
+	if (oldest)
+		ReleaseEntry(oldest);
+	return oldest;
+}
+
+
+/* Record a notification for Path, (re)starting its settle time. */
+static void
+WatchTouch(
+	_Inout_     PWATCH_CONTEXT  Ctx,
+	_In_        LPCWSTR         Path
+	)
+{
+	PWATCH_ENTRY    entry;
+	ULONGLONG       now;
+	ULONG           hash;
+
+	hash = HashPath(Path);
+	now = GetTickCount64();
+
+	EnterCriticalSection(&Ctx->Lock);
+
+	entry = FindEntry(Ctx, Path, hash);
+	if (NULL == entry) {
+		entry = AllocateEntry(Ctx);
+		if (entry)
+			entry->Path = _wcsdup(Path);
+		if (NULL == entry || NULL == entry->Path) {
+			if (entry)
+				ReleaseEntry(entry);
+			Ctx->EventsDropped++;
+			goto func_return;
+		}
+		entry->Hash = hash;
+	}
+
+	entry->LastTick = now;
+	if (WatchBusy == entry->State) {
+		entry->Dirty = TRUE;
+	} else {
+		entry->State = WatchPending;
+		entry->DueTick = now + Ctx->SettleMs;
+		WakeConditionVariable(&Ctx->WorkAvailable);
+	}
+
+func_return:
+	LeaveCriticalSection(&Ctx->Lock);
+}
+
+
+/* Path was deleted or renamed away. */
+static void
+WatchForget(
+	_Inout_     PWATCH_CONTEXT  Ctx,
+	_In_        LPCWSTR         Path
+	)
+{
+	PWATCH_ENTRY entry;
+
+	EnterCriticalSection(&Ctx->Lock);
+	entry = FindEntry(Ctx, Path, HashPath(Path));
+	/* A busy entry belongs to its worker, which finds the file gone. */
+	if (entry && WatchBusy != entry->State)
+		ReleaseEntry(entry);
+	LeaveCriticalSection(&Ctx->Lock);
+}
+
+
+typedef enum WATCH_RESULT {
+	/* Processed, or nothing to do. Remember the file as it is now. */
+	WatchResultDone,
+	/* Still being written; check again after the settle time. */
+	WatchResultRetry,
+	/* Gone, or not something we process. */
+	WatchResultForget,
+	WatchResultFailed
+} WATCH_RESULT;
+
+
+/* Runs without the lock; Entry is owned by the worker while busy. */
+static WATCH_RESULT
+ProcessEntry(
+	_Inout_     PWATCH_CONTEXT  Ctx,
+	_Inout_     PWATCH_ENTRY    Entry,
+	_Out_       PWATCH_ENTRY    Record,
+	_Out_       UINT64          *BytesZeroed
+	)
+{
+	WIN32_FILE_ATTRIBUTE_DATA   attrs;
+	TARGET_FILE                 target;
+	FILETIME                    now;
+	HANDLE                      probe;
+	UINT64                      size, age;
+	WATCH_RESULT                result;
+	DWORD                       errRet;
+
+	*BytesZeroed = 0;
+	memset(&target, 0, sizeof(target));
+
+	if (!GetFileAttributesExW(Entry->Path, GetFileExInfoStandard, &attrs))
+		return WatchResultForget;
+	if (attrs.dwFileAttributes & (FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_REPARSE_POINT))
+		return WatchResultForget;
+
+	size = ((UINT64)attrs.nFileSizeHigh << 32) | attrs.nFileSizeLow;
+	Record->DoneSize = size;
+	Record->DoneWriteTime = attrs.ftLastWriteTime;
+
+	if (0 == size)
+		return WatchResultDone;
+
+	if (Entry->HaveDoneRecord
+	    && size == Entry->DoneSize
+	    && attrs.ftLastWriteTime.dwLowDateTime == Entry->DoneWriteTime.dwLowDateTime
+	    && attrs.ftLastWriteTime.dwHighDateTime == Entry->DoneWriteTime.dwHighDateTime)
+		return WatchResultDone;
+
+	/* Notifications can be delayed or coalesced; the file's own write time
+	 * says whether the writer has really gone quiet. */
+	GetSystemTimeAsFileTime(&now);
+	age = ((((UINT64)now.dwHighDateTime << 32) | now.dwLowDateTime)
+	       - (((UINT64)attrs.ftLastWriteTime.dwHighDateTime << 32)
+	          | attrs.ftLastWriteTime.dwLowDateTime)) / FILETIME_PER_MS;
+	if (age < Ctx->SettleMs)
+		return WatchResultRetry;
+
+	/* A writer that still has the file open, even idle, wins. Probe first so
+	 * the expected sharing violation is not reported as an error. */
+	probe = CreateFileW(Entry->Path, GENERIC_READ, 0, NULL, OPEN_EXISTING,
+	                    FILE_ATTRIBUTE_NORMAL, NULL);
+	if (INVALID_HANDLE_VALUE == probe) {
+		errRet = GetLastError();
+		if (ERROR_SHARING_VIOLATION == errRet || ERROR_LOCK_VIOLATION == errRet)
+			return WatchResultRetry;
+		if (ERROR_FILE_NOT_FOUND == errRet || ERROR_PATH_NOT_FOUND == errRet)
+			return WatchResultForget;
+		LogError(L"Failed to open file %s with error %#llx\n",
+		         Entry->Path, (long long)errRet);
+		return WatchResultFailed;
+	}
+	(void)CloseHandle(probe);
+
+	result = WatchResultFailed;
+
+	errRet = TargetFileOpen(Ctx->Options, Entry->Path, &target);
+	if (ERROR_SUCCESS != errRet) {
+		if (ERROR_SHARING_VIOLATION == errRet)
+			result = WatchResultRetry;
+		goto func_return;
+	}
+
+	errRet = TargetFileScan(&target, 0, 0, NULL);
+	if (ERROR_SUCCESS != errRet) {
+		LogError(L"Failed to analyze %s with error %#llx\n",
+		         Entry->Path, (long long)errRet);
+		goto func_return;
+	}
+
+	errRet = TargetFileDeallocate(Ctx->Options, &target);
+	TargetFileClose(Ctx->Options, &target);
+	*BytesZeroed = target.DispatchStats.BytesZeroed;
+	if (ERROR_SUCCESS != errRet) {
+		LogError(L"Failed to deallocate zero ranges of %s with error %#llx\n",
+		         Entry->Path, (long long)errRet);
+		goto func_return;
+	}
+
+	if (target.DispatchStats.RangesQueued) {
+		LogInfo(L"%s: dispatched %llu zero ranges covering %8.2f MiB.\n",
+		        Entry->Path, target.DispatchStats.RangesQueued,
+		        (double)target.DispatchStats.BytesZeroed / 1048576.0);
+	}
+
+	/* Deallocating changes the write time unless it was preserved. */
+	if (GetFileAttributesExW(Entry->Path, GetFileExInfoStandard, &attrs)) {
+		Record->DoneSize = ((UINT64)attrs.nFileSizeHigh << 32) | attrs.nFileSizeLow;
+		Record->DoneWriteTime = attrs.ftLastWriteTime;
+	}
+	result = WatchResultDone;
+
+func_return:
+	TargetFileClose(Ctx->Options, &target);
+	TargetFileFree(&target);
+	return result;
+}
+
+
+static DWORD WINAPI
+WatchWorkerThread(
+	LPVOID      Param
+	)
+{
+	PWATCH_CONTEXT  ctx;
+	PWATCH_ENTRY    entry, candidate;
+	WATCH_ENTRY     record;
+	WATCH_RESULT    result;
+	ULONGLONG       now;
+	UINT64          bytesZeroed;
+	DWORD           waitMs;
+	SIZE_T          i;
+
+	ctx = Param;
+
+	EnterCriticalSection(&ctx->Lock);
+
+	while (!ctx->Stop) {
+		/* The table is small enough that a scan for the earliest due entry
+		 * costs nothing next to processing a file. */
+		entry = NULL;
+		for (i = 0; i < WATCH_MAX_ENTRIES; ++i) {
+			candidate = &ctx->Entries[i];
+			if (WatchPending == candidate->State
+			    && (NULL == entry || candidate->DueTick < entry->DueTick))
+				entry = candidate;
+		}
+
+		now = GetTickCount64();
+		if (NULL == entry || entry->DueTick > now) {
+			waitMs = entry ? (DWORD)MIN(entry->DueTick - now, INFINITE - 1) : INFINITE;
+			(void)SleepConditionVariableCS(&ctx->WorkAvailable, &ctx->Lock, waitMs);
+			continue;
+		}
+
+		entry->State = WatchBusy;
+		entry->Dirty = FALSE;
+		LeaveCriticalSection(&ctx->Lock);
+
+		memset(&record, 0, sizeof(record));
+		result = ProcessEntry(ctx, entry, &record, &bytesZeroed);
+
+		EnterCriticalSection(&ctx->Lock);
+
+		now = GetTickCount64();
+		entry->LastTick = now;
+		ctx->BytesZeroed += bytesZeroed;
+
+		switch (result) {
+		case WatchResultRetry:
+			entry->State = WatchPending;
+			entry->DueTick = now + ctx->SettleMs;
+			break;
+		case WatchResultForget:
+			ReleaseEntry(entry);
+			break;
+		default:
+			/* A file that failed is also left alone until it changes. */
+			if (WatchResultDone == result)
+				ctx->FilesProcessed++;
+			else
+				ctx->FilesFailed++;
+			entry->HaveDoneRecord = TRUE;
+			entry->DoneSize = record.DoneSize;
+			entry->DoneWriteTime = record.DoneWriteTime;
+			entry->State = WatchDone;
+			break;
+		}
+
+		if (entry->Dirty && WatchDone == entry->State) {
+			entry->State = WatchPending;
+			entry->DueTick = now + ctx->SettleMs;
+		}
+	}
+
+	LeaveCriticalSection(&ctx->Lock);
+
+	return 0;
+}
+
+
+/* Queue every file named in one buffer of notifications. */
+static void
+HandleNotifications(
+	_Inout_     PWATCH_CONTEXT  Ctx,
+	_In_        LPCWSTR         Root,
+	_In_        const BYTE      *Buffer,
+	_Out_writes_(PathSize)
+	            LPWSTR          Path,
+	_In_        SIZE_T          PathSize
+	)
+{
+	const FILE_NOTIFY_INFORMATION   *info;
+	SIZE_T                          nameLen;
+
+	for (;;) {
+		info = (const FILE_NOTIFY_INFORMATION *)Buffer;
+		nameLen = info->FileNameLength / sizeof(WCHAR);
+
+		(void)swprintf_s(Path, PathSize, L"%s\\%.*s", Root, (int)nameLen, info->FileName);
+
+		switch (info->Action) {
+		case FILE_ACTION_ADDED:
+		case FILE_ACTION_MODIFIED:
+		case FILE_ACTION_RENAMED_NEW_NAME:
+			WatchTouch(Ctx, Path);
+			break;
+		case FILE_ACTION_REMOVED:
+		case FILE_ACTION_RENAMED_OLD_NAME:
+			WatchForget(Ctx, Path);
+			break;
+		}
+
+		if (0 == info->NextEntryOffset)
+			break;
+		Buffer += info->NextEntryOffset;
+	}
+}
+
+
+_Use_decl_annotations_
+DWORD
+RunWatch(
+	const MAKESPARSE_OPTIONS    *Options
+	)
+{
+	WATCH_CONTEXT   ctx;
+	OVERLAPPED      ov;
+	HANDLE          dir, waits[2], threads[MAX_BATCH_THREADS];
+	BYTE            *buffer;
+	LPWSTR          path;
+	SIZE_T          pathSize, i;
+	DWORD           numThreads, bytes, wait, errRet;
+
+	memset(&ctx, 0, sizeof(ctx));
+	memset(&ov, 0, sizeof(ov));
+	dir = INVALID_HANDLE_VALUE;
+	buffer = NULL;
+	path = NULL;
+	numThreads = 0;
+
+	ctx.Options = Options;
+	ctx.SettleMs = (ULONGLONG)Options->SettleSeconds * 1000;
+	InitializeCriticalSection(&ctx.Lock);
+	InitializeConditionVariable(&ctx.WorkAvailable);
+
+	/* Room for the root, a separator, the longest relative name the buffer
+	 * can carry and the terminator. */
+	pathSize = wcslen(Options->WatchRoot) + 1 + WATCH_BUFFER_SIZE / sizeof(WCHAR) + 1;
+
+	ctx.Entries = calloc(WATCH_MAX_ENTRIES, sizeof(*ctx.Entries));
+	buffer = malloc(WATCH_BUFFER_SIZE);
+	path = malloc(pathSize * sizeof(*path));
+	if (NULL == ctx.Entries || NULL == buffer || NULL == path) {
+		errRet = ERROR_NOT_ENOUGH_MEMORY;
+		LogError(L"Failed to allocate watch state\n");
+		goto func_return;
+	}
+
+	StopEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+	ov.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+	if (NULL == StopEvent || NULL == ov.hEvent) {
+		errRet = GetLastError();
+		LogError(L"Failed CreateEventW with error %#llx\n", (long long)errRet);
+		goto func_return;
+	}
+	(void)SetConsoleCtrlHandler(WatchCtrlHandler, TRUE);
+
+	dir = CreateFileW(Options->WatchRoot,
+	                  FILE_LIST_DIRECTORY,
+	                  FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+	                  NULL,
+	                  OPEN_EXISTING,
+	                  FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,
+	                  NULL);
+	if (INVALID_HANDLE_VALUE == dir) {
+		errRet = GetLastError();
+		LogError(L"Failed to open directory %s with error %#llx\n",
+		         Options->WatchRoot, (long long)errRet);
+		goto func_return;
+	}
+
+	for (numThreads = 0; numThreads < (Options->Threads ? Options->Threads : WATCH_DEFAULT_THREADS);
+	     ++numThreads) {
+		threads[numThreads] = CreateThread(NULL, 0, WatchWorkerThread, &ctx, 0, NULL);
+		if (NULL == threads[numThreads]) {
+			errRet = GetLastError();
+			LogError(L"Failed CreateThread with error %#llx\n", (long long)errRet);
+			goto cleanup_return;
+		}
+	}
+
+	LogInfo(L"Watching %s with %lu threads. Files are processed once left alone "
+	        L"for %lu seconds. Press Ctrl+C to stop.\n",
+	        Options->WatchRoot, numThreads, Options->SettleSeconds);
+
+	waits[0] = StopEvent;
+	waits[1] = ov.hEvent;
+
+	for (;;) {
+		(void)ResetEvent(ov.hEvent);
+		if (!ReadDirectoryChangesW(dir, buffer, WATCH_BUFFER_SIZE, TRUE,
+		                           FILE_NOTIFY_CHANGE_FILE_NAME
+		                           | FILE_NOTIFY_CHANGE_SIZE
+		                           | FILE_NOTIFY_CHANGE_LAST_WRITE,
+		                           NULL, &ov, NULL)) {
+			errRet = GetLastError();
+			LogError(L"Failed ReadDirectoryChangesW with error %#llx\n", (long long)errRet);
+			goto cleanup_return;
+		}
+
+		wait = WaitForMultipleObjects(2, waits, FALSE, INFINITE);
+		if (WAIT_OBJECT_0 + 1 != wait) {
+			(void)CancelIoEx(dir, &ov);
+			(void)GetOverlappedResult(dir, &ov, &bytes, TRUE);
+			break;
+		}
+
+		if (!GetOverlappedResult(dir, &ov, &bytes, FALSE)) {
+			errRet = GetLastError();
+			/* The buffer was too small for what happened since the last
+			 * read. Those files are picked up when they next change. */
+			if (ERROR_NOTIFY_ENUM_DIR != errRet) {
+				LogError(L"Failed ReadDirectoryChangesW with error %#llx\n",
+				         (long long)errRet);
+				goto cleanup_return;
+			}
+			bytes = 0;
+		}
+
+		if (0 == bytes) {
+			LogInfo(L"WARNING: Change notifications were lost.\n");
+			EnterCriticalSection(&ctx.Lock);
+			ctx.EventsDropped++;
+			LeaveCriticalSection(&ctx.Lock);
+			continue;
+		}
+
+		HandleNotifications(&ctx, Options->WatchRoot, buffer, path, pathSize);
+	}
+
+	errRet = ERROR_SUCCESS;
+
+cleanup_return:
+	EnterCriticalSection(&ctx.Lock);
+	ctx.Stop = TRUE;
+	WakeAllConditionVariable(&ctx.WorkAvailable);
+	LeaveCriticalSection(&ctx.Lock);
+
+	for (i = 0; i < numThreads; ++i) {
+		(void)WaitForSingleObject(threads[i], INFINITE);
+		(void)CloseHandle(threads[i]);
+	}
+
+	LogInfo(L"Stopped watching. Processed %llu files, %llu failed, "
+	        L"reclaimed %8.2f MiB. %llu notifications dropped.\n",
+	        ctx.FilesProcessed, ctx.FilesFailed,
+	        (double)ctx.BytesZeroed / 1048576.0, ctx.EventsDropped);
+
+func_return:
+	if (INVALID_HANDLE_VALUE != dir)
+		(void)CloseHandle(dir);
+	(void)SetConsoleCtrlHandler(WatchCtrlHandler, FALSE);
+	if (ov.hEvent)
+		(void)CloseHandle(ov.hEvent);
+	if (StopEvent)
+		(void)CloseHandle(StopEvent);
+	StopEvent = NULL;
+	if (ctx.Entries) {
+		for (i = 0; i < WATCH_MAX_ENTRIES; ++i)
+			free(ctx.Entries[i].Path);
+		free(ctx.Entries);
+	}
+	free(buffer);
+	free(path);
+	DeleteCriticalSection(&ctx.Lock);
+
+	return errRet;
+}
@@ -0,0 +1,492 @@
+/* Standard BSD license disclaimer.
+
+Copyright(c) 2016-2021, Lance D. Stringham
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "targetver.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+// Necessary due to WIN32_LEAN_AND_MEAN
+#include <winioctl.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+
+#include <assert.h>
+
+#include "MakeSparse.h"
+
+/* Asynchronous dispatch of FSCTL_SET_ZERO_DATA requests.
+ *
+ * The file handle is associated with a private I/O completion port and every
+ * zero range is issued as an overlapped request. Requests are only waited on
+ * when the configured number are already in flight, at which point as many
+ * completions as are available get reaped in a single call. The dispatcher is
+ * not thread safe; a single thread is expected to own it. */
+
+/* Maximum number of completions pulled off the port in one call. */
+#define COMPLETION_BATCH_SIZE   64
+
+/* With ZERO_DISPATCH_VERIFY ranges are locked, read back and deallocated in
+ * pieces of this size, aligned to it, so no lock holds up the I/O of other
+ * handles for longer than one read and one request. */
+#define ZERO_VERIFY_WINDOW      (256 * 1024)
+
+struct ZERO_OP {
+	OVERLAPPED                  Ovrlp;
+	FILE_ZERO_DATA_INFORMATION  Fzdi;
+	/* The range is locked and has to be unlocked on completion. */
+	BOOL                        Locked;
+	struct ZERO_OP              *NextFree;
+};
+
+struct ZERO_DISPATCH {
+	HANDLE              FileHandle;
+	HANDLE              IoCompletionPort;
+	DWORD               MaxInFlight;
+	DWORD               InFlight;
+	DWORD               FirstError;
+	DWORD               Flags;
+	/* Only allocated with ZERO_DISPATCH_VERIFY. */
+	PVOID               VerifyBuffer;
+	HANDLE              LockEvent;
+	struct ZERO_OP      *FreeOps;
+	ZERO_DISPATCH_STATS Stats;
+	struct ZERO_OP      Ops[ANYSIZE_ARRAY];
+};
+
+
+static void
+RecordZeroFailure(
+	_Inout_     PZERO_DISPATCH  Dispatch,
+	_In_        UINT64          Start,
+	_In_        UINT64          End,
+	_In_        DWORD           Err
+	)
+{
+	Dispatch->Stats.RangesFailed++;
+	if (ERROR_SUCCESS == Dispatch->FirstError)
+		Dispatch->FirstError = Err;
+	LogError(L"Failed to zero range 0x%016llX - 0x%016llX with error %#lx.\n",
+	         Start, End, Err);
+}
+
+
+/* Take or drop the byte range lock on [Start, End). Taking it fails with
+ * ERROR_LOCK_VIOLATION rather than waiting if another handle holds a lock on
+ * any part of the range. */
+static DWORD
+LockZeroRange(
+	_Inout_     PZERO_DISPATCH  Dispatch,
+	_In_        UINT64          Start,
+	_In_        UINT64          End,
+	_In_        BOOL            Lock
+	)
+{
+	OVERLAPPED  ovrlp;
+	UINT64      length;
+	DWORD       bytes;
+	BOOL        done;
+
+	length = End - Start;
+	memset(&ovrlp, 0, sizeof(ovrlp));
+	ovrlp.Offset     = (DWORD)Start;
+	ovrlp.OffsetHigh = (DWORD)(Start >> 32);
+	/* Keep the completion port from seeing the request as explained in
+	 * DeviceIoControlSync. */
+	ovrlp.hEvent = (HANDLE)((ULONG_PTR)Dispatch->LockEvent | 1);
+	(void)ResetEvent(Dispatch->LockEvent);
+
+	if (Lock) {
+		done = LockFileEx(Dispatch->FileHandle,
+		                  LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY,
+		                  0,
+		                  (DWORD)length,
+		                  (DWORD)(length >> 32),
+		                  &ovrlp);
+	} else {
+		done = UnlockFileEx(Dispatch->FileHandle,
+		                    0,
+		                    (DWORD)length,
+		                    (DWORD)(length >> 32),
+		                    &ovrlp);
+	}
+
+	if (!done && ERROR_IO_PENDING == GetLastError())
+		done = GetOverlappedResult(Dispatch->FileHandle, &ovrlp, &bytes, TRUE);
+
+	return done ? ERROR_SUCCESS : GetLastError();
+}
+
+
+/* Re-read [Start, End) and report whether it is still all zeros. A range cut
+ * short by the file shrinking counts as changed. */
+static DWORD
+VerifyZeroRange(
+	_Inout_     PZERO_DISPATCH  Dispatch,
+	_In_        UINT64          Start,
+	_In_        UINT64          End,
+	_Out_       BOOL            *IsZero
+	)
+{
+	DWORD   toRead, bytesRead, err;
+
+	*IsZero = FALSE;
+
+	while (Start < End) {
+		toRead = (DWORD)MIN(ZERO_VERIFY_WINDOW, End - Start);
+		QosThrottle(QosClassRead, toRead);
+
+		err = ReadFileSync(Dispatch->FileHandle, Start, Dispatch->VerifyBuffer,
+		                   toRead, &bytesRead);
+		if (ERROR_SUCCESS != err)
+			return err;
+		if (bytesRead != toRead || !IsZeroBuf(Dispatch->VerifyBuffer, toRead))
+			return ERROR_SUCCESS;
+
+		Start += toRead;
+	}
+
+	*IsZero = TRUE;
+	return ERROR_SUCCESS;
+}
+
+
+/* Lock the range and check it is still zero. Returns FALSE if the range has to
+ * be skipped, in which case it has been accounted for and is not locked. */
+static BOOL
+PrepareVerifiedRange(
+	_Inout_     PZERO_DISPATCH  Dispatch,
+	_In_        UINT64          Start,
+	_In_        UINT64          End
+	)
+{
+	DWORD   err;
+	BOOL    isZero;
+
+	err = LockZeroRange(Dispatch, Start, End, TRUE);
+	if (ERROR_LOCK_VIOLATION == err) {
+		Dispatch->Stats.RangesLocked++;
+		return FALSE;
+	} else if (ERROR_SUCCESS != err) {
+		RecordZeroFailure(Dispatch, Start, End, err);
+		return FALSE;
+	}
+
+	err = VerifyZeroRange(Dispatch, Start, End, &isZero);
+	if (ERROR_SUCCESS == err && isZero)
+		return TRUE;
+
+	(void)LockZeroRange(Dispatch, Start, End, FALSE);
+	if (ERROR_SUCCESS != err)
+		RecordZeroFailure(Dispatch, Start, End, err);
+	else
+		Dispatch->Stats.RangesChanged++;
+	return FALSE;
+}
+
+
+static void
+CompleteZeroOp(
+	_Inout_     PZERO_DISPATCH  Dispatch,
+	_Inout_     struct ZERO_OP  *Op,
+	_In_        DWORD           Err
+	)
+{
+	UINT64 start, end;
+
+	start = (UINT64)Op->Fzdi.FileOffset.QuadPart;
+	end   = (UINT64)Op->Fzdi.BeyondFinalZero.QuadPart;
+
+	if (ERROR_SUCCESS == Err) {
+		Dispatch->Stats.RangesCompleted++;
+		Dispatch->Stats.BytesZeroed += end - start;
+	} else {
+		RecordZeroFailure(Dispatch, start, end, Err);
+	}
+
+	if (Op->Locked) {
+		(void)LockZeroRange(Dispatch, start, end, FALSE);
+		Op->Locked = FALSE;
+	}
+
+	Op->NextFree = Dispatch->FreeOps;
+	Dispatch->FreeOps = Op;
+}
+
+
+/* Wait for at least one outstanding request to complete and process every
+ * completion that is available. */
+static DWORD
+ReapZeroOps(
+	_Inout_     PZERO_DISPATCH  Dispatch
+	)
+{
+	OVERLAPPED_ENTRY    entries[COMPLETION_BATCH_SIZE];
+	ULONG               numEntries, i;
+	struct ZERO_OP      *op;
+	DWORD               bytes, err;
+
+	assert(Dispatch->InFlight);
+
+	if (!GetQueuedCompletionStatusEx(Dispatch->IoCompletionPort,
+	                                 entries,
+	                                 ARRAYSIZE(entries),
+	                                 &numEntries,
+	                                 INFINITE,
+	                                 FALSE))
+		return GetLastError();
+
+	for (i = 0; i < numEntries; ++i) {
+		op = CONTAINING_RECORD(entries[i].lpOverlapped, struct ZERO_OP, Ovrlp);
+		/* The completion entry only carries the raw NTSTATUS of the request.
+		 * Let GetOverlappedResult translate it to a Win32 error. */
+		err = ERROR_SUCCESS;
+		if (!GetOverlappedResult(Dispatch->FileHandle, &op->Ovrlp, &bytes, FALSE))
+			err = GetLastError();
+		--Dispatch->InFlight;
+		CompleteZeroOp(Dispatch, op, err);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+
+_Use_decl_annotations_
+PZERO_DISPATCH
+ZeroDispatchCreate(
+	HANDLE          FileHandle,
+	DWORD           MaxInFlight,
+	DWORD           Flags
+	)
+{
+	PZERO_DISPATCH  dispatch;
+	SIZE_T          allocSize;
+	DWORD           i, lastErr;
+
+	if (0 == MaxInFlight || MAX_ZERO_QUEUE_DEPTH < MaxInFlight
+	    || (Flags & ~ZERO_DISPATCH_VERIFY)) {
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return NULL;
+	}
+
+	allocSize = offsetof(struct ZERO_DISPATCH, Ops)
+	          + ((SIZE_T)MaxInFlight * sizeof(struct ZERO_OP));
+
+	dispatch = calloc(1, allocSize);
+	if (NULL == dispatch) {
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return NULL;
+	}
+
+	if (Flags & ZERO_DISPATCH_VERIFY) {
+		dispatch->VerifyBuffer = malloc(ZERO_VERIFY_WINDOW);
+		dispatch->LockEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+		if (NULL == dispatch->VerifyBuffer || NULL == dispatch->LockEvent) {
+			lastErr = dispatch->VerifyBuffer ? GetLastError() : ERROR_NOT_ENOUGH_MEMORY;
+			goto error_return;
+		}
+	}
+
+	dispatch->IoCompletionPort = CreateIoCompletionPort(FileHandle,
+	                                                    NULL,
+	                                                    (ULONG_PTR)dispatch,
+	                                                    1);
+	if (NULL == dispatch->IoCompletionPort) {
+		lastErr = GetLastError();
+		goto error_return;
+	}
+
+	dispatch->FileHandle  = FileHandle;
+	dispatch->MaxInFlight = MaxInFlight;
+	dispatch->FirstError  = ERROR_SUCCESS;
+	dispatch->Flags       = Flags;
+
+	for (i = 0; i < MaxInFlight; ++i) {
+		dispatch->Ops[i].NextFree = dispatch->FreeOps;
+		dispatch->FreeOps = &dispatch->Ops[i];
+	}
+
+	return dispatch;
+
+error_return:
+	if (dispatch->LockEvent)
+		(void)CloseHandle(dispatch->LockEvent);
+	free(dispatch->VerifyBuffer);
+	free(dispatch);
+	SetLastError(lastErr);
+	return NULL;
+}
+
+
+/* Issue one request for [FileOffset, BeyondFinalZero), verifying it first
+ * with ZERO_DISPATCH_VERIFY. */
+static DWORD
+QueueZeroOp(
+	_Inout_     PZERO_DISPATCH  Dispatch,
+	_In_        UINT64          FileOffset,
+	_In_        UINT64          BeyondFinalZero
+	)
+{
+	struct ZERO_OP  *op;
+	DWORD           err;
+
+	QosThrottle(QosClassPunch, 1);
+
+	while (NULL == Dispatch->FreeOps) {
+		err = ReapZeroOps(Dispatch);
+		if (ERROR_SUCCESS != err)
+			return err;
+	}
+
+	/* Verified only once a request slot is free, leaving the range as little
+	 * time as possible to change before it is deallocated. */
+	if ((Dispatch->Flags & ZERO_DISPATCH_VERIFY)
+	    && !PrepareVerifiedRange(Dispatch, FileOffset, BeyondFinalZero))
+		return ERROR_SUCCESS;
+
+	op = Dispatch->FreeOps;
+	Dispatch->FreeOps = op->NextFree;
+
+	memset(&op->Ovrlp, 0, sizeof(op->Ovrlp));
+	op->Fzdi.FileOffset.QuadPart      = (LONGLONG)FileOffset;
+	op->Fzdi.BeyondFinalZero.QuadPart = (LONGLONG)BeyondFinalZero;
+	op->Locked = (0 != (Dispatch->Flags & ZERO_DISPATCH_VERIFY));
+
+	Dispatch->Stats.RangesQueued++;
+
+	if (!DeviceIoControl(Dispatch->FileHandle,
+	                     FSCTL_SET_ZERO_DATA,
+	                     &op->Fzdi,
+	                     sizeof(op->Fzdi),
+	                     NULL,
+	                     0,
+	                     NULL,
+	                     &op->Ovrlp)) {
+		err = GetLastError();
+		if (ERROR_IO_PENDING != err) {
+			/* Failed before being queued so no completion packet will ever
+			 * show up for this request. */
+			CompleteZeroOp(Dispatch, op, err);
+			return ERROR_SUCCESS;
+		}
+	}
+
+	/* Pending or completed inline, either way a packet gets queued. */
+	++Dispatch->InFlight;
+
+	return ERROR_SUCCESS;
+}
+
+
+_Use_decl_annotations_
+DWORD
+ZeroDispatchQueue(
+	PZERO_DISPATCH  Dispatch,
+	UINT64          FileOffset,
+	UINT64          BeyondFinalZero
+	)
+{
+	UINT64  end;
+	DWORD   err;
+
+	assert(FileOffset < BeyondFinalZero);
+
+	if (!(Dispatch->Flags & ZERO_DISPATCH_VERIFY))
+		return QueueZeroOp(Dispatch, FileOffset, BeyondFinalZero);
+
+	/* Byte range locks are mandatory, so locking all of a large range would
+	 * fail the I/O of the process that has the file open for as long as the
+	 * whole range takes. */
+	for (; FileOffset < BeyondFinalZero; FileOffset = end) {
+		end = MIN(FileOffset - FileOffset % ZERO_VERIFY_WINDOW + ZERO_VERIFY_WINDOW,
+		          BeyondFinalZero);
+		err = QueueZeroOp(Dispatch, FileOffset, end);
+		if (ERROR_SUCCESS != err)
+			return err;
+	}
+
+	return ERROR_SUCCESS;
+}
+
+
+_Use_decl_annotations_
+DWORD
+ZeroDispatchDrain(
+	PZERO_DISPATCH  Dispatch
+	)
+{
+	DWORD err;
+
+	while (Dispatch->InFlight) {
+		err = ReapZeroOps(Dispatch);
+		if (ERROR_SUCCESS != err)
+			return err;
+	}
+
+	return Dispatch->FirstError;
+}
+
+
+_Use_decl_annotations_
+void
+ZeroDispatchGetStats(
+	PZERO_DISPATCH          Dispatch,
+	PZERO_DISPATCH_STATS    Stats
+	)
+{
+	*Stats = Dispatch->Stats;
+}
+
+
+_Use_decl_annotations_
+void
+ZeroDispatchFree(
+	PZERO_DISPATCH  Dispatch
+	)
+{
+	if (NULL == Dispatch)
+		return;
+
+	/* Requests reference memory owned by the dispatcher so they have to be
+	 * finished before it can go away. */
+	if (Dispatch->InFlight) {
+		(void)CancelIoEx(Dispatch->FileHandle, NULL);
+		(void)ZeroDispatchDrain(Dispatch);
+	}
+
+	(void)CloseHandle(Dispatch->IoCompletionPort);
+	if (Dispatch->LockEvent)
+		(void)CloseHandle(Dispatch->LockEvent);
+	free(Dispatch->VerifyBuffer);
+	free(Dispatch);
+}
@@ -276,17 +276,31 @@ int wmain(
 	DWORD                       lastErr;
 	struct CleanupThreadParams  *tParams;
 	struct WriteOp              *curWriteOp;
+	QOS_OPTIONS                 qos;
+	int                         i;
 
 	SparseFileLibInit();
 
-	if (2 != argc) {
+	/* QoS options may precede the output file name. */
+	memset(&qos, 0, sizeof(qos));
+	for (i = 1; i < argc - 1; ++i) {
+		if (QosArgConsumed != QosParseArg(argc - 1, argv, &i, &qos))
+			break;
+	}
+	if (argc < 2 || i != argc - 1) {
 		LogErrorFuncLine(L"Invalid command line parameters");
+		LogInfo(L"Usage: PipeSparse [--background] [--max-read SIZE] [--max-write SIZE]\n"
+		        L"\t[--qos-file QosLimits.txt] OUTPUTFILE\n"
+		        QOS_USAGE_TEXT);
 		ExitProcess(EXIT_FAILURE);
 	}
 
+	if (ERROR_SUCCESS != QosStart(&qos))
+		ExitProcess(EXIT_FAILURE);
+
 	stdInHndl = GetStdHandle(STD_INPUT_HANDLE);
 
-	outHndl = CreateFileW(argv[1],
+	outHndl = CreateFileW(argv[argc - 1],
 	                      GENERIC_ALL,
 	                      0,
 	                      NULL,
@@ -295,7 +309,7 @@ int wmain(
 	                      NULL);
 	if (INVALID_HANDLE_VALUE == outHndl) {
 		lastErr = GetLastError();
-		LogErrorFuncLine(L"Failed to create file %s with lastErr %lu.", argv[2], lastErr);
+		LogErrorFuncLine(L"Failed to create file %s with lastErr %lu.", argv[argc - 1], lastErr);
 		ExitProcess(EXIT_FAILURE);
 	}
 
@@ -383,8 +397,10 @@ int wmain(
 			}
 			doLoop = FALSE;
 		}
+		QosThrottle(QosClassRead, (UINT64)bytsRd);
 
 		if (bytsRd && (!IsZeroBuf(curWriteOp->Buf, (DWORD)bytsRd))) {
+			QosThrottle(QosClassWrite, (UINT64)bytsRd);
 			lastErr = WaitForSingleObject(ioAvailSemaphore, INFINITE);
 			if (WAIT_OBJECT_0 != lastErr) {
 				LogErrorFuncLine(L"Failed WaitForSingleObject waitRet %lu and lastErr: %lu", lastErr, GetLastError());
@@ -445,5 +461,6 @@ int wmain(
 	CloseHandle(outHndl);
 	CloseHandle(stdInHndl);
 	CloseHandle(ioAvailSemaphore);
+	QosStop();
 	return EXIT_SUCCESS;
 }
@@ -61,6 +61,67 @@ IsZeroBuf(
 	_In_        DWORD           BufSz
 	);
 
+/* Copy Size bytes from Source to Target in blocks of BlockSize bytes,
+ * skipping blocks that are all zeros so their part of Target is never
+ * touched. Data blocks are copied with non-temporal stores when both sides
+ * are suitably aligned. Returns the number of bytes copied. */
+SIZE_T __stdcall
+CopyNonZeroBlocks(
+	_Out_writes_bytes_(Size)
+	            PVOID           Target,
+	_In_reads_bytes_(Size)
+	            LPCVOID         Source,
+	_In_        SIZE_T          Size,
+	_In_        DWORD           BlockSize
+	);
+
+/* Values of the BlockMap of CopyNonZeroBlocksEx. */
+#define BLOCK_MAP_UNKNOWN   0
+#define BLOCK_MAP_ZERO      1
+#define BLOCK_MAP_DATA      2
+
+/* CopyNonZeroBlocks that remembers the zero test of every block in BlockMap,
+ * one byte per block set to BLOCK_MAP_UNKNOWN beforehand. Copying the same
+ * Source to more targets with the same BlockMap tests each block only once. */
+SIZE_T __stdcall
+CopyNonZeroBlocksEx(
+	_Out_writes_bytes_(Size)
+	            PVOID           Target,
+	_In_reads_bytes_(Size)
+	            LPCVOID         Source,
+	_In_        SIZE_T          Size,
+	_In_        DWORD           BlockSize,
+	_Inout_opt_ BYTE            *BlockMap
+	);
+
+/* CRC32C (Castagnoli) in raw form: no inversion going in or coming out, so
+ * the CRC of zeros started from 0 stays 0 and the CRC of a file is the XOR
+ * of the CRCs of its pieces, each shifted by the bytes that follow it. That
+ * lets pieces be hashed in any order and holes be skipped. Crc32cUpdate adds
+ * BufSz bytes to Crc using the CRC32 instruction where there is one.
+ * Crc32cShift adds Length zero bytes to Crc without reading anything.
+ * Crc32cFinal turns the raw CRC of Length bytes started from 0 into the
+ * standard CRC32C value. */
+UINT32 __stdcall
+Crc32cUpdate(
+	_In_        UINT32          Crc,
+	_In_reads_bytes_(BufSz)
+	            LPCVOID         Buf,
+	_In_        SIZE_T          BufSz
+	);
+
+UINT32 __stdcall
+Crc32cShift(
+	_In_        UINT32          Crc,
+	_In_        UINT64          Length
+	);
+
+UINT32 __stdcall
+Crc32cFinal(
+	_In_        UINT32          RawCrc,
+	_In_        UINT64          Length
+	);
+
 
 typedef struct CLUSTER_MAP *PCLUSTER_MAP;
 
@@ -91,12 +152,67 @@ ClusterMapIsMarkedZero(
 	_In_        UINT64          Cluster
 	);
 
+/* Mark clusters [FirstCluster, EndCluster). Unlike ClusterMapMarkZero this is
+ * not safe against concurrent updates of the same map. */
+void __stdcall
+ClusterMapMarkClusters(
+	_Inout_     PCLUSTER_MAP    ClusterMap,
+	_In_        UINT64          FirstCluster,
+	_In_        UINT64          EndCluster
+	);
+
+/* Set Dest to Src with every cluster marked in Mask cleared, over clusters
+ * [FirstCluster, EndCluster). Dest may be the same map as Src or Mask. All
+ * three maps must describe the same file size and cluster size. */
+_Success_(return == TRUE)
+BOOL __stdcall
+ClusterMapAndNot(
+	_Inout_     PCLUSTER_MAP    Dest,
+	_In_        PCLUSTER_MAP    Src,
+	_In_        PCLUSTER_MAP    Mask,
+	_In_        UINT64          FirstCluster,
+	_In_        UINT64          EndCluster
+	);
+
+/* Write the map as a grid of bits, 64 clusters to a line. Same as
+ * ClusterMapExport with ClusterMapFormatGrid, ignoring write errors. */
 void __stdcall
 ClusterMapPrint(
 	_In_        PCLUSTER_MAP    ClusterMap,
 	_In_        FILE            *FileStream
 	);
 
+/* Return the cluster after the run of clusters, starting at Cluster, that are
+ * all marked or all unmarked like Cluster is. Whole words of the map are
+ * skipped at a time. Never returns more than the number of clusters in the
+ * map, counting a trailing partial cluster. */
+UINT64 __stdcall
+ClusterMapRunEnd(
+	_In_        PCLUSTER_MAP    ClusterMap,
+	_In_        UINT64          Cluster
+	);
+
+typedef enum CLUSTER_MAP_FORMAT {
+	/* One "offset length zero|data" line per run, in bytes. */
+	ClusterMapFormatRuns,
+	/* A JSON object with the sizes and an array of extents. */
+	ClusterMapFormatJson,
+	/* The bit grid of ClusterMapPrint. */
+	ClusterMapFormatGrid
+} CLUSTER_MAP_FORMAT;
+
+/* Write the map to FileStream in Format. Output is built a run at a time in a
+ * large buffer of narrow characters and written with fwrite. Marked clusters
+ * are reported as zero. Returns ERROR_SUCCESS or the first write error. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD __stdcall
+ClusterMapExport(
+	_In_        PCLUSTER_MAP        ClusterMap,
+	_In_        FILE                *FileStream,
+	_In_        CLUSTER_MAP_FORMAT  Format
+	);
+
 /* If NULL is returned caller may use GetLastError to find out what happened.
  * If FS cluster size is not able to be determined then the parameter is set
  * to zero and GetLastError will return the underlying error. */
@@ -112,6 +228,21 @@ OpenFileExclusive(
 	_Out_opt_   LPFILETIME      LastWriteTime
 	);
 
+/* Same as OpenFileExclusive but lets other handles share the file according
+ * to ShareMode, a combination of FILE_SHARE_* flags. */
+_Success_(return != NULL)
+HANDLE __stdcall
+OpenFileWithSharing(
+	_In_        LPCWSTR         Filename,
+	_In_        DWORD           ShareMode,
+	_In_        DWORD           FileFlagsAttributes,
+	_Out_       PLARGE_INTEGER  FileSize,
+	_Out_opt_   PSIZE_T         FsClusterSize,
+	_Out_opt_   LPFILETIME      CreationTime,
+	_Out_opt_   LPFILETIME      LastAccessTime,
+	_Out_opt_   LPFILETIME      LastWriteTime
+	);
+
 /* Determine the cluster size of the file system that the handle resides on.
  * Returns -1 on failure. */
 _Must_inspect_result_
@@ -138,6 +269,62 @@ SetFileSize(
 	_In_        LARGE_INTEGER   NewFileSize
 	);
 
+/* Issue a DeviceIoControl request and wait for it to complete. This works for
+ * handles opened with or without FILE_FLAG_OVERLAPPED and will not queue a
+ * completion packet if the handle is associated with an I/O completion port.
+ * Returns ERROR_SUCCESS or the error the request failed with. ERROR_MORE_DATA
+ * is returned as is with BytesReturned set so callers can iterate. */
+_Success_(return == ERROR_SUCCESS)
+DWORD __stdcall
+DeviceIoControlSync(
+	_In_        HANDLE          Device,
+	_In_        DWORD           IoControlCode,
+	_In_reads_bytes_opt_(InBufferSize)
+	            LPVOID          InBuffer,
+	_In_        DWORD           InBufferSize,
+	_Out_writes_bytes_opt_(OutBufferSize)
+	            LPVOID          OutBuffer,
+	_In_        DWORD           OutBufferSize,
+	_Out_opt_   LPDWORD         BytesReturned
+	);
+
+/* Read from Offset and wait for the read to complete, with the same handle
+ * requirements as DeviceIoControlSync. Reading at or past the end of the file
+ * succeeds with BytesRead set to zero. */
+_Success_(return == ERROR_SUCCESS)
+DWORD __stdcall
+ReadFileSync(
+	_In_        HANDLE          File,
+	_In_        UINT64          Offset,
+	_Out_writes_bytes_to_(BufferSize, *BytesRead)
+	            LPVOID          Buffer,
+	_In_        DWORD           BufferSize,
+	_Out_       LPDWORD         BytesRead
+	);
+
+/* Write to Offset and wait for the write to complete, with the same handle
+ * requirements as DeviceIoControlSync. A short write fails with
+ * ERROR_WRITE_FAULT. */
+_Success_(return == ERROR_SUCCESS)
+DWORD __stdcall
+WriteFileSync(
+	_In_        HANDLE          File,
+	_In_        UINT64          Offset,
+	_In_reads_bytes_(BufferSize)
+	            LPCVOID         Buffer,
+	_In_        DWORD           BufferSize
+	);
+
+/* Parse an unsigned decimal or 0x prefixed hex command line value with an
+ * optional binary unit suffix (K, M, G or T). Returns FALSE if the string is
+ * not entirely a number or the value overflows. */
+_Success_(return == TRUE)
+BOOL __stdcall
+ParseSizeArg(
+	_In_        LPCWSTR         Arg,
+	_Out_       UINT64          *Value
+	);
+
 _Success_(return == TRUE)
 BOOL __stdcall
 BuildSparseMap(
@@ -148,6 +335,358 @@ BuildSparseMap(
 	_Out_ PCLUSTER_MAP *ClusterMap
 	);
 
+/* Index of data cluster fingerprints shared by every file of a run, used to
+ * find clusters whose data already exists elsewhere. */
+typedef struct DEDUPE_INDEX *PDEDUPE_INDEX;
+/* A file whose clusters are being added to an index. */
+typedef struct DEDUPE_FILE *PDEDUPE_FILE;
+
+typedef struct DEDUPE_STATS {
+	UINT64      ClustersHashed;
+	/* Clusters matching a fingerprint in the table. */
+	UINT64      DuplicateClusters;
+	UINT64      DuplicateBytes;
+	/* Clusters the filter has seen before once the table was full. Filter
+	 * false positives make these an estimate. */
+	UINT64      ProbableDuplicateClusters;
+	UINT64      ProbableDuplicateBytes;
+	/* New fingerprints dropped because the table was full. */
+	UINT64      ClustersNotIndexed;
+	UINT64      BytesCloned;
+	/* Duplicate bytes that were not cloned because the data changed, the
+	 * source could not be opened or the request failed. */
+	UINT64      BytesNotCloned;
+} DEDUPE_STATS, *PDEDUPE_STATS;
+
+/* Create an index using at most about MaxMemory bytes. Returns NULL on failure;
+ * check GetLastError. */
+_Success_(return != NULL)
+PDEDUPE_INDEX __stdcall
+DedupeIndexCreate(
+	_In_        UINT64          MaxMemory
+	);
+
+void __stdcall
+DedupeIndexGetStats(
+	_In_        PDEDUPE_INDEX   Index,
+	_Out_       PDEDUPE_STATS   Stats
+	);
+
+/* Every file created against the index must be freed first. */
+void __stdcall
+DedupeIndexFree(
+	_In_ _Post_invalid_
+	            PDEDUPE_INDEX   Index
+	);
+
+/* Add a file to the index. Path is remembered so later files can clone from
+ * it. With RecordMatches the duplicate ranges of the file are kept for
+ * DedupeFileClone. Returns NULL on failure; check GetLastError. */
+_Success_(return != NULL)
+PDEDUPE_FILE __stdcall
+DedupeFileCreate(
+	_Inout_     PDEDUPE_INDEX   Index,
+	_In_z_      LPCWSTR         Path,
+	_In_        SIZE_T          ClusterSize,
+	_In_        BOOL            RecordMatches
+	);
+
+/* The file's fingerprints stay in the index. */
+void __stdcall
+DedupeFileFree(
+	_In_ _Post_invalid_
+	            PDEDUPE_FILE    File
+	);
+
+/* Fingerprint the whole clusters of Data, which holds [Offset, Offset +
+ * Length) of the file, skipping those marked in ZeroMap. Offset must be a
+ * multiple of the cluster size. Disjoint ranges may be hashed concurrently. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD __stdcall
+DedupeFileHashRange(
+	_Inout_     PDEDUPE_FILE    File,
+	_In_        PCLUSTER_MAP    ZeroMap,
+	_In_reads_bytes_(Length)
+	            const BYTE      *Data,
+	_In_        UINT64          Offset,
+	_In_        SIZE_T          Length
+	);
+
+/* Share the recorded duplicate ranges of the file open as Handle with the
+ * data they duplicate through block cloning (ReFS). Each piece is compared
+ * with its source right before it is cloned. Returns ERROR_SUCCESS unless the
+ * volume cannot clone at all; other failures are counted in the stats.
+ * BytesCloned gets what this file had cloned, on failure too. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD __stdcall
+DedupeFileClone(
+	_Inout_     PDEDUPE_FILE    File,
+	_In_        HANDLE          Handle,
+	_Out_opt_   UINT64          *BytesCloned
+	);
+
+/* Called by BuildSparseMapEx after each view of the file has been analyzed and
+ * unmapped. Every cluster in [ViewOffset, ViewOffset + ViewLength) has its
+ * final value in the map and the range is no longer mapped by the scan, so it
+ * is safe to deallocate. Return FALSE to stop the scan; BuildSparseMapEx then
+ * fails with ERROR_CANCELLED. */
+typedef BOOL (__stdcall *PSPARSE_MAP_VIEW_CALLBACK)(
+	_In_opt_    PVOID           Context,
+	_In_        PCLUSTER_MAP    ClusterMap,
+	_In_        UINT64          ViewOffset,
+	_In_        UINT64          ViewLength
+	);
+
+typedef struct SPARSE_MAP_PARAMS {
+	FILE                        *StatsStream;
+	UINT64                      StatsFrequencyMillisec;
+	PSPARSE_MAP_VIEW_CALLBACK   ViewCallback;
+	PVOID                       CallbackContext;
+	/* Only analyze [RangeOffset, RangeOffset + RangeLength). RangeOffset must
+	 * be a multiple of SPARSE_MAP_RANGE_ALIGNMENT and of the cluster size and
+	 * the range must end on a cluster boundary or at the end of the file. A
+	 * zero RangeLength means up to the end of the file. */
+	UINT64                      RangeOffset;
+	UINT64                      RangeLength;
+	/* Mark zero clusters in this map instead of allocating a new one. It must
+	 * have been allocated for the file's size and cluster size. Marking is
+	 * atomic so several disjoint ranges may be analyzed into the same map
+	 * concurrently. The map is not freed on failure. */
+	PCLUSTER_MAP                ExistingMap;
+	/* Fingerprint every data cluster into this file's dedupe index. */
+	PDEDUPE_FILE                Dedupe;
+} SPARSE_MAP_PARAMS, *PSPARSE_MAP_PARAMS;
+
+/* File mapping offsets have to be multiples of the allocation granularity,
+ * which is 64 KiB on every version of Windows. */
+#define SPARSE_MAP_RANGE_ALIGNMENT  (64 * 1024)
+
+/* Same as BuildSparseMap with the optional behaviour selected through Params.
+ * A NULL Params behaves exactly like BuildSparseMap without stats output. */
+_Success_(return == TRUE)
+BOOL __stdcall
+BuildSparseMapEx(
+	_In_ HANDLE File,
+	_In_opt_ PSPARSE_MAP_PARAMS Params,
+	_Inout_opt_ SIZE_T *ClusterSize,
+	_Out_ PCLUSTER_MAP *ClusterMap
+	);
+
+typedef struct ALLOCATED_RANGE {
+	UINT64      Offset;
+	UINT64      Length;
+} ALLOCATED_RANGE, *PALLOCATED_RANGE;
+
+/* Return the ranges of [Offset, Offset + Length) of File that have storage
+ * allocated, in file order and clipped to that range, as reported by
+ * FSCTL_QUERY_ALLOCATED_RANGES. Free *Ranges with free(). File systems
+ * without the request fail with the error from it, typically
+ * ERROR_INVALID_FUNCTION. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD __stdcall
+QueryAllocatedRanges(
+	_In_        HANDLE                          File,
+	_In_        UINT64                          Offset,
+	_In_        UINT64                          Length,
+	_Outptr_result_buffer_(*NumRanges)
+	            PALLOCATED_RANGE                *Ranges,
+	_Out_       SIZE_T                          *NumRanges
+	);
+
+/* Share Length bytes of Source at SourceOffset with Target at TargetOffset
+ * through block cloning (FSCTL_DUPLICATE_EXTENTS_TO_FILE), without copying
+ * them. Both files have to be on the same ReFS volume, offsets cluster
+ * aligned and Length a multiple of the cluster size unless the range ends at
+ * the end of Target. Volumes without block cloning fail with
+ * ERROR_INVALID_FUNCTION or ERROR_NOT_SUPPORTED. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD __stdcall
+CloneFileRange(
+	_In_        HANDLE          Target,
+	_In_        UINT64          TargetOffset,
+	_In_        HANDLE          Source,
+	_In_        UINT64          SourceOffset,
+	_In_        UINT64          Length
+	);
+
+/* Build a map of the clusters of File that have no storage allocated, using
+ * FSCTL_QUERY_ALLOCATED_RANGES. A cluster only partly unallocated is left
+ * unmarked. File systems without the request fail with the error from it,
+ * typically ERROR_INVALID_FUNCTION. */
+_Success_(return == TRUE)
+BOOL __stdcall
+BuildUnallocatedMap(
+	_In_        HANDLE          File,
+	_In_        SIZE_T          ClusterSize,
+	_Out_       PCLUSTER_MAP    *UnallocatedMap
+	);
+
+/* Parse a shard given as OFFSET:LENGTH, each part as ParseSizeArg accepts. */
+_Success_(return == TRUE)
+BOOL __stdcall
+ParseRangeArg(
+	_In_        LPCWSTR         Arg,
+	_Out_       UINT64          *Offset,
+	_Out_       UINT64          *Length
+	);
+
+/* Check that a shard starting at Offset is valid for a file of FileSize bytes
+ * and clamp *Length to the end of the file; a zero *Length means up to the
+ * end. Shards must start, and end unless they reach the end of the file, on
+ * a multiple of both ClusterSize and SPARSE_MAP_RANGE_ALIGNMENT. */
+_Success_(return == TRUE)
+BOOL __stdcall
+ShardRangeResolve(
+	_In_        UINT64          FileSize,
+	_In_        SIZE_T          ClusterSize,
+	_In_        UINT64          Offset,
+	_Inout_     UINT64          *Length
+	);
+
+typedef struct SHARD_ZERO_RUN {
+	UINT64      Offset;
+	UINT64      Length;
+} SHARD_ZERO_RUN, *PSHARD_ZERO_RUN;
+
+/* What one shard did, as saved for a coordinator to merge. */
+typedef struct SHARD_RESULT {
+	WCHAR           Tool[32];
+	UINT64          FileSize;
+	UINT64          ClusterSize;
+	UINT64          RangeOffset;
+	UINT64          RangeLength;
+	/* ERROR_SUCCESS or the error the shard failed with. */
+	DWORD           Error;
+	UINT64          BytesRead;
+	UINT64          BytesWritten;
+	UINT64          RangesWritten;
+	/* Zero runs within the shard in increasing order. Only filled in by
+	 * ShardResultLoad. */
+	PSHARD_ZERO_RUN ZeroRuns;
+	UINT64          NumZeroRuns;
+	UINT64          ZeroRunsSize;
+} SHARD_RESULT, *PSHARD_RESULT;
+
+/* Write Result to Path along with the zero runs ZeroMap holds inside the
+ * shard, if given. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD __stdcall
+ShardResultSave(
+	_In_z_      LPCWSTR                 Path,
+	_In_        const SHARD_RESULT      *Result,
+	_In_opt_    PCLUSTER_MAP            ZeroMap
+	);
+
+/* Read a result written by ShardResultSave. ERROR_INVALID_DATA if the file is
+ * not a complete result. ShardResultFree releases the zero runs. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD __stdcall
+ShardResultLoad(
+	_In_z_      LPCWSTR         Path,
+	_Out_       PSHARD_RESULT   Result
+	);
+
+void __stdcall
+ShardResultFree(
+	_Inout_     PSHARD_RESULT   Result
+	);
+
+/* I/O quality of service. Limits apply to the whole process and may be
+ * changed at any time, including from the control file while running. Every
+ * limit is a token bucket holding up to one second worth of its rate. */
+typedef enum QOS_CLASS {
+	QosClassRead = 0,
+	QosClassWrite,
+	/* One token per deallocation request. */
+	QosClassPunch,
+	QosClassMax
+} QOS_CLASS;
+
+typedef struct QOS_LIMITS {
+	/* Per second rate of each class. Zero for no limit. */
+	UINT64          Rate[QosClassMax];
+} QOS_LIMITS, *PQOS_LIMITS;
+
+typedef struct QOS_OPTIONS {
+	/* Lower the CPU, I/O and memory priority of the process. */
+	BOOL            Background;
+	QOS_LIMITS      Limits;
+	/* File polled for new limits while running. May be NULL. */
+	LPCWSTR         ControlFile;
+} QOS_OPTIONS, *PQOS_OPTIONS;
+
+typedef enum QOS_ARG_RESULT {
+	QosArgNotQos = 0,
+	QosArgConsumed,
+	QosArgInvalid
+} QOS_ARG_RESULT;
+
+/* Command line help for the options understood by QosParseArg. */
+#define QOS_USAGE_TEXT \
+	L"\tSpecify --background to run at low CPU, I/O and memory priority.\n" \
+	L"\tSpecify --max-read and --max-write to limit bandwidth in bytes per\n" \
+	L"\t  second (K, M, G suffixes allowed) and --max-punch to limit\n" \
+	L"\t  deallocation requests per second.\n" \
+	L"\tSpecify --qos-file to reload the limits whenever the file changes. It\n" \
+	L"\t  holds read=SIZE, write=SIZE and punch=N lines; missing keys and\n" \
+	L"\t  zero mean no limit.\n"
+
+/* If Argv[*Index] is one of the QoS options, store it and its value in Options
+ * and advance *Index past the value. */
+QOS_ARG_RESULT __stdcall
+QosParseArg(
+	_In_        int             Argc,
+	_In_reads_(Argc)
+	            WCHAR           **Argv,
+	_Inout_     int             *Index,
+	_Inout_     PQOS_OPTIONS    Options
+	);
+
+/* Apply Options and start polling the control file if one is given. Failures
+ * are logged. */
+_Must_inspect_result_
+_Success_(return == ERROR_SUCCESS)
+DWORD __stdcall
+QosStart(
+	_In_        const QOS_OPTIONS   *Options
+	);
+
+/* Stop polling the control file. Limits stay in effect. */
+void __stdcall
+QosStop(
+	void
+	);
+
+void __stdcall
+QosSetLimits(
+	_In_        const QOS_LIMITS    *Limits
+	);
+
+/* Take Amount tokens of Class, sleeping as long as the limit requires. Amounts
+ * larger than a second worth of tokens are allowed and simply wait longer. */
+void __stdcall
+QosThrottle(
+	_In_        QOS_CLASS       Class,
+	_In_        UINT64          Amount
+	);
+
+/* Largest amount of Class worth doing between throttle calls. Preferred while
+ * Class is unlimited, otherwise small enough to keep the rate smooth. The
+ * result is a multiple of 64 KiB and of Alignment, which is zero or a power of
+ * two, if Preferred is. */
+SIZE_T __stdcall
+QosChunkSize(
+	_In_        QOS_CLASS       Class,
+	_In_        SIZE_T          Preferred,
+	_In_        SIZE_T          Alignment
+	);
+
 UINT64 __stdcall
 GetQPCVal(
 	void
@@ -212,6 +751,9 @@ ElapsedQPCInNanosec(
 #ifndef ALIGN_DOWN_BY
 #define ALIGN_DOWN_BY(size, align)   ((ULONG_PTR)(size) & ~((ULONG_PTR)(align) - 1))
 #endif
+#ifndef ALIGN_UP_BY
+#define ALIGN_UP_BY(size, align)     ALIGN_DOWN_BY((ULONG_PTR)(size) + (align) - 1, align)
+#endif
 #ifndef MIN
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 #endif
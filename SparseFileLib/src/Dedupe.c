@@ -0,0 +1,571 @@
+/* Standard BSD license disclaimer.
+
+Copyright(c) 2016-2021, Lance D. Stringham
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "targetver.h"
+#include <Windows.h>
+#include <winioctl.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <assert.h>
+
+#include "SparseFileLib.h"
+
+/* Duplicate data cluster detection.
+ *
+ * Every data cluster the scan sees is hashed and looked up in an index shared
+ * by all files. The index is an open addressing table of 64-bit fingerprints,
+ * each with the file and cluster it was first seen at, and stays within the
+ * memory it is given: once the table is three quarters full nothing more is
+ * added. A Bloom filter that every fingerprint is added to takes over from
+ * there, so duplicates of data that no longer fit the table are still counted
+ * as probable. Only table matches know where the original lives and can be
+ * shared; they are compared byte for byte before any cloning. */
+
+/* Part of the memory budget given to the filter, as a divisor. */
+#define DEDUPE_FILTER_SHARE         8
+#define DEDUPE_MIN_MEMORY           (1024 * 1024)
+/* The table stops taking new fingerprints at this load, in percent. */
+#define DEDUPE_MAX_LOAD_PERCENT     75
+/* A location is the file id above the cluster number. */
+#define DEDUPE_CLUSTER_BITS         40
+#define DEDUPE_MAX_FILES            (1u << (64 - DEDUPE_CLUSTER_BITS))
+/* Both ranges are compared in pieces this large before being cloned. */
+#define DEDUPE_CLONE_CHUNK          (1024 * 1024)
+#define DEDUPE_INITIAL_SIZE         256
+
+#define DEDUPE_PRIME_1              0x9E3779B185EBCA87ull
+#define DEDUPE_PRIME_2              0xC2B2AE3D27D4EB4Full
+#define DEDUPE_PRIME_3              0x165667B19E3779F9ull
+
+typedef struct DEDUPE_ENTRY {
+	/* Zero marks an empty slot. */
+	UINT64      Hash;
+	UINT64      Location;
+} DEDUPE_ENTRY, *PDEDUPE_ENTRY;
+
+struct DEDUPE_INDEX {
+	SRWLOCK         Lock;
+	PDEDUPE_ENTRY   Table;
+	UINT64          TableMask;
+	UINT64          Used;
+	UINT64          MaxUsed;
+	UINT64          *Filter;
+	UINT64          FilterMask;
+	/* Paths of the files, indexed by their id. */
+	LPWSTR          *Paths;
+	DWORD           NumFiles;
+	DWORD           PathsSize;
+	DEDUPE_STATS    Stats;
+};
+
+/* [Offset, Offset + Length) of the file holds the same data as the range at
+ * SourceOffset of file SourceFile. */
+typedef struct DEDUPE_MATCH {
+	UINT64      Offset;
+	UINT64      SourceOffset;
+	UINT64      Length;
+	DWORD       SourceFile;
+} DEDUPE_MATCH, *PDEDUPE_MATCH;
+
+struct DEDUPE_FILE {
+	PDEDUPE_INDEX   Index;
+	DWORD           Id;
+	SIZE_T          ClusterSize;
+	BOOL            RecordMatches;
+	/* Disjoint ranges of the file may be hashed concurrently. */
+	SRWLOCK         Lock;
+	PDEDUPE_MATCH   Matches;
+	SIZE_T          NumMatches;
+	SIZE_T          MatchesSize;
+};
+
+
+static UINT64
+DedupeRound(
+	_In_        UINT64      Acc,
+	_In_        UINT64      Input
+	)
+{
+	Acc += Input * DEDUPE_PRIME_2;
+	Acc = _rotl64(Acc, 31);
+	return Acc * DEDUPE_PRIME_1;
+}
+
+
+/* Fingerprint one cluster. Four independent lanes of 64-bit multiplies keep
+ * the pipeline full; Size is a multiple of 32 since clusters are at least 512
+ * bytes. The size seeds the lanes so clusters of files on volumes with
+ * different cluster sizes never match. Never returns zero. */
+static UINT64
+DedupeHashCluster(
+	_In_reads_bytes_(Size)
+	            const BYTE  *Data,
+	_In_        SIZE_T      Size
+	)
+{
+	const UINT64    *p;
+	UINT64          v1, v2, v3, v4, h;
+	SIZE_T          i;
+
+	p  = (const UINT64 *)Data;
+	v1 = Size + DEDUPE_PRIME_1 + DEDUPE_PRIME_2;
+	v2 = Size + DEDUPE_PRIME_2;
+	v3 = Size;
+	v4 = Size - DEDUPE_PRIME_1;
+
+	for (i = 0; i < Size / sizeof(UINT64); i += 4) {
+		v1 = DedupeRound(v1, p[i + 0]);
+		v2 = DedupeRound(v2, p[i + 1]);
+		v3 = DedupeRound(v3, p[i + 2]);
+		v4 = DedupeRound(v4, p[i + 3]);
+	}
+
+	h = _rotl64(v1, 1) + _rotl64(v2, 7) + _rotl64(v3, 12) + _rotl64(v4, 18);
+	h ^= h >> 33;
+	h *= DEDUPE_PRIME_2;
+	h ^= h >> 29;
+	h *= DEDUPE_PRIME_3;
+	h ^= h >> 32;
+
+	return h ? h : 1;
+}
+
+
+_Use_decl_annotations_
+PDEDUPE_INDEX __stdcall
+DedupeIndexCreate(
+	UINT64          MaxMemory
+	)
+{
+	PDEDUPE_INDEX   index;
+	UINT64          filterBytes, tableEntries;
+
+	MaxMemory = MAX(MaxMemory, DEDUPE_MIN_MEMORY);
+
+	/* Both sizes are powers of two so positions are a mask away. */
+	for (filterBytes = sizeof(UINT64); filterBytes * 2 <= MaxMemory / DEDUPE_FILTER_SHARE; )
+		filterBytes *= 2;
+	for (tableEntries = 1;
+	     tableEntries * 2 * sizeof(DEDUPE_ENTRY) <= MaxMemory - filterBytes; )
+		tableEntries *= 2;
+
+#ifndef _WIN64
+	if (tableEntries * sizeof(DEDUPE_ENTRY) > INT32_MAX)
+		tableEntries = INT32_MAX / sizeof(DEDUPE_ENTRY) / 2 + 1;
+#endif
+
+	index = calloc(1, sizeof(*index));
+	if (NULL == index)
+		goto nomem_return;
+
+	InitializeSRWLock(&index->Lock);
+	index->Table = calloc((SIZE_T)tableEntries, sizeof(DEDUPE_ENTRY));
+	index->Filter = calloc((SIZE_T)(filterBytes / sizeof(UINT64)), sizeof(UINT64));
+	if (NULL == index->Table || NULL == index->Filter)
+		goto nomem_return;
+
+	index->TableMask  = tableEntries - 1;
+	index->MaxUsed    = tableEntries * DEDUPE_MAX_LOAD_PERCENT / 100;
+	index->FilterMask = filterBytes * 8 - 1;
+	return index;
+
+nomem_return:
+	if (index)
+		DedupeIndexFree(index);
+	SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+	return NULL;
+}
+
+
+_Use_decl_annotations_
+void __stdcall
+DedupeIndexFree(
+	PDEDUPE_INDEX   Index
+	)
+{
+	DWORD i;
+
+	for (i = 0; i < Index->NumFiles; ++i)
+		free(Index->Paths[i]);
+	free(Index->Paths);
+	free(Index->Table);
+	free(Index->Filter);
+	free(Index);
+}
+
+
+_Use_decl_annotations_
+void __stdcall
+DedupeIndexGetStats(
+	PDEDUPE_INDEX   Index,
+	PDEDUPE_STATS   Stats
+	)
+{
+	AcquireSRWLockShared(&Index->Lock);
+	*Stats = Index->Stats;
+	ReleaseSRWLockShared(&Index->Lock);
+}
+
+
+_Use_decl_annotations_
+PDEDUPE_FILE __stdcall
+DedupeFileCreate(
+	PDEDUPE_INDEX   Index,
+	LPCWSTR         Path,
+	SIZE_T          ClusterSize,
+	BOOL            RecordMatches
+	)
+{
+	PDEDUPE_FILE    file;
+	LPWSTR          *newPaths, path;
+	DWORD           newSize, err;
+
+	file = calloc(1, sizeof(*file));
+	path = _wcsdup(Path);
+	if (NULL == file || NULL == path) {
+		err = ERROR_NOT_ENOUGH_MEMORY;
+		goto error_return;
+	}
+
+	AcquireSRWLockExclusive(&Index->Lock);
+	if (Index->NumFiles == Index->PathsSize) {
+		newSize = Index->PathsSize ? Index->PathsSize * 2 : DEDUPE_INITIAL_SIZE;
+		newPaths = (Index->NumFiles < DEDUPE_MAX_FILES)
+		         ? realloc(Index->Paths, newSize * sizeof(*newPaths))
+		         : NULL;
+		if (NULL == newPaths) {
+			ReleaseSRWLockExclusive(&Index->Lock);
+			err = ERROR_NOT_ENOUGH_MEMORY;
+			goto error_return;
+		}
+		Index->Paths = newPaths;
+		Index->PathsSize = newSize;
+	}
+	file->Id = Index->NumFiles;
+	Index->Paths[Index->NumFiles++] = path;
+	ReleaseSRWLockExclusive(&Index->Lock);
+
+	file->Index         = Index;
+	file->ClusterSize   = ClusterSize;
+	file->RecordMatches = RecordMatches;
+	InitializeSRWLock(&file->Lock);
+	return file;
+
+error_return:
+	free(path);
+	free(file);
+	SetLastError(err);
+	return NULL;
+}
+
+
+_Use_decl_annotations_
+void __stdcall
+DedupeFileFree(
+	PDEDUPE_FILE    File
+	)
+{
+	free(File->Matches);
+	free(File);
+}
+
+
+/* Look Hash up, adding it if it is new and there is room. Returns the
+ * location it was first seen at plus one, or zero. Called with the index
+ * lock held exclusively. */
+static UINT64
+DedupeIndexLookupAdd(
+	_Inout_     PDEDUPE_INDEX   Index,
+	_In_        UINT64          Hash,
+	_In_        UINT64          Location,
+	_In_        SIZE_T          ClusterSize
+	)
+{
+	UINT64  bit1, bit2, slot;
+	BOOL    inFilter;
+
+	bit1 = Hash & Index->FilterMask;
+	bit2 = _rotl64(Hash, 32) & Index->FilterMask;
+	inFilter = (Index->Filter[bit1 / 64] & (1ull << (bit1 % 64)))
+	        && (Index->Filter[bit2 / 64] & (1ull << (bit2 % 64)));
+	Index->Filter[bit1 / 64] |= 1ull << (bit1 % 64);
+	Index->Filter[bit2 / 64] |= 1ull << (bit2 % 64);
+
+	/* A fingerprint the filter has never seen cannot be in the table. */
+	slot = Hash & Index->TableMask;
+	if (inFilter) {
+		for (; Index->Table[slot].Hash; slot = (slot + 1) & Index->TableMask) {
+			if (Index->Table[slot].Hash == Hash) {
+				Index->Stats.DuplicateClusters++;
+				Index->Stats.DuplicateBytes += ClusterSize;
+				return Index->Table[slot].Location + 1;
+			}
+		}
+	}
+
+	if (Index->Used >= Index->MaxUsed) {
+		if (inFilter) {
+			Index->Stats.ProbableDuplicateClusters++;
+			Index->Stats.ProbableDuplicateBytes += ClusterSize;
+		} else {
+			Index->Stats.ClustersNotIndexed++;
+		}
+		return 0;
+	}
+
+	while (Index->Table[slot].Hash)
+		slot = (slot + 1) & Index->TableMask;
+	Index->Table[slot].Hash = Hash;
+	Index->Table[slot].Location = Location;
+	Index->Used++;
+	return 0;
+}
+
+
+/* Record that the cluster at Offset matches the one at Location. */
+static DWORD
+DedupeFileAddMatch(
+	_Inout_     PDEDUPE_FILE    File,
+	_In_        UINT64          Offset,
+	_In_        UINT64          Location
+	)
+{
+	PDEDUPE_MATCH   last, newMatches;
+	SIZE_T          newSize;
+	UINT64          sourceOffset;
+	DWORD           sourceFile;
+
+	sourceFile = (DWORD)(Location >> DEDUPE_CLUSTER_BITS);
+	sourceOffset = (Location & ((1ull << DEDUPE_CLUSTER_BITS) - 1)) * File->ClusterSize;
+
+	last = File->NumMatches ? &File->Matches[File->NumMatches - 1] : NULL;
+	if (last && last->SourceFile == sourceFile
+	    && last->Offset + last->Length == Offset
+	    && last->SourceOffset + last->Length == sourceOffset) {
+		last->Length += File->ClusterSize;
+		return ERROR_SUCCESS;
+	}
+
+	if (File->NumMatches == File->MatchesSize) {
+		newSize = File->MatchesSize ? File->MatchesSize * 2 : DEDUPE_INITIAL_SIZE;
+		newMatches = realloc(File->Matches, newSize * sizeof(*newMatches));
+		if (NULL == newMatches)
+			return ERROR_NOT_ENOUGH_MEMORY;
+		File->Matches = newMatches;
+		File->MatchesSize = newSize;
+	}
+
+	File->Matches[File->NumMatches].Offset       = Offset;
+	File->Matches[File->NumMatches].SourceOffset = sourceOffset;
+	File->Matches[File->NumMatches].Length       = File->ClusterSize;
+	File->Matches[File->NumMatches].SourceFile   = sourceFile;
+	File->NumMatches++;
+	return ERROR_SUCCESS;
+}
+
+
+_Use_decl_annotations_
+DWORD __stdcall
+DedupeFileHashRange(
+	PDEDUPE_FILE    File,
+	PCLUSTER_MAP    ZeroMap,
+	const BYTE      *Data,
+	UINT64          Offset,
+	SIZE_T          Length
+	)
+{
+	PDEDUPE_INDEX   index;
+	UINT64          *hashes, firstCluster, cluster, location;
+	SIZE_T          numClusters, i;
+	DWORD           err;
+
+	index = File->Index;
+	firstCluster = Offset / File->ClusterSize;
+	/* A trailing partial cluster cannot be shared. */
+	numClusters = Length / File->ClusterSize;
+	if (0 == numClusters)
+		return ERROR_SUCCESS;
+
+	hashes = malloc(numClusters * sizeof(*hashes));
+	if (NULL == hashes)
+		return ERROR_NOT_ENOUGH_MEMORY;
+
+	/* Hash outside the lock; zero clusters are left to deallocation. */
+	for (i = 0; i < numClusters; ++i) {
+		hashes[i] = 0;
+		if (!ClusterMapIsMarkedZero(ZeroMap, firstCluster + i))
+			hashes[i] = DedupeHashCluster(Data + i * File->ClusterSize, File->ClusterSize);
+	}
+
+	AcquireSRWLockExclusive(&index->Lock);
+	for (i = 0; i < numClusters; ++i) {
+		if (0 == hashes[i])
+			continue;
+		index->Stats.ClustersHashed++;
+		cluster = firstCluster + i;
+		location = ((UINT64)File->Id << DEDUPE_CLUSTER_BITS) | cluster;
+		if (cluster >> DEDUPE_CLUSTER_BITS) {
+			index->Stats.ClustersNotIndexed++;
+			hashes[i] = 0;
+			continue;
+		}
+		hashes[i] = DedupeIndexLookupAdd(index, hashes[i], location, File->ClusterSize);
+	}
+	ReleaseSRWLockExclusive(&index->Lock);
+
+	err = ERROR_SUCCESS;
+	if (File->RecordMatches) {
+		AcquireSRWLockExclusive(&File->Lock);
+		for (i = 0; i < numClusters && ERROR_SUCCESS == err; ++i) {
+			if (hashes[i])
+				err = DedupeFileAddMatch(File, (firstCluster + i) * File->ClusterSize,
+				                         hashes[i] - 1);
+		}
+		ReleaseSRWLockExclusive(&File->Lock);
+	}
+
+	free(hashes);
+	return err;
+}
+
+
+_Use_decl_annotations_
+DWORD __stdcall
+DedupeFileClone(
+	PDEDUPE_FILE    File,
+	HANDLE          Handle,
+	UINT64          *BytesCloned
+	)
+{
+	PDEDUPE_INDEX               index;
+	PDEDUPE_MATCH               match;
+	LARGE_INTEGER               sourceSize;
+	HANDLE                      source, opened;
+	BYTE                        *buffers;
+	UINT64                      pos, cloned, skipped;
+	LPCWSTR                     path;
+	SIZE_T                      i;
+	DWORD                       openedId, len, bytes1, bytes2, err, retErr;
+
+	index = File->Index;
+	opened = NULL;
+	openedId = 0;
+	cloned = 0;
+	skipped = 0;
+	retErr = ERROR_SUCCESS;
+	if (BytesCloned)
+		*BytesCloned = 0;
+
+	if (0 == File->NumMatches)
+		return ERROR_SUCCESS;
+
+	buffers = malloc(2 * DEDUPE_CLONE_CHUNK);
+	if (NULL == buffers)
+		return ERROR_NOT_ENOUGH_MEMORY;
+
+	for (i = 0; i < File->NumMatches; ++i) {
+		match = &File->Matches[i];
+
+		source = Handle;
+		if (match->SourceFile != File->Id) {
+			if (NULL == opened || openedId != match->SourceFile) {
+				if (opened)
+					(void)CloseHandle(opened);
+				AcquireSRWLockShared(&index->Lock);
+				path = index->Paths[match->SourceFile];
+				ReleaseSRWLockShared(&index->Lock);
+				/* The source may still be open elsewhere, or be gone. */
+				opened = OpenFileWithSharing(path,
+				                             FILE_SHARE_READ | FILE_SHARE_WRITE,
+				                             0,
+				                             &sourceSize,
+				                             NULL,
+				                             NULL,
+				                             NULL,
+				                             NULL);
+				openedId = match->SourceFile;
+			}
+			if (NULL == opened) {
+				skipped += match->Length;
+				continue;
+			}
+			source = opened;
+		}
+
+		for (pos = 0; pos < match->Length; pos += len) {
+			len = (DWORD)MIN(DEDUPE_CLONE_CHUNK, match->Length - pos);
+			QosThrottle(QosClassRead, 2 * (UINT64)len);
+
+			/* Only clone what is still identical right now. */
+			if (ERROR_SUCCESS != ReadFileSync(source, match->SourceOffset + pos,
+			                                  buffers, len, &bytes1)
+			    || ERROR_SUCCESS != ReadFileSync(Handle, match->Offset + pos,
+			                                     buffers + DEDUPE_CLONE_CHUNK, len, &bytes2)
+			    || bytes1 != len || bytes2 != len
+			    || memcmp(buffers, buffers + DEDUPE_CLONE_CHUNK, len)) {
+				skipped += len;
+				continue;
+			}
+
+			err = CloneFileRange(Handle, match->Offset + pos,
+			                     source, match->SourceOffset + pos, len);
+			if (ERROR_SUCCESS != err) {
+				/* Not ReFS, or block cloning unavailable: nothing will work.
+				 * Other failures only cost the range. */
+				if (ERROR_INVALID_FUNCTION == err || ERROR_NOT_SUPPORTED == err) {
+					retErr = err;
+					goto func_return;
+				}
+				skipped += len;
+				continue;
+			}
+			cloned += len;
+		}
+	}
+
+func_return:
+	if (opened)
+		(void)CloseHandle(opened);
+	free(buffers);
+
+	AcquireSRWLockExclusive(&index->Lock);
+	index->Stats.BytesCloned += cloned;
+	index->Stats.BytesNotCloned += skipped;
+	ReleaseSRWLockExclusive(&index->Lock);
+	if (BytesCloned)
+		*BytesCloned = cloned;
+
+	return retErr;
+}
@@ -0,0 +1,398 @@
+/* Standard BSD license disclaimer.
+
+Copyright(c) 2016-2021, Lance D. Stringham
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "targetver.h"
+#include <Windows.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <wctype.h>
+
+#include <assert.h>
+
+#include "SparseFileLib.h"
+
+/* Rates are clamped to this so token arithmetic in millionths of a token
+ * cannot overflow. 1 TiB/s is far beyond anything worth limiting to. */
+#define QOS_MAX_RATE                (1ull << 40)
+
+#define QOS_TOKEN_SCALE             1000000ll
+
+/* Throttled work is done in pieces of about this fraction of a second. */
+#define QOS_CHUNKS_PER_SECOND       8
+
+/* Mapped views have to start on this boundary. */
+#define QOS_CHUNK_ALIGNMENT         (64 * 1024)
+
+#define QOS_POLL_INTERVAL_MS        1000
+
+#define QOS_LINE_MAX                256
+
+typedef struct QOS_BUCKET {
+	UINT64      Rate;
+	/* In millionths of a token. Negative while callers are sleeping off a
+	 * request larger than what was available. */
+	INT64       Tokens;
+	UINT64      LastQPC;
+} QOS_BUCKET;
+
+static SRWLOCK QosLock = SRWLOCK_INIT;
+static QOS_BUCKET QosBuckets[QosClassMax];
+/* One bit per limited class so unlimited callers never take the lock. */
+static volatile LONG QosLimitedMask;
+
+static HANDLE QosStopEvent;
+static HANDLE QosControlThread;
+static LPWSTR QosControlPath;
+
+
+static const WCHAR *const QosClassKeys[QosClassMax] = {
+	L"read",
+	L"write",
+	L"punch"
+};
+
+
+_Use_decl_annotations_
+QOS_ARG_RESULT __stdcall
+QosParseArg(
+	int             Argc,
+	WCHAR           **Argv,
+	int             *Index,
+	PQOS_OPTIONS    Options
+	)
+{
+	LPCWSTR arg;
+	UINT64  tmp;
+	int     qosClass;
+
+	arg = Argv[*Index];
+
+	if (!wcscmp(arg, L"--background")) {
+		Options->Background = TRUE;
+		return QosArgConsumed;
+	}
+
+	if (!wcscmp(arg, L"--qos-file")) {
+		if (++*Index >= Argc)
+			return QosArgInvalid;
+		Options->ControlFile = Argv[*Index];
+		return QosArgConsumed;
+	}
+
+	if (!wcscmp(arg, L"--max-read"))
+		qosClass = QosClassRead;
+	else if (!wcscmp(arg, L"--max-write"))
+		qosClass = QosClassWrite;
+	else if (!wcscmp(arg, L"--max-punch"))
+		qosClass = QosClassPunch;
+	else
+		return QosArgNotQos;
+
+	if (++*Index >= Argc || !ParseSizeArg(Argv[*Index], &tmp) || !tmp)
+		return QosArgInvalid;
+	Options->Limits.Rate[qosClass] = tmp;
+	return QosArgConsumed;
+}
+
+
+_Use_decl_annotations_
+void __stdcall
+QosSetLimits(
+	const QOS_LIMITS    *Limits
+	)
+{
+	UINT64  now, rate;
+	LONG    mask;
+	int     i;
+
+	now = GetQPCVal();
+	mask = 0;
+
+	AcquireSRWLockExclusive(&QosLock);
+	for (i = 0; i < QosClassMax; ++i) {
+		rate = MIN(Limits->Rate[i], QOS_MAX_RATE);
+		if (rate != QosBuckets[i].Rate) {
+			/* Start the new rate with an empty bucket rather than a burst. */
+			QosBuckets[i].Rate = rate;
+			QosBuckets[i].Tokens = 0;
+			QosBuckets[i].LastQPC = now;
+		}
+		if (rate)
+			mask |= 1 << i;
+	}
+	(void)InterlockedExchange(&QosLimitedMask, mask);
+	ReleaseSRWLockExclusive(&QosLock);
+}
+
+
+_Use_decl_annotations_
+void __stdcall
+QosThrottle(
+	QOS_CLASS       Class,
+	UINT64          Amount
+	)
+{
+	QOS_BUCKET  *bucket;
+	UINT64      now, elapsedUs;
+	INT64       capacity;
+	DWORD       waitMs;
+
+	assert(Class < QosClassMax);
+
+	if (!(QosLimitedMask & (1 << Class)) || !Amount)
+		return;
+
+	waitMs = 0;
+
+	AcquireSRWLockExclusive(&QosLock);
+
+	bucket = &QosBuckets[Class];
+	if (bucket->Rate) {
+		now = GetQPCVal();
+		/* The bucket is full after a second so longer idle times add nothing
+		 * and would only risk overflow. */
+		elapsedUs = MIN(ElapsedQPCInMicrosec(bucket->LastQPC, now), (UINT64)QOS_TOKEN_SCALE);
+		bucket->LastQPC = now;
+
+		capacity = (INT64)bucket->Rate * QOS_TOKEN_SCALE;
+		bucket->Tokens = MIN(bucket->Tokens + (INT64)(bucket->Rate * elapsedUs), capacity);
+		bucket->Tokens -= (INT64)MIN(Amount, QOS_MAX_RATE) * QOS_TOKEN_SCALE;
+
+		if (bucket->Tokens < 0)
+			waitMs = (DWORD)MIN((UINT64)(-bucket->Tokens / (INT64)bucket->Rate) / 1000, INFINITE - 1);
+	}
+
+	ReleaseSRWLockExclusive(&QosLock);
+
+	/* Later callers add to the debt and sleep longer, so waiters are served
+	 * in roughly the order they arrived. */
+	if (waitMs)
+		Sleep(waitMs);
+}
+
+
+_Use_decl_annotations_
+SIZE_T __stdcall
+QosChunkSize(
+	QOS_CLASS       Class,
+	SIZE_T          Preferred,
+	SIZE_T          Alignment
+	)
+{
+	UINT64 rate;
+
+	assert(Class < QosClassMax);
+
+	if (!(QosLimitedMask & (1 << Class)))
+		return Preferred;
+
+	AcquireSRWLockShared(&QosLock);
+	rate = QosBuckets[Class].Rate;
+	ReleaseSRWLockShared(&QosLock);
+
+	if (!rate)
+		return Preferred;
+
+	/* Chunks of a file with clusters larger than the alignment have to keep
+	 * to whole clusters too. */
+	Alignment = MAX(Alignment, QOS_CHUNK_ALIGNMENT);
+	assert(!(Alignment & (Alignment - 1)));
+	rate = MAX(ALIGN_DOWN_BY(rate / QOS_CHUNKS_PER_SECOND, Alignment), Alignment);
+	return (SIZE_T)MIN(rate, (UINT64)Preferred);
+}
+
+
+/* Parse the control file into Limits. Returns FALSE, leaving Limits in an
+ * undefined state, if the file cannot be read or has an invalid line. */
+static BOOL
+QosLoadControlFile(
+	_In_        LPCWSTR         Path,
+	_Out_       PQOS_LIMITS     Limits
+	)
+{
+	WCHAR   line[QOS_LINE_MAX];
+	WCHAR   *key, *value, *end;
+	FILE    *fp;
+	UINT64  tmp;
+	BOOL    retVal;
+	int     i;
+
+	memset(Limits, 0, sizeof(*Limits));
+
+	fp = _wfopen(Path, L"rt, ccs=UTF-8");
+	if (NULL == fp) {
+		LogError(L"Failed to open QoS control file %s\n", Path);
+		return FALSE;
+	}
+
+	retVal = TRUE;
+	while (retVal && fgetws(line, QOS_LINE_MAX, fp)) {
+		key = line;
+		while (iswspace(*key))
+			++key;
+		end = key + wcslen(key);
+		while (end > key && iswspace(*(end - 1)))
+			*--end = L'\0';
+		if (L'\0' == *key || L'#' == *key)
+			continue;
+
+		value = wcschr(key, L'=');
+		retVal = FALSE;
+		if (NULL == value)
+			break;
+		*value++ = L'\0';
+		for (end = value - 1; end > key && iswspace(*(end - 1)); --end)
+			*(end - 1) = L'\0';
+		while (iswspace(*value))
+			++value;
+
+		for (i = 0; i < QosClassMax; ++i) {
+			if (!_wcsicmp(key, QosClassKeys[i])) {
+				retVal = ParseSizeArg(value, &tmp);
+				Limits->Rate[i] = tmp;
+				break;
+			}
+		}
+	}
+
+	if (!retVal)
+		LogError(L"Invalid line in QoS control file %s: %s\n", Path, line);
+	else if (ferror(fp))
+		retVal = FALSE;
+
+	(void)fclose(fp);
+	return retVal;
+}
+
+
+static DWORD WINAPI
+QosControlFileThread(
+	LPVOID      Param
+	)
+{
+	WIN32_FILE_ATTRIBUTE_DATA   attrs;
+	FILETIME                    lastWrite;
+	QOS_LIMITS                  limits;
+
+	UNREFERENCED_PARAMETER(Param);
+
+	memset(&lastWrite, 0, sizeof(lastWrite));
+
+	do {
+		if (!GetFileAttributesExW(QosControlPath, GetFileExInfoStandard, &attrs))
+			continue;
+		if (attrs.ftLastWriteTime.dwLowDateTime == lastWrite.dwLowDateTime
+		    && attrs.ftLastWriteTime.dwHighDateTime == lastWrite.dwHighDateTime)
+			continue;
+
+		/* Remembered even if the file is invalid; an editor saving it again
+		 * changes the time and gets it reloaded. */
+		lastWrite = attrs.ftLastWriteTime;
+		if (QosLoadControlFile(QosControlPath, &limits)) {
+			QosSetLimits(&limits);
+			LogInfo(L"QoS limits: read %llu B/s, write %llu B/s, punch %llu/s "
+			        L"(0 is unlimited).\n",
+			        limits.Rate[QosClassRead], limits.Rate[QosClassWrite],
+			        limits.Rate[QosClassPunch]);
+		}
+	} while (WAIT_TIMEOUT == WaitForSingleObject(QosStopEvent, QOS_POLL_INTERVAL_MS));
+
+	return 0;
+}
+
+
+_Use_decl_annotations_
+DWORD __stdcall
+QosStart(
+	const QOS_OPTIONS   *Options
+	)
+{
+	DWORD errRet;
+
+	if (Options->Background
+	    && !SetPriorityClass(GetCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN)) {
+		errRet = GetLastError();
+		LogError(L"Failed to enter background mode with error %#llx\n",
+		         (long long)errRet);
+		return errRet;
+	}
+
+	/* The control file takes over from the command line limits as soon as
+	 * it has been read. */
+	QosSetLimits(&Options->Limits);
+
+	if (NULL == Options->ControlFile || QosControlThread)
+		return ERROR_SUCCESS;
+
+	QosControlPath = _wcsdup(Options->ControlFile);
+	QosStopEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+	if (NULL == QosControlPath || NULL == QosStopEvent) {
+		errRet = QosControlPath ? GetLastError() : ERROR_NOT_ENOUGH_MEMORY;
+		goto error_return;
+	}
+
+	QosControlThread = CreateThread(NULL, 0, QosControlFileThread, NULL, 0, NULL);
+	if (NULL == QosControlThread) {
+		errRet = GetLastError();
+		goto error_return;
+	}
+
+	return ERROR_SUCCESS;
+
+error_return:
+	LogError(L"Failed to start polling QoS control file %s with error %#llx\n",
+	         Options->ControlFile, (long long)errRet);
+	QosStop();
+	return errRet;
+}
+
+
+void __stdcall
+QosStop(
+	void
+	)
+{
+	if (QosControlThread) {
+		(void)SetEvent(QosStopEvent);
+		(void)WaitForSingleObject(QosControlThread, INFINITE);
+		(void)CloseHandle(QosControlThread);
+		QosControlThread = NULL;
+	}
+	if (QosStopEvent) {
+		(void)CloseHandle(QosStopEvent);
+		QosStopEvent = NULL;
+	}
+	free(QosControlPath);
+	QosControlPath = NULL;
+}
@@ -0,0 +1,335 @@
+/* Standard BSD license disclaimer.
+
+Copyright(c) 2016-2021, Lance D. Stringham
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "targetver.h"
+#include <Windows.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <wctype.h>
+#include <errno.h>
+
+#include "SparseFileLib.h"
+
+/* Shards and their result files.
+ *
+ * A shard is a slice of a file processed by one process, typically one of
+ * several on different nodes sharing the storage. Shards start and end on
+ * boundaries that are multiples of both the cluster size and the view
+ * alignment, so no two shards ever touch the same cluster or map the same
+ * view.
+ *
+ * Each shard writes a small text file of "key = value" lines describing what
+ * it did, in the same form as the QoS control file, followed by one line per
+ * zero run it found. The last line is "end" so a coordinator can tell a
+ * finished result from one that was cut short. */
+
+#define SHARD_RESULT_VERSION        1
+/* A zero line holds two 64-bit numbers; anything longer is not ours. */
+#define SHARD_LINE_MAX              128
+#define SHARD_INITIAL_RUNS          64
+
+static const WCHAR *ShardKeyVersion         = L"version";
+static const WCHAR *ShardKeyTool            = L"tool";
+static const WCHAR *ShardKeyFileSize        = L"file_size";
+static const WCHAR *ShardKeyClusterSize     = L"cluster_size";
+static const WCHAR *ShardKeyRangeOffset     = L"range_offset";
+static const WCHAR *ShardKeyRangeLength     = L"range_length";
+static const WCHAR *ShardKeyError           = L"error";
+static const WCHAR *ShardKeyBytesRead       = L"bytes_read";
+static const WCHAR *ShardKeyBytesWritten    = L"bytes_written";
+static const WCHAR *ShardKeyRangesWritten   = L"ranges_written";
+static const WCHAR *ShardKeyZero            = L"zero";
+static const WCHAR *ShardKeyEnd             = L"end";
+
+
+_Use_decl_annotations_
+BOOL __stdcall
+ParseRangeArg(
+	LPCWSTR         Arg,
+	UINT64          *Offset,
+	UINT64          *Length
+	)
+{
+	WCHAR   offset[32];
+	LPCWSTR colon;
+	SIZE_T  len;
+
+	if (NULL == Arg)
+		return FALSE;
+	colon = wcschr(Arg, L':');
+	if (NULL == colon)
+		return FALSE;
+	len = colon - Arg;
+	if (0 == len || ARRAYSIZE(offset) <= len)
+		return FALSE;
+	memcpy(offset, Arg, len * sizeof(*offset));
+	offset[len] = L'\0';
+
+	return ParseSizeArg(offset, Offset) && ParseSizeArg(colon + 1, Length)
+	       && *Offset + *Length >= *Offset;
+}
+
+
+_Use_decl_annotations_
+BOOL __stdcall
+ShardRangeResolve(
+	UINT64          FileSize,
+	SIZE_T          ClusterSize,
+	UINT64          Offset,
+	UINT64          *Length
+	)
+{
+	UINT64 alignment, end;
+
+	alignment = MAX((UINT64)ClusterSize, SPARSE_MAP_RANGE_ALIGNMENT);
+
+	if (Offset % alignment || (Offset >= FileSize && 0 != FileSize))
+		return FALSE;
+
+	end = (0 == *Length) ? FileSize : MIN(Offset + *Length, FileSize);
+	if (end < FileSize && end % alignment)
+		return FALSE;
+
+	*Length = end - Offset;
+	return TRUE;
+}
+
+
+_Use_decl_annotations_
+DWORD __stdcall
+ShardResultSave(
+	LPCWSTR                 Path,
+	const SHARD_RESULT      *Result,
+	PCLUSTER_MAP            ZeroMap
+	)
+{
+	FILE    *fp;
+	UINT64  cluster, end, first, last, offset, length;
+	DWORD   errRet;
+
+	fp = _wfopen(Path, L"wt, ccs=UTF-8");
+	if (NULL == fp)
+		return (ENOENT == errno) ? ERROR_FILE_NOT_FOUND : ERROR_OPEN_FAILED;
+
+	fwprintf(fp, L"%s = %d\n", ShardKeyVersion, SHARD_RESULT_VERSION);
+	fwprintf(fp, L"%s = %s\n", ShardKeyTool, Result->Tool);
+	fwprintf(fp, L"%s = %llu\n", ShardKeyFileSize, Result->FileSize);
+	fwprintf(fp, L"%s = %llu\n", ShardKeyClusterSize, Result->ClusterSize);
+	fwprintf(fp, L"%s = %llu\n", ShardKeyRangeOffset, Result->RangeOffset);
+	fwprintf(fp, L"%s = %llu\n", ShardKeyRangeLength, Result->RangeLength);
+	fwprintf(fp, L"%s = %lu\n", ShardKeyError, Result->Error);
+	fwprintf(fp, L"%s = %llu\n", ShardKeyBytesRead, Result->BytesRead);
+	fwprintf(fp, L"%s = %llu\n", ShardKeyBytesWritten, Result->BytesWritten);
+	fwprintf(fp, L"%s = %llu\n", ShardKeyRangesWritten, Result->RangesWritten);
+
+	/* Only the shard's own clusters; the rest of the map belongs to others. */
+	if (ZeroMap && Result->RangeLength) {
+		first = Result->RangeOffset / Result->ClusterSize;
+		last  = (Result->RangeOffset + Result->RangeLength + Result->ClusterSize - 1)
+		        / Result->ClusterSize;
+		for (cluster = first; cluster < last; cluster = end) {
+			end = MIN(ClusterMapRunEnd(ZeroMap, cluster), last);
+			if (!ClusterMapIsMarkedZero(ZeroMap, cluster))
+				continue;
+			offset = cluster * Result->ClusterSize;
+			length = MIN(end * Result->ClusterSize, Result->RangeOffset + Result->RangeLength)
+			         - offset;
+			fwprintf(fp, L"%s = %llu %llu\n", ShardKeyZero, offset, length);
+		}
+	}
+
+	fwprintf(fp, L"%s\n", ShardKeyEnd);
+
+	errRet = ferror(fp) ? ERROR_WRITE_FAULT : ERROR_SUCCESS;
+	if (0 != fclose(fp) && ERROR_SUCCESS == errRet)
+		errRet = ERROR_WRITE_FAULT;
+	return errRet;
+}
+
+
+static DWORD
+ShardAddZeroRun(
+	_Inout_     PSHARD_RESULT   Result,
+	_In_        LPCWSTR         Value
+	)
+{
+	PSHARD_ZERO_RUN newRuns;
+	WCHAR           *end;
+	UINT64          offset, length, rangeEnd, newSize;
+
+	errno = 0;
+	offset = _wcstoui64(Value, &end, 10);
+	if (end == Value || !iswspace(*end) || ERANGE == errno)
+		return ERROR_INVALID_DATA;
+	Value = end;
+	length = _wcstoui64(Value, &end, 10);
+	if (end == Value || L'\0' != *end || ERANGE == errno)
+		return ERROR_INVALID_DATA;
+
+	/* Runs must stay inside the shard and in order. */
+	rangeEnd = Result->RangeOffset + Result->RangeLength;
+	if (offset < Result->RangeOffset || offset > rangeEnd || length > rangeEnd - offset
+	    || (Result->NumZeroRuns
+	        && offset < Result->ZeroRuns[Result->NumZeroRuns - 1].Offset
+	                    + Result->ZeroRuns[Result->NumZeroRuns - 1].Length))
+		return ERROR_INVALID_DATA;
+
+	if (Result->NumZeroRuns == Result->ZeroRunsSize) {
+		newSize = Result->ZeroRunsSize ? Result->ZeroRunsSize * 2 : SHARD_INITIAL_RUNS;
+		if (newSize > SIZE_MAX / sizeof(*newRuns))
+			return ERROR_NOT_ENOUGH_MEMORY;
+		newRuns = realloc(Result->ZeroRuns, (SIZE_T)newSize * sizeof(*newRuns));
+		if (NULL == newRuns)
+			return ERROR_NOT_ENOUGH_MEMORY;
+		Result->ZeroRuns = newRuns;
+		Result->ZeroRunsSize = newSize;
+	}
+
+	Result->ZeroRuns[Result->NumZeroRuns].Offset = offset;
+	Result->ZeroRuns[Result->NumZeroRuns].Length = length;
+	Result->NumZeroRuns++;
+	return ERROR_SUCCESS;
+}
+
+
+_Use_decl_annotations_
+DWORD __stdcall
+ShardResultLoad(
+	LPCWSTR         Path,
+	PSHARD_RESULT   Result
+	)
+{
+	WCHAR   line[SHARD_LINE_MAX];
+	WCHAR   *key, *value, *end;
+	FILE    *fp;
+	UINT64  tmp, version;
+	BOOL    ended;
+	DWORD   errRet;
+
+	memset(Result, 0, sizeof(*Result));
+	version = 0;
+	ended = FALSE;
+
+	fp = _wfopen(Path, L"rt, ccs=UTF-8");
+	if (NULL == fp)
+		return (ENOENT == errno) ? ERROR_FILE_NOT_FOUND : ERROR_OPEN_FAILED;
+
+	errRet = ERROR_SUCCESS;
+	while (ERROR_SUCCESS == errRet && !ended && fgetws(line, SHARD_LINE_MAX, fp)) {
+		key = line;
+		while (iswspace(*key))
+			++key;
+		end = key + wcslen(key);
+		while (end > key && iswspace(*(end - 1)))
+			*--end = L'\0';
+		if (L'\0' == *key || L'#' == *key)
+			continue;
+
+		if (!wcscmp(key, ShardKeyEnd)) {
+			ended = TRUE;
+			continue;
+		}
+
+		errRet = ERROR_INVALID_DATA;
+		value = wcschr(key, L'=');
+		if (NULL == value)
+			break;
+		*value++ = L'\0';
+		for (end = value - 1; end > key && iswspace(*(end - 1)); --end)
+			*(end - 1) = L'\0';
+		while (iswspace(*value))
+			++value;
+
+		if (!wcscmp(key, ShardKeyZero)) {
+			errRet = ShardAddZeroRun(Result, value);
+			continue;
+		} else if (!wcscmp(key, ShardKeyTool)) {
+			if (ARRAYSIZE(Result->Tool) <= wcslen(value))
+				break;
+			wcscpy_s(Result->Tool, ARRAYSIZE(Result->Tool), value);
+			errRet = ERROR_SUCCESS;
+			continue;
+		}
+
+		if (!ParseSizeArg(value, &tmp))
+			break;
+		errRet = ERROR_SUCCESS;
+		if (!wcscmp(key, ShardKeyVersion))
+			version = tmp;
+		else if (!wcscmp(key, ShardKeyFileSize))
+			Result->FileSize = tmp;
+		else if (!wcscmp(key, ShardKeyClusterSize))
+			Result->ClusterSize = tmp;
+		else if (!wcscmp(key, ShardKeyRangeOffset))
+			Result->RangeOffset = tmp;
+		else if (!wcscmp(key, ShardKeyRangeLength))
+			Result->RangeLength = tmp;
+		else if (!wcscmp(key, ShardKeyError))
+			Result->Error = (DWORD)tmp;
+		else if (!wcscmp(key, ShardKeyBytesRead))
+			Result->BytesRead = tmp;
+		else if (!wcscmp(key, ShardKeyBytesWritten))
+			Result->BytesWritten = tmp;
+		else if (!wcscmp(key, ShardKeyRangesWritten))
+			Result->RangesWritten = tmp;
+		/* Unknown keys are left for newer versions to use. */
+	}
+
+	if (ERROR_SUCCESS == errRet && ferror(fp))
+		errRet = ERROR_READ_FAULT;
+	(void)fclose(fp);
+
+	if (ERROR_SUCCESS == errRet
+	    && (SHARD_RESULT_VERSION != version || !ended || 0 == Result->ClusterSize
+	        || Result->RangeOffset > Result->FileSize
+	        || Result->RangeLength > Result->FileSize - Result->RangeOffset))
+		errRet = ERROR_INVALID_DATA;
+
+	if (ERROR_SUCCESS != errRet)
+		ShardResultFree(Result);
+	return errRet;
+}
+
+
+_Use_decl_annotations_
+void __stdcall
+ShardResultFree(
+	PSHARD_RESULT   Result
+	)
+{
+	free(Result->ZeroRuns);
+	Result->ZeroRuns = NULL;
+	Result->NumZeroRuns = 0;
+	Result->ZeroRunsSize = 0;
+}
@@ -31,20 +31,53 @@ THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "targetver.h"
 #include <Windows.h>
+#include <winioctl.h>
 
 #include <stdlib.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
+#include <errno.h>
 
 #include <assert.h>
 
+#if defined(_M_IX86) || defined(_M_X64)
+#include <intrin.h>
+#include <immintrin.h>
+#define SPARSEFILELIB_USE_SSE2
+#endif
+
 #include "SparseFileLib.h"
 
 // This gets initialized by SparseFileLibInit
 static UINT64 QPCFrequency;
 
+#ifdef SPARSEFILELIB_USE_SSE2
+// Always available on x64, checked by SparseFileLibInit on x86.
+static BOOL HaveSSE2 = TRUE;
+// Checked by SparseFileLibInit; needs support from both the CPU and the OS.
+static BOOL HaveAVX2 = FALSE;
+// Checked by SparseFileLibInit; provides the CRC32 instruction.
+static BOOL HaveSSE42 = FALSE;
+#endif
+
+// The vector loops below work on blocks this large.
+#define SIMD_BLOCK_SIZE 64
+
+// CRC32C (Castagnoli) polynomial, bit reflected.
+#define CRC32C_POLY 0x82F63B78
+// Buffers at least this large are hashed as three interleaved lanes, which
+// hides the latency of the CRC32 instruction.
+#define CRC32C_LANES_MIN (3 * 4096)
+
+// Both get filled in by SparseFileLibInit. The first drives the byte at a
+// time fallback and the second holds x^(2^n) modulo the polynomial. For this
+// polynomial x^(2^31) is x again, so the powers repeat every 31 entries.
+static UINT32 Crc32cTable[256];
+static UINT32 Crc32cX2nTable[31];
+
 
 // internal type declarations that are hidden from consumers
 struct CLUSTER_MAP {
@@ -87,7 +120,91 @@ LogInfo(
 }
 
 
-// TODO: Figure out the most efficient method of checking for zeros.
+#ifdef SPARSEFILELIB_USE_SSE2
+// These take 32 byte aligned blocks and a multiple of SIMD_BLOCK_SIZE bytes.
+static BOOL
+IsZeroAlignedSSE2(
+	_In_reads_bytes_(Size)  const BYTE  *Block,
+	_In_                    SIZE_T      Size
+	)
+{
+	const __m128i   *p, *e;
+	__m128i         acc;
+
+	for (p = (const __m128i *)Block, e = (const __m128i *)(Block + Size); p < e; p += 4) {
+		acc = _mm_or_si128(_mm_or_si128(_mm_load_si128(p), _mm_load_si128(p + 1)),
+		                   _mm_or_si128(_mm_load_si128(p + 2), _mm_load_si128(p + 3)));
+		if (0xFFFF != _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+
+static BOOL
+IsZeroAlignedAVX2(
+	_In_reads_bytes_(Size)  const BYTE  *Block,
+	_In_                    SIZE_T      Size
+	)
+{
+	const __m256i   *p, *e;
+	__m256i         acc;
+	BOOL            zero;
+
+	zero = TRUE;
+	for (p = (const __m256i *)Block, e = (const __m256i *)(Block + Size); p < e; p += 2) {
+		acc = _mm256_or_si256(_mm256_load_si256(p), _mm256_load_si256(p + 1));
+		if (!_mm256_testz_si256(acc, acc)) {
+			zero = FALSE;
+			break;
+		}
+	}
+	// Avoid the transition penalty when legacy SSE code runs next.
+	_mm256_zeroupper();
+	return zero;
+}
+
+
+static void
+StreamCopyAlignedSSE2(
+	_Out_writes_bytes_(Size)        BYTE        *Target,
+	_In_reads_bytes_(Size)          const BYTE  *Source,
+	_In_                            SIZE_T      Size
+	)
+{
+	const __m128i   *s, *e;
+	__m128i         *t;
+
+	for (s = (const __m128i *)Source, e = (const __m128i *)(Source + Size), t = (__m128i *)Target;
+	     s < e; s += 4, t += 4) {
+		_mm_stream_si128(t,     _mm_load_si128(s));
+		_mm_stream_si128(t + 1, _mm_load_si128(s + 1));
+		_mm_stream_si128(t + 2, _mm_load_si128(s + 2));
+		_mm_stream_si128(t + 3, _mm_load_si128(s + 3));
+	}
+}
+
+
+static void
+StreamCopyAlignedAVX2(
+	_Out_writes_bytes_(Size)        BYTE        *Target,
+	_In_reads_bytes_(Size)          const BYTE  *Source,
+	_In_                            SIZE_T      Size
+	)
+{
+	const __m256i   *s, *e;
+	__m256i         *t;
+
+	for (s = (const __m256i *)Source, e = (const __m256i *)(Source + Size), t = (__m256i *)Target;
+	     s < e; s += 2, t += 2) {
+		_mm256_stream_si256(t,     _mm256_load_si256(s));
+		_mm256_stream_si256(t + 1, _mm256_load_si256(s + 1));
+	}
+	_mm256_zeroupper();
+}
+#endif
+
+
 _Use_decl_annotations_
 BOOL __stdcall
 IsZeroBuf(
@@ -95,14 +212,234 @@ IsZeroBuf(
 	DWORD           BufSz
 	)
 {
-	char *p, *e;
+	const BYTE *p, *e;
 
 	p = Buf;
 	e = p + BufSz;
 
-	while (*p == 0 && ++p < e);
+#ifdef SPARSEFILELIB_USE_SSE2
+	if (HaveSSE2) {
+		SIZE_T body;
+
+		for (; p < e && ((ULONG_PTR)p & 31); ++p) {
+			if (*p)
+				return FALSE;
+		}
+		body = ALIGN_DOWN_BY(e - p, SIMD_BLOCK_SIZE);
+		if (HaveAVX2 ? !IsZeroAlignedAVX2(p, body) : !IsZeroAlignedSSE2(p, body))
+			return FALSE;
+		p += body;
+	}
+#endif
+
+	for (; p < e; ++p) {
+		if (*p)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+
+/* Multiply A and B modulo the CRC32C polynomial, both bit reflected. */
+static UINT32
+Crc32cMultModP(
+	_In_        UINT32          A,
+	_In_        UINT32          B
+	)
+{
+	UINT32 m, p;
+
+	p = 0;
+	for (m = 1u << 31; m; m >>= 1) {
+		if (A & m)
+			p ^= B;
+		B = (B & 1) ? (B >> 1) ^ CRC32C_POLY : B >> 1;
+	}
+	return p;
+}
+
+
+static void
+Crc32cInit(
+	void
+	)
+{
+	UINT32 c, i, j;
+
+	for (i = 0; i < ARRAYSIZE(Crc32cTable); ++i) {
+		c = i;
+		for (j = 0; j < 8; ++j)
+			c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		Crc32cTable[i] = c;
+	}
+
+	// x^1, then each entry squares the one before it.
+	Crc32cX2nTable[0] = c = 1u << 30;
+	for (i = 1; i < ARRAYSIZE(Crc32cX2nTable); ++i)
+		Crc32cX2nTable[i] = c = Crc32cMultModP(c, c);
+
+	// Shifts past the period of the table have to agree however the length
+	// is split, or the CRCs of large files depend on the view size.
+	assert(Crc32cShift(Crc32cShift(0x8C28B28A, 3ull << 28), 5ull << 29)
+	       == Crc32cShift(0x8C28B28A, (3ull << 28) + (5ull << 29)));
+}
+
+
+_Use_decl_annotations_
+UINT32 __stdcall
+Crc32cShift(
+	UINT32          Crc,
+	UINT64          Length
+	)
+{
+	UINT32 p, k;
+
+	// x^(8 * Length), built from the powers of two in Length.
+	p = 1u << 31;
+	for (k = 3; Length; Length >>= 1, ++k) {
+		if (Length & 1)
+			p = Crc32cMultModP(Crc32cX2nTable[k % ARRAYSIZE(Crc32cX2nTable)], p);
+	}
+	return Crc32cMultModP(p, Crc);
+}
+
+
+_Use_decl_annotations_
+UINT32 __stdcall
+Crc32cUpdate(
+	UINT32          Crc,
+	LPCVOID         Buf,
+	SIZE_T          BufSz
+	)
+{
+	const BYTE *p;
+
+	p = Buf;
+
+#ifdef SPARSEFILELIB_USE_SSE2
+	if (HaveSSE42) {
+		for (; BufSz && ((ULONG_PTR)p & 7); --BufSz)
+			Crc = _mm_crc32_u8(Crc, *p++);
+#ifdef _M_X64
+		if (BufSz >= CRC32C_LANES_MIN) {
+			UINT64  c0, c1, c2;
+			SIZE_T  lane, i;
+
+			lane = ALIGN_DOWN_BY(BufSz / 3, sizeof(UINT64));
+			c0 = Crc;
+			c1 = 0;
+			c2 = 0;
+			for (i = 0; i < lane; i += sizeof(UINT64)) {
+				c0 = _mm_crc32_u64(c0, *(const UINT64 *)(p + i));
+				c1 = _mm_crc32_u64(c1, *(const UINT64 *)(p + lane + i));
+				c2 = _mm_crc32_u64(c2, *(const UINT64 *)(p + 2 * lane + i));
+			}
+			Crc = Crc32cShift((UINT32)c0, 2 * (UINT64)lane)
+			    ^ Crc32cShift((UINT32)c1, lane) ^ (UINT32)c2;
+			p += 3 * lane;
+			BufSz -= 3 * lane;
+		}
+		for (; BufSz >= sizeof(UINT64); BufSz -= sizeof(UINT64), p += sizeof(UINT64))
+			Crc = (UINT32)_mm_crc32_u64(Crc, *(const UINT64 *)p);
+#else
+		for (; BufSz >= sizeof(UINT32); BufSz -= sizeof(UINT32), p += sizeof(UINT32))
+			Crc = _mm_crc32_u32(Crc, *(const UINT32 *)p);
+#endif
+		for (; BufSz; --BufSz)
+			Crc = _mm_crc32_u8(Crc, *p++);
+		return Crc;
+	}
+#endif
+
+	for (; BufSz; --BufSz)
+		Crc = Crc32cTable[(Crc ^ *p++) & 0xFF] ^ (Crc >> 8);
+	return Crc;
+}
+
+
+_Use_decl_annotations_
+UINT32 __stdcall
+Crc32cFinal(
+	UINT32          RawCrc,
+	UINT64          Length
+	)
+{
+	// The usual all ones start, which a raw CRC leaves out.
+	return ~(Crc32cShift(0xFFFFFFFF, Length) ^ RawCrc);
+}
+
+
+_Use_decl_annotations_
+SIZE_T __stdcall
+CopyNonZeroBlocks(
+	PVOID           Target,
+	LPCVOID         Source,
+	SIZE_T          Size,
+	DWORD           BlockSize
+	)
+{
+	return CopyNonZeroBlocksEx(Target, Source, Size, BlockSize, NULL);
+}
+
+
+_Use_decl_annotations_
+SIZE_T __stdcall
+CopyNonZeroBlocksEx(
+	PVOID           Target,
+	LPCVOID         Source,
+	SIZE_T          Size,
+	DWORD           BlockSize,
+	BYTE            *BlockMap
+	)
+{
+	const BYTE  *source;
+	BYTE        *target;
+	SIZE_T      pos, len, copied, block;
+	BOOL        streamed, zero;
+
+	source = Source;
+	target = Target;
+	copied = 0;
+	streamed = FALSE;
+
+	for (pos = 0, block = 0; pos < Size; pos += len, ++block) {
+		len = MIN(BlockSize, Size - pos);
+		if (BlockMap && BLOCK_MAP_UNKNOWN != BlockMap[block]) {
+			zero = (BLOCK_MAP_ZERO == BlockMap[block]);
+		} else {
+			zero = IsZeroBuf((LPVOID)(source + pos), (DWORD)len);
+			if (BlockMap)
+				BlockMap[block] = zero ? BLOCK_MAP_ZERO : BLOCK_MAP_DATA;
+		}
+		if (zero)
+			continue;
+		copied += len;
+
+#ifdef SPARSEFILELIB_USE_SSE2
+		// The target is not read back, so keep it out of the cache.
+		if (HaveSSE2 && 0 == (len % SIMD_BLOCK_SIZE)
+		    && 0 == (((ULONG_PTR)(source + pos) | (ULONG_PTR)(target + pos)) & 31)) {
+			if (HaveAVX2)
+				StreamCopyAlignedAVX2(target + pos, source + pos, len);
+			else
+				StreamCopyAlignedSSE2(target + pos, source + pos, len);
+			streamed = TRUE;
+			continue;
+		}
+#endif
+		memcpy(target + pos, source + pos, len);
+	}
+
+#ifdef SPARSEFILELIB_USE_SSE2
+	// Streaming stores are weakly ordered; make them visible before the
+	// caller unmaps or flushes the view.
+	if (streamed)
+		_mm_sfence();
+#else
+	UNREFERENCED_PARAMETER(streamed);
+#endif
 
-	return (p >= e);
+	return copied;
 }
 
 
@@ -199,32 +536,330 @@ ClusterMapIsMarkedZero(
 }
 
 
+/* Output is gathered in a buffer this large before each fwrite. */
+#define MAP_EXPORT_BUFFER_SIZE  (1024 * 1024)
+/* Room left for the longest single piece of output. */
+#define MAP_EXPORT_MAX_PIECE    256
+
+typedef struct MAP_WRITER {
+	FILE        *Stream;
+	char        *Buffer;
+	SIZE_T      Used;
+	DWORD       Error;
+} MAP_WRITER, *PMAP_WRITER;
+
+
+static void
+MapWriterFlush(
+	_Inout_     PMAP_WRITER     Writer
+	)
+{
+	if (Writer->Used && ERROR_SUCCESS == Writer->Error
+	    && fwrite(Writer->Buffer, 1, Writer->Used, Writer->Stream) != Writer->Used)
+		Writer->Error = ERROR_WRITE_FAULT;
+	Writer->Used = 0;
+}
+
+
+/* Append formatted output. A single piece must fit MAP_EXPORT_MAX_PIECE. */
+static void
+MapWriterPrintf(
+	_Inout_     PMAP_WRITER     Writer,
+	_In_z_ _Printf_format_string_
+	            const char      *Format,
+	...
+	)
+{
+	va_list     args;
+	int         len;
+
+	if (MAP_EXPORT_BUFFER_SIZE - Writer->Used < MAP_EXPORT_MAX_PIECE)
+		MapWriterFlush(Writer);
+
+	va_start(args, Format);
+	len = vsnprintf(Writer->Buffer + Writer->Used, MAP_EXPORT_MAX_PIECE, Format, args);
+	va_end(args);
+
+	if (len > 0)
+		Writer->Used += MIN((SIZE_T)len, MAP_EXPORT_MAX_PIECE - 1);
+}
+
+
+/* Append one line of the bit grid: up to 64 clusters from FirstCluster. */
+static void
+MapWriterGridLine(
+	_Inout_     PMAP_WRITER     Writer,
+	_In_        PCLUSTER_MAP    ClusterMap,
+	_In_        UINT64          FirstCluster,
+	_In_        UINT64          NumClusters
+	)
+{
+	char    *out;
+	UINT64  i, end;
+
+	MapWriterPrintf(Writer, "\n0x%016" PRIX64, FirstCluster << ClusterMap->ClusterShift);
+
+	/* 64 digits and 16 separators fit the room MapWriterPrintf left. */
+	out = Writer->Buffer + Writer->Used;
+	end = MIN(FirstCluster + 64, NumClusters);
+	for (i = FirstCluster; i < end; ++i) {
+		if (!(i % 4))
+			*out++ = ' ';
+		*out++ = ClusterMapIsMarkedZero(ClusterMap, i) ? '0' : '1';
+	}
+	Writer->Used = out - Writer->Buffer;
+}
+
+
 _Use_decl_annotations_
-void __stdcall
-ClusterMapPrint(
+UINT64 __stdcall
+ClusterMapRunEnd(
 	PCLUSTER_MAP    ClusterMap,
-	FILE            *FileStream
+	UINT64          Cluster
 	)
 {
-	UINT64 numClusters, i, displayGroups;
+	UINT64  numClusters, i;
+	LONG    fill;
+	BOOL    marked;
 
 	numClusters = ClusterMap->FileSize >> ClusterMap->ClusterShift;
 	if (ClusterMap->FileSize & (((UINT64)1 << ClusterMap->ClusterShift) - 1))
 		++numClusters;
+	if (Cluster >= numClusters)
+		return numClusters;
+
+	marked = ClusterMapIsMarkedZero(ClusterMap, Cluster);
+	fill = marked ? -1 : 0;
+
+	for (i = Cluster + 1; i < numClusters && (i & 31); ++i) {
+		if (ClusterMapIsMarkedZero(ClusterMap, i) != marked)
+			return i;
+	}
+
+	while (i + 32 <= numClusters && ClusterMap->ClusterMap[i / 32] == fill)
+		i += 32;
+
+	for (; i < numClusters; ++i) {
+		if (ClusterMapIsMarkedZero(ClusterMap, i) != marked)
+			return i;
+	}
+
+	return numClusters;
+}
 
-	fwprintf(FileStream, L"%-18s Cluster size = %d, 0 = empty cluster, 1 = data cluster",
-	                     L"File Offset", (1 << ClusterMap->ClusterShift));
 
-	for (i = 0, displayGroups = 0; i < numClusters; ++i) {
-		if (!(displayGroups % 16) && !(i % 4))
-			fwprintf(FileStream, L"\n0x%016llX", i << ClusterMap->ClusterShift);
-		if (!(i % 4)) {
-			++displayGroups;
-			fwprintf(FileStream, L" ");
+_Use_decl_annotations_
+DWORD __stdcall
+ClusterMapExport(
+	PCLUSTER_MAP        ClusterMap,
+	FILE                *FileStream,
+	CLUSTER_MAP_FORMAT  Format
+	)
+{
+	MAP_WRITER  writer;
+	UINT64      numClusters, cluster, end, start, length, clusterSize;
+	BOOL        zero, first;
+
+	clusterSize = (UINT64)1 << ClusterMap->ClusterShift;
+	numClusters = (ClusterMap->FileSize + clusterSize - 1) >> ClusterMap->ClusterShift;
+
+	memset(&writer, 0, sizeof(writer));
+	writer.Stream = FileStream;
+	writer.Buffer = malloc(MAP_EXPORT_BUFFER_SIZE);
+	if (NULL == writer.Buffer)
+		return ERROR_NOT_ENOUGH_MEMORY;
+
+	switch (Format) {
+	case ClusterMapFormatGrid:
+		MapWriterPrintf(&writer,
+		                "%-18s Cluster size = %d, 0 = empty cluster, 1 = data cluster",
+		                "File Offset", (int)clusterSize);
+		for (cluster = 0; cluster < numClusters && ERROR_SUCCESS == writer.Error;
+		     cluster += 64) {
+			MapWriterGridLine(&writer, ClusterMap, cluster, numClusters);
+		}
+		MapWriterPrintf(&writer, "\n");
+		break;
+
+	case ClusterMapFormatRuns:
+	case ClusterMapFormatJson:
+		if (ClusterMapFormatJson == Format) {
+			MapWriterPrintf(&writer,
+			                "{\"cluster_size\": %" PRIu64 ", \"file_size\": %" PRIu64
+			                ", \"extents\": [",
+			                clusterSize, ClusterMap->FileSize);
+		} else {
+			MapWriterPrintf(&writer,
+			                "# cluster size %" PRIu64 ", file size %" PRIu64 "\n"
+			                "# offset length zero|data\n",
+			                clusterSize, ClusterMap->FileSize);
 		}
-		fwprintf(FileStream, ClusterMapIsMarkedZero(ClusterMap, i) ? L"0" : L"1");
+
+		first = TRUE;
+		for (cluster = 0; cluster < numClusters && ERROR_SUCCESS == writer.Error;
+		     cluster = end) {
+			end    = ClusterMapRunEnd(ClusterMap, cluster);
+			zero   = ClusterMapIsMarkedZero(ClusterMap, cluster);
+			start  = cluster << ClusterMap->ClusterShift;
+			length = MIN(end << ClusterMap->ClusterShift, ClusterMap->FileSize) - start;
+
+			if (ClusterMapFormatJson == Format) {
+				MapWriterPrintf(&writer,
+				                "%s\n  {\"offset\": %" PRIu64 ", \"length\": %" PRIu64
+				                ", \"type\": \"%s\"}",
+				                first ? "" : ",", start, length, zero ? "zero" : "data");
+			} else {
+				MapWriterPrintf(&writer, "%" PRIu64 " %" PRIu64 " %s\n",
+				                start, length, zero ? "zero" : "data");
+			}
+			first = FALSE;
+		}
+
+		if (ClusterMapFormatJson == Format)
+			MapWriterPrintf(&writer, "\n]}\n");
+		break;
+
+	default:
+		free(writer.Buffer);
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	MapWriterFlush(&writer);
+	if (ERROR_SUCCESS == writer.Error && fflush(FileStream))
+		writer.Error = ERROR_WRITE_FAULT;
+
+	free(writer.Buffer);
+	return writer.Error;
+}
+
+
+_Use_decl_annotations_
+void __stdcall
+ClusterMapPrint(
+	PCLUSTER_MAP    ClusterMap,
+	FILE            *FileStream
+	)
+{
+	(void)ClusterMapExport(ClusterMap, FileStream, ClusterMapFormatGrid);
+}
+
+
+/* Number of LONGs backing the map, matching ClusterMapAllocate. */
+static UINT64
+ClusterMapWordCount(
+	_In_        PCLUSTER_MAP    ClusterMap
+	)
+{
+	return ((ClusterMap->FileSize >> ClusterMap->ClusterShift) / 32) + 1;
+}
+
+
+_Use_decl_annotations_
+void __stdcall
+ClusterMapMarkClusters(
+	PCLUSTER_MAP    ClusterMap,
+	UINT64          FirstCluster,
+	UINT64          EndCluster
+	)
+{
+	volatile LONG   *map;
+	UINT64          i;
+
+	map = ClusterMap->ClusterMap;
+	EndCluster = MIN(EndCluster, ClusterMapWordCount(ClusterMap) * 32);
+
+	for (i = FirstCluster; i < EndCluster && (i & 31); ++i)
+		map[i / 32] |= 1 << (i & 31);
+
+	for (; i + 32 <= EndCluster; i += 32)
+		map[i / 32] = -1;
+
+	for (; i < EndCluster; ++i)
+		map[i / 32] |= 1 << (i & 31);
+}
+
+
+/* Dest = Src & ~Mask for the bits in Bits of one word. Mask and Src are read
+ * before Dest is written so either may be the same map as Dest. */
+static void
+AndNotWordBits(
+	_Inout_     volatile LONG   *Dest,
+	_In_        volatile LONG   *Src,
+	_In_        volatile LONG   *Mask,
+	_In_        LONG            Bits
+	)
+{
+	LONG val;
+
+	val = *Src & ~*Mask & Bits;
+	*Dest = (*Dest & ~Bits) | val;
+}
+
+
+_Use_decl_annotations_
+BOOL __stdcall
+ClusterMapAndNot(
+	PCLUSTER_MAP    Dest,
+	PCLUSTER_MAP    Src,
+	PCLUSTER_MAP    Mask,
+	UINT64          FirstCluster,
+	UINT64          EndCluster
+	)
+{
+	UINT64  firstWord, endWord, i;
+	LONG    bits;
+
+	if (Dest->FileSize != Src->FileSize || Dest->FileSize != Mask->FileSize
+	    || Dest->ClusterShift != Src->ClusterShift
+	    || Dest->ClusterShift != Mask->ClusterShift) {
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	EndCluster = MIN(EndCluster, ClusterMapWordCount(Dest) * 32);
+	if (FirstCluster >= EndCluster)
+		return TRUE;
+
+	firstWord = FirstCluster / 32;
+	endWord   = EndCluster / 32;
+
+	/* Leading partial word, which may also be the trailing one. */
+	if (FirstCluster & 31) {
+		bits = (LONG)(0xFFFFFFFFul << (FirstCluster & 31));
+		if (firstWord == endWord)
+			bits &= (LONG)((1ul << (EndCluster & 31)) - 1);
+		AndNotWordBits(&Dest->ClusterMap[firstWord], &Src->ClusterMap[firstWord],
+		               &Mask->ClusterMap[firstWord], bits);
+		if (firstWord == endWord)
+			return TRUE;
+		++firstWord;
+	}
+
+	i = firstWord;
+
+#ifdef SPARSEFILELIB_USE_SSE2
+	/* Maps are only written by the scan threads, so once a range is final the
+	 * volatile qualifier can be dropped for the vector loop. */
+	if (HaveSSE2) {
+		for (; i + 4 <= endWord; i += 4) {
+			__m128i s, m;
+			s = _mm_loadu_si128((const __m128i *)(Src->ClusterMap + i));
+			m = _mm_loadu_si128((const __m128i *)(Mask->ClusterMap + i));
+			_mm_storeu_si128((__m128i *)(Dest->ClusterMap + i), _mm_andnot_si128(m, s));
+		}
+	}
+#endif
+
+	for (; i < endWord; ++i)
+		Dest->ClusterMap[i] = Src->ClusterMap[i] & ~Mask->ClusterMap[i];
+
+	if (EndCluster & 31) {
+		bits = (LONG)((1ul << (EndCluster & 31)) - 1);
+		AndNotWordBits(&Dest->ClusterMap[endWord], &Src->ClusterMap[endWord],
+		               &Mask->ClusterMap[endWord], bits);
 	}
-	fwprintf(FileStream, L"\n");
+
+	return TRUE;
 }
 
 
@@ -319,6 +954,30 @@ OpenFileExclusive(
 	LPFILETIME      LastAccessTime,
 	LPFILETIME      LastWriteTime
 	)
+{
+	return OpenFileWithSharing(Filename,
+	                           0,
+	                           FileFlagsAttributes,
+	                           FileSize,
+	                           FsClusterSize,
+	                           CreationTime,
+	                           LastAccessTime,
+	                           LastWriteTime);
+}
+
+
+_Use_decl_annotations_
+HANDLE __stdcall
+OpenFileWithSharing(
+	LPCWSTR         Filename,
+	DWORD           ShareMode,
+	DWORD           FileFlagsAttributes,
+	PLARGE_INTEGER  FileSize,
+	PSIZE_T         FsClusterSize,
+	LPFILETIME      CreationTime,
+	LPFILETIME      LastAccessTime,
+	LPFILETIME      LastWriteTime
+	)
 {
 	HANDLE      fl;
 	SIZE_T      fsClusterSize;
@@ -329,7 +988,7 @@ OpenFileExclusive(
 
 	fl = CreateFileW(Filename,                      // user supplied filename
 	                 GENERIC_READ | GENERIC_WRITE,  // read/write
-	                 0,                             // do not share
+	                 ShareMode,                     // caller specified
 	                 NULL,                          // default security
 	                 OPEN_EXISTING,                 // creation disp
 	                 FileFlagsAttributes,           // user specified
@@ -397,10 +1056,435 @@ func_return:
 }
 
 
+_Use_decl_annotations_
+DWORD __stdcall
+DeviceIoControlSync(
+	HANDLE          Device,
+	DWORD           IoControlCode,
+	LPVOID          InBuffer,
+	DWORD           InBufferSize,
+	LPVOID          OutBuffer,
+	DWORD           OutBufferSize,
+	LPDWORD         BytesReturned
+	)
+{
+	OVERLAPPED  ovrlp;
+	HANDLE      evt;
+	DWORD       bytes;
+	DWORD       lastErr;
+
+	bytes = 0;
+	memset(&ovrlp, 0, sizeof(ovrlp));
+
+	evt = CreateEventW(NULL, TRUE, FALSE, NULL);
+	if (NULL == evt) {
+		lastErr = GetLastError();
+		goto func_return;
+	}
+
+	/* Setting the low order bit of the event handle keeps the I/O manager from
+	 * queueing a completion packet to any port the handle is associated with.
+	 * Without this the packet would show up in some other thread's completion
+	 * loop with an OVERLAPPED it knows nothing about. */
+	ovrlp.hEvent = (HANDLE)((ULONG_PTR)evt | 1);
+
+	lastErr = ERROR_SUCCESS;
+	if (!DeviceIoControl(Device,
+	                     IoControlCode,
+	                     InBuffer,
+	                     InBufferSize,
+	                     OutBuffer,
+	                     OutBufferSize,
+	                     &bytes,
+	                     &ovrlp)) {
+		lastErr = GetLastError();
+		if (ERROR_IO_PENDING != lastErr && ERROR_MORE_DATA != lastErr)
+			goto cleanup_return;
+	}
+
+	if (!GetOverlappedResult(Device, &ovrlp, &bytes, TRUE))
+		lastErr = GetLastError();
+	else
+		lastErr = ERROR_SUCCESS;
+
+cleanup_return:
+	(void)CloseHandle(evt);
+
+func_return:
+	if (BytesReturned)
+		*BytesReturned = bytes;
+	return lastErr;
+}
+
+
+_Use_decl_annotations_
+DWORD __stdcall
+ReadFileSync(
+	HANDLE          File,
+	UINT64          Offset,
+	LPVOID          Buffer,
+	DWORD           BufferSize,
+	LPDWORD         BytesRead
+	)
+{
+	OVERLAPPED  ovrlp;
+	HANDLE      evt;
+	DWORD       lastErr;
+
+	*BytesRead = 0;
+	memset(&ovrlp, 0, sizeof(ovrlp));
+	ovrlp.Offset     = (DWORD)Offset;
+	ovrlp.OffsetHigh = (DWORD)(Offset >> 32);
+
+	evt = CreateEventW(NULL, TRUE, FALSE, NULL);
+	if (NULL == evt)
+		return GetLastError();
+
+	/* Keep any completion port away from the request as explained in
+	 * DeviceIoControlSync. */
+	ovrlp.hEvent = (HANDLE)((ULONG_PTR)evt | 1);
+
+	lastErr = ERROR_SUCCESS;
+	if (!ReadFile(File, Buffer, BufferSize, NULL, &ovrlp)) {
+		lastErr = GetLastError();
+		if (ERROR_IO_PENDING != lastErr)
+			goto cleanup_return;
+	}
+
+	if (!GetOverlappedResult(File, &ovrlp, BytesRead, TRUE))
+		lastErr = GetLastError();
+	else
+		lastErr = ERROR_SUCCESS;
+
+cleanup_return:
+	(void)CloseHandle(evt);
+
+	if (ERROR_HANDLE_EOF == lastErr) {
+		*BytesRead = 0;
+		lastErr = ERROR_SUCCESS;
+	}
+	return lastErr;
+}
+
+
+_Use_decl_annotations_
+DWORD __stdcall
+WriteFileSync(
+	HANDLE          File,
+	UINT64          Offset,
+	LPCVOID         Buffer,
+	DWORD           BufferSize
+	)
+{
+	OVERLAPPED  ovrlp;
+	HANDLE      evt;
+	DWORD       bytesWritten, lastErr;
+
+	memset(&ovrlp, 0, sizeof(ovrlp));
+	ovrlp.Offset     = (DWORD)Offset;
+	ovrlp.OffsetHigh = (DWORD)(Offset >> 32);
+
+	evt = CreateEventW(NULL, TRUE, FALSE, NULL);
+	if (NULL == evt)
+		return GetLastError();
+
+	/* Same reasoning as in ReadFileSync. */
+	ovrlp.hEvent = (HANDLE)((ULONG_PTR)evt | 1);
+
+	lastErr = ERROR_SUCCESS;
+	if (!WriteFile(File, Buffer, BufferSize, NULL, &ovrlp)) {
+		lastErr = GetLastError();
+		if (ERROR_IO_PENDING != lastErr)
+			goto cleanup_return;
+	}
+
+	if (!GetOverlappedResult(File, &ovrlp, &bytesWritten, TRUE))
+		lastErr = GetLastError();
+	else if (bytesWritten != BufferSize)
+		lastErr = ERROR_WRITE_FAULT;
+	else
+		lastErr = ERROR_SUCCESS;
+
+cleanup_return:
+	(void)CloseHandle(evt);
+	return lastErr;
+}
+
+
+_Use_decl_annotations_
+BOOL __stdcall
+ParseSizeArg(
+	LPCWSTR         Arg,
+	UINT64          *Value
+	)
+{
+	WCHAR   *end;
+	UINT64  val;
+	DWORD   shift;
+
+	if (NULL == Arg || L'\0' == *Arg || L'-' == *Arg)
+		return FALSE;
+
+	/* Base 0 would read a leading zero as octal. */
+	errno = 0;
+	val = _wcstoui64(Arg, &end,
+	                 (L'0' == Arg[0] && (L'x' == Arg[1] || L'X' == Arg[1])) ? 16 : 10);
+	if (end == Arg || ERANGE == errno)
+		return FALSE;
+
+	switch (*end) {
+	case L'\0':
+		shift = 0;
+		break;
+	case L'k': case L'K':
+		shift = 10;
+		break;
+	case L'm': case L'M':
+		shift = 20;
+		break;
+	case L'g': case L'G':
+		shift = 30;
+		break;
+	case L't': case L'T':
+		shift = 40;
+		break;
+	default:
+		return FALSE;
+	}
+	if (shift && L'\0' != *(end + 1))
+		return FALSE;
+
+	if (shift && (val >> (64 - shift)))
+		return FALSE;
+
+	*Value = val << shift;
+	return TRUE;
+}
+
+
+/* Number of allocated ranges fetched per FSCTL_QUERY_ALLOCATED_RANGES call. */
+#define ALLOCATED_RANGES_PER_QUERY 512
+
+
+/* Mark the clusters lying entirely inside the hole [HoleStart, HoleEnd). A
+ * cluster straddling the end of the file only has to be unallocated up to the
+ * end of the file. */
+static void
+MarkHole(
+	_Inout_     PCLUSTER_MAP    Map,
+	_In_        UINT64          HoleStart,
+	_In_        UINT64          HoleEnd
+	)
+{
+	UINT64 clusterSize, firstCluster, endCluster;
+
+	clusterSize = (UINT64)1 << Map->ClusterShift;
+
+	firstCluster = (HoleStart + clusterSize - 1) >> Map->ClusterShift;
+	if (HoleEnd >= Map->FileSize)
+		endCluster = (Map->FileSize + clusterSize - 1) >> Map->ClusterShift;
+	else
+		endCluster = HoleEnd >> Map->ClusterShift;
+
+	if (firstCluster < endCluster)
+		ClusterMapMarkClusters(Map, firstCluster, endCluster);
+}
+
+
+_Use_decl_annotations_
+DWORD __stdcall
+QueryAllocatedRanges(
+	HANDLE              File,
+	UINT64              Offset,
+	UINT64              Length,
+	PALLOCATED_RANGE    *Ranges,
+	SIZE_T              *NumRanges
+	)
+{
+	FILE_ALLOCATED_RANGE_BUFFER query;
+	PFILE_ALLOCATED_RANGE_BUFFER buf;
+	PALLOCATED_RANGE    ranges, tmpRanges;
+	SIZE_T              numRanges, maxRanges;
+	UINT64              end, next, rangeStart, rangeEnd;
+	DWORD               lastErr, bytes, numReturned, i;
+
+	*Ranges = NULL;
+	*NumRanges = 0;
+
+	numRanges = 0;
+	maxRanges = ALLOCATED_RANGES_PER_QUERY;
+	ranges = malloc(maxRanges * sizeof(*ranges));
+	buf = malloc(ALLOCATED_RANGES_PER_QUERY * sizeof(*buf));
+	if (NULL == ranges || NULL == buf) {
+		lastErr = ERROR_OUTOFMEMORY;
+		goto func_return;
+	}
+
+	end = Offset + Length;
+	next = Offset;
+	while (next < end) {
+		query.FileOffset.QuadPart = (LONGLONG)next;
+		query.Length.QuadPart = (LONGLONG)(end - next);
+		lastErr = DeviceIoControlSync(File,
+		                              FSCTL_QUERY_ALLOCATED_RANGES,
+		                              &query,
+		                              sizeof(query),
+		                              buf,
+		                              ALLOCATED_RANGES_PER_QUERY * sizeof(*buf),
+		                              &bytes);
+		if (ERROR_SUCCESS != lastErr && ERROR_MORE_DATA != lastErr)
+			goto func_return;
+
+		numReturned = bytes / sizeof(*buf);
+		if (maxRanges - numRanges < numReturned) {
+			tmpRanges = realloc(ranges, maxRanges * 2 * sizeof(*ranges));
+			if (NULL == tmpRanges) {
+				lastErr = ERROR_OUTOFMEMORY;
+				goto func_return;
+			}
+			ranges = tmpRanges;
+			maxRanges *= 2;
+		}
+
+		/* Clip what comes back to the range asked about. */
+		for (i = 0; i < numReturned; ++i) {
+			rangeStart = MAX((UINT64)buf[i].FileOffset.QuadPart, next);
+			rangeEnd   = MIN((UINT64)buf[i].FileOffset.QuadPart
+			                 + (UINT64)buf[i].Length.QuadPart, end);
+			if (rangeEnd <= rangeStart)
+				continue;
+			ranges[numRanges].Offset = rangeStart;
+			ranges[numRanges].Length = rangeEnd - rangeStart;
+			next = rangeEnd;
+			++numRanges;
+		}
+
+		if (ERROR_SUCCESS == lastErr)
+			break;
+
+		/* More ranges remain; continue after the last one returned. Guard
+		 * against a file system that reports more data without progress. */
+		if (0 == numReturned || (UINT64)query.FileOffset.QuadPart == next) {
+			lastErr = ERROR_INVALID_DATA;
+			goto func_return;
+		}
+	}
+
+	*Ranges = ranges;
+	*NumRanges = numRanges;
+	ranges = NULL;
+	lastErr = ERROR_SUCCESS;
+
+func_return:
+	free(buf);
+	free(ranges);
+	return lastErr;
+}
+
+
+/* Block cloning came with ReFS in Windows Server 2016 and the headers only
+ * declare it for targets that new. The layout is DUPLICATE_EXTENTS_DATA. */
+#ifndef FSCTL_DUPLICATE_EXTENTS_TO_FILE
+#define FSCTL_DUPLICATE_EXTENTS_TO_FILE \
+	CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 209, METHOD_BUFFERED, FILE_WRITE_DATA)
+#endif
+
+typedef struct SPARSE_DUPLICATE_EXTENTS {
+	HANDLE          FileHandle;
+	LARGE_INTEGER   SourceFileOffset;
+	LARGE_INTEGER   TargetFileOffset;
+	LARGE_INTEGER   ByteCount;
+} SPARSE_DUPLICATE_EXTENTS;
+
+
+_Use_decl_annotations_
+DWORD __stdcall
+CloneFileRange(
+	HANDLE          Target,
+	UINT64          TargetOffset,
+	HANDLE          Source,
+	UINT64          SourceOffset,
+	UINT64          Length
+	)
+{
+	SPARSE_DUPLICATE_EXTENTS dup;
+
+	memset(&dup, 0, sizeof(dup));
+	dup.FileHandle = Source;
+	dup.SourceFileOffset.QuadPart = (LONGLONG)SourceOffset;
+	dup.TargetFileOffset.QuadPart = (LONGLONG)TargetOffset;
+	dup.ByteCount.QuadPart = (LONGLONG)Length;
+	return DeviceIoControlSync(Target,
+	                           FSCTL_DUPLICATE_EXTENTS_TO_FILE,
+	                           &dup,
+	                           sizeof(dup),
+	                           NULL,
+	                           0,
+	                           NULL);
+}
+
+
+_Use_decl_annotations_
+BOOL __stdcall
+BuildUnallocatedMap(
+	HANDLE          File,
+	SIZE_T          ClusterSize,
+	PCLUSTER_MAP    *UnallocatedMap
+	)
+{
+	PALLOCATED_RANGE ranges;
+	PCLUSTER_MAP    map;
+	LARGE_INTEGER   fileSize;
+	UINT64          holeStart, rangeStart;
+	SIZE_T          numRanges, i;
+	DWORD           lastErr;
+
+	map = NULL;
+	ranges = NULL;
+	*UnallocatedMap = NULL;
+
+	if (!GetFileSizeEx(File, &fileSize)) {
+		lastErr = GetLastError();
+		goto func_return;
+	}
+
+	map = ClusterMapAllocate((DWORD)ClusterSize, (UINT64)fileSize.QuadPart);
+	if (NULL == map) {
+		lastErr = GetLastError();
+		goto func_return;
+	}
+
+	lastErr = QueryAllocatedRanges(File, 0, (UINT64)fileSize.QuadPart, &ranges, &numRanges);
+	if (ERROR_SUCCESS != lastErr)
+		goto func_return;
+
+	holeStart = 0;
+	for (i = 0; i < numRanges; ++i) {
+		rangeStart = ranges[i].Offset;
+		if (rangeStart > holeStart)
+			MarkHole(map, holeStart, rangeStart);
+		holeStart = MAX(holeStart, rangeStart + ranges[i].Length);
+	}
+
+	if (holeStart < (UINT64)fileSize.QuadPart)
+		MarkHole(map, holeStart, (UINT64)fileSize.QuadPart);
+
+	*UnallocatedMap = map;
+	map = NULL;
+	lastErr = ERROR_SUCCESS;
+
+func_return:
+	free(ranges);
+	if (map)
+		ClusterMapFree(map);
+	SetLastError(lastErr);
+	return (ERROR_SUCCESS == lastErr);
+}
+
+
 #define MAX_FILE_VIEW_SIZE (512 * 1024 * 1024)
 
 
-/* TODO: Query existing sparse ranges and don't re-analyze them. */
 _Success_(return == TRUE)
 BOOL __stdcall
 BuildSparseMap(
@@ -411,18 +1495,40 @@ BuildSparseMap(
 	_Out_ PCLUSTER_MAP *ClusterMap
 	)
 {
+	SPARSE_MAP_PARAMS params;
+
+	memset(&params, 0, sizeof(params));
+	params.StatsStream            = StatsStream;
+	params.StatsFrequencyMillisec = StatsFrequencyMillisec;
+
+	return BuildSparseMapEx(File, &params, ClusterSize, ClusterMap);
+}
+
+
+/* TODO: Query existing sparse ranges and don't re-analyze them. */
+_Success_(return == TRUE)
+BOOL __stdcall
+BuildSparseMapEx(
+	_In_ HANDLE File,
+	_In_opt_ PSPARSE_MAP_PARAMS Params,
+	_Inout_opt_ SIZE_T *ClusterSize,
+	_Out_ PCLUSTER_MAP *ClusterMap
+	)
+{
+	SPARSE_MAP_PARAMS params;
+	FILE *statsStream;
 	SIZE_T fsClusterSize;
 	BOOL retVal;
 	UINT64 bytesProcessed, numSparseClusters, startQPC, lastStatQPC;
 	LARGE_INTEGER tmpLI;
-	UINT64 flSize, hours, minutes, seconds;
+	UINT64 flSize, rangeStart, rangeEnd, hours, minutes, seconds;
 	HANDLE flMap;
 	SIZE_T currentViewSize, currentViewAlignedDownSize, i, startClusterOfst,
 	       sequentialZeros;
 	char *currentViewBase;
 	PCLUSTER_MAP clusterMap;
 	DWORD lastErr;
-	double flSizeMiB;
+	double rangeSizeMiB;
 
 	lastErr = 0;
 	fsClusterSize = 0;
@@ -433,6 +1539,12 @@ BuildSparseMap(
 	clusterMap = NULL;
 	numSparseClusters = 0;
 
+	if (Params)
+		params = *Params;
+	else
+		memset(&params, 0, sizeof(params));
+	statsStream = params.StatsStream;
+
 	startQPC = GetQPCVal();
 	lastStatQPC = startQPC;
 
@@ -454,21 +1566,43 @@ BuildSparseMap(
 		goto error_return;
 	}
 
-	if (FALSE == GetFileSizeEx(File, &tmpLI))
+	if (FALSE == GetFileSizeEx(File, &tmpLI)) {
+		lastErr = GetLastError();
 		goto error_return;
+	}
 
 	flSize = (UINT64)tmpLI.QuadPart;
 	if (!flSize) {
 		lastErr = ERROR_FILE_INVALID;
 		goto error_return;
 	}
-	flSizeMiB = (double)flSize / (double)(1024 * 1024);
 
-	clusterMap = ClusterMapAllocate((DWORD)fsClusterSize, flSize);
-	if (!clusterMap) {
-		lastErr = GetLastError();
+	rangeStart = params.RangeOffset;
+	rangeEnd = flSize;
+	if (params.RangeLength && params.RangeLength < flSize - MIN(rangeStart, flSize))
+		rangeEnd = rangeStart + params.RangeLength;
+	if (rangeStart >= flSize
+	    || rangeStart % MAX(fsClusterSize, SPARSE_MAP_RANGE_ALIGNMENT)
+	    || (rangeEnd != flSize && rangeEnd % fsClusterSize)) {
+		lastErr = ERROR_INVALID_PARAMETER;
 		goto error_return;
 	}
+	rangeSizeMiB = (double)(rangeEnd - rangeStart) / (double)(1024 * 1024);
+
+	if (params.ExistingMap) {
+		if (params.ExistingMap->FileSize != flSize
+		    || ((SIZE_T)1 << params.ExistingMap->ClusterShift) != fsClusterSize) {
+			lastErr = ERROR_INVALID_PARAMETER;
+			goto error_return;
+		}
+		clusterMap = params.ExistingMap;
+	} else {
+		clusterMap = ClusterMapAllocate((DWORD)fsClusterSize, flSize);
+		if (!clusterMap) {
+			lastErr = GetLastError();
+			goto error_return;
+		}
+	}
 
 	flMap = CreateFileMappingW(File,
 	                           NULL,
@@ -482,9 +1616,13 @@ BuildSparseMap(
 		goto error_return;
 	}
 
-	while (bytesProcessed < flSize) {
-		currentViewSize = (SIZE_T)MIN(MAX_FILE_VIEW_SIZE, flSize - bytesProcessed);
+	bytesProcessed = rangeStart;
+	while (bytesProcessed < rangeEnd) {
+		currentViewSize = (SIZE_T)MIN(QosChunkSize(QosClassRead, MAX_FILE_VIEW_SIZE,
+		                                           fsClusterSize),
+		                              rangeEnd - bytesProcessed);
 		currentViewAlignedDownSize = ALIGN_DOWN_BY(currentViewSize, sizeof(ULONG_PTR));
+		QosThrottle(QosClassRead, currentViewSize);
 		currentViewBase = MapViewOfFile(flMap,
 		                                FILE_MAP_READ,
 		                                (DWORD)(bytesProcessed >> 32),
@@ -547,6 +1685,17 @@ BuildSparseMap(
 				} while (sequentialZeros);
 			}
 
+			/* The view's zero clusters are all marked by now. */
+			if (params.Dedupe) {
+				lastErr = DedupeFileHashRange(params.Dedupe,
+				                              clusterMap,
+				                              (const BYTE *)currentViewBase,
+				                              bytesProcessed,
+				                              currentViewSize);
+				if (ERROR_SUCCESS != lastErr)
+					goto error_return;
+			}
+
 		} __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR
 		                               ?  EXCEPTION_EXECUTE_HANDLER
 		                               :  EXCEPTION_CONTINUE_SEARCH) {
@@ -557,12 +1706,12 @@ BuildSparseMap(
 
 		bytesProcessed += currentViewSize;
 
-		if (StatsStream) {
-			if (ElapsedQPCInMillisec(lastStatQPC, GetQPCVal()) >= StatsFrequencyMillisec) {
-				fwprintf(StatsStream,
+		if (statsStream) {
+			if (ElapsedQPCInMillisec(lastStatQPC, GetQPCVal()) >= params.StatsFrequencyMillisec) {
+				fwprintf(statsStream,
 				         L"Analyzed: %8.2f MiB of %8.2f MiB. %8.2f MiB of sparse ranges found.\n",
-				         (double)bytesProcessed / 1048576.0,
-				         flSizeMiB,
+				         (double)(bytesProcessed - rangeStart) / 1048576.0,
+				         rangeSizeMiB,
 				         (double)(numSparseClusters * fsClusterSize) / 1048576.0);
 				lastStatQPC = GetQPCVal();
 			}
@@ -574,6 +1723,17 @@ BuildSparseMap(
 			goto error_return;
 		}
 		currentViewBase = NULL;
+
+		/* Only hand the range out once it is unmapped. Deallocating clusters
+		 * under a live view of the file is refused by the file system. */
+		if (params.ViewCallback
+		    && !params.ViewCallback(params.CallbackContext,
+		                            clusterMap,
+		                            bytesProcessed - currentViewSize,
+		                            currentViewSize)) {
+			lastErr = ERROR_CANCELLED;
+			goto error_return;
+		}
 	}
 
 	if (!CloseHandle(flMap)) {
@@ -583,18 +1743,18 @@ BuildSparseMap(
 
 	*ClusterMap = clusterMap;
 
-	if (StatsStream) {
+	if (statsStream) {
 		seconds = ElapsedQPCInSeconds(startQPC, GetQPCVal());
 		hours = seconds / (60 * 60);
 		seconds = seconds % (60 * 60);
 		minutes = seconds / 60;
 		seconds = seconds % 60;
 
-		fwprintf(StatsStream,
+		fwprintf(statsStream,
 		        L"Analyzed: %8.2f MiB of %8.2f MiB. %8.2f MiB of zero ranges found.\n"
 		        L"Elapsed time: %llu hours, %llu minutes, %llu seconds\n",
-		        (double)bytesProcessed / 1048576.0,
-		        flSizeMiB,
+		        (double)(bytesProcessed - rangeStart) / 1048576.0,
+		        rangeSizeMiB,
 		        (double)(numSparseClusters * fsClusterSize) / 1048576.0,
 		        hours, minutes, seconds);
 	}
@@ -607,7 +1767,7 @@ error_return:
 		(void)UnmapViewOfFile(currentViewBase);
 	if (flMap)
 		(void)CloseHandle(flMap);
-	if (clusterMap)
+	if (clusterMap && clusterMap != params.ExistingMap)
 		ClusterMapFree(clusterMap);
 
 	retVal = FALSE;
@@ -702,8 +1862,30 @@ SparseFileLibInit(
 	)
 {
 	LARGE_INTEGER tmp;
+#ifdef SPARSEFILELIB_USE_SSE2
+	int cpuInfo[4], maxLeaf;
+#endif
 	// Per MS docs this will always succeed on XP or later.
 	(void)QueryPerformanceFrequency(&tmp);
 	QPCFrequency = (UINT64)tmp.QuadPart;
+
+#if defined(SPARSEFILELIB_USE_SSE2) && defined(_M_IX86)
+	HaveSSE2 = IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE);
+#endif
+
+#ifdef SPARSEFILELIB_USE_SSE2
+	__cpuid(cpuInfo, 0);
+	maxLeaf = cpuInfo[0];
+	__cpuid(cpuInfo, 1);
+	HaveSSE42 = HaveSSE2 && 0 != (cpuInfo[2] & (1 << 20));
+	// AVX2 needs the CPU to have it and the OS to save the YMM registers.
+	if (HaveSSE2 && maxLeaf >= 7 && (cpuInfo[2] & (1 << 27)) && (cpuInfo[2] & (1 << 28))
+	    && 6 == (_xgetbv(0) & 6)) {
+		__cpuidex(cpuInfo, 7, 0);
+		HaveAVX2 = 0 != (cpuInfo[1] & (1 << 5));
+	}
+#endif
+
+	Crc32cInit();
 }
 